@@ -4,7 +4,6 @@
 
 UBENCH_EX(Bench, BinaryTree) {
     VM vm;
-    (void)vm;
     InterpretResult ires;
         const char src[] = 
         "class Tree {"
@@ -41,7 +40,7 @@ UBENCH_EX(Bench, BinaryTree) {
         ""
         "var longLivedTree = Tree(0, maxDepth);"
         ""
-        "// iterations = 2 ** maxDepth"
+        "// iterations = 2 ** maxDepth\n"
         "var iterations = 1;"
         "var d = 0;"
         "while (d < maxDepth) {"
@@ -76,10 +75,10 @@ UBENCH_EX(Bench, BinaryTree) {
         "print \"elapsed:\";"
         "print clock() - start;"
     ;
-    initVM(stdout, stderr);
-    UBENCH_DO_BENCHMARK() { ires = interpret(src);}
+    initVM(&vm, stdout, stderr);
+    UBENCH_DO_BENCHMARK() { ires = interpret(&vm, src);}
     assert(ires == INTERPRET_OK);
-    freeVM();
+    freeVM(&vm);
 }
 
 UBENCH_MAIN()
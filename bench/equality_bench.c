@@ -2,39 +2,50 @@
 #include "ubench.h"
 #include <assert.h>
 
+static const char src[] =
+    "var i = 0;"
+    " while (i < 10000000) {"
+    "   i = i + 1;"
+    " "
+    "   1; 1; 1; 2; 1; nil; 1; \"str\"; 1; true;"
+    "   nil; nil; nil; 1; nil; \"str\"; nil; true;"
+    "   true; true; true; 1; true; false; true; \"str\"; true; nil;"
+    "   \"str\"; \"str\"; \"str\"; \"stru\"; \"str\"; 1; \"str\"; nil; "
+    "\"str\"; true;"
+    " }"
+    " "
+    " "
+    " i = 0;"
+    " while (i < 10000000) {"
+    "   i = i + 1;"
+    " "
+    "   1 == 1; 1 == 2; 1 == nil; 1 == \"str\"; 1 == true;"
+    "   nil == nil; nil == 1; nil == \"str\"; nil == true;"
+    "   true == true; true == 1; true == false; true == \"str\"; true == "
+    "nil;"
+    "   \"str\" == \"str\"; \"str\" == \"stru\"; \"str\" == 1; \"str\" == "
+    "nil; \"str\" == true;"
+    " }";
+
 UBENCH_EX(Bench, Equality) {
     VM vm;
-    (void) vm;
     InterpretResult ires;
-    const char src[] =
-        "var i = 0;"
-        " while (i < 10000000) {"
-        "   i = i + 1;"
-        " "
-        "   1; 1; 1; 2; 1; nil; 1; \"str\"; 1; true;"
-        "   nil; nil; nil; 1; nil; \"str\"; nil; true;"
-        "   true; true; true; 1; true; false; true; \"str\"; true; nil;"
-        "   \"str\"; \"str\"; \"str\"; \"stru\"; \"str\"; 1; \"str\"; nil; "
-        "\"str\"; true;"
-        " }"
-        " "
-        " "
-        " i = 0;"
-        " while (i < 10000000) {"
-        "   i = i + 1;"
-        " "
-        "   1 == 1; 1 == 2; 1 == nil; 1 == \"str\"; 1 == true;"
-        "   nil == nil; nil == 1; nil == \"str\"; nil == true;"
-        "   true == true; true == 1; true == false; true == \"str\"; true == "
-        "nil;"
-        "   \"str\" == \"str\"; \"str\" == \"stru\"; \"str\" == 1; \"str\" == "
-        "nil; \"str\" == true;"
-        " }";
+    initVM(&vm, stdout, stderr);
+    UBENCH_DO_BENCHMARK() { ires = interpret(&vm, src); }
+    assert(ires == INTERPRET_OK);
+    freeVM(&vm);
+}
 
-    initVM(stdout, stderr);
-    UBENCH_DO_BENCHMARK() { ires = interpret(src); }
+// The statements in both loops are literals, or fold to one, that the
+// peephole pass drops along with their pops.
+UBENCH_EX(Bench, EqualityNoPeephole) {
+    VM vm;
+    InterpretResult ires;
+    initVM(&vm, stdout, stderr);
+    vm.peepholeEnabled = false;
+    UBENCH_DO_BENCHMARK() { ires = interpret(&vm, src); }
     assert(ires == INTERPRET_OK);
-    freeVM();
+    freeVM(&vm);
 }
 
 UBENCH_MAIN();
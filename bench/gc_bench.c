@@ -0,0 +1,42 @@
+#include "../src/vm.h"
+#include "ubench.h"
+#include <assert.h>
+#include <stdio.h>
+
+// Sixteen trees stay alive while the script keeps replacing them and
+// throwing others away, so full collections have a big heap to mark. Each
+// run prints the longest time the collector stopped the script for.
+static const char trees[] =
+    "class Node { init(l, r) { this.l = l; this.r = r; } }"
+    "fun make(d) {"
+    "  if (d == 0) return Node(nil, nil);"
+    "  return Node(make(d - 1), make(d - 1));"
+    "}"
+    "var keep = [];"
+    "for (var i = 0; i < 16; i = i + 1) keep.push(make(12));"
+    "var j = 0;"
+    "for (var i = 0; i < 64; i = i + 1) {"
+    "  keep[j] = make(12);"
+    "  j = j + 1;"
+    "  if (j == 16) j = 0;"
+    "  make(10);"
+    "}";
+
+#define GC_BENCH(name, setup)                                                  \
+    UBENCH_EX(Gc, name) {                                                      \
+        InterpretResult ires;                                                  \
+        VM vm;                                                                 \
+        initVM(&vm, stdout, stderr);                                           \
+        setup;                                                                 \
+        UBENCH_DO_BENCHMARK() { ires = interpret(&vm, trees); }                \
+        assert(ires == INTERPRET_OK);                                          \
+        (void) ires;                                                           \
+        printf("longest pause %.3f ms\n", vm.longestPause * 1000);             \
+        freeVM(&vm);                                                           \
+    }
+
+GC_BENCH(StopTheWorld, vm.gcPause = 0)
+GC_BENCH(Incremental, (void) 0)
+GC_BENCH(Concurrent, vm.gcConcurrent = true)
+
+UBENCH_MAIN();
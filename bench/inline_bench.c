@@ -0,0 +1,41 @@
+#include "../src/vm.h"
+#include "ubench.h"
+#include <assert.h>
+
+static const char src[] =
+    "class Point {"
+    "  init(x, y) { this.x = x; this.y = y; }"
+    "  getX() { return this.x; }"
+    "  getY() { return this.y; }"
+    "  setX(x) { this.x = x; }"
+    "}"
+    "fun id(v) { return v; }"
+    "var p = Point(0, 1);"
+    "var s = 0;"
+    "for (var i = 0; i < 1000000; i = i + 1) {"
+    "  p.setX(i);"
+    "  s = s + p.getX() + p.getY() + id(i);"
+    "}";
+
+UBENCH_EX(Bench, Inline) {
+    VM vm;
+    InterpretResult ires;
+    initVM(&vm, stdout, stderr);
+    UBENCH_DO_BENCHMARK() { ires = interpret(&vm, src); }
+    assert(ires == INTERPRET_OK);
+    freeVM(&vm);
+}
+
+// Each iteration makes four calls that only load or store a field or return
+// their argument; inlined, they cost a guard each instead of a frame.
+UBENCH_EX(Bench, InlineDisabled) {
+    VM vm;
+    InterpretResult ires;
+    initVM(&vm, stdout, stderr);
+    vm.inlineEnabled = false;
+    UBENCH_DO_BENCHMARK() { ires = interpret(&vm, src); }
+    assert(ires == INTERPRET_OK);
+    freeVM(&vm);
+}
+
+UBENCH_MAIN();
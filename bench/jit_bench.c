@@ -0,0 +1,78 @@
+#include "../src/vm.h"
+#include "ubench.h"
+#include <assert.h>
+
+// Each program runs interpreted, then with --jit and with --trace-jit. Build
+// with JIT=1 (see `make bench-jit`) or all of them are interpreted.
+
+static const char numbers[] = "var l = [];"
+                              "for (var i = 0; i < 1000; i = i + 1) l.push(i);"
+                              "var sum = 0;"
+                              "for (var j = 0; j < 3000; j = j + 1) {"
+                              "  for (var i = 0; i < 1000; i = i + 1) {"
+                              "    sum = sum + l[i] * 2 - i;"
+                              "  }"
+                              "}";
+
+static const char equality[] = "var i = 0; var n = 0;"
+                               "while (i < 3000000) {"
+                               "  i = i + 1;"
+                               "  if (i == 1) n = n + 1;"
+                               "  if (nil == \"str\") n = n + 1;"
+                               "  if (true != false) n = n + 1;"
+                               "}";
+
+static const char calls[] = "fun fib(n) {"
+                            "  if (n < 2) return n;"
+                            "  return fib(n - 1) + fib(n - 2);"
+                            "}"
+                            "fib(27);";
+
+static const char zoo[] = "class Zoo {"
+                          "  init() { this.aardvark = 1; this.baboon = 1; }"
+                          "  ant() { return this.aardvark; }"
+                          "  banana() { return this.baboon; }"
+                          "}"
+                          "var zoo = Zoo();"
+                          "var sum = 0;"
+                          "while (sum < 2000000) {"
+                          "  sum = sum + zoo.ant() + zoo.banana() + zoo.aardvark;"
+                          "}";
+
+#define JIT_BENCH(name, source)                                                \
+    UBENCH_EX(Interpreter, name) {                                             \
+        InterpretResult ires;                                                  \
+        VM vm;                                                                 \
+        initVM(&vm, stdout, stderr);                                           \
+        UBENCH_DO_BENCHMARK() { ires = interpret(&vm, source); }               \
+        assert(ires == INTERPRET_OK);                                          \
+        (void) ires;                                                           \
+        freeVM(&vm);                                                           \
+    }                                                                          \
+    UBENCH_EX(Jit, name) {                                                     \
+        InterpretResult ires;                                                  \
+        VM vm;                                                                 \
+        initVM(&vm, stdout, stderr);                                           \
+        vm.jitEnabled = true;                                                  \
+        UBENCH_DO_BENCHMARK() { ires = interpret(&vm, source); }               \
+        assert(ires == INTERPRET_OK);                                          \
+        (void) ires;                                                           \
+        freeVM(&vm);                                                           \
+    }                                                                          \
+    UBENCH_EX(Trace, name) {                                                   \
+        InterpretResult ires;                                                  \
+        VM vm;                                                                 \
+        initVM(&vm, stdout, stderr);                                           \
+        vm.tracingEnabled = true;                                              \
+        UBENCH_DO_BENCHMARK() { ires = interpret(&vm, source); }               \
+        assert(ires == INTERPRET_OK);                                          \
+        (void) ires;                                                           \
+        freeVM(&vm);                                                           \
+    }
+
+JIT_BENCH(Numbers, numbers)
+JIT_BENCH(Equality, equality)
+JIT_BENCH(Calls, calls)
+JIT_BENCH(Zoo, zoo)
+
+UBENCH_MAIN();
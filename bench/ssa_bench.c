@@ -0,0 +1,43 @@
+#include "../src/vm.h"
+#include "ubench.h"
+#include <assert.h>
+
+static const char src[] =
+    "class Grid {"
+    "  init(w, h) { this.w = w; this.h = h; this.scale = 3; }"
+    "  sum() {"
+    "    var s = 0;"
+    "    for (var y = 0; y < this.h; y = y + 1) {"
+    "      for (var x = 0; x < this.w; x = x + 1) {"
+    "        s = s + this.scale * this.w + x * this.scale + y;"
+    "      }"
+    "    }"
+    "    return s;"
+    "  }"
+    "}"
+    "var grid = Grid(1000, 1000);"
+    "var i = 0;"
+    "while (i < 3) { grid.sum(); i = i + 1; }";
+
+UBENCH_EX(Bench, Ssa) {
+    VM vm;
+    InterpretResult ires;
+    initVM(&vm, stdout, stderr);
+    UBENCH_DO_BENCHMARK() { ires = interpret(&vm, src); }
+    assert(ires == INTERPRET_OK);
+    freeVM(&vm);
+}
+
+// The inner loop loads this.w and this.scale on every iteration and
+// recomputes this.scale * this.w, which the SSA optimizer does once per row.
+UBENCH_EX(Bench, SsaDisabled) {
+    VM vm;
+    InterpretResult ires;
+    initVM(&vm, stdout, stderr);
+    vm.ssaEnabled = false;
+    UBENCH_DO_BENCHMARK() { ires = interpret(&vm, src); }
+    assert(ires == INTERPRET_OK);
+    freeVM(&vm);
+}
+
+UBENCH_MAIN();
@@ -6,7 +6,6 @@
 
 UBENCH_EX(Bench, Zoo) {
     VM vm;
-    (void) vm;
     InterpretResult ires;
     const char src[] = "class Zoo { \n"
                        "  init() { \n"
@@ -36,10 +35,10 @@ UBENCH_EX(Bench, Zoo) {
                        "      zoo.mouse(); \n"
                        "} \n";
 
-    initVM(stdout, stderr);
-    UBENCH_DO_BENCHMARK() { ires = interpret(src); }
+    initVM(&vm, stdout, stderr);
+    UBENCH_DO_BENCHMARK() { ires = interpret(&vm, src); }
     assert(ires == INTERPRET_OK);
-    freeVM();
+    freeVM(&vm);
 }
 
 UBENCH_MAIN();
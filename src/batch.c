@@ -0,0 +1,251 @@
+// Runs many scripts at once. Every script gets a VM of its own, so workers
+// share nothing but the queues they take scripts from.
+#define _DEFAULT_SOURCE
+#include "batch.h"
+#include "vm.h"
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// The scripts a worker has yet to run: indices [head, tail) of the batch.
+// The owner works forwards from head; a thief takes the back half.
+typedef struct {
+    pthread_mutex_t lock;
+    int head;
+    int tail;
+} WorkQueue;
+
+typedef struct {
+    Batch *batch;
+    const BatchOptions *options;
+    WorkQueue *queues;
+    int workerCount;
+} Pool;
+
+typedef struct {
+    Pool *pool;
+    int index;
+} Worker;
+
+void initBatch(Batch *batch) {
+    batch->count = 0;
+    batch->capacity = 0;
+    batch->scripts = nullptr;
+}
+
+void freeBatch(Batch *batch) {
+    for (int i = 0; i < batch->count; i++) {
+        BatchScript *script = &batch->scripts[i];
+        free(script->path);
+        if (script->out.fp != nullptr) freeFileStream(&script->out);
+        if (script->err.fp != nullptr) freeFileStream(&script->err);
+    }
+    free(batch->scripts);
+    initBatch(batch);
+}
+
+void addBatchScript(Batch *batch, const char *path, const char *source) {
+    if (batch->count == batch->capacity) {
+        batch->capacity = batch->capacity < 8 ? 8 : batch->capacity * 2;
+        size_t size = sizeof(BatchScript) * (size_t) batch->capacity;
+        batch->scripts = realloc(batch->scripts, size);
+        if (batch->scripts == nullptr) exit(1);
+    }
+    BatchScript *script = &batch->scripts[batch->count++];
+    memset(script, 0, sizeof(BatchScript));
+    script->path = strdup(path);
+    if (script->path == nullptr) exit(1);
+    script->source = source;
+}
+
+static int isLoxFile(const struct dirent *entry) {
+    size_t length = strlen(entry->d_name);
+    return length > 4 && strcmp(entry->d_name + length - 4, ".lox") == 0;
+}
+
+bool addBatchPath(Batch *batch, const char *path) {
+    struct stat info;
+    if (stat(path, &info) != 0) return false;
+    if (!S_ISDIR(info.st_mode)) {
+        addBatchScript(batch, path, nullptr);
+        return true;
+    }
+
+    struct dirent **entries;
+    int count = scandir(path, &entries, isLoxFile, alphasort);
+    if (count < 0) return false;
+    for (int i = 0; i < count; i++) {
+        size_t length = strlen(path) + strlen(entries[i]->d_name) + 2;
+        char *file = malloc(length);
+        if (file == nullptr) exit(1);
+        bool slash = path[strlen(path) - 1] == '/';
+        snprintf(file, length, "%s%s%s", path, slash ? "" : "/",
+                 entries[i]->d_name);
+        addBatchScript(batch, file, nullptr);
+        free(file);
+        free(entries[i]);
+    }
+    free(entries);
+    return true;
+}
+
+// Like read_file_contents() in main.c, but a missing file fails the one
+// script instead of the process.
+static char *readFile(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == nullptr) return nullptr;
+    char *buffer = nullptr;
+    if (fseek(file, 0, SEEK_END) == 0) {
+        long size = ftell(file);
+        rewind(file);
+        buffer = size < 0 ? nullptr : malloc((size_t) size + 1);
+        if (buffer != nullptr) {
+            if (fread(buffer, 1, (size_t) size, file) == (size_t) size) {
+                buffer[size] = '\0';
+            } else {
+                free(buffer);
+                buffer = nullptr;
+            }
+        }
+    }
+    fclose(file);
+    return buffer;
+}
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double) time.tv_sec + (double) time.tv_nsec / 1e9;
+}
+
+static void runScript(BatchScript *script, const BatchOptions *options) {
+    double start = now();
+    initFileStream(&script->out);
+    initFileStream(&script->err);
+
+    char *contents = script->source == nullptr ? readFile(script->path)
+                                               : nullptr;
+    const char *source = script->source != nullptr ? script->source : contents;
+    if (source == nullptr) {
+        fprintf(script->err.fp, "Could not open file: %s\n", script->path);
+        script->status = 74;
+    } else {
+        VM vm;
+        if (options->image == nullptr) {
+            initVM(&vm, script->out.fp, script->err.fp);
+        } else {
+            initVMFromSnapshot(&vm, script->out.fp, script->err.fp,
+                               options->image);
+        }
+        vm.jitEnabled = options->jitEnabled;
+        vm.tracingEnabled = options->tracingEnabled;
+        vm.lazyCompile = options->lazyCompile;
+        vm.peepholeEnabled = options->peepholeEnabled;
+        vm.ssaEnabled = options->ssaEnabled;
+        vm.inlineEnabled = options->inlineEnabled;
+        if (options->maxFrames != 0) vm.maxFrames = options->maxFrames;
+        vm.cacheDir = options->cacheDir;
+        InterpretResult result = interpret(&vm, source);
+        freeVM(&vm);
+        script->status = result == INTERPRET_COMPILE_ERROR   ? 65
+                         : result == INTERPRET_RUNTIME_ERROR ? 70
+                                                             : 0;
+    }
+    free(contents);
+
+    fflush(script->out.fp);
+    fflush(script->err.fp);
+    script->seconds = now() - start;
+}
+
+static int takeScript(WorkQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    int script = queue->head < queue->tail ? queue->head++ : -1;
+    pthread_mutex_unlock(&queue->lock);
+    return script;
+}
+
+// Moves the back half of the first non-empty queue after the thief's own
+// into it. False once every queue looked empty.
+static bool steal(Pool *pool, int thief) {
+    for (int i = 1; i < pool->workerCount; i++) {
+        WorkQueue *victim = &pool->queues[(thief + i) % pool->workerCount];
+        pthread_mutex_lock(&victim->lock);
+        int remaining = victim->tail - victim->head;
+        int taken = (remaining + 1) / 2;
+        int tail = victim->tail;
+        victim->tail -= taken;
+        pthread_mutex_unlock(&victim->lock);
+        if (taken == 0) continue;
+
+        WorkQueue *own = &pool->queues[thief];
+        pthread_mutex_lock(&own->lock);
+        own->head = tail - taken;
+        own->tail = tail;
+        pthread_mutex_unlock(&own->lock);
+        return true;
+    }
+    return false;
+}
+
+static void *work(void *argument) {
+    Worker *worker = argument;
+    Pool *pool = worker->pool;
+    WorkQueue *own = &pool->queues[worker->index];
+    for (;;) {
+        int script = takeScript(own);
+        if (script >= 0) {
+            runScript(&pool->batch->scripts[script], pool->options);
+        } else if (!steal(pool, worker->index)) {
+            return nullptr;
+        }
+    }
+}
+
+int runBatch(Batch *batch, const BatchOptions *options) {
+    int threads = options->threads;
+    if (threads <= 0) threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > batch->count) threads = batch->count;
+    if (threads < 1) threads = 1;
+
+    Pool pool = {batch, options, nullptr, threads};
+    pool.queues = malloc(sizeof(WorkQueue) * (size_t) threads);
+    Worker *workers = malloc(sizeof(Worker) * (size_t) threads);
+    pthread_t *ids = malloc(sizeof(pthread_t) * (size_t) threads);
+    if (pool.queues == nullptr || workers == nullptr || ids == nullptr) exit(1);
+
+    // Each worker starts with an even, contiguous share; stealing evens out
+    // whatever the scripts' running times don't.
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_init(&pool.queues[i].lock, nullptr);
+        pool.queues[i].head = (int) ((long) batch->count * i / threads);
+        pool.queues[i].tail = (int) ((long) batch->count * (i + 1) / threads);
+        workers[i] = (Worker){&pool, i};
+    }
+    // The calling thread is worker 0.
+    int started = 1;
+    for (; started < threads; started++) {
+        if (pthread_create(&ids[started], nullptr, work,
+                           &workers[started]) != 0) {
+            break;
+        }
+    }
+    work(&workers[0]);
+    for (int i = 1; i < started; i++) {
+        pthread_join(ids[i], nullptr);
+    }
+
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_destroy(&pool.queues[i].lock);
+    }
+    free(pool.queues);
+    free(workers);
+    free(ids);
+    return started;
+}
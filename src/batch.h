@@ -0,0 +1,54 @@
+#ifndef BATCH_H
+#define BATCH_H
+#include "common.h"
+#include "memory.h"
+
+// One script of a batch and, once the batch has run, what became of it.
+typedef struct {
+    char *path;
+    // Run instead of the file at `path` when set; not owned by the batch.
+    const char *source;
+    // What `run` would have exited with: 0, 65, 70, or 74 when the file
+    // couldn't be read.
+    int status;
+    double seconds;
+    // Everything the script printed and every error it reported.
+    FileStream out;
+    FileStream err;
+} BatchScript;
+
+typedef struct {
+    int count;
+    int capacity;
+    BatchScript *scripts;
+} Batch;
+
+// Applied to the VM of every script.
+typedef struct {
+    // Worker threads; 0 means one per online CPU.
+    int threads;
+    bool jitEnabled;
+    bool tracingEnabled;
+    bool lazyCompile;
+    bool peepholeEnabled;
+    bool ssaEnabled;
+    bool inlineEnabled;
+    // 0 keeps the VM's default.
+    int maxFrames;
+    // Shared by every script's VM; see VM.cacheDir.
+    const char *cacheDir;
+    // Image every script's VM starts from, or null for a fresh heap.
+    const char *image;
+} BatchOptions;
+
+void initBatch(Batch *batch);
+void freeBatch(Batch *batch);
+void addBatchScript(Batch *batch, const char *path, const char *source);
+// Adds the file at `path`, or every .lox file directly inside it in name
+// order if it's a directory. False if it's neither.
+bool addBatchPath(Batch *batch, const char *path);
+// Runs each script in a VM of its own, spread over a pool of worker threads.
+// Returns how many threads it used.
+int runBatch(Batch *batch, const BatchOptions *options);
+
+#endif /* BATCH_H */
@@ -0,0 +1,667 @@
+// Compiled scripts on disk. A file is a header, fixed-size tables of
+// strings, global names and functions, and the bytes they point into. The
+// loader maps it and lets each chunk use its code and line numbers in place;
+// only the objects themselves are built: interned strings, functions and
+// their constants.
+#define _DEFAULT_SOURCE
+#include "bytecode.h"
+#include "compiler.h"
+#include "memory.h"
+#include "table.h"
+#include "vm.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char magic[4] = {'L', 'O', 'X', 'B'};
+
+static const char *const opcodeNames[] = {
+#define X(e) #e,
+    OPCODE_ENUM
+#undef X
+};
+#define OPCODE_COUNT ((int) (sizeof(opcodeNames) / sizeof(opcodeNames[0])))
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    // Identifies the instruction set, value representation and byte order.
+    uint64_t format;
+    uint64_t sourceHash;
+    uint32_t stringCount;
+    uint32_t globalCount;
+    uint32_t functionCount;
+    // File offsets of the three tables.
+    uint32_t strings;
+    uint32_t globals;
+    uint32_t functions;
+} Header;
+
+typedef struct {
+    uint32_t chars;
+    uint32_t length;
+} StringRecord;
+
+typedef enum {
+    CONSTANT_VALUE, // a number or other unboxed value, stored as is
+    CONSTANT_STRING,
+    CONSTANT_FUNCTION,
+} ConstantKind;
+
+typedef struct {
+    uint32_t kind;
+    // A string or function table index.
+    uint32_t index;
+    uint64_t value;
+} ConstantRecord;
+
+// Functions are stored children first, so a function's constants only ever
+// refer back to functions already built; the last one is the script.
+typedef struct {
+    int32_t arity;
+    int32_t upvalueCount;
+    int32_t name; // string index, or -1 for the script
+    uint32_t code;
+    uint32_t count;
+    uint32_t lines;
+    uint32_t constants;
+    uint32_t constantCount;
+    uint32_t cacheCount;
+} FunctionRecord;
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t length) {
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+uint64_t hashSource(const char *source) {
+    return fnv1a(14695981039346656037u, source, strlen(source));
+}
+
+uint64_t cacheKey(VM *vm, const char *source) {
+    bool options[] = {vm->peepholeEnabled, vm->ssaEnabled, vm->inlineEnabled};
+    return fnv1a(hashSource(source), options, sizeof(options));
+}
+
+uint64_t bytecodeFormat() {
+    uint32_t version = BYTECODE_VERSION;
+    uint64_t hash = fnv1a(14695981039346656037u, &version, sizeof(version));
+    for (int i = 0; i < OPCODE_COUNT; i++) {
+        hash = fnv1a(hash, opcodeNames[i], strlen(opcodeNames[i]) + 1);
+    }
+    Value probe = NUMBER_VAL(1.5);
+    return fnv1a(hash, &probe, sizeof(probe));
+}
+
+bool isBytecodeFile(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == nullptr) return false;
+    char start[sizeof(magic)];
+    bool isBytecode = fread(start, 1, sizeof(start), file) == sizeof(start) &&
+                      memcmp(start, magic, sizeof(magic)) == 0;
+    fclose(file);
+    return isBytecode;
+}
+
+// Writing.
+
+uint32_t reserveBytes(ByteBuffer *buffer, size_t size, size_t align) {
+    size_t offset = (buffer->count + align - 1) / align * align;
+    if (offset + size > buffer->capacity) {
+        size_t capacity = buffer->capacity < 256 ? 256 : buffer->capacity;
+        while (capacity < offset + size) capacity *= 2;
+        buffer->bytes = realloc(buffer->bytes, capacity);
+        if (buffer->bytes == nullptr) exit(1);
+        buffer->capacity = capacity;
+    }
+    memset(buffer->bytes + buffer->count, 0, offset + size - buffer->count);
+    buffer->count = offset + size;
+    return (uint32_t) offset;
+}
+
+uint32_t appendBytes(ByteBuffer *buffer, const void *data, size_t size,
+                     size_t align) {
+    uint32_t offset = reserveBytes(buffer, size, align);
+    if (size > 0) memcpy(buffer->bytes + offset, data, size);
+    return offset;
+}
+
+typedef struct {
+    VM *vm;
+    ByteBuffer buffer;
+    ObjFunction **functions;
+    int functionCount;
+    int functionCapacity;
+    // Each string maps to its index in `strings`.
+    Table stringIndex;
+    ObjString **strings;
+    int stringCount;
+    int stringCapacity;
+} Writer;
+
+static int stringIndex(Writer *writer, ObjString *string) {
+    Value index;
+    if (tableGet(&writer->stringIndex, string, &index)) {
+        return (int) AS_NUMBER(index);
+    }
+    if (writer->stringCount == writer->stringCapacity) {
+        writer->stringCapacity = GROW_CAPACITY(writer->stringCapacity);
+        writer->strings =
+            realloc(writer->strings,
+                    sizeof(ObjString *) * (size_t) writer->stringCapacity);
+        if (writer->strings == nullptr) exit(1);
+    }
+    writer->strings[writer->stringCount] = string;
+    tableSet(writer->vm, &writer->stringIndex, string,
+             NUMBER_VAL(writer->stringCount));
+    return writer->stringCount++;
+}
+
+static int functionIndex(Writer *writer, ObjFunction *function) {
+    for (int i = 0; i < writer->functionCount; i++) {
+        if (writer->functions[i] == function) return i;
+    }
+    return -1;
+}
+
+// Lists `function` after everything nested in it, compiling any function
+// whose body was skipped. False if one doesn't compile or a constant is an
+// object the format has no room for.
+static bool collectFunctions(Writer *writer, ObjFunction *function) {
+    if (function->lazy != nullptr &&
+        !compileLazyFunction(writer->vm, function)) {
+        return false;
+    }
+    ValueArray *constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+        Value constant = constants->values[i];
+        if (IS_FUNCTION(constant)) {
+            if (functionIndex(writer, AS_FUNCTION(constant)) < 0 &&
+                !collectFunctions(writer, AS_FUNCTION(constant))) {
+                return false;
+            }
+        } else if (IS_OBJ(constant) && !IS_STRING(constant)) {
+            return false;
+        }
+    }
+    if (writer->functionCount == writer->functionCapacity) {
+        writer->functionCapacity = GROW_CAPACITY(writer->functionCapacity);
+        writer->functions =
+            realloc(writer->functions,
+                    sizeof(ObjFunction *) * (size_t) writer->functionCapacity);
+        if (writer->functions == nullptr) exit(1);
+    }
+    writer->functions[writer->functionCount++] = function;
+    return true;
+}
+
+// The code as the compiler emitted it: quickened instructions go back to
+// their generic forms, which any VM can run.
+static void writeCode(Writer *writer, FunctionRecord *record, Chunk *chunk) {
+    record->code = appendBytes(&writer->buffer, chunk->code, (size_t) chunk->count,
+                          1);
+    uint8_t *code = writer->buffer.bytes + record->code;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        switch (code[offset]) {
+            case OP_ADD_NUM:
+            case OP_ADD_STR: code[offset] = OP_ADD; break;
+            case OP_GET_INDEX_LIST: code[offset] = OP_GET_INDEX; break;
+            case OP_SET_INDEX_LIST: code[offset] = OP_SET_INDEX; break;
+        }
+    }
+    record->count = (uint32_t) chunk->count;
+    record->lines = appendBytes(&writer->buffer, chunk->lines,
+                           sizeof(int) * (size_t) chunk->count, sizeof(int));
+}
+
+static void writeFunction(Writer *writer, uint32_t offset,
+                          ObjFunction *function) {
+    FunctionRecord record = {0};
+    record.arity = function->arity;
+    record.upvalueCount = function->upvalueCount;
+    record.name = function->name == nullptr
+                      ? -1
+                      : stringIndex(writer, function->name);
+    writeCode(writer, &record, &function->chunk);
+    record.cacheCount = (uint32_t) function->chunk.cacheCount;
+
+    ValueArray *constants = &function->chunk.constants;
+    record.constantCount = (uint32_t) constants->count;
+    size_t size = sizeof(ConstantRecord) * (size_t) constants->count;
+    record.constants = reserveBytes(&writer->buffer, size, sizeof(uint64_t));
+    for (int i = 0; i < constants->count; i++) {
+        Value value = constants->values[i];
+        ConstantRecord constant = {CONSTANT_VALUE, 0, value};
+        if (IS_STRING(value)) {
+            constant = (ConstantRecord){
+                CONSTANT_STRING,
+                (uint32_t) stringIndex(writer, AS_STRING(value)), 0};
+        } else if (IS_FUNCTION(value)) {
+            constant = (ConstantRecord){
+                CONSTANT_FUNCTION,
+                (uint32_t) functionIndex(writer, AS_FUNCTION(value)), 0};
+        }
+        memcpy(writer->buffer.bytes + record.constants +
+                   sizeof(ConstantRecord) * (size_t) i,
+               &constant, sizeof(constant));
+    }
+    memcpy(writer->buffer.bytes + offset, &record, sizeof(record));
+}
+
+bool writeBytes(const ByteBuffer *buffer, const char *path) {
+    size_t length = strlen(path) + 8;
+    char *temporary = malloc(length);
+    if (temporary == nullptr) return false;
+    snprintf(temporary, length, "%s.XXXXXX", path);
+    int fd = mkstemp(temporary);
+    // mkstemp() makes the file private to us; compiled code is no secret.
+    bool ok = fd >= 0 && fchmod(fd, 0644) == 0;
+    for (size_t written = 0; ok && written < buffer->count;) {
+        ssize_t n = write(fd, buffer->bytes + written, buffer->count - written);
+        ok = n > 0;
+        written += ok ? (size_t) n : 0;
+    }
+    if (fd >= 0) ok = close(fd) == 0 && ok;
+    if (ok) ok = rename(temporary, path) == 0;
+    if (!ok && fd >= 0) unlink(temporary);
+    free(temporary);
+    return ok;
+}
+
+bool writeBytecode(VM *vm, ObjFunction *function, uint64_t sourceHash,
+                   const char *path) {
+    Writer writer = {0};
+    writer.vm = vm;
+    initTable(&writer.stringIndex);
+    bool ok = collectFunctions(&writer, function);
+
+    if (ok) {
+        Header header = {0};
+        memcpy(header.magic, magic, sizeof(magic));
+        header.version = BYTECODE_VERSION;
+        header.format = bytecodeFormat();
+        header.sourceHash = sourceHash;
+        reserveBytes(&writer.buffer, sizeof(Header), sizeof(uint64_t));
+
+        // Global names first: slot numbers are what the code refers to.
+        header.globalCount = (uint32_t) vm->globalNames.count;
+        header.globals = reserveBytes(&writer.buffer,
+                                 sizeof(uint32_t) * header.globalCount,
+                                 sizeof(uint32_t));
+        for (uint32_t i = 0; i < header.globalCount; i++) {
+            uint32_t index = (uint32_t) stringIndex(
+                &writer, AS_STRING(vm->globalNames.values[i]));
+            memcpy(writer.buffer.bytes + header.globals + sizeof(uint32_t) * i,
+                   &index, sizeof(index));
+        }
+
+        header.functionCount = (uint32_t) writer.functionCount;
+        header.functions =
+            reserveBytes(&writer.buffer,
+                    sizeof(FunctionRecord) * header.functionCount,
+                    sizeof(uint64_t));
+        for (uint32_t i = 0; i < header.functionCount; i++) {
+            uint32_t offset =
+                header.functions + (uint32_t) sizeof(FunctionRecord) * i;
+            writeFunction(&writer, offset, writer.functions[i]);
+        }
+
+        header.stringCount = (uint32_t) writer.stringCount;
+        header.strings = reserveBytes(&writer.buffer,
+                                 sizeof(StringRecord) * header.stringCount,
+                                 sizeof(uint32_t));
+        for (int i = 0; i < writer.stringCount; i++) {
+            ObjString *string = writer.strings[i];
+            StringRecord record = {
+                appendBytes(&writer.buffer, string->chars, (size_t) string->length,
+                       1),
+                (uint32_t) string->length};
+            memcpy(writer.buffer.bytes + header.strings +
+                       sizeof(StringRecord) * (size_t) i,
+                   &record, sizeof(record));
+        }
+        memcpy(writer.buffer.bytes, &header, sizeof(header));
+        ok = writeBytes(&writer.buffer, path);
+    }
+
+    freeTable(vm, &writer.stringIndex);
+    free(writer.strings);
+    free(writer.functions);
+    free(writer.buffer.bytes);
+    return ok;
+}
+
+// Loading.
+
+typedef struct {
+    uint8_t *base;
+    size_t size;
+    const Header *header;
+    // Where this load's strings and then functions sit on the VM's stack,
+    // which keeps them alive until the script is built.
+    int stackBase;
+    int *slots;
+} Loader;
+
+static bool inFile(const Loader *loader, uint32_t offset, size_t count,
+                   size_t size, size_t align) {
+    return offset % align == 0 && offset <= loader->size &&
+           count <= (loader->size - offset) / size;
+}
+
+static ObjString *loadedString(VM *vm, Loader *loader, uint32_t index) {
+    return AS_STRING(vm->stack[loader->stackBase + (int) index]);
+}
+
+static ObjFunction *loadedFunction(VM *vm, Loader *loader, uint32_t index) {
+    int base = loader->stackBase + (int) loader->header->stringCount;
+    return AS_FUNCTION(vm->stack[base + (int) index]);
+}
+
+// Instructions are only rewritten when a slot moved, so the pages of a
+// mapped file usually stay shared.
+bool verifyBytecode(ObjFunction *function, int globalCount,
+                    const int *slots) {
+    Chunk *chunk = &function->chunk;
+    uint8_t *code = chunk->code;
+    Value *constants = chunk->constants.values;
+    int constantCount = chunk->constants.count;
+    // Where each instruction starts, for checking jumps land on one.
+    bool *starts = calloc((size_t) chunk->count, sizeof(bool));
+    if (starts == nullptr) exit(1);
+    bool ok = chunk->count > 0;
+    uint8_t last = OP_RETURN;
+    for (int offset = 0; ok && offset < chunk->count;) {
+        uint8_t op = code[offset];
+        starts[offset] = true;
+        last = op;
+        // OP_CLOSURE's length depends on the function it closes over.
+        if (op >= OPCODE_COUNT ||
+            (op == OP_CLOSURE && (offset + 1 >= chunk->count ||
+                                  code[offset + 1] >= constantCount ||
+                                  !IS_FUNCTION(constants[code[offset + 1]])))) {
+            ok = false;
+            break;
+        }
+        int length = instructionLength(chunk, offset);
+        if (offset + length > chunk->count) {
+            ok = false;
+            break;
+        }
+
+        switch (op) {
+            case OP_CONSTANT: ok = code[offset + 1] < constantCount; break;
+            // The rest name a property, method or class.
+            case OP_GET_SUPER:
+            case OP_CLASS:
+            case OP_METHOD:
+                ok = code[offset + 1] < constantCount &&
+                     IS_STRING(constants[code[offset + 1]]);
+                break;
+            case OP_GET_PROPERTY:
+            case OP_SET_PROPERTY:
+            case OP_SET_PROPERTY_POP:
+            case OP_INVOKE:
+            case OP_SUPER_INVOKE: {
+                int at = offset + length - 2;
+                ok = code[offset + 1] < constantCount &&
+                     IS_STRING(constants[code[offset + 1]]) &&
+                     ((code[at] << 8) | code[at + 1]) < chunk->cacheCount;
+                break;
+            }
+            // The guards name the function whose body they precede, and
+            // the method one its call's name and two caches.
+            case OP_CALL_INLINE:
+            case OP_INVOKE_INLINE: {
+                int function = code[offset + length - 3];
+                ok = function < constantCount &&
+                     IS_FUNCTION(constants[function]);
+                if (ok && op == OP_INVOKE_INLINE) {
+                    ok = code[offset + 1] < constantCount &&
+                         IS_STRING(constants[code[offset + 1]]) &&
+                         ((code[offset + 3] << 8) | code[offset + 4]) <
+                             chunk->cacheCount &&
+                         ((code[offset + 5] << 8) | code[offset + 6]) <
+                             chunk->cacheCount;
+                }
+                break;
+            }
+            case OP_GET_GLOBAL:
+            case OP_DEFINE_GLOBAL:
+            case OP_SET_GLOBAL:
+            case OP_SET_GLOBAL_POP: {
+                uint32_t slot =
+                    (uint32_t) ((code[offset + 1] << 8) | code[offset + 2]);
+                ok = slot < (uint32_t) globalCount;
+                if (ok && slots != nullptr && slots[slot] != (int) slot) {
+                    code[offset + 1] = (uint8_t) (slots[slot] >> 8);
+                    code[offset + 2] = (uint8_t) slots[slot];
+                }
+                break;
+            }
+            default: break;
+        }
+        offset += length;
+    }
+    for (int offset = 0; ok && offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        int target = jumpTarget(chunk, offset);
+        if (target == -1 && code[offset] != OP_LOOP) continue;
+        ok = target >= 0 && target < chunk->count && starts[target];
+    }
+    free(starts);
+    // Nothing may run off the end.
+    if (!ok || (last != OP_RETURN && last != OP_RETURN_NIL &&
+                last != OP_JUMP && last != OP_LOOP)) {
+        return false;
+    }
+
+    function->maxSlots = maxStackDepth(chunk, function->arity + 1);
+    if (function->maxSlots < 0) return false;
+    for (int offset = 0; ok && offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        switch (code[offset]) {
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+            case OP_SET_LOCAL_POP:
+                ok = code[offset + 1] < function->maxSlots;
+                break;
+            case OP_GET_UPVALUE:
+            case OP_SET_UPVALUE:
+                ok = code[offset + 1] < function->upvalueCount;
+                break;
+            case OP_CLOSURE: {
+                int length = instructionLength(chunk, offset);
+                for (int i = offset + 2; ok && i < offset + length; i += 2) {
+                    ok = code[i + 1] < (code[i] ? function->maxSlots
+                                                : function->upvalueCount);
+                }
+                break;
+            }
+            default: break;
+        }
+    }
+    return ok;
+}
+
+static ObjFunction *loadFunction(VM *vm, Loader *loader,
+                                 const FunctionRecord *record, uint32_t index) {
+    if (!inFile(loader, record->code, record->count, 1, 1) ||
+        !inFile(loader, record->lines, record->count, sizeof(int),
+                sizeof(int)) ||
+        !inFile(loader, record->constants, record->constantCount,
+                sizeof(ConstantRecord), sizeof(uint64_t)) ||
+        record->count > INT32_MAX || record->cacheCount > UINT16_MAX + 1u ||
+        record->arity < 0 || record->arity > UINT8_MAX ||
+        record->upvalueCount < 0 || record->upvalueCount > UINT8_MAX + 1 ||
+        record->name >= (int32_t) loader->header->stringCount) {
+        return nullptr;
+    }
+
+    ObjFunction *function = newFunction(vm);
+    push(vm, OBJ_VAL(function));
+    function->arity = record->arity;
+    function->upvalueCount = record->upvalueCount;
+    if (record->name >= 0) {
+        function->name = loadedString(vm, loader, (uint32_t) record->name);
+    }
+
+    const ConstantRecord *constants =
+        (const ConstantRecord *) (loader->base + record->constants);
+    for (uint32_t i = 0; i < record->constantCount; i++) {
+        Value value;
+        switch (constants[i].kind) {
+            case CONSTANT_VALUE:
+                value = constants[i].value;
+                if (IS_OBJ(value)) return nullptr;
+                break;
+            case CONSTANT_STRING:
+                if (constants[i].index >= loader->header->stringCount) {
+                    return nullptr;
+                }
+                value = OBJ_VAL(loadedString(vm, loader, constants[i].index));
+                break;
+            case CONSTANT_FUNCTION:
+                if (constants[i].index >= index) return nullptr;
+                value = OBJ_VAL(loadedFunction(vm, loader, constants[i].index));
+                break;
+            default: return nullptr;
+        }
+        writeValueArray(vm, &function->chunk.constants, value);
+    }
+    for (uint32_t i = 0; i < record->cacheCount; i++) {
+        addInlineCache(vm, &function->chunk);
+    }
+
+    // Borrowed from the mapping: with no capacity, freeChunk() leaves them.
+    function->chunk.code = loader->base + record->code;
+    function->chunk.lines = (int *) (loader->base + record->lines);
+    function->chunk.count = (int) record->count;
+    function->chunk.capacity = 0;
+    if (!verifyBytecode(function, (int) loader->header->globalCount,
+                        loader->slots)) {
+        function->chunk.code = nullptr;
+        function->chunk.lines = nullptr;
+        function->chunk.count = 0;
+        return nullptr;
+    }
+    return function;
+}
+
+static ObjFunction *loadImage(VM *vm, Loader *loader) {
+    const Header *header = loader->header;
+    if (!inFile(loader, header->strings, header->stringCount,
+                sizeof(StringRecord), sizeof(uint32_t)) ||
+        !inFile(loader, header->globals, header->globalCount, sizeof(uint32_t),
+                sizeof(uint32_t)) ||
+        !inFile(loader, header->functions, header->functionCount,
+                sizeof(FunctionRecord), sizeof(uint64_t)) ||
+        header->functionCount == 0 || header->globalCount > UINT16_MAX + 1u) {
+        return nullptr;
+    }
+
+    const StringRecord *strings =
+        (const StringRecord *) (loader->base + header->strings);
+    for (uint32_t i = 0; i < header->stringCount; i++) {
+        if (!inFile(loader, strings[i].chars, strings[i].length, 1, 1) ||
+            strings[i].length > INT32_MAX) {
+            return nullptr;
+        }
+        push(vm, OBJ_VAL(copyString(vm,
+                                    (char *) loader->base + strings[i].chars,
+                                    (int) strings[i].length)));
+    }
+
+    const uint32_t *globals =
+        (const uint32_t *) (loader->base + header->globals);
+    for (uint32_t i = 0; i < header->globalCount; i++) {
+        if (globals[i] >= header->stringCount) return nullptr;
+        loader->slots[i] = globalSlot(vm, loadedString(vm, loader, globals[i]));
+        if (loader->slots[i] > UINT16_MAX) return nullptr;
+    }
+
+    const FunctionRecord *functions =
+        (const FunctionRecord *) (loader->base + header->functions);
+    ObjFunction *function = nullptr;
+    for (uint32_t i = 0; i < header->functionCount; i++) {
+        function = loadFunction(vm, loader, &functions[i], i);
+        if (function == nullptr) return nullptr;
+    }
+    // The last is the script, which nothing calls with arguments or closes.
+    if (function->arity != 0 || function->upvalueCount != 0) return nullptr;
+    return function;
+}
+
+void *mapFile(const char *path, size_t minSize, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return nullptr;
+    struct stat info;
+    void *base = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && (size_t) info.st_size >= minSize &&
+        (uint64_t) info.st_size <= UINT32_MAX) {
+        // Private and writable: renumbering a global or quickening an
+        // instruction copies just that page.
+        base = mmap(nullptr, (size_t) info.st_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (base == MAP_FAILED) return nullptr;
+    *size = (size_t) info.st_size;
+    return base;
+}
+
+void keepMapping(VM *vm, void *base, size_t size) {
+    BytecodeImage *image = malloc(sizeof(BytecodeImage));
+    if (image == nullptr) exit(1);
+    image->base = base;
+    image->size = size;
+    image->next = vm->images;
+    vm->images = image;
+}
+
+ObjFunction *loadBytecode(VM *vm, const char *path, uint64_t sourceHash) {
+    size_t size;
+    uint8_t *base = mapFile(path, sizeof(Header), &size);
+    if (base == nullptr) return nullptr;
+
+    Loader loader = {base, size, (const Header *) base,
+                     (int) (vm->stackTop - vm->stack), nullptr};
+    const Header *header = loader.header;
+    ObjFunction *function = nullptr;
+    if (memcmp(header->magic, magic, sizeof(magic)) == 0 &&
+        header->version == BYTECODE_VERSION &&
+        header->format == bytecodeFormat() &&
+        (sourceHash == 0 || header->sourceHash == sourceHash)) {
+        loader.slots = malloc(sizeof(int) * (header->globalCount + 1));
+        if (loader.slots == nullptr) exit(1);
+        function = loadImage(vm, &loader);
+        free(loader.slots);
+    }
+    vm->stackTop = vm->stack + loader.stackBase;
+
+    if (function == nullptr) {
+        munmap(base, size);
+        return nullptr;
+    }
+    keepMapping(vm, base, size);
+    return function;
+}
+
+void freeBytecodeImages(VM *vm) {
+    while (vm->images != nullptr) {
+        BytecodeImage *next = vm->images->next;
+        munmap(vm->images->base, vm->images->size);
+        free(vm->images);
+        vm->images = next;
+    }
+}
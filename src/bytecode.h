@@ -0,0 +1,70 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+#include "common.h"
+#include "object.h"
+
+// Bumped whenever the file layout changes. The opcode list is hashed into
+// every header as well, so a build with different instructions rejects the
+// file without anyone having to remember to bump this.
+#define BYTECODE_VERSION 1
+
+// A bytecode file mapped by loadBytecode(). The functions built from it
+// borrow their code and line numbers from the mapping, so it stays until
+// the VM is freed.
+typedef struct BytecodeImage {
+    void *base;
+    size_t size;
+    struct BytecodeImage *next;
+} BytecodeImage;
+
+// What the file writers build their output in.
+typedef struct {
+    uint8_t *bytes;
+    size_t count;
+    size_t capacity;
+} ByteBuffer;
+
+// Reserves `size` zeroed bytes at the next multiple of `align` and returns
+// their offset.
+uint32_t reserveBytes(ByteBuffer *buffer, size_t size, size_t align);
+uint32_t appendBytes(ByteBuffer *buffer, const void *data, size_t size,
+                     size_t align);
+// Writes the buffer to `path` through a temporary file and a rename, so the
+// file appears whole or not at all.
+bool writeBytes(const ByteBuffer *buffer, const char *path);
+// Maps a file privately and writably; nullptr if it is smaller than
+// `minSize` or can't be mapped.
+void *mapFile(const char *path, size_t minSize, size_t *size);
+// Hands a mapping objects borrow from to the VM, which unmaps it in freeVM().
+void keepMapping(VM *vm, void *base, size_t size);
+
+// Identifies the instruction set, the value representation and the file
+// layout, so a build that differs in any of them rejects the file.
+uint64_t bytecodeFormat();
+// Checks every operand of a loaded function's code stays inside the chunk,
+// its constants, the `globalCount` globals and the function's own stack
+// slots and upvalues, and that nothing runs off the end. The stack depth is
+// recomputed rather than trusted. Global slot `i` becomes `slots[i]` unless
+// `slots` is nullptr.
+bool verifyBytecode(ObjFunction *function, int globalCount, const int *slots);
+
+uint64_t hashSource(const char *source);
+// Identifies the code compile() makes of `source` with the VM's optimization
+// settings, which the passes change; the cache in vm.cacheDir is keyed on it.
+uint64_t cacheKey(VM *vm, const char *source);
+bool isBytecodeFile(const char *path);
+// Writes the top-level `function` and every function nested in it, along
+// with the global names their instructions refer to. Concurrent writers and
+// readers of one path are safe.
+bool writeBytecode(VM *vm, ObjFunction *function, uint64_t sourceHash,
+                   const char *path);
+// Maps a file written by writeBytecode() and returns its top-level function,
+// with global slots renumbered for this VM. nullptr if the file is missing,
+// truncated, written by a different build, or, unless `sourceHash` is 0,
+// compiled from different source. Every operand is bounds-checked, but the
+// stack discipline the compiler guarantees is not, so only load files from
+// places you would take source from.
+ObjFunction *loadBytecode(VM *vm, const char *path, uint64_t sourceHash);
+void freeBytecodeImages(VM *vm);
+
+#endif /* BYTECODE_H */
@@ -1,37 +1,268 @@
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 #include "vm.h"
+#include <stdlib.h>
 
 void initChunk(Chunk *chunk) {
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->lines = nullptr;
     chunk->code = nullptr;
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
+    chunk->caches = nullptr;
     initValueArray(&chunk->constants);
 }
 
-void writeChunk(Chunk *chunk, uint8_t byte, int line) {
+void writeChunk(VM *vm, Chunk *chunk, uint8_t byte, int line) {
     if (chunk->capacity < chunk->count + 1) {
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
+        chunk->code = GROW_ARRAY(vm, uint8_t, chunk->code, oldCapacity,
+                                 chunk->capacity);
+        chunk->lines = GROW_ARRAY(vm, int, chunk->lines, oldCapacity,
+                                  chunk->capacity);
     }
     chunk->code[chunk->count] = byte;
     chunk->lines[chunk->count] = line;
     chunk->count++;
 }
 
-int addConstant(Chunk *chunk, Value value) {
-    push(value);
-    writeValueArray(&chunk->constants, value);
-    pop();
+int addConstant(VM *vm, Chunk *chunk, Value value) {
+    push(vm, value);
+    writeValueArray(vm, &chunk->constants, value);
+    pop(vm);
     return chunk->constants.count - 1;
 }
 
-void freeChunk(Chunk *chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
-    freeValueArray(&chunk->constants);
+int addInlineCache(VM *vm, Chunk *chunk) {
+    if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+        int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->caches = GROW_ARRAY(vm, InlineCache, chunk->caches, oldCapacity,
+                                   chunk->cacheCapacity);
+    }
+    InlineCache *cache = &chunk->caches[chunk->cacheCount];
+    cache->epoch = 0;
+    cache->count = 0;
+    return chunk->cacheCount++;
+}
+
+// Size in bytes of the instruction at `offset`, operands included.
+int instructionLength(const Chunk *chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_SUPER:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+            return 2;
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_POP:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_NOT_LESS:
+            return 3;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_SET_PROPERTY_POP:
+            return 4;
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_CALL_INLINE:
+            return 5;
+        case OP_INVOKE_INLINE: return 10;
+        case OP_CLOSURE: {
+            ObjFunction *function =
+                AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + 2 * function->upvalueCount;
+        }
+        default: return 1;
+    }
+}
+
+// Offset the instruction at `offset` may branch to, or -1 if it never does.
+int jumpTarget(const Chunk *chunk, int offset) {
+    int sign;
+    switch (chunk->code[offset]) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_CALL_INLINE:
+        case OP_INVOKE_INLINE: sign = 1; break;
+        case OP_LOOP: sign = -1; break;
+        default: return -1;
+    }
+    // The distance is always the last operand.
+    int next = offset + instructionLength(chunk, offset);
+    const uint8_t *operand = &chunk->code[next - 2];
+    uint16_t jump = (uint16_t) ((operand[0] << 8) | operand[1]);
+    return next + sign * jump;
+}
+
+// Net change in stack height over the instruction at `offset`. It is the
+// same whether a conditional jump is taken or not, except for the guards in
+// front of an inlined call: their body starts with the callee and arguments
+// still in place, while the call made when they jump over it leaves only the
+// result.
+static int stackEffect(const Chunk *chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_LIST_INIT:
+        case OP_MAP_INIT:
+        case OP_CLASS:
+        case OP_CLOSURE:
+        case OP_RETURN_NIL: return 1;
+        case OP_SET_LOCAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_UPVALUE:
+        case OP_GET_PROPERTY:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_CALL_INLINE:
+        case OP_INVOKE_INLINE: return 0;
+        case OP_SET_PROPERTY_POP:
+        case OP_SET_INDEX:
+        case OP_SET_INDEX_LIST:
+        case OP_MAP_DATA:
+        case OP_JUMP_IF_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_NOT_LESS: return -2;
+        case OP_CALL:
+        case OP_TAIL_CALL: return -chunk->code[offset + 1];
+        case OP_INVOKE: return -chunk->code[offset + 2];
+        case OP_SUPER_INVOKE: return -chunk->code[offset + 2] - 1;
+        default: return -1;
+    }
+}
+
+static int jumpEffect(const Chunk *chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_CALL_INLINE: return -chunk->code[offset + 1];
+        case OP_INVOKE_INLINE: return -chunk->code[offset + 2];
+        default: return 0;
+    }
+}
+
+// Stack height before each instruction, counted from the frame's first
+// slot, or -1 for instructions that are never reached. Each frame starts
+// `entryDepth` deep: the callee and its arguments. The compiler only emits
+// code whose depth at an instruction is the same along every path, so each
+// one is visited once; code that breaks that, or pops below the frame, gets
+// nullptr. The caller frees the array.
+int *stackDepths(const Chunk *chunk, int entryDepth) {
+    int *depths = malloc(sizeof(int) * (size_t) (chunk->count + 1));
+    int *worklist = malloc(sizeof(int) * (size_t) (chunk->count + 1));
+    if (depths == nullptr || worklist == nullptr) exit(1);
+    for (int i = 0; i < chunk->count; i++) depths[i] = -1;
+    if (chunk->count == 0) {
+        free(worklist);
+        return depths;
+    }
+
+    int pending = 0;
+    bool valid = true;
+    depths[0] = entryDepth;
+    worklist[pending++] = 0;
+    while (valid && pending > 0) {
+        int offset = worklist[--pending];
+        int depth = depths[offset] + stackEffect(chunk, offset);
+        valid = depth >= 0;
+
+        uint8_t instruction = chunk->code[offset];
+        if (instruction == OP_RETURN || instruction == OP_RETURN_NIL) continue;
+        int successors[2];
+        int successorDepths[2];
+        int successorCount = 0;
+        int target = jumpTarget(chunk, offset);
+        if (target >= 0) {
+            successorDepths[successorCount] = depth + jumpEffect(chunk, offset);
+            successors[successorCount++] = target;
+        }
+        if (instruction != OP_JUMP && instruction != OP_LOOP) {
+            successorDepths[successorCount] = depth;
+            successors[successorCount++] =
+                offset + instructionLength(chunk, offset);
+        }
+        for (int i = 0; i < successorCount; i++) {
+            int next = successors[i];
+            valid = valid && successorDepths[i] >= 0;
+            if (!valid || next >= chunk->count) continue;
+            if (depths[next] >= 0) {
+                valid = valid && depths[next] == successorDepths[i];
+                continue;
+            }
+            depths[next] = successorDepths[i];
+            worklist[pending++] = next;
+        }
+    }
+    free(worklist);
+    if (!valid) {
+        free(depths);
+        return nullptr;
+    }
+    return depths;
+}
+
+// Deepest the stack gets while the chunk runs, or -1 if stackDepths() can't
+// follow it.
+int maxStackDepth(const Chunk *chunk, int entryDepth) {
+    int *depths = stackDepths(chunk, entryDepth);
+    if (depths == nullptr) return -1;
+    int maxDepth = entryDepth;
+    for (int offset = 0; offset < chunk->count; offset++) {
+        if (depths[offset] < 0) continue;
+        int depth = depths[offset] + stackEffect(chunk, offset);
+        if (depth > maxDepth) maxDepth = depth;
+    }
+    free(depths);
+    return maxDepth;
+}
+
+void freeChunk(VM *vm, Chunk *chunk) {
+    // A chunk loaded from a bytecode file borrows its code and lines from the
+    // mapping and has no capacity of its own.
+    if (chunk->capacity > 0) {
+        FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+        FREE_ARRAY(vm, int, chunk->lines, chunk->capacity);
+    }
+    FREE_ARRAY(vm, InlineCache, chunk->caches, chunk->cacheCapacity);
+    freeValueArray(vm, &chunk->constants);
     initChunk(chunk);
 }
@@ -3,63 +3,120 @@
 #include "common.h"
 #include "value.h"
 
+// The quickened forms after OP_RETURN are never emitted by the compiler.
+// run() rewrites a generic instruction into one of them once it has seen the
+// operand types, and back again when the guard fails.
+//
+// OP_CALL_INLINE and OP_INVOKE_INLINE are guards placed by inlineCalls() in
+// front of a copy of the callee's body. When the call would run that callee
+// they fall through into the copy; otherwise they jump over it and make the
+// call.
+#define OPCODE_ENUM                                                            \
+    X(OP_CONSTANT)                                                             \
+    X(OP_NIL)                                                                  \
+    X(OP_TRUE)                                                                 \
+    X(OP_FALSE)                                                                \
+    X(OP_POP)                                                                  \
+    X(OP_SET_LOCAL)                                                            \
+    X(OP_SET_LOCAL_POP)                                                        \
+    X(OP_GET_LOCAL)                                                            \
+    X(OP_GET_GLOBAL)                                                           \
+    X(OP_DEFINE_GLOBAL)                                                        \
+    X(OP_SET_GLOBAL)                                                           \
+    X(OP_SET_GLOBAL_POP)                                                       \
+    X(OP_GET_UPVALUE)                                                          \
+    X(OP_SET_UPVALUE)                                                          \
+    X(OP_GET_PROPERTY)                                                         \
+    X(OP_SET_PROPERTY)                                                         \
+    X(OP_SET_PROPERTY_POP)                                                     \
+    X(OP_GET_SUPER)                                                            \
+    X(OP_GET_INDEX)                                                            \
+    X(OP_SET_INDEX)                                                            \
+    X(OP_LIST_INIT)                                                            \
+    X(OP_LIST_DATA)                                                            \
+    X(OP_MAP_INIT)                                                             \
+    X(OP_MAP_DATA)                                                             \
+    X(OP_EQUAL)                                                                \
+    X(OP_GREATER)                                                              \
+    X(OP_LESS)                                                                 \
+    X(OP_ADD)                                                                  \
+    X(OP_SUBTRACT)                                                             \
+    X(OP_MULTIPLY)                                                             \
+    X(OP_DIVIDE)                                                               \
+    X(OP_NOT)                                                                  \
+    X(OP_NEGATE)                                                               \
+    X(OP_PRINT)                                                                \
+    X(OP_JUMP)                                                                 \
+    X(OP_JUMP_IF_FALSE)                                                        \
+    X(OP_LOOP)                                                                 \
+    X(OP_POP_JUMP_IF_FALSE)                                                    \
+    X(OP_POP_JUMP_IF_TRUE)                                                     \
+    X(OP_JUMP_IF_EQUAL)                                                        \
+    X(OP_JUMP_IF_NOT_EQUAL)                                                    \
+    X(OP_JUMP_IF_GREATER)                                                      \
+    X(OP_JUMP_IF_NOT_GREATER)                                                  \
+    X(OP_JUMP_IF_LESS)                                                         \
+    X(OP_JUMP_IF_NOT_LESS)                                                     \
+    X(OP_CALL)                                                                 \
+    X(OP_TAIL_CALL)                                                            \
+    X(OP_INVOKE)                                                               \
+    X(OP_SUPER_INVOKE)                                                         \
+    X(OP_CALL_INLINE)                                                          \
+    X(OP_INVOKE_INLINE)                                                        \
+    X(OP_CLASS)                                                                \
+    X(OP_INHERIT)                                                              \
+    X(OP_METHOD)                                                               \
+    X(OP_CLOSURE)                                                              \
+    X(OP_CLOSE_UPVALUE)                                                        \
+    X(OP_RETURN_NIL)                                                           \
+    X(OP_RETURN)                                                               \
+    X(OP_ADD_NUM)                                                              \
+    X(OP_ADD_STR)                                                              \
+    X(OP_GET_INDEX_LIST)                                                       \
+    X(OP_SET_INDEX_LIST)
+
 typedef enum {
-    OP_CONSTANT,
-    OP_NIL,
-    OP_TRUE,
-    OP_FALSE,
-    OP_POP,
-    OP_SET_LOCAL,
-    OP_GET_LOCAL,
-    OP_GET_GLOBAL,
-    OP_DEFINE_GLOBAL,
-    OP_SET_GLOBAL,
-    OP_GET_UPVALUE,
-    OP_SET_UPVALUE,
-    OP_GET_PROPERTY,
-    OP_SET_PROPERTY,
-    OP_GET_SUPER,
-    OP_GET_INDEX,
-    OP_SET_INDEX,
-    OP_LIST_INIT,
-    OP_LIST_DATA,
-    OP_MAP_INIT,
-    OP_MAP_DATA,
-    OP_EQUAL,
-    OP_GREATER,
-    OP_LESS,
-    OP_ADD,
-    OP_SUBTRACT,
-    OP_MULTIPLY,
-    OP_DIVIDE,
-    OP_NOT,
-    OP_NEGATE,
-    OP_PRINT,
-    OP_JUMP,
-    OP_JUMP_IF_FALSE,
-    OP_LOOP,
-    OP_CALL,
-    OP_INVOKE,
-    OP_SUPER_INVOKE,
-    OP_CLASS,
-    OP_INHERIT,
-    OP_METHOD,
-    OP_CLOSURE,
-    OP_CLOSE_UPVALUE,
-    OP_RETURN,
+#define X(e) e,
+    OPCODE_ENUM
+#undef X
 } OpCode;
 
+// Number of receivers an inline cache remembers before it stops learning
+// new ones and the site is considered megamorphic.
+#define IC_POLYMORPHIC_MAX 4
+#define IC_MEGAMORPHIC UINT8_MAX
+
+typedef struct {
+    Obj *key;    // receiver shape, or class for lists, maps and super calls
+    int slot;    // field slot, or -1 when `value` holds the method
+    Value value; // method, or the shape after the store for OP_SET_PROPERTY
+} CacheEntry;
+
+typedef struct {
+    uint32_t epoch; // vm.cacheEpoch when the entries were filled
+    uint8_t count;
+    CacheEntry entries[IC_POLYMORPHIC_MAX];
+} InlineCache;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t *code;
     int *lines;
     ValueArray constants;
+    int cacheCount;
+    int cacheCapacity;
+    InlineCache *caches;
 } Chunk;
 
 void initChunk(Chunk *chunk);
-void writeChunk(Chunk *chunk, uint8_t byte, int line);
-void freeChunk(Chunk *chunk);
-int addConstant(Chunk *chunk, Value value);
+void writeChunk(VM *vm, Chunk *chunk, uint8_t byte, int line);
+void freeChunk(VM *vm, Chunk *chunk);
+int addConstant(VM *vm, Chunk *chunk, Value value);
+int addInlineCache(VM *vm, Chunk *chunk);
+int instructionLength(const Chunk *chunk, int offset);
+int jumpTarget(const Chunk *chunk, int offset);
+int *stackDepths(const Chunk *chunk, int entryDepth);
+int maxStackDepth(const Chunk *chunk, int entryDepth);
 
 #endif /* CHUNK_H */
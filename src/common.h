@@ -7,5 +7,15 @@
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
 #define NAN_BOXING
+// Threaded dispatch in run() relies on the labels-as-values extension.
+#if !defined(NO_COMPUTED_GOTO) && (defined(__GNUC__) || defined(__clang__))
+#define COMPUTED_GOTO
+#endif
+// The baseline JIT emits x86-64 code against the NaN-boxed value layout; it is
+// only built when asked for with ENABLE_JIT (make JIT=1).
+#if defined(ENABLE_JIT) && defined(NAN_BOXING) && defined(__x86_64__) &&         \
+    defined(__linux__)
+#define LOX_JIT
+#endif
 #define UINT8_COUNT (UINT8_MAX + 1)
 #endif /* COMMON_H */
@@ -2,26 +2,26 @@
 #include "compiler.h"
 #include "chunk.h"
 #include "common.h"
+#include "inline.h"
 #include "memory.h"
 #include "object.h"
+#include "peephole.h"
 #include "scanner.h"
+#include "ssa.h"
 #include "value.h"
 #include "vm.h"
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
 
+#include <assert.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-typedef struct {
-    Token current;
-    Token previous;
-    bool hadError;
-    bool panicMode;
-} Parser;
+typedef struct Parser Parser;
 
 typedef enum {
     PREC_NONE,
@@ -37,7 +37,7 @@ typedef enum {
     PREC_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)(bool canAssign);
+typedef void (*ParseFn)(Parser *parser, bool canAssign);
 
 typedef struct {
     ParseFn prefix;
@@ -70,7 +70,26 @@ typedef struct Compiler {
     int localCount;
     Local locals[UINT8_COUNT];
     Upvalue upvalues[UINT8_COUNT];
+    // For a function compiled on its first call, the names of the upvalues
+    // it was given when its body was skipped; there is no enclosing compiler
+    // left to resolve them in.
+    ObjString **upvalueNames;
     int scopeDepth;
+
+    // Superinstruction bookkeeping. A comparison or store can only be fused
+    // with what follows while it is still the last instruction in the chunk
+    // and no jump lands after its first byte.
+    int lastJumpTarget;
+    int comparisonOffset;
+    int comparisonLength;
+    uint8_t comparisonJump; // fused jump taken when the comparison is false
+    int storeOffset;
+    int callOffset;
+
+    // Constant folding. Where the left operand of the infix operator being
+    // compiled starts, and the last instruction known to leave a number.
+    int operandOffset;
+    int numberOffset;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -78,10 +97,22 @@ typedef struct ClassCompiler {
     bool hasSuperclass;
 } ClassCompiler;
 
-Parser parser;
-Compiler *current = nullptr;
-ClassCompiler *currentClass = nullptr;
-Chunk *compilingChunk;
+// Everything one compile works on, so VMs on different threads can compile
+// at the same time.
+struct Parser {
+    VM *vm;
+    Scanner scanner;
+    const char *source;
+    // A copy of the source for functions to compile later, made for the
+    // first one skipped.
+    ObjString *sourceString;
+    Token current;
+    Token previous;
+    bool hadError;
+    bool panicMode;
+    Compiler *compiler; // innermost function being compiled
+    ClassCompiler *currentClass;
+};
 
 typedef enum {
     EX_ASSIGN,
@@ -155,7 +186,8 @@ static Expr *create_literal_expr(Token token) {
         v->as.boolean = token.type == TOKEN_TRUE;
     } else {
         v->type = VAL_OBJ;
-        ObjString *s = copyString(token.start + 1, token.length - 2);
+        ObjString *s = copyString(parser->vm, token.start + 1,
+                                  token.length - 2);
         v->as.obj = (Obj *) s;
     }
 #endif
@@ -196,8 +228,6 @@ void free_expr(Expr *expr) {
 }
 
 void print_ast(FILE *fout, Expr *expr) {
-    if (parser.panicMode)
-        return;
 #ifdef NAN_BOXING
     if (expr != NULL) {
         if (expr->type == EX_LITERAL) {
@@ -284,125 +314,331 @@ void print_ast(FILE *fout, Expr *expr) {
 #endif
 }
 
-static Chunk *currentChunk() { return &current->function->chunk; }
+static Chunk *currentChunk(Parser *parser) {
+    return &parser->compiler->function->chunk;
+}
 
-static void errorAt(Token *token, const char *message) {
-    if (parser.panicMode)
+static void errorAt(Parser *parser, Token *token, const char *message) {
+    if (parser->panicMode)
         return;
-    parser.panicMode = true;
-    fprintf(vm.ferr, "[line %d] Error", token->line);
+    parser->panicMode = true;
+    fprintf(parser->vm->ferr, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF) {
-        fprintf(vm.ferr, " at end");
+        fprintf(parser->vm->ferr, " at end");
     } else if (token->type == TOKEN_ERROR) {
         // nop
     } else {
-        fprintf(vm.ferr, " at '%.*s'", token->length, token->start);
+        fprintf(parser->vm->ferr, " at '%.*s'", token->length, token->start);
     }
 
-    fprintf(vm.ferr, ": %s\n", message);
-    parser.hadError = true;
+    fprintf(parser->vm->ferr, ": %s\n", message);
+    parser->hadError = true;
 }
 
-static void error(const char *message) { errorAt(&parser.previous, message); }
+static void error(Parser *parser, const char *message) {
+    errorAt(parser, &parser->previous, message);
+}
 
-static void errorAtCurrent(const char *message) {
-    errorAt(&parser.current, message);
+static void errorAtCurrent(Parser *parser, const char *message) {
+    errorAt(parser, &parser->current, message);
 }
 
-static void advance() {
-    parser.previous = parser.current;
+static void advance(Parser *parser) {
+    parser->previous = parser->current;
     for (;;) {
-        parser.current = scanToken();
-        if (parser.current.type != TOKEN_ERROR)
+        parser->current = scanToken(&parser->scanner);
+        if (parser->current.type != TOKEN_ERROR)
             break;
 
-        errorAtCurrent(parser.current.start);
+        errorAtCurrent(parser, parser->current.start);
     }
 }
 
-static void consume(TokenType type, const char *message) {
-    if (parser.current.type == type) {
-        advance();
+static void consume(Parser *parser, TokenType type, const char *message) {
+    if (parser->current.type == type) {
+        advance(parser);
         return;
     }
 
-    errorAtCurrent(message);
+    errorAtCurrent(parser, message);
 }
 
-static void emitByte(uint8_t byte) {
-    writeChunk(currentChunk(), byte, parser.previous.line);
+static void emitByte(Parser *parser, uint8_t byte) {
+    writeChunk(parser->vm, currentChunk(parser), byte, parser->previous.line);
 }
 
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-    emitByte(byte1);
-    emitByte(byte2);
+static void emitBytes(Parser *parser, uint8_t byte1, uint8_t byte2) {
+    emitByte(parser, byte1);
+    emitByte(parser, byte2);
 }
 
-static void emitLoop(int loopStart) {
-    emitByte(OP_LOOP);
+static void emitLoop(Parser *parser, int loopStart) {
+    emitByte(parser, OP_LOOP);
 
-    int offset = currentChunk()->count - loopStart + 2;
+    int offset = currentChunk(parser)->count - loopStart + 2;
     if (offset > UINT16_MAX)
-        error("Loop body too large.");
+        error(parser, "Loop body too large.");
 
-    emitByte((offset >> 8) & 0xFF);
-    emitByte(offset & 0xFF);
+    emitByte(parser, (offset >> 8) & 0xFF);
+    emitByte(parser, offset & 0xFF);
 }
 
-static int emitJump(uint8_t instruction) {
-    emitByte(instruction);
-    emitByte(0xFF);
-    emitByte(0xFF);
-    return currentChunk()->count - 2;
+static int emitJump(Parser *parser, uint8_t instruction) {
+    emitByte(parser, instruction);
+    emitByte(parser, 0xFF);
+    emitByte(parser, 0xFF);
+    return currentChunk(parser)->count - 2;
 }
 
-static void emitReturn() {
-    if (current->type == TYPE_INITIALIZER) {
-        emitBytes(OP_GET_LOCAL, 0);
+static void emitReturn(Parser *parser) {
+    if (parser->compiler->type == TYPE_INITIALIZER) {
+        emitBytes(parser, OP_GET_LOCAL, 0);
+        emitByte(parser, OP_RETURN);
     } else {
-        emitByte(OP_NIL);
+        emitByte(parser, OP_RETURN_NIL);
     }
-    emitByte(OP_RETURN);
 }
 
-static uint8_t makeConstant(Value value) {
-    int constant = addConstant(currentChunk(), value);
+static bool canFuse(Parser *parser, int offset, int length) {
+    return offset >= 0 && offset + length == currentChunk(parser)->count &&
+           parser->compiler->lastJumpTarget <= offset;
+}
+
+// Emits a jump taken when the condition just compiled is false. Unlike
+// OP_JUMP_IF_FALSE it pops the condition, and a trailing comparison is
+// folded into it so the operands never become a boolean on the stack.
+static int emitConditionJump(Parser *parser) {
+    Chunk *chunk = currentChunk(parser);
+    if (!canFuse(parser, parser->compiler->comparisonOffset,
+                 parser->compiler->comparisonLength)) {
+        return emitJump(parser, OP_POP_JUMP_IF_FALSE);
+    }
+    // Keep the comparison's line for its runtime errors.
+    int line = chunk->lines[parser->compiler->comparisonOffset];
+    chunk->count = parser->compiler->comparisonOffset;
+    parser->compiler->comparisonOffset = -1;
+    writeChunk(parser->vm, chunk, parser->compiler->comparisonJump, line);
+    writeChunk(parser->vm, chunk, 0xFF, line);
+    writeChunk(parser->vm, chunk, 0xFF, line);
+    return chunk->count - 2;
+}
+
+// Records that the instruction about to be emitted is a store.
+static void markStore(Parser *parser) {
+    parser->compiler->storeOffset = currentChunk(parser)->count;
+}
+
+// Discards the value of an expression statement, turning a trailing store
+// into its popping form when possible.
+static void emitPop(Parser *parser) {
+    Chunk *chunk = currentChunk(parser);
+    int offset = parser->compiler->storeOffset;
+    if (offset < 0 || offset >= chunk->count ||
+        !canFuse(parser, offset, instructionLength(chunk, offset))) {
+        emitByte(parser, OP_POP);
+        return;
+    }
+    uint8_t *instruction = &chunk->code[offset];
+    switch (*instruction) {
+        case OP_SET_LOCAL: *instruction = OP_SET_LOCAL_POP; break;
+        case OP_SET_GLOBAL: *instruction = OP_SET_GLOBAL_POP; break;
+        case OP_SET_PROPERTY: *instruction = OP_SET_PROPERTY_POP; break;
+        default: emitByte(parser, OP_POP); break;
+    }
+    parser->compiler->storeOffset = -1;
+}
+
+static uint8_t makeConstant(Parser *parser, Value value) {
+    int constant = addConstant(parser->vm, currentChunk(parser), value);
     if (constant > UINT8_MAX) {
-        error("Too many constants in one chunk.");
+        error(parser, "Too many constants in one chunk.");
         return 0;
     }
     return (uint8_t) constant;
 }
 
-static void emitConstant(Value value) {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+// Reserves an inline cache in the current chunk and emits its index as the
+// trailing 16-bit operand of a property access or invoke.
+static void emitCache(Parser *parser) {
+    int cache = addInlineCache(parser->vm, currentChunk(parser));
+    if (cache > UINT16_MAX)
+        error(parser, "Too many property accesses in one chunk.");
+
+    emitByte(parser, (cache >> 8) & 0xFF);
+    emitByte(parser, cache & 0xFF);
 }
 
-static void patchJump(int offset) {
-    int jump = currentChunk()->count - offset - 2;
+static void emitConstant(Parser *parser, Value value) {
+    emitBytes(parser, OP_CONSTANT, makeConstant(parser, value));
+}
+
+// Reads the literal pushed by the instruction at `offset` and returns its
+// length, or 0 if it pushes something else or a jump may land past it.
+static int literalAt(Parser *parser, int offset, Value *value) {
+    Chunk *chunk = currentChunk(parser);
+    if (offset < parser->compiler->lastJumpTarget || offset >= chunk->count)
+        return 0;
+
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+            *value = chunk->constants.values[chunk->code[offset + 1]];
+            return 2;
+        case OP_NIL: *value = NIL_VAL; return 1;
+        case OP_TRUE: *value = BOOL_VAL(true); return 1;
+        case OP_FALSE: *value = BOOL_VAL(false); return 1;
+        default: return 0;
+    }
+}
+
+// Removes the literal pushed from `offset` on, along with its slot in the
+// constant table when it was the last one added.
+static void dropOperand(Parser *parser, int offset) {
+    Chunk *chunk = currentChunk(parser);
+    if (chunk->code[offset] == OP_CONSTANT &&
+        chunk->code[offset + 1] == chunk->constants.count - 1) {
+        chunk->constants.count--;
+    }
+    chunk->count = offset;
+}
+
+static void emitFolded(Parser *parser, Value value) {
+    if (IS_NIL(value)) {
+        emitByte(parser, OP_NIL);
+    } else if (IS_BOOL(value)) {
+        emitByte(parser, AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    } else {
+        emitConstant(parser, value);
+    }
+}
+
+// Computes a binary operator over two literals the way the VM would. Fails
+// for operands the VM rejects, which are left for it to report.
+static bool foldBinary(Parser *parser, TokenType operatorType, Value a,
+                       Value b, Value *result) {
+    if (operatorType == TOKEN_EQUAL_EQUAL || operatorType == TOKEN_BANG_EQUAL) {
+        bool equal = valuesEqual(a, b);
+        *result = BOOL_VAL(operatorType == TOKEN_EQUAL_EQUAL ? equal : !equal);
+        return true;
+    }
+    if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+        ObjString *left = AS_STRING(a);
+        ObjString *right = AS_STRING(b);
+        int length = left->length + right->length;
+        char *chars = ALLOCATE(parser->vm, char, length + 1);
+        memcpy(chars, left->chars, left->length);
+        memcpy(chars + left->length, right->chars, right->length);
+        chars[length] = '\0';
+        *result = OBJ_VAL(takeString(parser->vm, chars, length));
+        return true;
+    }
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (operatorType) {
+        case TOKEN_PLUS: *result = NUMBER_VAL(x + y); return true;
+        case TOKEN_MINUS: *result = NUMBER_VAL(x - y); return true;
+        case TOKEN_STAR: *result = NUMBER_VAL(x * y); return true;
+        case TOKEN_SLASH: *result = NUMBER_VAL(x / y); return true;
+        case TOKEN_GREATER: *result = BOOL_VAL(x > y); return true;
+        case TOKEN_LESS: *result = BOOL_VAL(x < y); return true;
+        // Compiled as the negated opposite comparison, so NaN compares true.
+        case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(!(x < y)); return true;
+        case TOKEN_LESS_EQUAL: *result = BOOL_VAL(!(x > y)); return true;
+        default: return false;
+    }
+}
+
+// Whether `x op c` is x itself for every number x, -0 and NaN included.
+static bool isIdentity(TokenType operatorType, Value c) {
+    if (!IS_NUMBER(c)) return false;
+    double y = AS_NUMBER(c);
+    switch (operatorType) {
+        case TOKEN_STAR:
+        case TOKEN_SLASH: return y == 1;
+        case TOKEN_MINUS: return y == 0 && !signbit(y);
+        default: return false;
+    }
+}
+
+// Folds the operator just parsed when both operands are literals, or drops
+// it when it cannot change a left operand known to be a number. The
+// operands' code starts at `left` and `right` and runs to the chunk's end.
+static bool foldOperands(Parser *parser, TokenType operatorType, int left,
+                         int right) {
+    Value b;
+    int length = literalAt(parser, right, &b);
+    if (length == 0 || right + length != currentChunk(parser)->count)
+        return false;
+
+    Value a;
+    length = literalAt(parser, left, &a);
+    if (length > 0 && left + length == right) {
+        Value result;
+        if (!foldBinary(parser, operatorType, a, b, &result)) return false;
+        push(parser->vm, result);
+        dropOperand(parser, right);
+        dropOperand(parser, left);
+        emitFolded(parser, result);
+        pop(parser->vm);
+        return true;
+    }
+
+    // The instruction that leaves the number checks the operands that went
+    // into it, so no runtime error is lost.
+    int number = parser->compiler->numberOffset;
+    if (number < left || number != right - 1 ||
+        number < parser->compiler->lastJumpTarget ||
+        !isIdentity(operatorType, b)) {
+        return false;
+    }
+    dropOperand(parser, right);
+    return true;
+}
+
+// Emits an operator whose result is always a number when it succeeds.
+static void emitArithmetic(Parser *parser, uint8_t instruction) {
+    parser->compiler->numberOffset = currentChunk(parser)->count;
+    emitByte(parser, instruction);
+}
+
+static void patchJump(Parser *parser, int offset) {
+    int jump = currentChunk(parser)->count - offset - 2;
     if (jump > UINT16_MAX) {
-        error("Too much code to jump over.");
+        error(parser, "Too much code to jump over.");
     }
+    parser->compiler->lastJumpTarget = currentChunk(parser)->count;
 
-    currentChunk()->code[offset] = (jump >> 8) & 0xFF;
-    currentChunk()->code[offset + 1] = jump & 0xFF;
+    currentChunk(parser)->code[offset] = (jump >> 8) & 0xFF;
+    currentChunk(parser)->code[offset + 1] = jump & 0xFF;
 }
 
-static void initCompiler(Compiler *compiler, FunctionType type) {
-    compiler->enclosing = current;
+// Starts compiling `function`, or a new one if it is null.
+static void initCompiler(Parser *parser, Compiler *compiler, FunctionType type,
+                         ObjFunction *function) {
+    compiler->enclosing = parser->compiler;
     compiler->function = nullptr;
     compiler->type = type;
+    compiler->upvalueNames = nullptr;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
-    compiler->function = newFunction();
-    current = compiler;
-    if (type != TYPE_SCRIPT) {
-        current->function->name =
-            copyString(parser.previous.start, parser.previous.length);
-    }
-
-    Local *local = &current->locals[current->localCount++];
+    compiler->lastJumpTarget = 0;
+    compiler->comparisonOffset = -1;
+    compiler->storeOffset = -1;
+    compiler->callOffset = -1;
+    compiler->operandOffset = -1;
+    compiler->numberOffset = -1;
+    compiler->function = function != nullptr ? function
+                                             : newFunction(parser->vm);
+    parser->compiler = compiler;
+    if (type != TYPE_SCRIPT && function == nullptr) {
+        parser->compiler->function->name =
+            copyString(parser->vm, parser->previous.start,
+                       parser->previous.length);
+    }
+
+    Local *local = &parser->compiler->locals[parser->compiler->localCount++];
     local->depth = 0;
     local->isCaptured = false;
     if (type != TYPE_FUNCTION) {
@@ -415,46 +651,60 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
     }
 }
 
-static ObjFunction *endCompiler() {
-    emitReturn();
-    ObjFunction *function = current->function;
+static ObjFunction *endCompiler(Parser *parser) {
+    emitReturn(parser);
+    ObjFunction *function = parser->compiler->function;
+    if (!parser->hadError) {
+        VM *vm = parser->vm;
+        if (vm->peepholeEnabled) optimizeChunk(&function->chunk);
+        // The peephole pass tidies up after the optimizer, which leaves
+        // loads only to be popped where it took values from temporaries.
+        if (vm->ssaEnabled && optimizeSsa(vm, function) &&
+            vm->peepholeEnabled) {
+            optimizeChunk(&function->chunk);
+        }
+    }
+    function->maxSlots = maxStackDepth(&function->chunk, function->arity + 1);
+    assert(parser->hadError || function->maxSlots >= 0);
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError) {
-        disassembleChunk(currentChunk(), function->name != nullptr
-                                             ? function->name->chars
-                                             : "<script>");
+    if (!parser->hadError) {
+        disassembleChunk(parser->vm, parser->vm->ferr, currentChunk(parser),
+                         function->name != nullptr ? function->name->chars
+                                                   : "<script>");
     }
 #endif
-    current = current->enclosing;
+    parser->compiler = parser->compiler->enclosing;
     return function;
 }
 
-static void beginScope() { current->scopeDepth++; }
+static void beginScope(Parser *parser) { parser->compiler->scopeDepth++; }
 
-static void endScope() {
-    current->scopeDepth--;
-    while (current->localCount > 0 &&
-           current->locals[current->localCount - 1].depth >
-               current->scopeDepth) {
-        if (current->locals[current->localCount - 1].isCaptured) {
-            emitByte(OP_CLOSE_UPVALUE);
+static void endScope(Parser *parser) {
+    Compiler *compiler = parser->compiler;
+    compiler->scopeDepth--;
+    while (compiler->localCount > 0 &&
+           compiler->locals[compiler->localCount - 1].depth >
+               compiler->scopeDepth) {
+        if (compiler->locals[compiler->localCount - 1].isCaptured) {
+            emitByte(parser, OP_CLOSE_UPVALUE);
         } else {
-            emitByte(OP_POP);
+            emitByte(parser, OP_POP);
         }
-        current->localCount--;
+        compiler->localCount--;
     }
 }
 
-static void expression();
-static void statement();
-static void declaration();
-static bool match(TokenType type);
-static bool check(TokenType type);
+static void expression(Parser *parser);
+static void statement(Parser *parser);
+static void declaration(Parser *parser);
+static bool match(Parser *parser, TokenType type);
+static bool check(Parser *parser, TokenType type);
 static ParseRule *getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
+static void parsePrecedence(Parser *parser, Precedence precedence);
 
-static uint8_t identifierConstant(Token *name) {
-    return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+static uint8_t identifierConstant(Parser *parser, Token *name) {
+    return makeConstant(parser, OBJ_VAL(copyString(parser->vm, name->start,
+                                                   name->length)));
 }
 
 static bool identifiersEqual(Token *a, Token *b) {
@@ -463,12 +713,13 @@ static bool identifiersEqual(Token *a, Token *b) {
     return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static int resolveLocal(Compiler *compiler, Token *name) {
+static int resolveLocal(Parser *parser, Compiler *compiler, Token *name) {
     for (int i = compiler->localCount - 1; i >= 0; i--) {
         Local *local = &compiler->locals[i];
         if (identifiersEqual(name, &local->name)) {
             if (local->depth == -1) {
-                error("Can't read local variable in its own initializer.");
+                error(parser,
+                      "Can't read local variable in its own initializer.");
             }
             return i;
         }
@@ -476,7 +727,8 @@ static int resolveLocal(Compiler *compiler, Token *name) {
     return -1;
 }
 
-static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal) {
+static int addUpvalue(Parser *parser, Compiler *compiler, uint8_t index,
+                      bool isLocal) {
     int upvalueCount = compiler->function->upvalueCount;
 
     for (int i = 0; i < upvalueCount; i++) {
@@ -487,7 +739,7 @@ static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal) {
     }
 
     if (upvalueCount == UINT8_COUNT) {
-        error("Too many closures in function.");
+        error(parser, "Too many closures in function.");
         return 0;
     }
 
@@ -496,408 +748,550 @@ static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal) {
     return compiler->function->upvalueCount++;
 }
 
-static int resolveUpvalue(Compiler *compiler, Token *name) {
+static int resolveUpvalue(Parser *parser, Compiler *compiler, Token *name) {
     if (compiler->enclosing == nullptr) {
+        for (int i = 0; compiler->upvalueNames != nullptr &&
+                        i < compiler->function->upvalueCount; i++) {
+            ObjString *upvalue = compiler->upvalueNames[i];
+            if (upvalue->length == name->length &&
+                memcmp(upvalue->chars, name->start, name->length) == 0) {
+                return i;
+            }
+        }
         return -1;
     }
-    int local = resolveLocal(compiler->enclosing, name);
+    int local = resolveLocal(parser, compiler->enclosing, name);
     if (local != -1) {
         compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(compiler, (uint8_t) local, true);
+        return addUpvalue(parser, compiler, (uint8_t) local, true);
     }
 
-    int upvalue = resolveUpvalue(compiler->enclosing, name);
+    int upvalue = resolveUpvalue(parser, compiler->enclosing, name);
     if (upvalue != -1) {
-        return addUpvalue(compiler, (uint8_t) upvalue, false);
+        return addUpvalue(parser, compiler, (uint8_t) upvalue, false);
     }
     return -1;
 }
 
-static void addLocal(Token name) {
-    if (current->localCount == UINT8_COUNT) {
-        error("Too many local variables in function.");
+static void addLocal(Parser *parser, Token name) {
+    if (parser->compiler->localCount == UINT8_COUNT) {
+        error(parser, "Too many local variables in function.");
         return;
     }
-    Local *local = &current->locals[current->localCount++];
+    Local *local = &parser->compiler->locals[parser->compiler->localCount++];
     local->name = name;
     local->depth = -1;
     local->isCaptured = false;
 }
 
-static void declareVariable() {
-    if (current->scopeDepth == 0)
+static void declareVariable(Parser *parser) {
+    if (parser->compiler->scopeDepth == 0)
         return;
-    Token *name = &parser.previous;
-    for (int i = current->localCount - 1; i >= 0; i--) {
-        Local *local = &current->locals[i];
-        if (local->depth != -1 && local->depth < current->scopeDepth) {
+    Token *name = &parser->previous;
+    for (int i = parser->compiler->localCount - 1; i >= 0; i--) {
+        Local *local = &parser->compiler->locals[i];
+        if (local->depth != -1 && local->depth < parser->compiler->scopeDepth) {
             break;
         }
 
         if (identifiersEqual(name, &local->name)) {
-            error("Already a variable with this name in this scope.");
+            error(parser, "Already a variable with this name in this scope.");
         }
     }
-    addLocal(*name);
+    addLocal(parser, *name);
+}
+
+static uint16_t globalVariable(Parser *parser, Token *name) {
+    int slot = globalSlot(parser->vm, copyString(parser->vm, name->start,
+                                                 name->length));
+    if (slot > UINT16_MAX) {
+        error(parser, "Too many global variables.");
+        return 0;
+    }
+    return (uint16_t) slot;
+}
+
+static void emitGlobal(Parser *parser, uint8_t instruction, uint16_t slot) {
+    emitByte(parser, instruction);
+    emitByte(parser, (slot >> 8) & 0xFF);
+    emitByte(parser, slot & 0xFF);
 }
 
-static uint8_t parseVariable(const char *errorMessage) {
-    consume(TOKEN_IDENTIFIER, errorMessage);
-    declareVariable();
-    if (current->scopeDepth > 0)
+static uint16_t parseVariable(Parser *parser, const char *errorMessage) {
+    consume(parser, TOKEN_IDENTIFIER, errorMessage);
+    declareVariable(parser);
+    if (parser->compiler->scopeDepth > 0)
         return 0;
-    return identifierConstant(&parser.previous);
+    return globalVariable(parser, &parser->previous);
 }
 
-static void markInitialized() {
-    if (current->scopeDepth == 0)
+static void markInitialized(Parser *parser) {
+    Compiler *compiler = parser->compiler;
+    if (compiler->scopeDepth == 0)
         return;
-    current->locals[current->localCount - 1].depth = current->scopeDepth;
+    compiler->locals[compiler->localCount - 1].depth = compiler->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
-    if (current->scopeDepth > 0) {
-        markInitialized();
+static void defineVariable(Parser *parser, uint16_t global) {
+    if (parser->compiler->scopeDepth > 0) {
+        markInitialized(parser);
         return;
     }
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitGlobal(parser, OP_DEFINE_GLOBAL, global);
 }
 
-static uint8_t argumentList() {
+static uint8_t argumentList(Parser *parser) {
     uint8_t argCount = 0;
-    if (!check(TOKEN_RIGHT_PAREN)) {
+    if (!check(parser, TOKEN_RIGHT_PAREN)) {
         do {
-            expression();
+            expression(parser);
             if (argCount == 255) {
-                error("Can't have more than 255 arguments.");
+                error(parser, "Can't have more than 255 arguments.");
             }
             argCount++;
 
-        } while (match(TOKEN_COMMA));
+        } while (match(parser, TOKEN_COMMA));
     }
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
     return argCount;
 }
 
-static void and_(bool canAssign) {
+static void and_(Parser *parser, bool canAssign) {
     (void) canAssign;
-    int endJump = emitJump(OP_JUMP_IF_FALSE);
+    int endJump = emitJump(parser, OP_JUMP_IF_FALSE);
 
-    emitByte(OP_POP);
-    parsePrecedence(PREC_AND);
-    patchJump(endJump);
+    emitByte(parser, OP_POP);
+    parsePrecedence(parser, PREC_AND);
+    patchJump(parser, endJump);
 }
 
-static void binary(bool canAssign) {
+static void binary(Parser *parser, bool canAssign) {
     (void) canAssign;
-    TokenType operatorType = parser.previous.type;
+    TokenType operatorType = parser->previous.type;
     ParseRule *rule = getRule(operatorType);
-    parsePrecedence((Precedence) (rule->precedence + 1));
+    int left = parser->compiler->operandOffset;
+    int right = currentChunk(parser)->count;
+    parsePrecedence(parser, (Precedence) (rule->precedence + 1));
+    if (foldOperands(parser, operatorType, left, right)) return;
 
+    int offset = currentChunk(parser)->count;
+    uint8_t jump;
     switch (operatorType) {
-        case TOKEN_BANG_EQUAL: emitBytes(OP_EQUAL, OP_NOT); break;
-        case TOKEN_EQUAL_EQUAL: emitByte(OP_EQUAL); break;
-        case TOKEN_GREATER: emitByte(OP_GREATER); break;
-        case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
-        case TOKEN_LESS: emitByte(OP_LESS); break;
-        case TOKEN_LESS_EQUAL: emitBytes(OP_GREATER, OP_NOT); break;
-        case TOKEN_PLUS: emitByte(OP_ADD); break;
-        case TOKEN_MINUS: emitByte(OP_SUBTRACT); break;
-        case TOKEN_STAR: emitByte(OP_MULTIPLY); break;
-        case TOKEN_SLASH: emitByte(OP_DIVIDE); break;
+        case TOKEN_BANG_EQUAL:
+            emitBytes(parser, OP_EQUAL, OP_NOT);
+            jump = OP_JUMP_IF_EQUAL;
+            break;
+        case TOKEN_EQUAL_EQUAL:
+            emitByte(parser, OP_EQUAL);
+            jump = OP_JUMP_IF_NOT_EQUAL;
+            break;
+        case TOKEN_GREATER:
+            emitByte(parser, OP_GREATER);
+            jump = OP_JUMP_IF_NOT_GREATER;
+            break;
+        case TOKEN_GREATER_EQUAL:
+            emitBytes(parser, OP_LESS, OP_NOT);
+            jump = OP_JUMP_IF_LESS;
+            break;
+        case TOKEN_LESS: emitByte(parser,
+                                  OP_LESS); jump = OP_JUMP_IF_NOT_LESS; break;
+        case TOKEN_LESS_EQUAL:
+            emitBytes(parser, OP_GREATER, OP_NOT);
+            jump = OP_JUMP_IF_GREATER;
+            break;
+        case TOKEN_PLUS: emitByte(parser, OP_ADD); return;
+        case TOKEN_MINUS: emitArithmetic(parser, OP_SUBTRACT); return;
+        case TOKEN_STAR: emitArithmetic(parser, OP_MULTIPLY); return;
+        case TOKEN_SLASH: emitArithmetic(parser, OP_DIVIDE); return;
         default: return;
     }
+    parser->compiler->comparisonOffset = offset;
+    parser->compiler->comparisonLength = currentChunk(parser)->count - offset;
+    parser->compiler->comparisonJump = jump;
 }
 
-static void call(bool canAssign) {
+static void call(Parser *parser, bool canAssign) {
     (void) canAssign;
-    uint8_t argCount = argumentList();
-    emitBytes(OP_CALL, argCount);
-}
-
-static void dot(bool canAssign) {
-    consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifierConstant(&parser.previous);
-
-    if (canAssign && match(TOKEN_EQUAL)) {
-        expression();
-        emitBytes(OP_SET_PROPERTY, name);
-    } else if (match(TOKEN_LEFT_PAREN)) {
-        uint8_t argCount = argumentList();
-        emitBytes(OP_INVOKE, name);
-        emitByte(argCount);
+    uint8_t argCount = argumentList(parser);
+    parser->compiler->callOffset = currentChunk(parser)->count;
+    emitBytes(parser, OP_CALL, argCount);
+}
+
+static void dot(Parser *parser, bool canAssign) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect property name after '.'.");
+    uint8_t name = identifierConstant(parser, &parser->previous);
+
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        markStore(parser);
+        emitBytes(parser, OP_SET_PROPERTY, name);
+        emitCache(parser);
+    } else if (match(parser, TOKEN_LEFT_PAREN)) {
+        uint8_t argCount = argumentList(parser);
+        emitBytes(parser, OP_INVOKE, name);
+        emitByte(parser, argCount);
+        emitCache(parser);
     } else {
-        emitBytes(OP_GET_PROPERTY, name);
+        emitBytes(parser, OP_GET_PROPERTY, name);
+        emitCache(parser);
     }
 }
 
-static void literal(bool canAssign) {
+static void literal(Parser *parser, bool canAssign) {
     (void) canAssign;
-    switch (parser.previous.type) {
-        case TOKEN_FALSE: emitByte(OP_FALSE); break;
-        case TOKEN_TRUE: emitByte(OP_TRUE); break;
-        case TOKEN_NIL: emitByte(OP_NIL); break;
+    switch (parser->previous.type) {
+        case TOKEN_FALSE: emitByte(parser, OP_FALSE); break;
+        case TOKEN_TRUE: emitByte(parser, OP_TRUE); break;
+        case TOKEN_NIL: emitByte(parser, OP_NIL); break;
         default: return;
     }
 }
 
-static void expression() { parsePrecedence(PREC_ASSIGNMENT); }
+static void expression(Parser *parser) { parsePrecedence(parser,
+                                                         PREC_ASSIGNMENT); }
 
-static void block() {
-    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-        declaration();
+static void block(Parser *parser) {
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+        declaration(parser);
     }
 
-    consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type) {
-    Compiler compiler;
-    initCompiler(&compiler, type);
-    beginScope();
+static Token syntheticToken(const char *text) {
+    Token token;
+    token.start = text;
+    token.length = (int) strlen(text);
+    return token;
+}
 
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
-    if (!check(TOKEN_RIGHT_PAREN)) {
+static void parameters(Parser *parser) {
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    if (!check(parser, TOKEN_RIGHT_PAREN)) {
         do {
-            current->function->arity++;
-            if (current->function->arity > 255) {
-                errorAtCurrent("Can't have more than 255 parameters.");
+            parser->compiler->function->arity++;
+            if (parser->compiler->function->arity > 255) {
+                errorAtCurrent(parser, "Can't have more than 255 parameters.");
             }
-            uint8_t constant = parseVariable("Expect parameter name.");
-            defineVariable(constant);
-        } while (match(TOKEN_COMMA));
+            uint16_t constant = parseVariable(parser, "Expect parameter name.");
+            defineVariable(parser, constant);
+        } while (match(parser, TOKEN_COMMA));
+    }
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+}
+
+// Resolves a name in a skipped body as compiling it would, if it can't be
+// one of the function's own parameters. Names the body declares itself may
+// be captured needlessly, which costs a closed upvalue but changes nothing.
+static void skipName(Parser *parser, Token name, Token *upvalueNames) {
+    Compiler *compiler = parser->compiler;
+    if (resolveLocal(parser, compiler, &name) != -1) return;
+    int upvalue = resolveUpvalue(parser, compiler, &name);
+    if (upvalue != -1) upvalueNames[upvalue] = name;
+}
+
+// Moves past a function body, after its '{', without compiling it. Only
+// the braces are matched, so syntax errors inside wait for the first call.
+static void skipBody(Parser *parser, Token *upvalueNames) {
+    TokenType last = TOKEN_LEFT_BRACE;
+    int depth = 1;
+    while (depth > 0 && !check(parser, TOKEN_EOF)) {
+        advance(parser);
+        switch (parser->previous.type) {
+            case TOKEN_LEFT_BRACE: depth++; break;
+            case TOKEN_RIGHT_BRACE: depth--; break;
+            case TOKEN_IDENTIFIER:
+                // Property names and map keys aren't variables.
+                if (last != TOKEN_DOT && !check(parser, TOKEN_COLON)) {
+                    skipName(parser, parser->previous, upvalueNames);
+                }
+                break;
+            case TOKEN_SUPER:
+                skipName(parser, syntheticToken("super"), upvalueNames);
+                skipName(parser, syntheticToken("this"), upvalueNames);
+                break;
+            case TOKEN_THIS:
+                skipName(parser, syntheticToken("this"), upvalueNames);
+                break;
+            default: break;
+        }
+        last = parser->previous.type;
+    }
+    if (depth > 0) errorAtCurrent(parser, "Expect '}' after block.");
+}
+
+// Finishes a function whose body was skipped, keeping what compiling it
+// later takes.
+static ObjFunction *endLazyCompiler(Parser *parser, int offset, int line,
+                                    Token *upvalueNames) {
+    VM *vm = parser->vm;
+    ObjFunction *function = parser->compiler->function;
+    if (parser->sourceString == nullptr) {
+        parser->sourceString =
+            copyString(vm, parser->source, (int) strlen(parser->source));
+    }
+    ObjString **names = ALLOCATE(vm, ObjString *, function->upvalueCount);
+    for (int i = 0; i < function->upvalueCount; i++) names[i] = nullptr;
+    LazyFunction *lazy = ALLOCATE(vm, LazyFunction, 1);
+    lazy->source = parser->sourceString;
+    lazy->offset = offset;
+    lazy->line = line;
+    lazy->type = (uint8_t) parser->compiler->type;
+    lazy->inClass = parser->currentClass != nullptr;
+    lazy->hasSuperclass =
+        lazy->inClass && parser->currentClass->hasSuperclass;
+    lazy->upvalueNames = names;
+    function->lazy = lazy;
+    for (int i = 0; i < function->upvalueCount; i++) {
+        names[i] = copyString(vm, upvalueNames[i].start,
+                              upvalueNames[i].length);
     }
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
-    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-    block();
+    parser->compiler = parser->compiler->enclosing;
+    return function;
+}
 
-    ObjFunction *function = endCompiler();
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+static void function(Parser *parser, FunctionType type) {
+    Compiler compiler;
+    initCompiler(parser, &compiler, type, nullptr);
+    beginScope(parser);
+
+    int offset = (int) (parser->current.start - parser->source);
+    int line = parser->current.line;
+    parameters(parser);
+    ObjFunction *function;
+    if (parser->vm->lazyCompile) {
+        Token upvalueNames[UINT8_COUNT];
+        skipBody(parser, upvalueNames);
+        function = endLazyCompiler(parser, offset, line, upvalueNames);
+    } else {
+        block(parser);
+        function = endCompiler(parser);
+    }
+    emitBytes(parser, OP_CLOSURE, makeConstant(parser, OBJ_VAL(function)));
     for (int i = 0; i < function->upvalueCount; i++) {
-        emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-        emitByte(compiler.upvalues[i].index);
+        emitByte(parser, compiler.upvalues[i].isLocal ? 1 : 0);
+        emitByte(parser, compiler.upvalues[i].index);
     }
 }
 
-static void method() {
-    consume(TOKEN_IDENTIFIER, "Expect method name.");
-    uint8_t constant = identifierConstant(&parser.previous);
+static void method(Parser *parser) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect method name.");
+    uint8_t constant = identifierConstant(parser, &parser->previous);
     FunctionType type = TYPE_METHOD;
-    if (parser.previous.length == 4 &&
-        0 == memcmp(parser.previous.start, "init", 4)) {
+    if (parser->previous.length == 4 &&
+        0 == memcmp(parser->previous.start, "init", 4)) {
         type = TYPE_INITIALIZER;
     }
-    function(type);
-    emitBytes(OP_METHOD, constant);
+    function(parser, type);
+    emitBytes(parser, OP_METHOD, constant);
 }
 
-static void variable(bool canAssign);
-static void namedVariable(Token name, bool canAssign);
+static void variable(Parser *parser, bool canAssign);
+static void namedVariable(Parser *parser, Token name, bool canAssign);
 
-static Token syntheticToken(const char *text) {
-    Token token;
-    token.start = text;
-    token.length = (int) strlen(text);
-    return token;
-}
-
-static void super(bool canAssign) {
+static void super(Parser *parser, bool canAssign) {
     (void) canAssign;
-    if (currentClass == nullptr) {
-        error("Can't use 'super' outside of a class.");
-    } else if (!currentClass->hasSuperclass) {
-        error("Can't use 'super' in a class with no superclass.");
-    }
-
-    consume(TOKEN_DOT, "Expect '.' after 'super'.");
-    consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifierConstant(&parser.previous);
-    namedVariable(syntheticToken("this"), false);
-    if (match(TOKEN_LEFT_PAREN)) {
-        uint8_t argCount = argumentList();
-        namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_SUPER_INVOKE, name);
-        emitByte(argCount);
+    if (parser->currentClass == nullptr) {
+        error(parser, "Can't use 'super' outside of a class.");
+    } else if (!parser->currentClass->hasSuperclass) {
+        error(parser, "Can't use 'super' in a class with no superclass.");
+    }
+
+    consume(parser, TOKEN_DOT, "Expect '.' after 'super'.");
+    consume(parser, TOKEN_IDENTIFIER, "Expect superclass method name.");
+    uint8_t name = identifierConstant(parser, &parser->previous);
+    namedVariable(parser, syntheticToken("this"), false);
+    if (match(parser, TOKEN_LEFT_PAREN)) {
+        uint8_t argCount = argumentList(parser);
+        namedVariable(parser, syntheticToken("super"), false);
+        emitBytes(parser, OP_SUPER_INVOKE, name);
+        emitByte(parser, argCount);
+        emitCache(parser);
     } else {
-        namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_GET_SUPER, name);
+        namedVariable(parser, syntheticToken("super"), false);
+        emitBytes(parser, OP_GET_SUPER, name);
     }
 }
 
-static void classDeclaration() {
-    consume(TOKEN_IDENTIFIER, "Expect class name.");
-    Token className = parser.previous;
-    uint8_t nameConstant = identifierConstant(&parser.previous);
-    declareVariable();
+static void classDeclaration(Parser *parser) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect class name.");
+    Token className = parser->previous;
+    uint8_t nameConstant = identifierConstant(parser, &parser->previous);
+    declareVariable(parser);
 
-    emitBytes(OP_CLASS, nameConstant);
-    defineVariable(nameConstant);
+    emitBytes(parser, OP_CLASS, nameConstant);
+    defineVariable(parser, parser->compiler->scopeDepth > 0
+                               ? 0
+                               : globalVariable(parser, &className));
 
     ClassCompiler classCompiler;
     classCompiler.hasSuperclass = false;
-    classCompiler.enclosing = currentClass;
-    currentClass = &classCompiler;
+    classCompiler.enclosing = parser->currentClass;
+    parser->currentClass = &classCompiler;
 
-    if (match(TOKEN_LESS)) {
-        consume(TOKEN_IDENTIFIER, "Expect superclass name.");
-        variable(false);
+    if (match(parser, TOKEN_LESS)) {
+        consume(parser, TOKEN_IDENTIFIER, "Expect superclass name.");
+        variable(parser, false);
 
-        if (identifiersEqual(&className, &parser.previous)) {
-            error("A class can't inherit from itself.");
+        if (identifiersEqual(&className, &parser->previous)) {
+            error(parser, "A class can't inherit from itself.");
         }
-        beginScope();
-        addLocal(syntheticToken("super"));
-        defineVariable(0);
+        beginScope(parser);
+        addLocal(parser, syntheticToken("super"));
+        defineVariable(parser, 0);
 
-        namedVariable(className, false);
-        emitByte(OP_INHERIT);
+        namedVariable(parser, className, false);
+        emitByte(parser, OP_INHERIT);
         classCompiler.hasSuperclass = true;
     }
 
-    namedVariable(className, false);
-    consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
-    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-        method();
+    namedVariable(parser, className, false);
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+        method(parser);
     }
-    consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
-    emitByte(OP_POP);
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+    emitByte(parser, OP_POP);
 
     if (classCompiler.hasSuperclass) {
-        endScope();
+        endScope(parser);
     }
 
-    currentClass = currentClass->enclosing;
+    parser->currentClass = parser->currentClass->enclosing;
 }
 
-static void funDeclaration() {
-    uint8_t global = parseVariable("Expect function name.");
-    markInitialized();
-    function(TYPE_FUNCTION);
-    defineVariable(global);
+static void funDeclaration(Parser *parser) {
+    uint16_t global = parseVariable(parser, "Expect function name.");
+    markInitialized(parser);
+    function(parser, TYPE_FUNCTION);
+    defineVariable(parser, global);
 }
 
-static void varDeclaration() {
-    uint8_t global = parseVariable("Expect variable name.");
+static void varDeclaration(Parser *parser) {
+    uint16_t global = parseVariable(parser, "Expect variable name.");
 
-    if (match(TOKEN_EQUAL)) {
-        expression();
+    if (match(parser, TOKEN_EQUAL)) {
+        expression(parser);
     } else {
-        emitByte(OP_NIL);
+        emitByte(parser, OP_NIL);
     }
-    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
-    defineVariable(global);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+    defineVariable(parser, global);
 }
 
-static void expressionStatement() {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emitByte(OP_POP);
+static void expressionStatement(Parser *parser) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+    emitPop(parser);
 }
 
-static void forStatement() {
-    beginScope();
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
-    if (match(TOKEN_SEMICOLON)) {
+static void forStatement(Parser *parser) {
+    beginScope(parser);
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    if (match(parser, TOKEN_SEMICOLON)) {
         // no initializer
-    } else if (match(TOKEN_VAR)) {
-        varDeclaration();
+    } else if (match(parser, TOKEN_VAR)) {
+        varDeclaration(parser);
     } else {
-        expressionStatement();
+        expressionStatement(parser);
     }
 
-    int loopStart = currentChunk()->count;
+    int loopStart = currentChunk(parser)->count;
     int exitJump = -1;
-    if (!match(TOKEN_SEMICOLON)) {
-        expression();
-        consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP);
+    if (!match(parser, TOKEN_SEMICOLON)) {
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+        exitJump = emitConditionJump(parser);
     }
 
-    if (!match(TOKEN_RIGHT_PAREN)) {
-        int bodyJump = emitJump(OP_JUMP);
-        int incrementStart = currentChunk()->count;
-        expression();
-        emitByte(OP_POP);
-        consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+    if (!match(parser, TOKEN_RIGHT_PAREN)) {
+        int bodyJump = emitJump(parser, OP_JUMP);
+        int incrementStart = currentChunk(parser)->count;
+        expression(parser);
+        emitPop(parser);
+        consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
-        emitLoop(loopStart);
+        emitLoop(parser, loopStart);
         loopStart = incrementStart;
-        patchJump(bodyJump);
+        patchJump(parser, bodyJump);
     }
 
-    statement();
-    emitLoop(loopStart);
+    statement(parser);
+    emitLoop(parser, loopStart);
     if (exitJump != -1) {
-        patchJump(exitJump);
-        emitByte(OP_POP);
+        patchJump(parser, exitJump);
     }
-    endScope();
+    endScope(parser);
 }
 
-static void ifStatement() {
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after if.");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+static void ifStatement(Parser *parser) {
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after if.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    statement();
+    int thenJump = emitConditionJump(parser);
+    statement(parser);
 
-    int elseJump = emitJump(OP_JUMP);
-    patchJump(thenJump);
-    emitByte(OP_POP);
-
-    if (match(TOKEN_ELSE))
-        statement();
-    patchJump(elseJump);
+    if (match(parser, TOKEN_ELSE)) {
+        int elseJump = emitJump(parser, OP_JUMP);
+        patchJump(parser, thenJump);
+        statement(parser);
+        patchJump(parser, elseJump);
+    } else {
+        patchJump(parser, thenJump);
+    }
 }
 
-static void printStatement() {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ; after value");
-    emitByte(OP_PRINT);
+static void printStatement(Parser *parser) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ; after value");
+    emitByte(parser, OP_PRINT);
 }
 
-static void returnStatement() {
-    if (current->type == TYPE_SCRIPT) {
-        error("Can't return from top-level code.");
+static void returnStatement(Parser *parser) {
+    if (parser->compiler->type == TYPE_SCRIPT) {
+        error(parser, "Can't return from top-level code.");
     }
 
-    if (match(TOKEN_SEMICOLON)) {
-        emitReturn();
+    if (match(parser, TOKEN_SEMICOLON)) {
+        emitReturn(parser);
     } else {
-        if (current->type == TYPE_INITIALIZER) {
-            error("Can't return a value from an initializer.");
+        if (parser->compiler->type == TYPE_INITIALIZER) {
+            error(parser, "Can't return a value from an initializer.");
         }
 
-        expression();
-        consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-        emitByte(OP_RETURN);
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+        // `return f(...)` reuses the frame. The OP_RETURN stays for callees
+        // that can't take it over, like natives and classes.
+        if (canFuse(parser, parser->compiler->callOffset, 2)) {
+            int callOffset = parser->compiler->callOffset;
+            currentChunk(parser)->code[callOffset] = OP_TAIL_CALL;
+        }
+        emitByte(parser, OP_RETURN);
     }
 }
 
-static void whileStatement() {
-    int loopStart = currentChunk()->count;
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+static void whileStatement(Parser *parser) {
+    int loopStart = currentChunk(parser)->count;
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    statement();
-    emitLoop(loopStart);
-    patchJump(exitJump);
-    emitByte(OP_POP);
+    int exitJump = emitConditionJump(parser);
+    statement(parser);
+    emitLoop(parser, loopStart);
+    patchJump(parser, exitJump);
 }
 
-static void synchronize() {
-    parser.panicMode = false;
+static void synchronize(Parser *parser) {
+    parser->panicMode = false;
 
-    while (parser.current.type != TOKEN_EOF) {
-        if (parser.previous.type == TOKEN_SEMICOLON)
+    while (parser->current.type != TOKEN_EOF) {
+        if (parser->previous.type == TOKEN_SEMICOLON)
             return;
-        switch (parser.current.type) {
+        switch (parser->current.type) {
             case TOKEN_CLASS:
             case TOKEN_FUN:
             case TOKEN_VAR:
@@ -910,165 +1304,190 @@ static void synchronize() {
             default: // nop
                 ;
         }
-        advance();
+        advance(parser);
     }
 }
 
-static void declaration() {
-    if (match(TOKEN_CLASS)) {
-        classDeclaration();
-    } else if (match(TOKEN_FUN)) {
-        funDeclaration();
-    } else if (match(TOKEN_VAR)) {
-        varDeclaration();
+static void declaration(Parser *parser) {
+    if (match(parser, TOKEN_CLASS)) {
+        classDeclaration(parser);
+    } else if (match(parser, TOKEN_FUN)) {
+        funDeclaration(parser);
+    } else if (match(parser, TOKEN_VAR)) {
+        varDeclaration(parser);
     } else {
-        statement();
-    }
-    if (parser.panicMode)
-        synchronize();
-}
-
-static void statement() {
-    if (match(TOKEN_PRINT)) {
-        printStatement();
-    } else if (match(TOKEN_FOR)) {
-        forStatement();
-    } else if (match(TOKEN_IF)) {
-        ifStatement();
-    } else if (match(TOKEN_RETURN)) {
-        returnStatement();
-    } else if (match(TOKEN_WHILE)) {
-        whileStatement();
-    } else if (match(TOKEN_LEFT_BRACE)) {
-        beginScope();
-        block();
-        endScope();
+        statement(parser);
+    }
+    if (parser->panicMode)
+        synchronize(parser);
+}
+
+static void statement(Parser *parser) {
+    if (match(parser, TOKEN_PRINT)) {
+        printStatement(parser);
+    } else if (match(parser, TOKEN_FOR)) {
+        forStatement(parser);
+    } else if (match(parser, TOKEN_IF)) {
+        ifStatement(parser);
+    } else if (match(parser, TOKEN_RETURN)) {
+        returnStatement(parser);
+    } else if (match(parser, TOKEN_WHILE)) {
+        whileStatement(parser);
+    } else if (match(parser, TOKEN_LEFT_BRACE)) {
+        beginScope(parser);
+        block(parser);
+        endScope(parser);
     } else {
-        expressionStatement();
+        expressionStatement(parser);
     }
 }
 
-static void index_(bool canAssign) {
-    expression();
-    consume(TOKEN_RIGHT_SQUARE, "Expect ']' after expression.");
+static void index_(Parser *parser, bool canAssign) {
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_SQUARE, "Expect ']' after expression.");
 
-    if (canAssign && match(TOKEN_EQUAL)) {
-        expression();
-        emitByte(OP_SET_INDEX);
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        emitByte(parser, OP_SET_INDEX);
     } else {
-        emitByte(OP_GET_INDEX);
+        emitByte(parser, OP_GET_INDEX);
     }
 }
 
-static void list(bool canAssign) {
+static void list(Parser *parser, bool canAssign) {
     (void) canAssign;
-    emitByte(OP_LIST_INIT);
+    emitByte(parser, OP_LIST_INIT);
     do {
-        if (check(TOKEN_RIGHT_SQUARE)) {
+        if (check(parser, TOKEN_RIGHT_SQUARE)) {
             break;
         }
-        expression();
-        emitByte(OP_LIST_DATA);
-    } while (match(TOKEN_COMMA));
-    consume(TOKEN_RIGHT_SQUARE, "Expect ']' after list.");
+        expression(parser);
+        emitByte(parser, OP_LIST_DATA);
+    } while (match(parser, TOKEN_COMMA));
+    consume(parser, TOKEN_RIGHT_SQUARE, "Expect ']' after list.");
 }
 
-static void map(bool canAssign) {
+static void map(Parser *parser, bool canAssign) {
     (void) canAssign;
-    emitByte(OP_MAP_INIT);
+    emitByte(parser, OP_MAP_INIT);
     do {
-        if (check(TOKEN_RIGHT_BRACE)) {
+        if (check(parser, TOKEN_RIGHT_BRACE)) {
             break;
         }
-        if (match(TOKEN_LEFT_SQUARE)) {
-            expression();
-            consume(TOKEN_RIGHT_SQUARE, "Expect ']' after expression.");
+        if (match(parser, TOKEN_LEFT_SQUARE)) {
+            expression(parser);
+            consume(parser, TOKEN_RIGHT_SQUARE, "Expect ']' after expression.");
         } else {
-            consume(TOKEN_IDENTIFIER, "Expect identifier or '['.");
-            uint8_t constant = identifierConstant(&parser.previous);
-            emitBytes(OP_CONSTANT, constant);
+            consume(parser, TOKEN_IDENTIFIER, "Expect identifier or '['.");
+            uint8_t constant = identifierConstant(parser, &parser->previous);
+            emitBytes(parser, OP_CONSTANT, constant);
         }
-        consume(TOKEN_COLON, "Expect ':' after map key.");
-        expression();
-        emitByte(OP_MAP_DATA);
-    } while (match(TOKEN_COMMA));
-    consume(TOKEN_RIGHT_BRACE, "Expect '}' after map.");
+        consume(parser, TOKEN_COLON, "Expect ':' after map key.");
+        expression(parser);
+        emitByte(parser, OP_MAP_DATA);
+    } while (match(parser, TOKEN_COMMA));
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after map.");
 }
 
-static void grouping(bool canAssign) {
+static void grouping(Parser *parser, bool canAssign) {
     (void) canAssign;
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-static void number(bool canAssign) {
+static void number(Parser *parser, bool canAssign) {
     (void) canAssign;
-    double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+    double value = strtod(parser->previous.start, NULL);
+    emitConstant(parser, NUMBER_VAL(value));
 }
 
-static void or_(bool canAssign) {
+static void or_(Parser *parser, bool canAssign) {
     (void) canAssign;
-    int elseJump = emitJump(OP_JUMP_IF_FALSE);
-    int endJump = emitJump(OP_JUMP);
+    int elseJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    int endJump = emitJump(parser, OP_JUMP);
 
-    patchJump(elseJump);
-    emitByte(OP_POP);
-    parsePrecedence(PREC_OR);
-    patchJump(endJump);
+    patchJump(parser, elseJump);
+    emitByte(parser, OP_POP);
+    parsePrecedence(parser, PREC_OR);
+    patchJump(parser, endJump);
 }
 
-static void string(bool canAssign) {
+static void string(Parser *parser, bool canAssign) {
     (void) canAssign;
-    emitConstant(OBJ_VAL(
-        copyString(parser.previous.start + 1, parser.previous.length - 2)));
+    emitConstant(parser, OBJ_VAL(
+        copyString(parser->vm, parser->previous.start + 1,
+                   parser->previous.length - 2)));
 }
 
-static void namedVariable(Token name, bool canAssign) {
+static void namedVariable(Parser *parser, Token name, bool canAssign) {
     uint8_t getOp, setOp;
-    int arg = resolveLocal(current, &name);
+    int arg = resolveLocal(parser, parser->compiler, &name);
     if (arg != -1) {
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
-    } else if ((arg = resolveUpvalue(current, &name)) != -1) {
+    } else if ((arg = resolveUpvalue(parser, parser->compiler, &name)) != -1) {
         getOp = OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
     } else {
-        arg = identifierConstant(&name);
-        getOp = OP_GET_GLOBAL;
-        setOp = OP_SET_GLOBAL;
+        uint16_t global = globalVariable(parser, &name);
+        if (canAssign && match(parser, TOKEN_EQUAL)) {
+            expression(parser);
+            markStore(parser);
+            emitGlobal(parser, OP_SET_GLOBAL, global);
+        } else {
+            emitGlobal(parser, OP_GET_GLOBAL, global);
+        }
+        return;
     }
 
-    if (canAssign && match(TOKEN_EQUAL)) {
-        expression();
-        emitBytes(setOp, (uint8_t) arg);
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        markStore(parser);
+        emitBytes(parser, setOp, (uint8_t) arg);
     } else {
-        emitBytes(getOp, (uint8_t) arg);
+        emitBytes(parser, getOp, (uint8_t) arg);
     }
 }
 
-static void variable(bool canAssign) {
-    namedVariable(parser.previous, canAssign);
+static void variable(Parser *parser, bool canAssign) {
+    namedVariable(parser, parser->previous, canAssign);
 }
 
-static void this(bool canAssign) {
+static void this(Parser *parser, bool canAssign) {
     (void) canAssign;
-    if (currentClass == nullptr) {
-        error("Can't use 'this' outside of a class.");
+    if (parser->currentClass == nullptr) {
+        error(parser, "Can't use 'this' outside of a class.");
         return;
     }
-    variable(false);
+    variable(parser, false);
 }
 
-static void unary(bool canAssign) {
+static void unary(Parser *parser, bool canAssign) {
     (void) canAssign;
-    TokenType operatorType = parser.previous.type;
-
-    parsePrecedence(PREC_UNARY);
+    TokenType operatorType = parser->previous.type;
+
+    int operand = currentChunk(parser)->count;
+    parsePrecedence(parser, PREC_UNARY);
+
+    Value value;
+    int length = literalAt(parser, operand, &value);
+    if (length > 0 && operand + length == currentChunk(parser)->count) {
+        if (operatorType == TOKEN_BANG) {
+            dropOperand(parser, operand);
+            emitFolded(parser, BOOL_VAL(IS_NIL(value) || (IS_BOOL(value) &&
+                                                          !AS_BOOL(value))));
+            return;
+        }
+        if (operatorType == TOKEN_MINUS && IS_NUMBER(value)) {
+            dropOperand(parser, operand);
+            emitFolded(parser, NUMBER_VAL(-AS_NUMBER(value)));
+            return;
+        }
+    }
 
     switch (operatorType) {
-        case TOKEN_BANG: emitByte(OP_NOT); break;
-        case TOKEN_MINUS: emitByte(OP_NEGATE); break;
+        case TOKEN_BANG: emitByte(parser, OP_NOT); break;
+        case TOKEN_MINUS: emitArithmetic(parser, OP_NEGATE); break;
         default: return;
     }
 }
@@ -1120,70 +1539,75 @@ ParseRule rules[] = {
 };
 // clang-format on
 
-static void parsePrecedence(Precedence precedence) {
-    advance();
-    ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+static void parsePrecedence(Parser *parser, Precedence precedence) {
+    advance(parser);
+    ParseFn prefixRule = getRule(parser->previous.type)->prefix;
     if (prefixRule == nullptr) {
-        error("Expect expression");
+        error(parser, "Expect expression");
         return;
     }
 
     bool canAssign = precedence <= PREC_ASSIGNMENT;
-    prefixRule(canAssign);
+    int operand = currentChunk(parser)->count;
+    prefixRule(parser, canAssign);
 
-    while (precedence <= getRule(parser.current.type)->precedence) {
-        advance();
-        ParseFn infixRule = getRule(parser.previous.type)->infix;
-        infixRule(canAssign);
+    while (precedence <= getRule(parser->current.type)->precedence) {
+        advance(parser);
+        ParseFn infixRule = getRule(parser->previous.type)->infix;
+        parser->compiler->operandOffset = operand;
+        infixRule(parser, canAssign);
     }
-    if (canAssign && match(TOKEN_EQUAL)) {
-        error("Invalid assignment target.");
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        error(parser, "Invalid assignment target.");
     }
 }
 
 static ParseRule *getRule(TokenType type) { return &rules[type]; }
 
-static bool check(TokenType type) { return parser.current.type == type; }
+static bool check(Parser *parser,
+                  TokenType type) { return parser->current.type == type; }
 
-static bool match(TokenType type) {
-    if (!check(type)) {
+static bool match(Parser *parser, TokenType type) {
+    if (!check(parser, type)) {
         return false;
     }
-    advance();
+    advance(parser);
     return true;
 }
-static Expr *equality();
-Expr *parse_expression() { return equality(); }
+static Expr *equality(Parser *parser);
+Expr *parse_expression(Parser *parser) { return equality(parser); }
 
-static Expr *primary() {
-    Token current = parser.current;
+static Expr *primary(Parser *parser) {
+    Token current = parser->current;
     if (current.type == TOKEN_EOF) {
-        errorAtCurrent("Unexpected end of input.");
+        errorAtCurrent(parser, "Unexpected end of input.");
         return nullptr;
     }
 
-    if (match(TOKEN_TRUE) || match(TOKEN_FALSE) || match(TOKEN_NIL)) {
-        return create_literal_expr(parser.previous);
+    if (match(parser, TOKEN_TRUE) || match(parser,
+                                           TOKEN_FALSE) || match(parser,
+                                                                 TOKEN_NIL)) {
+        return create_literal_expr(parser->previous);
     }
-    if (match(TOKEN_NUMBER) || match(TOKEN_STRING)) {
-        return create_literal_expr(parser.previous);
+    if (match(parser, TOKEN_NUMBER) || match(parser, TOKEN_STRING)) {
+        return create_literal_expr(parser->previous);
     }
 
-    if (match(TOKEN_LEFT_PAREN)) {
-        Expr *expr = parse_expression();
+    if (match(parser, TOKEN_LEFT_PAREN)) {
+        Expr *expr = parse_expression(parser);
         if (expr == nullptr)
             return nullptr;
-        consume(TOKEN_RIGHT_PAREN, "Expect ') after expression");
+        consume(parser, TOKEN_RIGHT_PAREN, "Expect ') after expression");
         return create_grouping_expr(expr);
     }
-    errorAtCurrent("Expect expression.");
+    errorAtCurrent(parser, "Expect expression.");
     return nullptr;
 }
 
-static Expr *exp_unary() {
-    if (match(TOKEN_BANG) || match(TOKEN_MINUS)) {
-        Token operator= parser.previous;
-        Expr *right = exp_unary();
+static Expr *exp_unary(Parser *parser) {
+    if (match(parser, TOKEN_BANG) || match(parser, TOKEN_MINUS)) {
+        Token operator= parser->previous;
+        Expr *right = exp_unary(parser);
         if (right == nullptr)
             return nullptr;
         Expr *r = malloc(sizeof(Expr));
@@ -1193,104 +1617,160 @@ static Expr *exp_unary() {
         r->line = right->line;
         return r;
     }
-    return primary();
+    return primary(parser);
 }
 
-static Expr *factor() {
-    Expr *expr = exp_unary();
+static Expr *factor(Parser *parser) {
+    Expr *expr = exp_unary(parser);
     if (expr == nullptr)
         return nullptr;
-    while (match(TOKEN_SLASH) || match(TOKEN_STAR)) {
-        Token operator= parser.previous;
-        Expr *right = exp_unary();
+    while (match(parser, TOKEN_SLASH) || match(parser, TOKEN_STAR)) {
+        Token operator= parser->previous;
+        Expr *right = exp_unary(parser);
         expr = create_binary_expr(operator, expr, right);
     }
     return expr;
 }
 
-static Expr *term() {
-    Expr *expr = factor();
+static Expr *term(Parser *parser) {
+    Expr *expr = factor(parser);
     if (expr == nullptr)
         return nullptr;
-    while (match(TOKEN_MINUS) || match(TOKEN_PLUS)) {
-        Token operator= parser.previous;
-        Expr *right = factor();
+    while (match(parser, TOKEN_MINUS) || match(parser, TOKEN_PLUS)) {
+        Token operator= parser->previous;
+        Expr *right = factor(parser);
         expr = create_binary_expr(operator, expr, right);
     }
     return expr;
 }
 
-static Expr *comparison() {
-    Expr *expr = term();
+static Expr *comparison(Parser *parser) {
+    Expr *expr = term(parser);
     if (expr == nullptr)
         return nullptr;
-    while (match(TOKEN_GREATER) || match(TOKEN_GREATER_EQUAL) ||
-           match(TOKEN_LESS) || match(TOKEN_LESS_EQUAL)) {
-        Token operator= parser.previous;
-        Expr *right = term();
+    while (match(parser, TOKEN_GREATER) || match(parser, TOKEN_GREATER_EQUAL) ||
+           match(parser, TOKEN_LESS) || match(parser, TOKEN_LESS_EQUAL)) {
+        Token operator= parser->previous;
+        Expr *right = term(parser);
         expr = create_binary_expr(operator, expr, right);
     }
     return expr;
 }
 
-static Expr *equality() {
-    Expr *expr = comparison();
+static Expr *equality(Parser *parser) {
+    Expr *expr = comparison(parser);
     if (expr == nullptr)
         return nullptr;
-    while (match(TOKEN_BANG_EQUAL) || match(TOKEN_EQUAL_EQUAL)) {
-        Token op = parser.previous;
-        Expr *right = comparison();
+    while (match(parser, TOKEN_BANG_EQUAL) || match(parser,
+                                                    TOKEN_EQUAL_EQUAL)) {
+        Token op = parser->previous;
+        Expr *right = comparison(parser);
         expr = create_binary_expr(op, expr, right);
     }
     return expr;
 }
 
-Expr *parse(const char *source) {
-    initScanner(source);
-    parser.hadError = false;
-    parser.panicMode = false;
-    advance();
-    return equality();
+static void initParser(Parser *parser, VM *vm, const char *source) {
+    parser->vm = vm;
+    initScanner(&parser->scanner, source);
+    parser->source = source;
+    parser->sourceString = nullptr;
+    parser->hadError = false;
+    parser->panicMode = false;
+    parser->compiler = nullptr;
+    parser->currentClass = nullptr;
+    vm->parser = parser;
+}
+
+Expr *parse(VM *vm, const char *source) {
+    Parser parser;
+    initParser(&parser, vm, source);
+    advance(&parser);
+    Expr *expr = equality(&parser);
+    vm->parser = nullptr;
+    if (parser.hadError) {
+        free_expr(expr);
+        return nullptr;
+    }
+    return expr;
 }
 
-bool hadError() { return parser.hadError; }
-
-ObjFunction *compile_expression(const char *source) {
-    initScanner(source);
+ObjFunction *compile_expression(VM *vm, const char *source) {
+    Parser parser;
+    initParser(&parser, vm, source);
     Compiler compiler;
-    initCompiler(&compiler, TYPE_SCRIPT);
-
-    parser.hadError = false;
-    parser.panicMode = false;
-
-    advance();
-    expression();
-    consume(TOKEN_EOF, "Expect end of expression.");
-    emitByte(OP_PRINT);
-    ObjFunction *function = endCompiler();
+    initCompiler(&parser, &compiler, TYPE_SCRIPT, nullptr);
+
+    advance(&parser);
+    expression(&parser);
+    consume(&parser, TOKEN_EOF, "Expect end of expression.");
+    emitByte(&parser, OP_PRINT);
+    ObjFunction *function = endCompiler(&parser);
+    vm->parser = nullptr;
     return parser.hadError ? nullptr : function;
 }
 
-ObjFunction *compile(const char *source) {
-    initScanner(source);
+ObjFunction *compile(VM *vm, const char *source) {
+    Parser parser;
+    initParser(&parser, vm, source);
     Compiler compiler;
-    initCompiler(&compiler, TYPE_SCRIPT);
+    initCompiler(&parser, &compiler, TYPE_SCRIPT, nullptr);
+
+    advance(&parser);
+    while (!match(&parser, TOKEN_EOF)) {
+        declaration(&parser);
+    }
+    ObjFunction *function = endCompiler(&parser);
+    vm->parser = nullptr;
+    if (parser.hadError) return nullptr;
+    // Inlining needs every function in the script, so it runs once they
+    // have all compiled rather than in endCompiler().
+    if (vm->inlineEnabled) {
+        push(vm, OBJ_VAL(function));
+        inlineCalls(vm, function);
+        pop(vm);
+    }
+    return function;
+}
 
-    parser.hadError = false;
-    parser.panicMode = false;
+bool compileLazyFunction(VM *vm, ObjFunction *function) {
+    LazyFunction *lazy = function->lazy;
+    Parser *enclosing = vm->parser;
+    Parser parser;
+    initParser(&parser, vm, lazy->source->chars);
+    parser.sourceString = lazy->source;
+    initScanner(&parser.scanner, lazy->source->chars + lazy->offset);
+    parser.scanner.line = lazy->line;
+    ClassCompiler classCompiler = {nullptr, lazy->hasSuperclass};
+    if (lazy->inClass) parser.currentClass = &classCompiler;
 
-    advance();
-    while (!match(TOKEN_EOF)) {
-        declaration();
+    int arity = function->arity;
+    function->arity = 0;
+    Compiler compiler;
+    initCompiler(&parser, &compiler, (FunctionType) lazy->type, function);
+    compiler.upvalueNames = lazy->upvalueNames;
+    beginScope(&parser);
+    advance(&parser);
+    parameters(&parser);
+    block(&parser);
+    endCompiler(&parser);
+    vm->parser = enclosing;
+
+    if (parser.hadError) {
+        freeChunk(vm, &function->chunk);
+        function->arity = arity;
+        return false;
     }
-    ObjFunction *function = endCompiler();
-    return parser.hadError ? nullptr : function;
+    freeLazyFunction(vm, function);
+    return true;
 }
 
-void markCompilerRoots() {
-    Compiler *compiler = current;
+void markCompilerRoots(VM *vm) {
+    if (vm->parser == nullptr) return;
+    markObject(vm, (Obj *) vm->parser->sourceString);
+    Compiler *compiler = vm->parser->compiler;
     while (compiler != nullptr) {
-        markObject((Obj *) compiler->function);
+        markObject(vm, (Obj *) compiler->function);
         compiler = compiler->enclosing;
     }
 }
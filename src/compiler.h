@@ -3,15 +3,17 @@
 
 #include "chunk.h"
 #include "object.h"
-ObjFunction *compile(const char *source);
-ObjFunction *compile_expression(const char *source);
-void markCompilerRoots();
+ObjFunction *compile(VM *vm, const char *source);
+ObjFunction *compile_expression(VM *vm, const char *source);
+// Compiles a function the compiler skipped when VM.lazyCompile was set.
+// Compile errors are reported as usual and leave it uncompiled.
+bool compileLazyFunction(VM *vm, ObjFunction *function);
+void markCompilerRoots(VM *vm);
 
 typedef struct Expr Expr;
 void print_ast(FILE *fout, Expr *expr);
 void free_expr(Expr *expr);
-Expr *parse(const char *source);
-bool hadError();
+Expr *parse(VM *vm, const char *source);
 
 
 #endif /* COMPILER_H */
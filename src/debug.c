@@ -2,13 +2,21 @@
 #include "chunk.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 
-void disassembleChunk(FILE *ferr, Chunk *chunk, const char *name) {
+static const char *opcodeNames[] = {
+#define X(e) #e,
+    OPCODE_ENUM
+#undef X
+};
+
+void disassembleChunk(VM *vm, FILE *ferr, Chunk *chunk, const char *name) {
     fprintf(ferr, "== %s ==\n", name);
     for (int offset = 0; offset < chunk->count;) {
-        offset = disassembleInstruction(ferr, chunk, offset);
+        offset = disassembleInstruction(vm, ferr, chunk, offset);
     }
 }
 
@@ -39,16 +47,61 @@ static int constantInstruction(FILE *ferr, const char *name, Chunk *chunk, int o
     return offset + 2;
 }
 
+static int propertyInstruction(FILE *ferr, const char *name, Chunk *chunk, int offset) {
+    uint8_t constant = chunk->code[offset + 1];
+    uint16_t cache = (uint16_t) (chunk->code[offset + 2] << 8);
+    cache |= chunk->code[offset + 3];
+    fprintf(ferr, "%-16s %4d '", name, constant);
+    printValue(ferr, chunk->constants.values[constant]);
+    fprintf(ferr, "' ic %d\n", cache);
+    return offset + 4;
+}
+
+static int globalInstruction(VM *vm, FILE *ferr, const char *name,
+                             Chunk *chunk, int offset) {
+    uint16_t slot = (uint16_t) (chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+    fprintf(ferr, "%-16s %4d '", name, slot);
+    printValue(ferr, vm->globalNames.values[slot]);
+    fprintf(ferr, "'\n");
+    return offset + 3;
+}
+
 static int invokeInstruction(FILE *ferr, const char *name, Chunk *chunk, int offset) {
     uint8_t constant = chunk->code[offset + 1];
     uint8_t argCount = chunk->code[offset + 2];
+    uint16_t cache = (uint16_t) (chunk->code[offset + 3] << 8);
+    cache |= chunk->code[offset + 4];
     fprintf(ferr, "%-16s (%d args) %4d '", name, argCount, constant);
     printValue(ferr, chunk->constants.values[constant]);
-    fprintf(ferr, "'\n");
-    return offset + 3;
+    fprintf(ferr, "' ic %d\n", cache);
+    return offset + 5;
 }
 
-int disassembleInstruction(FILE *ferr, Chunk *chunk, int offset) {
+// The guards in front of an inlined call: what they call, the function whose
+// body follows and where the call goes when they jump over it.
+static int inlineInstruction(FILE *ferr, const char *name, Chunk *chunk,
+                             int offset) {
+    int next = offset + instructionLength(chunk, offset);
+    bool isInvoke = chunk->code[offset] == OP_INVOKE_INLINE;
+    uint8_t argCount = chunk->code[offset + (isInvoke ? 2 : 1)];
+    fprintf(ferr, "%-16s (%d args) ", name, argCount);
+    if (isInvoke) {
+        uint8_t constant = chunk->code[offset + 1];
+        uint16_t cache = (uint16_t) (chunk->code[offset + 3] << 8);
+        cache |= chunk->code[offset + 4];
+        uint16_t guard = (uint16_t) (chunk->code[offset + 5] << 8);
+        guard |= chunk->code[offset + 6];
+        fprintf(ferr, "%4d '", constant);
+        printValue(ferr, chunk->constants.values[constant]);
+        fprintf(ferr, "' ic %d guard %d ", cache, guard);
+    }
+    printValue(ferr, chunk->constants.values[chunk->code[next - 3]]);
+    fprintf(ferr, " -> %d\n", jumpTarget(chunk, offset));
+    return next;
+}
+
+int disassembleInstruction(VM *vm, FILE *ferr, Chunk *chunk, int offset) {
     fprintf(ferr, "%04d ", offset);
     if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
         fprintf(ferr, "   | ");
@@ -65,22 +118,30 @@ int disassembleInstruction(FILE *ferr, Chunk *chunk, int offset) {
         case OP_POP: return simpleInstruction(ferr, "OP_POP", offset);
         case OP_SET_LOCAL:
             return byteInstruction(ferr, "OP_SET_LOCAL", chunk, offset);
+        case OP_SET_LOCAL_POP:
+            return byteInstruction(ferr, "OP_SET_LOCAL_POP", chunk, offset);
         case OP_GET_LOCAL:
             return byteInstruction(ferr, "OP_GET_LOCAL", chunk, offset);
         case OP_GET_GLOBAL:
-            return constantInstruction(ferr, "OP_GET_GLOBAL", chunk, offset);
+            return globalInstruction(vm, ferr, "OP_GET_GLOBAL", chunk, offset);
         case OP_DEFINE_GLOBAL:
-            return constantInstruction(ferr, "OP_DEFINE_GLOBAL", chunk, offset);
+            return globalInstruction(vm, ferr, "OP_DEFINE_GLOBAL", chunk,
+                                     offset);
         case OP_SET_GLOBAL:
-            return constantInstruction(ferr, "OP_SET_GLOBAL", chunk, offset);
+            return globalInstruction(vm, ferr, "OP_SET_GLOBAL", chunk, offset);
+        case OP_SET_GLOBAL_POP:
+            return globalInstruction(vm, ferr, "OP_SET_GLOBAL_POP", chunk,
+                                     offset);
         case OP_GET_UPVALUE:
             return byteInstruction(ferr, "OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE:
             return byteInstruction(ferr, "OP_SET_UPVALUE", chunk, offset);
         case OP_GET_PROPERTY:
-            return constantInstruction(ferr, "OP_GET_PROPERTY", chunk, offset);
+            return propertyInstruction(ferr, "OP_GET_PROPERTY", chunk, offset);
         case OP_SET_PROPERTY:
-            return constantInstruction(ferr, "OP_SET_PROPERTY", chunk, offset);
+            return propertyInstruction(ferr, "OP_SET_PROPERTY", chunk, offset);
+        case OP_SET_PROPERTY_POP:
+            return propertyInstruction(ferr, "OP_SET_PROPERTY_POP", chunk, offset);
         case OP_GET_SUPER:
             return constantInstruction(ferr, "OP_GET_SUPER", chunk, offset);
         case OP_EQUAL: return simpleInstruction(ferr, "OP_EQUAL", offset);
@@ -97,10 +158,25 @@ int disassembleInstruction(FILE *ferr, Chunk *chunk, int offset) {
         case OP_JUMP_IF_FALSE:
             return jumpInstruction(ferr, "OP_JUMP_IF_FALSE", 1, chunk, offset);
         case OP_LOOP: return jumpInstruction(ferr, "OP_LOOP", -1, chunk, offset);
-        case OP_CALL: return byteInstruction(ferr, "OP_CALL", chunk, offset);
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_NOT_LESS:
+            return jumpInstruction(ferr, opcodeNames[instruction], 1, chunk, offset);
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            return byteInstruction(ferr, opcodeNames[instruction], chunk, offset);
         case OP_INVOKE: return invokeInstruction(ferr, "OP_INVOKE", chunk, offset);
         case OP_SUPER_INVOKE:
             return invokeInstruction(ferr, "OP_SUPER_INVOKE", chunk, offset);
+        case OP_CALL_INLINE:
+            return inlineInstruction(ferr, "OP_CALL_INLINE", chunk, offset);
+        case OP_INVOKE_INLINE:
+            return inlineInstruction(ferr, "OP_INVOKE_INLINE", chunk, offset);
         case OP_CLOSURE: {
             offset++;
             uint8_t constant = chunk->code[offset++];
@@ -122,7 +198,110 @@ int disassembleInstruction(FILE *ferr, Chunk *chunk, int offset) {
         case OP_METHOD: return constantInstruction(ferr, "OP_METHOD", chunk, offset);
         case OP_CLOSE_UPVALUE:
             return simpleInstruction(ferr, "OP_CLOSE_UPVALUE", offset);
+        case OP_RETURN_NIL: return simpleInstruction(ferr, "OP_RETURN_NIL", offset);
         case OP_RETURN: return simpleInstruction(ferr, "OP_RETURN", offset);
+        case OP_ADD_NUM: return simpleInstruction(ferr, "OP_ADD_NUM", offset);
+        case OP_ADD_STR: return simpleInstruction(ferr, "OP_ADD_STR", offset);
+        case OP_GET_INDEX_LIST:
+            return simpleInstruction(ferr, "OP_GET_INDEX_LIST", offset);
+        case OP_SET_INDEX_LIST:
+            return simpleInstruction(ferr, "OP_SET_INDEX_LIST", offset);
         default: fprintf(ferr, "Unknown opcode: %d\n", instruction); return offset + 1;
     }
 }
+
+// N-grams pack up to four opcodes into one key, first opcode in the top byte.
+#define NGRAM_MAX 4
+
+typedef struct {
+    uint32_t key;
+    int count;
+} Ngram;
+
+typedef struct {
+    int count;
+    int capacity;
+    uint32_t *keys;
+} NgramKeys;
+
+static void addNgramKey(NgramKeys *keys, uint32_t key) {
+    if (keys->count == keys->capacity) {
+        keys->capacity = keys->capacity < 64 ? 64 : keys->capacity * 2;
+        keys->keys = realloc(keys->keys, sizeof(uint32_t) * (size_t) keys->capacity);
+        if (keys->keys == nullptr) exit(1);
+    }
+    keys->keys[keys->count++] = key;
+}
+
+// Sequences never span a jump target, since a fused instruction could not
+// be entered halfway through.
+static void countChunkNgrams(NgramKeys *keys, ObjFunction *function, int n) {
+    Chunk *chunk = &function->chunk;
+    bool *isTarget = calloc((size_t) chunk->count + 1, sizeof(bool));
+    if (isTarget == nullptr) exit(1);
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        int target = jumpTarget(chunk, offset);
+        if (target >= 0) isTarget[target] = true;
+    }
+
+    uint32_t window = 0;
+    int length = 0;
+    uint32_t mask = n == NGRAM_MAX ? UINT32_MAX : (1u << (8 * n)) - 1;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        if (isTarget[offset]) length = 0;
+        window = ((window << 8) | chunk->code[offset]) & mask;
+        if (++length >= n) addNgramKey(keys, window);
+    }
+    free(isTarget);
+
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value constant = chunk->constants.values[i];
+        if (IS_FUNCTION(constant)) countChunkNgrams(keys, AS_FUNCTION(constant), n);
+    }
+}
+
+static int compareKeys(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+static int compareCounts(const void *a, const void *b) {
+    const Ngram *x = a, *y = b;
+    if (x->count != y->count) return y->count - x->count;
+    return (x->key > y->key) - (x->key < y->key);
+}
+
+void printOpcodeNgrams(FILE *fout, ObjFunction **scripts, int scriptCount, int n,
+                       int top) {
+    if (n < 1 || n > NGRAM_MAX) return;
+    NgramKeys keys = {0, 0, nullptr};
+    for (int i = 0; i < scriptCount; i++) {
+        countChunkNgrams(&keys, scripts[i], n);
+    }
+    if (keys.count == 0) return;
+
+    qsort(keys.keys, (size_t) keys.count, sizeof(uint32_t), compareKeys);
+    Ngram *ngrams = malloc(sizeof(Ngram) * (size_t) keys.count);
+    if (ngrams == nullptr) exit(1);
+    int distinct = 0;
+    for (int i = 0; i < keys.count; i++) {
+        if (distinct > 0 && ngrams[distinct - 1].key == keys.keys[i]) {
+            ngrams[distinct - 1].count++;
+        } else {
+            ngrams[distinct++] = (Ngram){keys.keys[i], 1};
+        }
+    }
+    qsort(ngrams, (size_t) distinct, sizeof(Ngram), compareCounts);
+
+    fprintf(fout, "== %d-grams (%d total, %d distinct) ==\n", n, keys.count, distinct);
+    for (int i = 0; i < distinct && i < top; i++) {
+        fprintf(fout, "%8d %5.1f%% ", ngrams[i].count,
+                100.0 * ngrams[i].count / keys.count);
+        for (int j = n - 1; j >= 0; j--) {
+            fprintf(fout, " %s", opcodeNames[(ngrams[i].key >> (8 * j)) & 0xFF]);
+        }
+        fprintf(fout, "\n");
+    }
+    free(ngrams);
+    free(keys.keys);
+}
@@ -1,8 +1,11 @@
 #ifndef DEBUG_H
 #define DEBUG_H
 #include "chunk.h"
+#include "object.h"
 
-void disassembleChunk(FILE *ferr, Chunk *chunk, const char *name);
-int disassembleInstruction(FILE *ferr, Chunk *chunk, int offset);
+void disassembleChunk(VM *vm, FILE *ferr, Chunk *chunk, const char *name);
+int disassembleInstruction(VM *vm, FILE *ferr, Chunk *chunk, int offset);
+void printOpcodeNgrams(FILE *fout, ObjFunction **scripts, int scriptCount, int n,
+                       int top);
 
 #endif /* DEBUG_H */
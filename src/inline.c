@@ -0,0 +1,512 @@
+// Inlining of small functions and methods at their call sites. Once a
+// script has compiled, every function in it is known: top-level functions
+// by the global they are defined in, and methods by name when no other
+// method in the script shares it. A call to one whose body is short,
+// straight-line code that cannot fail gets a copy of that body behind an
+// OP_CALL_INLINE or OP_INVOKE_INLINE guard. Loading a field only fails when
+// it is missing, so the method guard also checks that the receiver has
+// every field the body reads. With nothing in a copy able to fail, no
+// runtime error is ever reported from code whose frame was inlined away.
+//
+// A copy works on the callee and arguments where the call left them, which
+// become the callee's slots, and leaves the result where the callee was.
+// When the body opens by loading its parameters in order and reads no other
+// locals, those loads are left out and it works on the arguments directly.
+#include "inline.h"
+#include "chunk.h"
+#include "memory.h"
+#include "vm.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Longest body that is copied, counting its return.
+#define INLINE_MAX_INSTRUCTIONS 8
+
+typedef enum { BODY_UNKNOWN, BODY_INLINABLE, BODY_NOT_INLINABLE } BodyState;
+
+typedef struct {
+    ObjString *name;       // of a method, or null for a top-level function
+    int global;            // slot of a top-level function, or -1
+    ObjFunction *function; // null once a second definition turns up
+    // Set by analyze().
+    BodyState state;
+    int prefix;      // parameter loads left out of the copy
+    int end;         // offset of the return
+    int returnDepth; // height of the frame at the return, result included
+    int maxSlot;     // highest local the copy reads or writes
+} Candidate;
+
+typedef struct {
+    VM *vm;
+    ObjFunction **functions;
+    int functionCount;
+    int functionCapacity;
+    Candidate *candidates;
+    int candidateCount;
+    int candidateCapacity;
+} Inliner;
+
+typedef struct {
+    uint8_t *code;
+    int *lines;
+    int count;
+    int capacity;
+} Code;
+
+static void *grow(void *array, int *capacity, size_t size) {
+    *capacity = *capacity < 8 ? 8 : *capacity * 2;
+    array = realloc(array, size * (size_t) *capacity);
+    if (array == nullptr) exit(1);
+    return array;
+}
+
+static void emit(Code *code, uint8_t byte, int line) {
+    if (code->count == code->capacity) {
+        int capacity = code->capacity;
+        code->code = grow(code->code, &code->capacity, sizeof(uint8_t));
+        code->lines = grow(code->lines, &capacity, sizeof(int));
+    }
+    code->code[code->count] = byte;
+    code->lines[code->count] = line;
+    code->count++;
+}
+
+static void emitShort(Code *code, int value, int line) {
+    emit(code, (uint8_t) (value >> 8), line);
+    emit(code, (uint8_t) value, line);
+}
+
+static void collectFunctions(Inliner *inliner, ObjFunction *function) {
+    for (int i = 0; i < inliner->functionCount; i++) {
+        if (inliner->functions[i] == function) return;
+    }
+    if (inliner->functionCount == inliner->functionCapacity) {
+        inliner->functions =
+            grow(inliner->functions, &inliner->functionCapacity,
+                 sizeof(ObjFunction *));
+    }
+    inliner->functions[inliner->functionCount++] = function;
+    ValueArray *constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+        if (IS_FUNCTION(constants->values[i])) {
+            collectFunctions(inliner, AS_FUNCTION(constants->values[i]));
+        }
+    }
+}
+
+static Candidate *findCandidate(Inliner *inliner, ObjString *name,
+                                int global) {
+    for (int i = 0; i < inliner->candidateCount; i++) {
+        Candidate *candidate = &inliner->candidates[i];
+        if (candidate->name == name && candidate->global == global) {
+            return candidate;
+        }
+    }
+    return nullptr;
+}
+
+static void define(Inliner *inliner, ObjString *name, int global,
+                   ObjFunction *function) {
+    Candidate *candidate = findCandidate(inliner, name, global);
+    if (candidate != nullptr) {
+        if (candidate->function != function) candidate->function = nullptr;
+        return;
+    }
+    if (inliner->candidateCount == inliner->candidateCapacity) {
+        inliner->candidates = grow(inliner->candidates,
+                                   &inliner->candidateCapacity,
+                                   sizeof(Candidate));
+    }
+    inliner->candidates[inliner->candidateCount++] =
+        (Candidate){name, global, function, BODY_UNKNOWN, 0, 0, 0, 0};
+}
+
+// Finds the functions closed over right before OP_METHOD or, at the top
+// level, OP_DEFINE_GLOBAL. Anything else defined the same way, such as a
+// global variable of the same name, makes the definition ambiguous.
+static void findDefinitions(Inliner *inliner, ObjFunction *function) {
+    Chunk *chunk = &function->chunk;
+    ObjFunction *closure = nullptr;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        uint8_t *code = &chunk->code[offset];
+        Value *constants = chunk->constants.values;
+        switch (code[0]) {
+            case OP_METHOD: {
+                ObjString *name = AS_STRING(constants[code[1]]);
+                // Initializers run through the class, not OP_INVOKE.
+                if (name != inliner->vm->initString) {
+                    define(inliner, name, -1, closure);
+                }
+                break;
+            }
+            case OP_DEFINE_GLOBAL:
+                define(inliner, nullptr, (code[1] << 8) | code[2], closure);
+                break;
+            default: break;
+        }
+        closure = code[0] == OP_CLOSURE ? AS_FUNCTION(constants[code[1]])
+                                        : nullptr;
+    }
+}
+
+// Whether the candidate's body is short, straight-line code that can't
+// fail: literals, locals, equality and negation, and for a method the
+// fields of `this`. Arithmetic, globals and calls can all fail or run other
+// code, and a function with upvalues needs its closure.
+static bool analyze(Candidate *candidate) {
+    ObjFunction *function = candidate->function;
+    Chunk *chunk = &function->chunk;
+    if (function->lazy != nullptr || function->upvalueCount > 0) return false;
+
+    bool isMethod = candidate->name != nullptr;
+    // Which values on the frame's stack are `this`.
+    bool isThis[UINT8_COUNT + INLINE_MAX_INSTRUCTIONS + 1];
+    int depth = function->arity + 1;
+    memset(isThis, 0, sizeof(isThis));
+    isThis[0] = isMethod;
+    // The parameter loads the body opens with, from slot `first` on, and
+    // whether it touches any other local.
+    int first = -1;
+    int loads = 0;
+    bool otherLocals = false;
+    int instructions = 0;
+    candidate->maxSlot = 0;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        if (++instructions > INLINE_MAX_INSTRUCTIONS) return false;
+        uint8_t op = chunk->code[offset];
+        int slot = 0;
+        if (op == OP_GET_LOCAL || op == OP_SET_LOCAL ||
+            op == OP_SET_LOCAL_POP) {
+            slot = chunk->code[offset + 1];
+            if (slot > candidate->maxSlot) candidate->maxSlot = slot;
+            if (op == OP_GET_LOCAL && loads == instructions - 1 &&
+                (loads == 0 ? slot <= 1 : slot == first + loads)) {
+                if (loads == 0) first = slot;
+                loads++;
+            } else {
+                otherLocals = true;
+            }
+        }
+
+        switch (op) {
+            case OP_CONSTANT:
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE: isThis[depth++] = false; break;
+            case OP_GET_LOCAL:
+                if (slot >= depth) return false;
+                isThis[depth++] = isThis[slot];
+                break;
+            case OP_SET_LOCAL:
+            case OP_SET_LOCAL_POP:
+                if (slot == 0 || slot >= depth) return false;
+                isThis[slot] = false;
+                if (op == OP_SET_LOCAL_POP) depth--;
+                break;
+            case OP_POP: depth--; break;
+            case OP_EQUAL: depth--; // fall through
+            case OP_NOT: isThis[depth - 1] = false; break;
+            case OP_GET_PROPERTY:
+                if (!isThis[depth - 1]) return false;
+                isThis[depth - 1] = false;
+                break;
+            case OP_SET_PROPERTY:
+            case OP_SET_PROPERTY_POP:
+                if (depth < 2 || !isThis[depth - 2]) return false;
+                depth -= op == OP_SET_PROPERTY ? 1 : 2;
+                isThis[depth - 1] = false;
+                break;
+            case OP_RETURN:
+            case OP_RETURN_NIL:
+                candidate->end = offset;
+                candidate->returnDepth = depth + (op == OP_RETURN_NIL);
+                candidate->prefix =
+                    !otherLocals && loads == function->arity + 1 - first
+                        ? loads
+                        : 0;
+                return true;
+            default: return false;
+        }
+        if (depth <= function->arity) return false;
+    }
+    return false;
+}
+
+static Candidate *inlinable(Inliner *inliner, ObjString *name, int global,
+                            int argCount) {
+    Candidate *candidate = findCandidate(inliner, name, global);
+    if (candidate == nullptr || candidate->function == nullptr ||
+        candidate->function->arity != argCount) {
+        return nullptr;
+    }
+    if (candidate->state == BODY_UNKNOWN) {
+        candidate->state =
+            analyze(candidate) ? BODY_INLINABLE : BODY_NOT_INLINABLE;
+    }
+    return candidate->state == BODY_INLINABLE ? candidate : nullptr;
+}
+
+// Index of `value` in the chunk's constants, adding it if it isn't there.
+// Only objects are looked for, which is what bodies mostly load.
+static int constantIndex(VM *vm, Chunk *chunk, Value value) {
+    if (IS_OBJ(value)) {
+        for (int i = 0; i < chunk->constants.count; i++) {
+            Value constant = chunk->constants.values[i];
+            if (IS_OBJ(constant) && AS_OBJ(constant) == AS_OBJ(value)) {
+                return i;
+            }
+        }
+    }
+    return addConstant(vm, chunk, value);
+}
+
+// Appends the guard for the call at `offset` and the copy of the body after
+// it. `base` is the callee's slot in the caller's frame. False if an operand
+// doesn't fit.
+static bool emitInlined(VM *vm, Chunk *chunk, int offset,
+                        Candidate *candidate, int base, Code *out) {
+    ObjFunction *function = candidate->function;
+    Chunk *body = &function->chunk;
+    int line = chunk->lines[offset];
+    int functionConstant = constantIndex(vm, chunk, OBJ_VAL(function));
+    if (functionConstant > UINT8_MAX || chunk->cacheCount > UINT16_MAX) {
+        return false;
+    }
+
+    uint8_t *call = &chunk->code[offset];
+    if (call[0] == OP_CALL) {
+        emit(out, OP_CALL_INLINE, line);
+        emit(out, call[1], line);
+    } else {
+        emit(out, OP_INVOKE_INLINE, line);
+        emit(out, call[1], line);
+        emit(out, call[2], line);
+        emit(out, call[3], line);
+        emit(out, call[4], line);
+        emitShort(out, addInlineCache(vm, chunk), line);
+    }
+    emit(out, (uint8_t) functionConstant, line);
+    int skip = out->count;
+    emitShort(out, 0, line);
+
+    int instruction = 0;
+    for (int at = 0; at <= candidate->end;
+         at += instructionLength(body, at), instruction++) {
+        if (instruction < candidate->prefix) continue;
+        uint8_t op = body->code[at];
+        switch (op) {
+            case OP_CONSTANT: {
+                Value value = body->constants.values[body->code[at + 1]];
+                int constant = constantIndex(vm, chunk, value);
+                if (constant > UINT8_MAX) return false;
+                emit(out, op, line);
+                emit(out, (uint8_t) constant, line);
+                break;
+            }
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+            case OP_SET_LOCAL_POP:
+                emit(out, op, line);
+                emit(out, (uint8_t) (base + body->code[at + 1]), line);
+                break;
+            case OP_GET_PROPERTY:
+            case OP_SET_PROPERTY:
+            case OP_SET_PROPERTY_POP: {
+                Value name = body->constants.values[body->code[at + 1]];
+                int constant = constantIndex(vm, chunk, name);
+                if (constant > UINT8_MAX || chunk->cacheCount > UINT16_MAX) {
+                    return false;
+                }
+                emit(out, op, line);
+                emit(out, (uint8_t) constant, line);
+                emitShort(out, addInlineCache(vm, chunk), line);
+                break;
+            }
+            case OP_RETURN_NIL: emit(out, OP_NIL, line); break;
+            case OP_RETURN: break;
+            default: emit(out, op, line); break;
+        }
+    }
+
+    // Move the result down to the callee's slot and drop what is above it.
+    int height = candidate->returnDepth - candidate->prefix;
+    if (height > 1) {
+        emit(out, OP_SET_LOCAL_POP, line);
+        emit(out, (uint8_t) base, line);
+        for (int i = 2; i < height; i++) emit(out, OP_POP, line);
+    }
+    int length = out->count - skip - 2;
+    if (length > UINT16_MAX) return false;
+    out->code[skip] = (uint8_t) (length >> 8);
+    out->code[skip + 1] = (uint8_t) length;
+    return true;
+}
+
+// What the call at `offset`, made with the stack `depth` high, calls if it
+// is a candidate that can be inlined there, and in `base` the callee's slot.
+// `callees` holds the instruction that pushed each value on the stack, where
+// it is known.
+static Candidate *callee(Inliner *inliner, Chunk *chunk, int offset,
+                         int depth, const int *callees, int *base) {
+    uint8_t *code = &chunk->code[offset];
+    Candidate *candidate = nullptr;
+    int argCount = 0;
+    if (code[0] == OP_CALL) {
+        argCount = code[1];
+        int pushedBy = callees[depth - argCount - 1];
+        if (pushedBy >= 0 && chunk->code[pushedBy] == OP_GET_GLOBAL) {
+            int global = (chunk->code[pushedBy + 1] << 8) |
+                         chunk->code[pushedBy + 2];
+            candidate = inlinable(inliner, nullptr, global, argCount);
+        }
+    } else if (code[0] == OP_INVOKE) {
+        argCount = code[2];
+        ObjString *name = AS_STRING(chunk->constants.values[code[1]]);
+        candidate = inlinable(inliner, name, -1, argCount);
+    }
+    *base = depth - argCount - 1;
+    if (candidate == nullptr || *base + candidate->maxSlot > UINT8_MAX) {
+        return nullptr;
+    }
+    return candidate;
+}
+
+static bool pushesOnly(uint8_t op) {
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_LIST_INIT:
+        case OP_MAP_INIT:
+        case OP_CLASS:
+        case OP_CLOSURE: return true;
+        default: return false;
+    }
+}
+
+// Rewrites the calls in `function` that can be inlined. The chunk is left
+// as it was if a jump over a copy would no longer fit.
+static void inlineInto(Inliner *inliner, ObjFunction *function) {
+    VM *vm = inliner->vm;
+    Chunk *chunk = &function->chunk;
+    if (function->lazy != nullptr || chunk->count == 0) return;
+    int *depths = stackDepths(chunk, function->arity + 1);
+    if (depths == nullptr) return;
+    bool *targeted = calloc((size_t) chunk->count + 1, sizeof(bool));
+    int *callees = malloc(sizeof(int) * (size_t) (function->maxSlots + 1));
+    int *offsets = malloc(sizeof(int) * (size_t) (chunk->count + 1));
+    if (targeted == nullptr || callees == nullptr || offsets == nullptr) {
+        exit(1);
+    }
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        int target = jumpTarget(chunk, offset);
+        if (target >= 0) targeted[target] = true;
+    }
+
+    // What pushed each stack value is only followed within a basic block.
+    Code out = {0};
+    bool changed = false;
+    bool valid = true;
+    for (int offset = 0; valid && offset < chunk->count;) {
+        int length = instructionLength(chunk, offset);
+        int next = offset + length;
+        int depth = depths[offset];
+        uint8_t op = chunk->code[offset];
+        if (offset == 0 || targeted[offset] || depth < 0) {
+            for (int i = 0; i <= function->maxSlots; i++) callees[i] = -1;
+        }
+
+        offsets[offset] = out.count;
+        int base = 0;
+        Candidate *candidate =
+            depth < 0 ? nullptr
+                      : callee(inliner, chunk, offset, depth, callees, &base);
+        if (candidate != nullptr) {
+            valid = emitInlined(vm, chunk, offset, candidate, base, &out);
+            changed = true;
+        } else {
+            for (int i = offset; i < next; i++) {
+                emit(&out, chunk->code[i], chunk->lines[i]);
+            }
+        }
+
+        if (depth >= 0 && next < chunk->count && depths[next] >= 0) {
+            if (pushesOnly(op)) {
+                callees[depth] = offset;
+            } else {
+                int after = depths[next];
+                int from = (after < depth ? after : depth) - 1;
+                for (int i = from < 0 ? 0 : from; i < after; i++) {
+                    callees[i] = -1;
+                }
+            }
+            if (op == OP_SET_LOCAL || op == OP_SET_LOCAL_POP) {
+                callees[chunk->code[offset + 1]] = -1;
+            }
+        }
+        offset = next;
+    }
+    offsets[chunk->count] = out.count;
+
+    // Relocate the jumps, which are all in the copied code.
+    for (int offset = 0; valid && changed && offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        int target = jumpTarget(chunk, offset);
+        if (target < 0) continue;
+        int at = offsets[offset];
+        int after = at + instructionLength(chunk, offset);
+        int jump = offsets[target] - after;
+        if (jump < 0) jump = -jump;
+        if (jump > UINT16_MAX) {
+            valid = false;
+            break;
+        }
+        out.code[at + 1] = (uint8_t) (jump >> 8);
+        out.code[at + 2] = (uint8_t) jump;
+    }
+
+    if (valid && changed) {
+        if (out.count > chunk->capacity) {
+            chunk->code = GROW_ARRAY(vm, uint8_t, chunk->code,
+                                     chunk->capacity, out.count);
+            chunk->lines = GROW_ARRAY(vm, int, chunk->lines, chunk->capacity,
+                                      out.count);
+            chunk->capacity = out.count;
+        }
+        memcpy(chunk->code, out.code, (size_t) out.count);
+        memcpy(chunk->lines, out.lines, sizeof(int) * (size_t) out.count);
+        chunk->count = out.count;
+        function->maxSlots = maxStackDepth(chunk, function->arity + 1);
+    }
+    free(out.code);
+    free(out.lines);
+    free(depths);
+    free(targeted);
+    free(callees);
+    free(offsets);
+}
+
+void inlineCalls(VM *vm, ObjFunction *script) {
+    Inliner inliner = {0};
+    inliner.vm = vm;
+    collectFunctions(&inliner, script);
+    for (int i = 0; i < inliner.functionCount; i++) {
+        findDefinitions(&inliner, inliner.functions[i]);
+    }
+    if (inliner.candidateCount > 0) {
+        for (int i = 0; i < inliner.functionCount; i++) {
+            inlineInto(&inliner, inliner.functions[i]);
+        }
+    }
+    free(inliner.functions);
+    free(inliner.candidates);
+}
@@ -0,0 +1,12 @@
+#ifndef INLINE_H
+#define INLINE_H
+#include "object.h"
+
+// Copies the bodies of small functions and methods into the code that
+// calls them, throughout a script that has just compiled. Each copy sits
+// behind a guard that the call would still run that function, so
+// redefining it, shadowing a method with a field or calling through another
+// receiver makes the call as before.
+void inlineCalls(VM *vm, ObjFunction *script);
+
+#endif /* INLINE_H */
@@ -0,0 +1,638 @@
+// A baseline JIT: each hot function is translated instruction by
+// instruction into x86-64, with the simple instructions expanded inline and
+// everything else calling the same slow paths run() uses. Compiled code
+// works on the VM's value stack directly, so control can pass between it
+// and run() at any instruction boundary.
+#define _DEFAULT_SOURCE
+#include "jit.h"
+#include "x64.h"
+
+#ifdef LOX_JIT
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+struct JitCode {
+    uint8_t *code;
+    size_t size;
+    // Native offset of every instruction start, indexed by bytecode offset.
+    uint32_t *entries;
+};
+
+typedef enum {
+    // A jump to another instruction of the same function.
+    PATCH_BYTECODE,
+    // A jump to a stub that leaves for run() at the given instruction.
+    PATCH_EXIT,
+    // A jump to the error exit.
+    PATCH_ERROR,
+    // A jump to the frame switch after a call or return.
+    PATCH_SWITCH,
+} PatchKind;
+
+typedef JitStatus (*EnterFn)(VM *vm, CallFrame *frame, void *target);
+
+// Shared by every compiled function of every VM: the way in and the ways
+// back out that slow paths hand out when they can't name a continuation of
+// their own. Built once, by whichever thread gets there first.
+static struct {
+    EnterFn enter;
+    uint8_t *exitFrame;
+    uint8_t *exitError;
+} stubs;
+static pthread_once_t stubsOnce = PTHREAD_ONCE_INIT;
+
+uint8_t *mapCode(const Assembler *as, size_t *size) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t length = ((size_t) as->count + page - 1) / page * page;
+    void *memory = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return nullptr;
+    memcpy(memory, as->code, (size_t) as->count);
+    if (mprotect(memory, length, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, length);
+        return nullptr;
+    }
+    *size = length;
+    return memory;
+}
+
+void unmapCode(uint8_t *code, size_t size) { munmap(code, size); }
+
+static void initStubs() {
+    Assembler as = {0};
+
+    // JitStatus enter(VM *vm, CallFrame *frame, void *target)
+    emitPush(&as, RBX);
+    emitPush(&as, R12);
+    emitPush(&as, R13);
+    emitPush(&as, R14);
+    emitPush(&as, R15);
+    emitPush(&as, RBP);
+    alu(&as, ALU_SUB, RSP, 8); // keep calls 16-byte aligned
+    opRegister(&as, 0x89, R_VM, RDI);
+    opRegister(&as, 0x89, R_FRAME, RSI);
+    load(&as, R_SLOTS, R_FRAME, offsetof(CallFrame, slots));
+    load(&as, R_STACK_TOP, R_VM, offsetof(VM, stackTop));
+    moveImmediate(&as, R_QNAN, QNAN);
+    moveImmediate(&as, R_NIL, NIL_VAL);
+    emitByte(&as, 0xFF);
+    emitByte(&as, 0xE2); // jmp rdx
+
+    int exitFrame = as.count;
+    moveImmediate(&as, RAX, JIT_FRAME);
+    epilogue(&as);
+    int exitError = as.count;
+    moveImmediate(&as, RAX, JIT_ERROR);
+    epilogue(&as);
+
+    size_t size;
+    uint8_t *code = mapCode(&as, &size);
+    free(as.code);
+    if (code == nullptr) return;
+    stubs.exitFrame = code + exitFrame;
+    stubs.exitError = code + exitError;
+    stubs.enter = (EnterFn) (uintptr_t) code;
+}
+
+static bool haveStubs() {
+    pthread_once(&stubsOnce, initStubs);
+    return stubs.enter != nullptr;
+}
+
+static int32_t stackOffset(int distance) { return -8 * (distance + 1); }
+
+static void pushValue(Assembler *as, int reg) {
+    store(as, R_STACK_TOP, 0, reg);
+    lea(as, R_STACK_TOP, R_STACK_TOP, 8);
+}
+
+static void dropValues(Assembler *as, int count) {
+    lea(as, R_STACK_TOP, R_STACK_TOP, -8 * count);
+}
+
+// Leaves for run() at `offset` unless the value `distance` down the stack is
+// a number.
+static void guardNumber(Assembler *as, int distance, int offset) {
+    load(as, RDX, R_STACK_TOP, stackOffset(distance));
+    opRegister(as, 0x21, RDX, R_QNAN);
+    opRegister(as, 0x39, RDX, R_QNAN);
+    addPatch(as, PATCH_EXIT, jumpIf(as, CC_E), offset);
+}
+
+// Jumps to `target` when the value in RAX is nil or false, which are the
+// two values just below NIL_VAL + 2, or when it is neither if `truthy`.
+static void jumpIfFalsey(Assembler *as, int target, bool truthy) {
+    opRegister(as, 0x29, RAX, R_NIL);
+    alu(as, ALU_CMP, RAX, 1);
+    addPatch(as, PATCH_BYTECODE, jumpIf(as, truthy ? CC_A : CC_BE), target);
+}
+
+static void storeIp(Assembler *as, uint8_t *ip) {
+    moveImmediate(as, RAX, (uint64_t) (uintptr_t) ip);
+    store(as, R_FRAME, offsetof(CallFrame, ip), RAX);
+}
+
+static void storeStackTop(Assembler *as) {
+    store(as, R_VM, offsetof(VM, stackTop), R_STACK_TOP);
+}
+
+// The arguments every ip/stackTop slow path takes first.
+static void frameArguments(Assembler *as, uint8_t *ip) {
+    opRegister(as, 0x89, RDI, R_VM);
+    opRegister(as, 0x89, RSI, R_FRAME);
+    moveImmediate(as, RDX, (uint64_t) (uintptr_t) ip);
+    opRegister(as, 0x89, RCX, R_STACK_TOP);
+}
+
+// Every other slow path takes the VM first.
+static void vmArgument(Assembler *as) { opRegister(as, 0x89, RDI, R_VM); }
+
+static void checkSucceeded(Assembler *as) {
+    emitByte(as, 0x84);
+    emitByte(as, 0xC0); // test al, al
+    addPatch(as, PATCH_ERROR, jumpIf(as, CC_E), 0);
+}
+
+// After a call: a null continuation means the callee was native and this
+// frame carries on; anything else is where to go next.
+static void followCall(Assembler *as) {
+    opRegister(as, 0x85, RAX, RAX);
+    addPatch(as, PATCH_SWITCH, jumpIf(as, CC_NE), 0);
+    load(as, R_STACK_TOP, R_VM, offsetof(VM, stackTop));
+}
+
+// The common case of OP_GET_PROPERTY done inline: an instance whose shape
+// matches the first entry of a live cache that holds a field. Misses are
+// appended to `misses` for the caller to send to the slow path.
+static void cachedGetField(Assembler *as, InlineCache *cache, int misses[6]) {
+    int slot = offsetof(InlineCache, entries) + offsetof(CacheEntry, slot);
+    int key = offsetof(InlineCache, entries) + offsetof(CacheEntry, key);
+
+    load(as, RAX, R_STACK_TOP, stackOffset(0));
+    opRegister(as, 0x89, RCX, RAX);
+    shift(as, 5, RCX, 50);
+    alu(as, ALU_CMP, RCX, (int32_t) ((QNAN | SIGN_BIT) >> 50));
+    misses[0] = jumpIf(as, CC_NE);
+    shift(as, 4, RAX, 14);
+    shift(as, 5, RAX, 14); // AS_OBJ
+    aluMemory(as, ALU_CMP, 4, RAX, offsetof(Obj, type), OBJ_INSTANCE);
+    misses[1] = jumpIf(as, CC_NE);
+
+    moveImmediate(as, RDX, (uint64_t) (uintptr_t) cache);
+    aluMemory(as, ALU_CMP, 1, RDX, offsetof(InlineCache, count), 0);
+    misses[2] = jumpIf(as, CC_E);
+    opMemory32(as, 0x8B, RSI, RDX, offsetof(InlineCache, epoch));
+    opMemory32(as, 0x3B, RSI, R_VM, offsetof(VM, cacheEpoch));
+    misses[3] = jumpIf(as, CC_NE);
+    load(as, RCX, RAX, offsetof(ObjInstance, shape));
+    opMemory(as, 0x3B, RCX, RDX, key);
+    misses[4] = jumpIf(as, CC_NE);
+    opMemory(as, 0x63, RSI, RDX, slot); // movsxd
+    opRegister(as, 0x85, RSI, RSI);
+    misses[5] = jumpIf(as, CC_S);
+
+    load(as, RCX, RAX, offsetof(ObjInstance, fields));
+    loadIndexed(as, RCX, RCX, RSI);
+    store(as, R_STACK_TOP, stackOffset(0), RCX);
+    aluMemory(as, ALU_ADD, 8, R_VM, offsetof(VM, cacheHits), 1);
+}
+
+static void arithmetic(Assembler *as, uint8_t op, int offset) {
+    guardNumber(as, 0, offset);
+    guardNumber(as, 1, offset);
+    sse(as, 0xF2, 0x10, 0, R_STACK_TOP, stackOffset(1));
+    sse(as, 0xF2, op, 0, R_STACK_TOP, stackOffset(0));
+    sse(as, 0xF2, 0x11, 0, R_STACK_TOP, stackOffset(1));
+    dropValues(as, 1);
+}
+
+// Sets the flags for `a > b` (or `b > a` when `swap`) with ucomisd, which
+// leaves `above` false for NaN just like the C comparison.
+static void compareNumbers(Assembler *as, bool swap, int offset) {
+    guardNumber(as, 0, offset);
+    guardNumber(as, 1, offset);
+    sse(as, 0xF2, 0x10, 0, R_STACK_TOP, stackOffset(swap ? 0 : 1));
+    sse(as, 0x66, 0x2E, 0, R_STACK_TOP, stackOffset(swap ? 1 : 0));
+}
+
+static void compareJump(Assembler *as, bool swap, Condition cc, int offset,
+                        int target) {
+    compareNumbers(as, swap, offset);
+    dropValues(as, 2);
+    addPatch(as, PATCH_BYTECODE, jumpIf(as, cc), target);
+}
+
+static void exitAt(Assembler *as, int offset) {
+    addPatch(as, PATCH_EXIT, jump(as), offset);
+}
+
+// After a guard: leaves for run() at `offset` if it returned false.
+static void exitUnlessPassed(Assembler *as, int offset) {
+    emitByte(as, 0x84);
+    emitByte(as, 0xC0); // test al, al
+    addPatch(as, PATCH_EXIT, jumpIf(as, CC_E), offset);
+}
+
+static int readShort(const uint8_t *code, int offset) {
+    return (code[offset] << 8) | code[offset + 1];
+}
+
+static void compileInstruction(Assembler *as, ObjFunction *function, int offset) {
+    Chunk *chunk = &function->chunk;
+    uint8_t *code = chunk->code;
+    uint8_t *next = code + offset + instructionLength(chunk, offset);
+    Value *constants = chunk->constants.values;
+    int32_t globals = offsetof(VM, globalValues) + offsetof(ValueArray, values);
+
+    switch (code[offset]) {
+        case OP_CONSTANT:
+            moveImmediate(as, RAX, constants[code[offset + 1]]);
+            pushValue(as, RAX);
+            break;
+        case OP_NIL: pushValue(as, R_NIL); break;
+        case OP_TRUE:
+            lea(as, RAX, R_NIL, 2);
+            pushValue(as, RAX);
+            break;
+        case OP_FALSE:
+            lea(as, RAX, R_NIL, 1);
+            pushValue(as, RAX);
+            break;
+        case OP_POP: dropValues(as, 1); break;
+        case OP_GET_LOCAL:
+            load(as, RAX, R_SLOTS, 8 * code[offset + 1]);
+            pushValue(as, RAX);
+            break;
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
+            load(as, RAX, R_STACK_TOP, stackOffset(0));
+            store(as, R_SLOTS, 8 * code[offset + 1], RAX);
+            if (code[offset] == OP_SET_LOCAL_POP) dropValues(as, 1);
+            break;
+        case OP_GET_GLOBAL:
+            load(as, RCX, R_VM, globals);
+            load(as, RAX, RCX, 8 * readShort(code, offset + 1));
+            lea(as, RDX, R_NIL, TAG_UNDEFINED - TAG_NIL);
+            opRegister(as, 0x39, RAX, RDX);
+            addPatch(as, PATCH_EXIT, jumpIf(as, CC_E), offset);
+            pushValue(as, RAX);
+            break;
+        case OP_DEFINE_GLOBAL:
+            load(as, RCX, R_VM, globals);
+            load(as, RAX, R_STACK_TOP, stackOffset(0));
+            store(as, RCX, 8 * readShort(code, offset + 1), RAX);
+            dropValues(as, 1);
+            break;
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_POP: {
+            int32_t slot = 8 * readShort(code, offset + 1);
+            load(as, RCX, R_VM, globals);
+            load(as, RAX, RCX, slot);
+            lea(as, RDX, R_NIL, TAG_UNDEFINED - TAG_NIL);
+            opRegister(as, 0x39, RAX, RDX);
+            addPatch(as, PATCH_EXIT, jumpIf(as, CC_E), offset);
+            load(as, RAX, R_STACK_TOP, stackOffset(0));
+            store(as, RCX, slot, RAX);
+            if (code[offset] == OP_SET_GLOBAL_POP) dropValues(as, 1);
+            break;
+        }
+        case OP_GET_UPVALUE:
+            load(as, RCX, R_FRAME, offsetof(CallFrame, closure));
+            load(as, RCX, RCX, offsetof(ObjClosure, upvalues));
+            load(as, RCX, RCX, 8 * code[offset + 1]);
+            load(as, RCX, RCX, offsetof(ObjUpvalue, location));
+            load(as, RAX, RCX, 0);
+            pushValue(as, RAX);
+            break;
+        case OP_SET_UPVALUE:
+            // The store goes through the write barrier.
+            vmArgument(as);
+            load(as, RSI, R_FRAME, offsetof(CallFrame, closure));
+            load(as, RSI, RSI, offsetof(ObjClosure, upvalues));
+            load(as, RSI, RSI, 8 * code[offset + 1]);
+            load(as, RDX, R_STACK_TOP, stackOffset(0));
+            callAbsolute(as, jitSetUpvalue);
+            break;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_SET_PROPERTY_POP: {
+            InlineCache *cache = &chunk->caches[readShort(code, offset + 2)];
+            int done = -1;
+            if (code[offset] == OP_GET_PROPERTY) {
+                int misses[6];
+                cachedGetField(as, cache, misses);
+                done = jump(as);
+                for (int i = 0; i < 6; i++) patchJump(as, misses[i], as->count);
+            }
+            frameArguments(as, next);
+            moveImmediate(as, R8,
+                          constants[code[offset + 1]] & ~(SIGN_BIT | QNAN));
+            moveImmediate(as, R9, (uint64_t) (uintptr_t) cache);
+            if (code[offset] == OP_GET_PROPERTY) {
+                callAbsolute(as, jitGetProperty);
+                checkSucceeded(as);
+                patchJump(as, done, as->count);
+                break;
+            }
+            callAbsolute(as, jitSetProperty);
+            checkSucceeded(as);
+            if (code[offset] == OP_SET_PROPERTY) {
+                load(as, RAX, R_STACK_TOP, stackOffset(0));
+                store(as, R_STACK_TOP, stackOffset(1), RAX);
+                dropValues(as, 1);
+            } else {
+                dropValues(as, 2);
+            }
+            break;
+        }
+        case OP_GET_INDEX:
+        case OP_GET_INDEX_LIST:
+            frameArguments(as, next);
+            callAbsolute(as, jitGetIndex);
+            checkSucceeded(as);
+            dropValues(as, 1);
+            break;
+        case OP_SET_INDEX:
+        case OP_SET_INDEX_LIST:
+            frameArguments(as, next);
+            callAbsolute(as, jitSetIndex);
+            checkSucceeded(as);
+            dropValues(as, 2);
+            break;
+        case OP_EQUAL:
+            load(as, RAX, R_STACK_TOP, stackOffset(1));
+            opMemory(as, 0x3B, RAX, R_STACK_TOP, stackOffset(0));
+            boolFromCondition(as, CC_E, RAX);
+            store(as, R_STACK_TOP, stackOffset(1), RAX);
+            dropValues(as, 1);
+            break;
+        case OP_GREATER:
+        case OP_LESS:
+            compareNumbers(as, code[offset] == OP_LESS, offset);
+            boolFromCondition(as, CC_A, RAX);
+            store(as, R_STACK_TOP, stackOffset(1), RAX);
+            dropValues(as, 1);
+            break;
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR: {
+            // Strings and type errors take the slow path inline rather than
+            // leaving, so concatenation in a loop stays compiled.
+            load(as, RAX, R_STACK_TOP, stackOffset(0));
+            opRegister(as, 0x21, RAX, R_QNAN);
+            opRegister(as, 0x39, RAX, R_QNAN);
+            int notNumber = jumpIf(as, CC_E);
+            load(as, RAX, R_STACK_TOP, stackOffset(1));
+            opRegister(as, 0x21, RAX, R_QNAN);
+            opRegister(as, 0x39, RAX, R_QNAN);
+            int otherNotNumber = jumpIf(as, CC_E);
+            sse(as, 0xF2, 0x10, 0, R_STACK_TOP, stackOffset(1));
+            sse(as, 0xF2, 0x58, 0, R_STACK_TOP, stackOffset(0));
+            sse(as, 0xF2, 0x11, 0, R_STACK_TOP, stackOffset(1));
+            int done = jump(as);
+            patchJump(as, notNumber, as->count);
+            patchJump(as, otherNotNumber, as->count);
+            frameArguments(as, next);
+            callAbsolute(as, jitAdd);
+            checkSucceeded(as);
+            patchJump(as, done, as->count);
+            dropValues(as, 1);
+            break;
+        }
+        case OP_SUBTRACT: arithmetic(as, 0x5C, offset); break;
+        case OP_MULTIPLY: arithmetic(as, 0x59, offset); break;
+        case OP_DIVIDE: arithmetic(as, 0x5E, offset); break;
+        case OP_NOT:
+            load(as, RAX, R_STACK_TOP, stackOffset(0));
+            opRegister(as, 0x29, RAX, R_NIL);
+            alu(as, ALU_CMP, RAX, 1);
+            boolFromCondition(as, CC_BE, RAX);
+            store(as, R_STACK_TOP, stackOffset(0), RAX);
+            break;
+        case OP_NEGATE:
+            guardNumber(as, 0, offset);
+            load(as, RAX, R_STACK_TOP, stackOffset(0));
+            moveImmediate(as, RCX, SIGN_BIT);
+            opRegister(as, 0x31, RAX, RCX);
+            store(as, R_STACK_TOP, stackOffset(0), RAX);
+            break;
+        case OP_PRINT:
+            vmArgument(as);
+            load(as, RSI, R_STACK_TOP, stackOffset(0));
+            dropValues(as, 1);
+            callAbsolute(as, jitPrint);
+            break;
+        case OP_JUMP:
+            addPatch(as, PATCH_BYTECODE, jump(as),
+                     (int) (next - code) + readShort(code, offset + 1));
+            break;
+        case OP_LOOP:
+            addPatch(as, PATCH_BYTECODE, jump(as),
+                     (int) (next - code) - readShort(code, offset + 1));
+            break;
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_TRUE:
+            load(as, RAX, R_STACK_TOP, stackOffset(0));
+            if (code[offset] != OP_JUMP_IF_FALSE) dropValues(as, 1);
+            jumpIfFalsey(as, (int) (next - code) + readShort(code, offset + 1),
+                         code[offset] == OP_POP_JUMP_IF_TRUE);
+            break;
+        case OP_JUMP_IF_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+            load(as, RAX, R_STACK_TOP, stackOffset(1));
+            opMemory(as, 0x3B, RAX, R_STACK_TOP, stackOffset(0));
+            dropValues(as, 2);
+            addPatch(as, PATCH_BYTECODE,
+                     jumpIf(as, code[offset] == OP_JUMP_IF_EQUAL ? CC_E : CC_NE),
+                     (int) (next - code) + readShort(code, offset + 1));
+            break;
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_NOT_LESS: {
+            uint8_t op = code[offset];
+            bool swap = op == OP_JUMP_IF_LESS || op == OP_JUMP_IF_NOT_LESS;
+            bool negated = op == OP_JUMP_IF_NOT_GREATER || op == OP_JUMP_IF_NOT_LESS;
+            compareJump(as, swap, negated ? CC_BE : CC_A, offset,
+                        (int) (next - code) + readShort(code, offset + 1));
+            break;
+        }
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            storeIp(as, next);
+            storeStackTop(as);
+            vmArgument(as);
+            moveImmediate(as, RSI, code[offset + 1]);
+            callAbsolute(as, code[offset] == OP_CALL ? (void *) jitCall
+                                                     : (void *) jitTailCall);
+            followCall(as);
+            break;
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+            storeIp(as, next);
+            storeStackTop(as);
+            vmArgument(as);
+            moveImmediate(as, RSI,
+                          constants[code[offset + 1]] & ~(SIGN_BIT | QNAN));
+            moveImmediate(as, RDX, code[offset + 2]);
+            moveImmediate(as, RCX,
+                          (uint64_t) (uintptr_t) &chunk->caches[readShort(code, offset + 3)]);
+            callAbsolute(as, code[offset] == OP_INVOKE ? (void *) jitInvoke
+                                                       : (void *) jitSuperInvoke);
+            followCall(as);
+            break;
+        // The inlined body is compiled like any other code; a guard that
+        // fails has run() make the call instead.
+        case OP_CALL_INLINE:
+            load(as, RDI, R_STACK_TOP, stackOffset(code[offset + 1]));
+            moveImmediate(as, RSI, (uint64_t) (uintptr_t) AS_FUNCTION(
+                                       constants[code[offset + 2]]));
+            callAbsolute(as, jitCallsInlined);
+            exitUnlessPassed(as, offset);
+            break;
+        case OP_INVOKE_INLINE:
+            vmArgument(as);
+            load(as, RSI, R_STACK_TOP, stackOffset(code[offset + 2]));
+            moveImmediate(as, RDX, (uint64_t) (uintptr_t) AS_STRING(
+                                       constants[code[offset + 1]]));
+            moveImmediate(as, RCX, (uint64_t) (uintptr_t) AS_FUNCTION(
+                                       constants[code[offset + 7]]));
+            moveImmediate(as, R8,
+                          (uint64_t) (uintptr_t) &chunk->caches[readShort(code, offset + 5)]);
+            callAbsolute(as, jitInvokesInlined);
+            exitUnlessPassed(as, offset);
+            break;
+        case OP_CLOSE_UPVALUE:
+            vmArgument(as);
+            lea(as, RSI, R_STACK_TOP, stackOffset(0));
+            callAbsolute(as, jitCloseUpvalues);
+            dropValues(as, 1);
+            break;
+        case OP_RETURN_NIL:
+        case OP_RETURN:
+            if (code[offset] == OP_RETURN_NIL) pushValue(as, R_NIL);
+            storeStackTop(as);
+            vmArgument(as);
+            opRegister(as, 0x89, RSI, R_SLOTS);
+            callAbsolute(as, jitReturn);
+            addPatch(as, PATCH_SWITCH, jump(as), 0);
+            break;
+        default:
+            // Closures, classes and collection literals are left to run().
+            exitAt(as, offset);
+            break;
+    }
+}
+
+void jitCompile(ObjFunction *function) {
+    if (!haveStubs()) return;
+
+    Chunk *chunk = &function->chunk;
+    uint32_t *entries = malloc(sizeof(uint32_t) * (size_t) chunk->count);
+    if (entries == nullptr) return;
+    Assembler as = {0};
+
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        entries[offset] = (uint32_t) as.count;
+        compileInstruction(&as, function, offset);
+    }
+
+    // Out-of-line tails, shared by the whole function.
+    int error = as.count;
+    moveImmediate(&as, RAX, JIT_ERROR);
+    epilogue(&as);
+
+    // RAX holds where to continue; the frame it belongs to is the innermost.
+    int frameSwitch = as.count;
+    rex(&as, true, RCX, 0, R_VM);
+    emitByte(&as, 0x63);
+    modrmMemory(&as, RCX, R_VM, offsetof(VM, frameCount)); // movsxd rcx, frameCount
+    rex(&as, true, RCX, 0, RCX);
+    emitByte(&as, 0x69);
+    modrmRegister(&as, RCX, RCX);
+    emit32(&as, sizeof(CallFrame)); // imul rcx, rcx, sizeof(CallFrame)
+    // lea r13, [vm->frames + rcx - sizeof(CallFrame)]
+    load(&as, R_FRAME, R_VM, offsetof(VM, frames));
+    rex(&as, true, R_FRAME, RCX, R_FRAME);
+    emitByte(&as, 0x8D);
+    emitByte(&as, (uint8_t) (0x80 | ((R_FRAME & 7) << 3) | 4));
+    emitByte(&as, (uint8_t) ((RCX << 3) | (R_FRAME & 7)));
+    emit32(&as, (uint32_t) -(int32_t) sizeof(CallFrame));
+    load(&as, R_SLOTS, R_FRAME, offsetof(CallFrame, slots));
+    load(&as, R_STACK_TOP, R_VM, offsetof(VM, stackTop));
+    emitByte(&as, 0xFF);
+    emitByte(&as, 0xE0); // jmp rax
+
+    // RAX holds the ip of the instruction run() should pick up at.
+    int exit = as.count;
+    store(&as, R_FRAME, offsetof(CallFrame, ip), RAX);
+    storeStackTop(&as);
+    moveImmediate(&as, RAX, JIT_EXIT);
+    epilogue(&as);
+
+    for (int i = 0; i < as.patchCount; i++) {
+        Patch *patch = &as.patches[i];
+        switch (patch->kind) {
+            case PATCH_BYTECODE:
+                patchJump(&as, patch->position, (int) entries[patch->offset]);
+                break;
+            case PATCH_EXIT:
+                patchJump(&as, patch->position, as.count);
+                moveImmediate(&as, RAX, (uint64_t) (uintptr_t) (chunk->code + patch->offset));
+                patchJump(&as, jump(&as), exit);
+                break;
+            case PATCH_ERROR: patchJump(&as, patch->position, error); break;
+            case PATCH_SWITCH: patchJump(&as, patch->position, frameSwitch); break;
+        }
+    }
+
+    JitCode *jitCode = malloc(sizeof(JitCode));
+    if (jitCode != nullptr) {
+        jitCode->code = mapCode(&as, &jitCode->size);
+        jitCode->entries = entries;
+    }
+    if (jitCode == nullptr || jitCode->code == nullptr) {
+        free(jitCode);
+        free(entries);
+    } else {
+        function->jitCode = jitCode;
+    }
+    free(as.code);
+    free(as.patches);
+}
+
+void jitFree(JitCode *code) {
+    if (code == nullptr) return;
+    munmap(code->code, code->size);
+    free(code->entries);
+    free(code);
+}
+
+JitStatus jitEnter(VM *vm, CallFrame *frame) {
+    JitCode *code = frame->function->jitCode;
+    size_t offset = (size_t) (frame->ip - frame->function->chunk.code);
+    return stubs.enter(vm, frame, code->code + code->entries[offset]);
+}
+
+JitStatus jitEnterAt(VM *vm, CallFrame *frame, void *code) {
+    if (!haveStubs()) return JIT_EXIT;
+    return stubs.enter(vm, frame, code);
+}
+
+void *jitContinuation(VM *vm) {
+    if (vm->frameCount == 0) return stubs.exitFrame;
+    CallFrame *frame = &vm->frames[vm->frameCount - 1];
+    JitCode *code = frame->function->jitCode;
+    if (code == nullptr) return stubs.exitFrame;
+    return code->code + code->entries[frame->ip - frame->function->chunk.code];
+}
+
+void *jitErrorExit() { return stubs.exitError; }
+#endif
@@ -0,0 +1,60 @@
+#ifndef JIT_H
+#define JIT_H
+#include "common.h"
+
+#ifdef LOX_JIT
+#include "chunk.h"
+#include "object.h"
+#include "vm.h"
+
+// A function is compiled once its calls plus loop back edges reach this.
+#define JIT_HOT_THRESHOLD 1000
+
+// Why compiled code handed control back to run().
+typedef enum {
+    // The instruction at frame->ip isn't compiled; interpret it.
+    JIT_EXIT,
+    // A call or return moved to a frame without compiled code at its ip.
+    JIT_FRAME,
+    // A runtime error has already been reported.
+    JIT_ERROR,
+} JitStatus;
+
+void jitCompile(ObjFunction *function);
+void jitFree(JitCode *code);
+// Runs the compiled code of the innermost frame from its ip.
+JitStatus jitEnter(VM *vm, CallFrame *frame);
+// Runs other native code, such as a trace, with the registers compiled code
+// expects. JIT_EXIT if it couldn't be entered at all.
+JitStatus jitEnterAt(VM *vm, CallFrame *frame, void *code);
+// Where compiled code continues once a call or return has changed the
+// current frame: its native code, or an exit back to run().
+void *jitContinuation(VM *vm);
+void *jitErrorExit();
+
+// Slow paths called from compiled code, implemented in vm.c. Those taking
+// `ip` and `stackTop` write them back themselves when they need to; the
+// others expect frame->ip and vm->stackTop to be current already.
+bool jitGetProperty(VM *vm, CallFrame *frame, uint8_t *ip, Value *stackTop,
+                    ObjString *name, InlineCache *cache);
+bool jitSetProperty(VM *vm, CallFrame *frame, uint8_t *ip, Value *stackTop,
+                    ObjString *name, InlineCache *cache);
+bool jitGetIndex(VM *vm, CallFrame *frame, uint8_t *ip, Value *stackTop);
+bool jitSetIndex(VM *vm, CallFrame *frame, uint8_t *ip, Value *stackTop);
+bool jitAdd(VM *vm, CallFrame *frame, uint8_t *ip, Value *stackTop);
+void jitPrint(VM *vm, Value value);
+void jitCloseUpvalues(VM *vm, Value *last);
+void jitSetUpvalue(VM *vm, ObjUpvalue *upvalue, Value value);
+void *jitCall(VM *vm, int argCount);
+void *jitTailCall(VM *vm, int argCount);
+void *jitInvoke(VM *vm, ObjString *name, int argCount, InlineCache *cache);
+void *jitSuperInvoke(VM *vm, ObjString *name, int argCount, InlineCache *cache);
+// The guards of inlined calls. Compiled code leaves for run() when they
+// fail, which makes the call itself.
+bool jitCallsInlined(Value callee, ObjFunction *function);
+bool jitInvokesInlined(VM *vm, Value receiver, ObjString *name,
+                       ObjFunction *function, InlineCache *guard);
+void *jitReturn(VM *vm, Value *slots);
+#endif
+
+#endif /* JIT_H */
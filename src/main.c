@@ -1,27 +1,121 @@
+#define _POSIX_C_SOURCE 200809L
 #include "compiler.h"
+#include "batch.h"
 #include "bestline.h"
+#include "bytecode.h"
+#include "debug.h"
 #include "memory.h"
 #include "scanner.h"
+#include "snapshot.h"
 #include "vm.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 char *read_file_contents(const char *filename);
+static int batch(VM *vm, const char *image, int jobs, int count,
+                 char *paths[]);
 
 int main(int argc, char *argv[]) {
-    initVM(stdout, stderr);
     // Disable output buffering
     setbuf(stdout, NULL);
     setbuf(stderr, NULL);
 
+    // Options may come anywhere; take them out before looking at the command.
+    int args = 1;
+    int jobs = 0;
+    bool jitEnabled = false;
+    bool tracingEnabled = false;
+    bool lazyCompile = false;
+    bool peepholeEnabled = true;
+    bool ssaEnabled = true;
+    bool inlineEnabled = true;
+    int maxFrames = 0;
+    int gcPause = -1;
+    bool gcConcurrent = false;
+    const char *cacheDir = getenv("LOX_CACHE_DIR");
+    const char *image = getenv("LOX_IMAGE");
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--jit") == 0) {
+#ifdef LOX_JIT
+            jitEnabled = true;
+#else
+            fprintf(stderr, "Ignoring --jit: built without JIT support (make JIT=1).\n");
+#endif
+        } else if (strcmp(argv[i], "--trace-jit") == 0) {
+#ifdef LOX_JIT
+            tracingEnabled = true;
+#else
+            fprintf(stderr, "Ignoring --trace-jit: built without JIT support (make JIT=1).\n");
+#endif
+        } else if (strcmp(argv[i], "--lazy") == 0) {
+            lazyCompile = true;
+        } else if (strcmp(argv[i], "--no-peephole") == 0) {
+            peepholeEnabled = false;
+        } else if (strcmp(argv[i], "--no-ssa") == 0) {
+            ssaEnabled = false;
+        } else if (strcmp(argv[i], "--no-inline") == 0) {
+            inlineEnabled = false;
+        } else if (strncmp(argv[i], "--max-depth=", 12) == 0) {
+            maxFrames = atoi(argv[i] + 12);
+            if (maxFrames < 1) {
+                fprintf(stderr, "Invalid --max-depth: %s\n", argv[i] + 12);
+                return 64;
+            }
+        } else if (strcmp(argv[i], "--gc-concurrent") == 0) {
+            gcConcurrent = true;
+        } else if (strncmp(argv[i], "--gc-pause=", 11) == 0) {
+            char *end;
+            gcPause = (int) strtol(argv[i] + 11, &end, 10);
+            if (end == argv[i] + 11 || *end != '\0' || gcPause < 0) {
+                fprintf(stderr, "Invalid --gc-pause: %s\n", argv[i] + 11);
+                return 64;
+            }
+        } else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+            jobs = atoi(argv[i] + 7);
+            if (jobs < 1) {
+                fprintf(stderr, "Invalid --jobs: %s\n", argv[i] + 7);
+                return 64;
+            }
+        } else if (strncmp(argv[i], "--cache-dir=", 12) == 0) {
+            cacheDir = argv[i][12] == '\0' ? nullptr : argv[i] + 12;
+        } else if (strncmp(argv[i], "--image=", 8) == 0) {
+            image = argv[i][8] == '\0' ? nullptr : argv[i] + 8;
+        } else {
+            argv[args++] = argv[i];
+        }
+    }
+    argc = args;
+
+    // An image made by the snapshot command starts the VM with its heap
+    // already set up.
+    VM vm;
+    if (image == nullptr) {
+        initVM(&vm, stdout, stderr);
+    } else if (!initVMFromSnapshot(&vm, stdout, stderr, image)) {
+        fprintf(stderr, "Could not load image: %s\n", image);
+        freeVM(&vm);
+        return 74;
+    }
+    vm.jitEnabled = jitEnabled;
+    vm.tracingEnabled = tracingEnabled;
+    vm.lazyCompile = lazyCompile;
+    vm.peepholeEnabled = peepholeEnabled;
+    vm.ssaEnabled = ssaEnabled;
+    vm.inlineEnabled = inlineEnabled;
+    if (maxFrames != 0) vm.maxFrames = maxFrames;
+    if (gcPause >= 0) vm.gcPause = gcPause;
+    vm.gcConcurrent = gcConcurrent;
+    vm.cacheDir = cacheDir;
+
     if (argc < 3) {
         char *line;
         while ((line = bestlineWithHistory("> ", "lox"))) {
-            interpret(line);
+            interpret(&vm, line);
             free(line);
         }
-        freeVM();
+        freeVM(&vm);
         return 0;
     }
 
@@ -34,8 +128,8 @@ int main(int argc, char *argv[]) {
         return hadError ? 65 : 0;
     } else if (strcmp(command, "parse") == 0) {
         char *source = read_file_contents(argv[2]);
-        Expr *ast = parse(source);
-        if (hadError()) {
+        Expr *ast = parse(&vm, source);
+        if (ast == nullptr) {
             return 65;
         }
         print_ast(stdout, ast);
@@ -45,30 +139,168 @@ int main(int argc, char *argv[]) {
 
     } else if (strcmp(command, "evaluate") == 0) {
         char *source = read_file_contents(argv[2]);
-        InterpretResult result = evaluate(source);
+        InterpretResult result = evaluate(&vm, source);
         free(source);
         if (result == INTERPRET_COMPILE_ERROR)
             exit(65);
         if (result == INTERPRET_RUNTIME_ERROR)
             exit(70);
 
-    } else if (strcmp(command, "run") == 0) {
+    } else if (strcmp(command, "run") == 0 || strcmp(command, "stats") == 0) {
+        InterpretResult result;
+        if (isBytecodeFile(argv[2])) {
+            ObjFunction *script = loadBytecode(&vm, argv[2], 0);
+            if (script == nullptr) {
+                fprintf(stderr, "Could not load bytecode file: %s\n", argv[2]);
+                exit(65);
+            }
+            result = interpretFunction(&vm, script);
+        } else {
+            char *source = read_file_contents(argv[2]);
+            result = interpret(&vm, source);
+            free(source);
+        }
+        if (strcmp(command, "stats") == 0)
+            printStats(&vm, stderr);
+        if (result == INTERPRET_COMPILE_ERROR)
+            exit(65);
+        if (result == INTERPRET_RUNTIME_ERROR)
+            exit(70);
+    } else if (strcmp(command, "compile") == 0) {
+        // compile SRC [OUT] writes the bytecode `run` can load in place of
+        // SRC, to SRC with a "c" appended unless told otherwise.
+        char *source = read_file_contents(argv[2]);
+        ObjFunction *script = compile(&vm, source);
+        if (script == nullptr) {
+            exit(65);
+        }
+        char *out = nullptr;
+        if (argc < 4) {
+            out = malloc(strlen(argv[2]) + 2);
+            if (out == nullptr) exit(1);
+            sprintf(out, "%sc", argv[2]);
+        }
+        const char *path = argc < 4 ? out : argv[3];
+        push(&vm, OBJ_VAL(script));
+        bool written = writeBytecode(&vm, script, hashSource(source), path);
+        pop(&vm);
+        if (!written) {
+            fprintf(stderr, "Could not write bytecode file: %s\n", path);
+            exit(74);
+        }
+        free(out);
+        free(source);
+    } else if (strcmp(command, "snapshot") == 0) {
+        // snapshot PRELUDE OUT runs PRELUDE and saves the heap it leaves
+        // behind as an image for --image to start from.
+        if (argc < 4) {
+            fprintf(stderr, "Usage: snapshot PRELUDE OUT\n");
+            exit(64);
+        }
         char *source = read_file_contents(argv[2]);
-        InterpretResult result = interpret(source);
+        InterpretResult result = interpret(&vm, source);
         free(source);
         if (result == INTERPRET_COMPILE_ERROR)
             exit(65);
         if (result == INTERPRET_RUNTIME_ERROR)
             exit(70);
+        if (!writeSnapshot(&vm, argv[3])) {
+            fprintf(stderr, "Could not write image: %s\n", argv[3]);
+            exit(74);
+        }
+    } else if (strcmp(command, "batch") == 0) {
+        int status = batch(&vm, image, jobs, argc - 2, argv + 2);
+        freeVM(&vm);
+        return status;
+    } else if (strcmp(command, "ngrams") == 0) {
+        // Static opcode sequence counts over every file given, used to pick
+        // superinstructions.
+        int scriptCount = 0;
+        ObjFunction **scripts = malloc(sizeof(ObjFunction *) * (size_t) (argc - 2));
+        for (int i = 2; i < argc; i++) {
+            char *source = read_file_contents(argv[i]);
+            ObjFunction *script = compile(&vm, source);
+            free(source);
+            if (script == nullptr) {
+                fprintf(stderr, "Skipping %s: compile error.\n", argv[i]);
+                continue;
+            }
+            push(&vm, OBJ_VAL(script));
+            scripts[scriptCount++] = script;
+        }
+        for (int n = 2; n <= 4; n++) {
+            printOpcodeNgrams(stdout, scripts, scriptCount, n, 20);
+        }
+        free(scripts);
     } else {
         fprintf(stderr, "Unknown command: %s\n", command);
         return 1;
     }
 
-    freeVM();
+    freeVM(&vm);
     return 0;
 }
 
+// Runs every script named, or found in a directory named, or listed one per
+// line on stdin for "-", each in a fresh VM configured like `vm` and started
+// from `image` if there is one. Prints each script's status, time and output
+// in the order given, then a summary on stderr, and exits with the worst
+// status of them all.
+static int batch(VM *vm, const char *image, int jobs, int count,
+                 char *paths[]) {
+    Batch batch;
+    initBatch(&batch);
+    for (int i = 0; i < count; i++) {
+        if (strcmp(paths[i], "-") == 0) {
+            char *line = nullptr;
+            size_t size = 0;
+            ssize_t length;
+            while ((length = getline(&line, &size, stdin)) > 0) {
+                if (line[length - 1] == '\n') line[--length] = '\0';
+                if (length > 0) addBatchScript(&batch, line, nullptr);
+            }
+            free(line);
+        } else if (!addBatchPath(&batch, paths[i])) {
+            fprintf(stderr, "Could not open file: %s\n", paths[i]);
+            freeBatch(&batch);
+            return 74;
+        }
+    }
+
+    BatchOptions options = {jobs,
+                            vm->jitEnabled,
+                            vm->tracingEnabled,
+                            vm->lazyCompile,
+                            vm->peepholeEnabled,
+                            vm->ssaEnabled,
+                            vm->inlineEnabled,
+                            vm->maxFrames,
+                            vm->cacheDir,
+                            image};
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int threads = runBatch(&batch, &options);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    int status = 0;
+    int failed = 0;
+    for (int i = 0; i < batch.count; i++) {
+        BatchScript *script = &batch.scripts[i];
+        printf("[%s %d %.3f ms] %s\n", script->status == 0 ? "ok" : "failed",
+               script->status, script->seconds * 1e3, script->path);
+        fwrite(script->out.buf, 1, script->out.size, stdout);
+        fwrite(script->err.buf, 1, script->err.size, stdout);
+        if (script->status > status) status = script->status;
+        if (script->status != 0) failed++;
+    }
+    double seconds = (double) (end.tv_sec - start.tv_sec) +
+                     (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "%d scripts, %d failed, %d threads, %.3f s\n", batch.count,
+            failed, threads, seconds);
+    freeBatch(&batch);
+    return status;
+}
+
 char *read_file_contents(const char *filename) {
     FILE *f = fopen(filename, "rb");
 
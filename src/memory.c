@@ -1,34 +1,102 @@
-#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+#include <assert.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
 
 #include "chunk.h"
 #include "compiler.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
+#include "trace.h"
 #include "value.h"
 #include "vm.h"
 
 #define GC_HEAP_GROW_FACTOR 2
+// Bytes allocated between minor collections.
+#define GC_YOUNG_SIZE (1024 * 1024)
+// Bytes allocated between steps of a full collection.
+#define GC_STEP_SIZE (64 * 1024)
+// Objects marked or swept between checks of the clock.
+#define GC_STEP_WORK 64
 
 #ifdef DEBUG_LOG_GC
 #include "debug.h"
 #include <stdio.h>
 #endif
 
-void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
-    vm.bytesAllocated += newSize - oldSize;
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#else
+#define ASAN_POISON_MEMORY_REGION(addr, size) ((void) (addr), (void) (size))
+#define ASAN_UNPOISON_MEMORY_REGION(addr, size) ((void) (addr), (void) (size))
+#endif
+
+// Copies the block to a new one rather than resizing or freeing it in place,
+// since the marker thread may be reading it. stopMarker() frees it.
+static void *retireBlock(VM *vm, void *pointer, size_t oldSize,
+                         size_t newSize) {
+    if (vm->retiredCapacity < vm->retiredCount + 1) {
+        vm->retiredCapacity = GROW_CAPACITY(vm->retiredCapacity);
+        vm->retired = (void **) realloc(vm->retired,
+                                        sizeof(void *) * vm->retiredCapacity);
+        if (vm->retired == nullptr)
+            exit(1);
+    }
+    vm->retired[vm->retiredCount++] = pointer;
+    if (newSize == 0)
+        return nullptr;
+    void *result = malloc(newSize);
+    if (result == nullptr)
+        exit(1);
+    memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+    return result;
+}
+
+// Counts the change in size and, if it is time for a collection, runs it.
+static void countAllocation(VM *vm, size_t oldSize, size_t newSize) {
+    vm->bytesAllocated += newSize - oldSize;
     if (newSize > oldSize) {
+        vm->youngBytes += newSize - oldSize;
+        if (vm->gcHeld)
+            return;
 #ifdef DEBUG_STRESS_GC
-        collectGarbage();
+        // Every allocation moves a full collection along as little as it
+        // can. Between them, alternating keeps full collections from hiding
+        // a missing barrier while still running both kinds everywhere.
+        if (vm->gcPhase != GC_IDLE) {
+            collectStep(vm);
+        } else if ((vm->minorCollections + vm->majorCollections) % 2 == 0) {
+            collectYoung(vm);
+        } else {
+            beginCollection(vm);
+        }
 #else
-        if (vm.bytesAllocated > vm.nextGC) {
-            collectGarbage();
+        vm->stepBytes += newSize - oldSize;
+        if (vm->gcPhase != GC_IDLE && vm->stepBytes > GC_STEP_SIZE)
+            collectStep(vm);
+        // Only what earlier collections promoted counts against nextGC.
+        if (vm->gcPhase != GC_MARKING && vm->youngBytes > GC_YOUNG_SIZE) {
+            if (vm->gcPhase == GC_IDLE &&
+                vm->bytesAllocated > vm->youngBytes + vm->nextGC) {
+                beginCollection(vm);
+            } else {
+                collectYoung(vm);
+            }
         }
-
 #endif
     }
+}
+
+void *reallocate(VM *vm, void *pointer, size_t oldSize, size_t newSize) {
+    countAllocation(vm, oldSize, newSize);
+    if (vm->markerRunning && pointer != nullptr)
+        return retireBlock(vm, pointer, oldSize, newSize);
     if (newSize == 0) {
         free(pointer);
         return nullptr;
@@ -39,41 +107,189 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
     return result;
 }
 
-void markObject(Obj *object) {
+static_assert(sizeof(ObjInstance) + sizeof(Value) * SHAPE_MAX_SLOTS <=
+                  POOL_MAX_SIZE,
+              "an instance with all its fields inline must fit in a cell");
+
+// Cells start past the page header, on a granule.
+#define PAGE_CELLS_OFFSET                                                      \
+    ((sizeof(Page) + POOL_GRANULE - 1) / POOL_GRANULE * POOL_GRANULE)
+
+static int sizeClass(size_t size) {
+    return (int) ((size - 1) / POOL_GRANULE);
+}
+
+static size_t cellSize(int sizeClass) {
+    return (size_t) (sizeClass + 1) * POOL_GRANULE;
+}
+
+static size_t cellCount(int sizeClass) {
+    return (POOL_PAGE_SIZE - PAGE_CELLS_OFFSET) / cellSize(sizeClass);
+}
+
+static Obj *pageCell(Page *page, size_t index) {
+    return (Obj *) ((char *) page + PAGE_CELLS_OFFSET +
+                    index * cellSize(page->sizeClass));
+}
+
+static void setBit(uint64_t *bitmap, size_t bit) {
+    bitmap[bit / 64] |= (uint64_t) 1 << (bit % 64);
+}
+
+static void clearBit(uint64_t *bitmap, size_t bit) {
+    bitmap[bit / 64] &= ~((uint64_t) 1 << (bit % 64));
+}
+
+static bool testBit(const uint64_t *bitmap, size_t bit) {
+    return (bitmap[bit / 64] >> (bit % 64)) & 1;
+}
+
+static void pushCell(VM *vm, int sizeClass, void *pointer) {
+    FreeCell *cell = (FreeCell *) pointer;
+    ASAN_UNPOISON_MEMORY_REGION(cell, sizeof(FreeCell));
+    cell->next = vm->freeCells[sizeClass];
+    vm->freeCells[sizeClass] = cell;
+    ASAN_POISON_MEMORY_REGION(cell, cellSize(sizeClass));
+}
+
+// Maps twice the size and trims it down to an aligned page. Unlike malloc,
+// this leaves nothing in front of the page to share or touch.
+static Page *mapPage(void) {
+    size_t size = 2 * POOL_PAGE_SIZE;
+    char *base = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        exit(1);
+    char *page = (char *) (((uintptr_t) base + POOL_PAGE_SIZE - 1) &
+                           ~(uintptr_t) (POOL_PAGE_SIZE - 1));
+    if (page > base)
+        munmap(base, (size_t) (page - base));
+    if (page + POOL_PAGE_SIZE < base + size)
+        munmap(page + POOL_PAGE_SIZE,
+               (size_t) (base + size - page - POOL_PAGE_SIZE));
+    return (Page *) page;
+}
+
+static void addPage(VM *vm, int sizeClass) {
+    Page *page = mapPage();
+    page->sizeClass = sizeClass;
+    page->next = vm->pages[sizeClass];
+    vm->pages[sizeClass] = page;
+    // Pushed back to front so that they're handed out in address order.
+    for (size_t i = cellCount(sizeClass); i > 0; i--) {
+        pushCell(vm, sizeClass, pageCell(page, i - 1));
+    }
+}
+
+static void freeObject(VM *vm, Obj *object);
+
+// Frees the unmarked objects in a page that a full collection has marked,
+// puts every free cell in it on the free list and clears the marks.
+static void sweepPage(VM *vm, Page *page) {
+    for (size_t i = cellCount(page->sizeClass); i > 0; i--) {
+        Obj *object = pageCell(page, i - 1);
+        size_t bit = cellBit(object);
+        if (!testBit(page->allocated, bit)) {
+            pushCell(vm, page->sizeClass, object);
+        } else if (!testBit(page->marks, bit)) {
+            freeObject(vm, object);
+        }
+    }
+    memset(page->marks, 0, sizeof(page->marks));
+}
+
+static void sweepNextPage(VM *vm, int sizeClass) {
+    Page *page = vm->unswept[sizeClass];
+    vm->unswept[sizeClass] = page->next;
+    page->next = vm->pages[sizeClass];
+    vm->pages[sizeClass] = page;
+    sweepPage(vm, page);
+}
+
+void *allocateCell(VM *vm, size_t size) {
+    assert(size <= POOL_MAX_SIZE);
+    countAllocation(vm, 0, size);
+    int class = sizeClass(size);
+    // The pages a collection has yet to sweep are the first place to look.
+    while (vm->freeCells[class] == nullptr && vm->unswept[class] != nullptr) {
+        sweepNextPage(vm, class);
+    }
+    if (vm->freeCells[class] == nullptr)
+        addPage(vm, class);
+    FreeCell *cell = vm->freeCells[class];
+    ASAN_UNPOISON_MEMORY_REGION(cell, size);
+    vm->freeCells[class] = cell->next;
+
+    Page *page = pageOf((Obj *) cell);
+    size_t bit = cellBit((Obj *) cell);
+    setBit(page->allocated, bit);
+    setBit(page->young, bit);
+    if (!page->hasYoung) {
+        if (vm->youngPageCapacity < vm->youngPageCount + 1) {
+            vm->youngPageCapacity = GROW_CAPACITY(vm->youngPageCapacity);
+            vm->youngPages = (Page **) realloc(
+                vm->youngPages, sizeof(Page *) * vm->youngPageCapacity);
+            if (vm->youngPages == nullptr)
+                exit(1);
+        }
+        page->hasYoung = true;
+        vm->youngPages[vm->youngPageCount++] = page;
+    }
+    return cell;
+}
+
+void freeCell(VM *vm, void *pointer, size_t size) {
+    countAllocation(vm, size, 0);
+    Page *page = pageOf((Obj *) pointer);
+    size_t bit = cellBit((Obj *) pointer);
+    clearBit(page->allocated, bit);
+    clearBit(page->young, bit);
+    pushCell(vm, sizeClass(size), pointer);
+}
+
+void markObject(VM *vm, Obj *object) {
     if (object == nullptr)
         return;
-    if (object->isMarked)
+    // A minor collection takes every old object to be live, and a full one
+    // leaves young objects, which change without barriers, to the remark.
+    if (object->isOld ? vm->collectingYoung : vm->gcPhase == GC_MARKING)
+        return;
+    Page *page = pageOf(object);
+    size_t bit = cellBit(object);
+    if (testBit(page->marks, bit))
         return;
 #ifdef DEBUG_LOG_GC
     printf("%p mark ", (void *) object);
     printValue(OBJ_VAL(object));
     printf("\n");
 #endif
-    object->isMarked = true;
+    setBit(page->marks, bit);
 
-    if (vm.grayCapacity < vm.grayCount + 1) {
-        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-        vm.grayStack =
-            (Obj **) realloc(vm.grayStack, sizeof(Obj *) * vm.grayCapacity);
-        if (vm.grayStack == nullptr)
+    if (vm->grayCapacity < vm->grayCount + 1) {
+        vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+        vm->grayStack =
+            (Obj **) realloc(vm->grayStack, sizeof(Obj *) * vm->grayCapacity);
+        if (vm->grayStack == nullptr)
             exit(1);
     }
-    vm.grayStack[vm.grayCount++] = object;
+    vm->grayStack[vm->grayCount++] = object;
 }
 
-void markValue(Value value) {
+void markValue(VM *vm, Value value) {
     if (IS_OBJ(value)) {
-        markObject(AS_OBJ(value));
+        markObject(vm, AS_OBJ(value));
     }
 }
 
-static void markArray(ValueArray *array) {
-    for (int i = 0; i < array->count; i++) {
-        markValue(array->values[i]);
+static void markArray(VM *vm, ValueArray *array) {
+    int count = __atomic_load_n(&array->count, __ATOMIC_ACQUIRE);
+    Value *values = __atomic_load_n(&array->values, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; i++) {
+        markValue(vm, loadValue(&values[i]));
     }
 }
 
-static void blackenObject(Obj *object) {
+static void blackenObject(VM *vm, Obj *object) {
 #ifdef DEBUG_LOG_GC
     printf("%p blacken ", (void *) object);
     printValue(OBJ_VAL(object));
@@ -83,191 +299,508 @@ static void blackenObject(Obj *object) {
     switch (object->type) {
         case OBJ_BOUND_METHOD: {
             ObjBoundMethod *bound = (ObjBoundMethod *) object;
-            markValue(bound->receiver);
-            markObject((Obj *) bound->method);
+            markValue(vm, bound->receiver);
+            markObject(vm, (Obj *) bound->method);
             break;
         }
         case OBJ_CLASS: {
             ObjClass *class = (ObjClass *) object;
-            markObject((Obj *) class->name);
-            markTable(&class->methods);
+            markObject(vm, (Obj *) class->name);
+            markObject(vm, (Obj *) class->rootShape);
+            markTable(vm, &class->methods);
             break;
         }
         case OBJ_CLOSURE: {
             ObjClosure *closure = (ObjClosure *) object;
-            markObject((Obj *) closure->function);
+            markObject(vm, (Obj *) closure->function);
             for (int i = 0; i < closure->upvalueCount; i++) {
-                markObject((Obj *) closure->upvalues[i]);
+                markObject(vm, (Obj *) closure->upvalues[i]);
             }
             break;
         }
         case OBJ_FUNCTION: {
             ObjFunction *function = (ObjFunction *) object;
-            markObject((Obj *) function->name);
-            markArray(&function->chunk.constants);
+            markObject(vm, (Obj *) function->name);
+            markArray(vm, &function->chunk.constants);
+            if (function->lazy != nullptr) {
+                markObject(vm, (Obj *) function->lazy->source);
+                for (int i = 0; i < function->upvalueCount; i++) {
+                    markObject(vm, (Obj *) function->lazy->upvalueNames[i]);
+                }
+            }
+            // Cache keys are compared by address, so they must stay alive for
+            // as long as the entry does or a new object could reuse the slot.
+            for (int i = 0; i < function->chunk.cacheCount; i++) {
+                InlineCache *cache = &function->chunk.caches[i];
+                int count = cache->count < IC_POLYMORPHIC_MAX ? cache->count
+                                                              : IC_POLYMORPHIC_MAX;
+                for (int j = 0; j < count; j++) {
+                    markObject(vm, cache->entries[j].key);
+                    markValue(vm, cache->entries[j].value);
+                }
+            }
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance *instance = (ObjInstance *) object;
-            markObject((Obj *) instance->class);
-            markTable(&instance->fields);
+            ObjShape *shape =
+                __atomic_load_n(&instance->shape, __ATOMIC_ACQUIRE);
+            // A dictionary shape grows in place, after its new field is set.
+            int slotCount =
+                __atomic_load_n(&shape->slotCount, __ATOMIC_ACQUIRE);
+            Value *fields =
+                __atomic_load_n(&instance->fields, __ATOMIC_ACQUIRE);
+            markObject(vm, (Obj *) instance->class);
+            markObject(vm, (Obj *) shape);
+            for (int i = 0; i < slotCount; i++) {
+                markValue(vm, loadValue(&fields[i]));
+            }
             break;
         }
         case OBJ_LIST: {
             ObjList *list = (ObjList *) object;
-            markArray(&list->elements);
+            markArray(vm, &list->elements);
             break;
         }
         case OBJ_MAP: {
             ObjMap *map = (ObjMap *) object;
-            markTable(&map->table);
+            markTable(vm, &map->table);
+            break;
+        }
+        case OBJ_SHAPE: {
+            ObjShape *shape = (ObjShape *) object;
+            markTable(vm, &shape->slots);
+            markTable(vm, &shape->transitions);
             break;
         }
-        case OBJ_UPVALUE: markValue(((ObjUpvalue *) object)->closed); break;
+        case OBJ_UPVALUE:
+            markValue(vm, loadValue(&((ObjUpvalue *) object)->closed));
+            break;
         case OBJ_NATIVE:
         case OBJ_STRING: break;
     }
 }
 
-void freeObject(Obj *object) {
+static void freeObject(VM *vm, Obj *object) {
 #ifdef DEBUG_LOG_GC
     printf("%p free type %s\n", (void *) object, ObjType_String[object->type]);
 #endif
 
     switch (object->type) {
         case OBJ_BOUND_METHOD: {
-            FREE(ObjBoundMethod, object);
+            FREE_OBJ(vm, ObjBoundMethod, object);
             break;
         }
         case OBJ_CLASS: {
             ObjClass *class = (ObjClass *) object;
-            freeTable(&class->methods);
-            FREE(ObjClass, object);
+            freeTable(vm, &class->methods);
+            FREE_OBJ(vm, ObjClass, object);
             break;
         }
         case OBJ_CLOSURE: {
             ObjClosure *closure = (ObjClosure *) object;
-            FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalueCount);
-            FREE(ObjClosure, object);
+            FREE_ARRAY(vm, ObjUpvalue *, closure->upvalues,
+                       closure->upvalueCount);
+            FREE_OBJ(vm, ObjClosure, object);
             break;
         }
         case OBJ_UPVALUE: {
-            FREE(ObjUpvalue, object);
+            FREE_OBJ(vm, ObjUpvalue, object);
             break;
         }
         case OBJ_FUNCTION: {
             ObjFunction *function = (ObjFunction *) object;
-            freeChunk(&function->chunk);
-            FREE(ObjFunction, object);
+#ifdef LOX_JIT
+            jitFree(function->jitCode);
+            traceFree(function->loops);
+#endif
+            freeLazyFunction(vm, function);
+            freeChunk(vm, &function->chunk);
+            FREE_OBJ(vm, ObjFunction, object);
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance *instance = (ObjInstance *) object;
-            freeTable(&instance->fields);
-            FREE(ObjInstance, object);
+            if (instance->fields != instance->inlineFields) {
+                FREE_ARRAY(vm, Value, instance->fields,
+                           instance->fieldCapacity);
+            }
+            freeCell(vm, object,
+                     sizeof(ObjInstance) +
+                         sizeof(Value) * instance->inlineCapacity);
             break;
         }
         case OBJ_LIST: {
             ObjList *list = (ObjList *) object;
-            freeValueArray(&list->elements);
-            FREE(ObjList, object);
+            freeValueArray(vm, &list->elements);
+            FREE_OBJ(vm, ObjList, object);
             break;
         }
         case OBJ_MAP: {
             ObjMap *map = (ObjMap *) object;
-            freeTable(&map->table);
-            FREE(ObjMap, object);
+            freeTable(vm, &map->table);
+            FREE_OBJ(vm, ObjMap, object);
             break;
         }
         case OBJ_NATIVE: {
-            FREE(ObjNative, object);
+            FREE_OBJ(vm, ObjNative, object);
+            break;
+        }
+        case OBJ_SHAPE: {
+            ObjShape *shape = (ObjShape *) object;
+            freeTable(vm, &shape->slots);
+            freeTable(vm, &shape->transitions);
+            FREE_OBJ(vm, ObjShape, object);
             break;
         }
         case OBJ_STRING: {
             ObjString *string = (ObjString *) object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+            FREE_ARRAY(vm, char, string->chars, string->length + 1);
+            FREE_OBJ(vm, ObjString, object);
             break;
         }
     }
 }
 
-static void markRoots() {
-    for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
-        markValue(*slot);
+static void markRoots(VM *vm) {
+    for (Value *slot = vm->stack; slot < vm->stackTop; slot++) {
+        markValue(vm, *slot);
     }
 
-    for (int i = 0; i < vm.frameCount; i++) {
-        markObject((Obj *) vm.frames[i].closure);
+    for (int i = 0; i < vm->frameCount; i++) {
+        markObject(vm, (Obj *) vm->frames[i].closure);
     }
 
-    for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != nullptr;
+    for (ObjUpvalue *upvalue = vm->openUpvalues; upvalue != nullptr;
          upvalue = upvalue->next) {
-        markObject((Obj *) upvalue);
+        markObject(vm, (Obj *) upvalue);
     }
 
-    markTable(&vm.globals);
-    markCompilerRoots();
-    markObject((Obj *) vm.initString);
+    markTable(vm, &vm->globalSlots);
+    markArray(vm, &vm->globalValues);
+    markArray(vm, &vm->globalNames);
+    markCompilerRoots(vm);
+    markObject(vm, (Obj *) vm->initString);
+    markObject(vm, (Obj *) vm->listClass);
+    markObject(vm, (Obj *) vm->mapClass);
 }
 
-static void traceReferences() {
-    while (vm.grayCount > 0) {
-        Obj *object = vm.grayStack[--vm.grayCount];
-        blackenObject(object);
+static void traceReferences(VM *vm) {
+    while (vm->grayCount > 0) {
+        Obj *object = vm->grayStack[--vm->grayCount];
+        blackenObject(vm, object);
     }
 }
 
-static void sweep() {
-    Obj *previous = nullptr;
-    Obj *object = vm.objects;
-    while (object != nullptr) {
-        if (object->isMarked) {
-            object->isMarked = false;
-            previous = object;
-            object = object->next;
+// Functions, classes and shapes are written to from too many places, the
+// compiler and inline caches among them, to put a barrier behind each. There
+// are few of them, so once old they stay remembered instead.
+static bool alwaysRemembered(Obj *object) {
+    return object->type == OBJ_FUNCTION || object->type == OBJ_CLASS ||
+           object->type == OBJ_SHAPE;
+}
+
+void rememberObject(VM *vm, Obj *object) {
+    if (vm->rememberedCapacity < vm->rememberedCount + 1) {
+        vm->rememberedCapacity = GROW_CAPACITY(vm->rememberedCapacity);
+        vm->remembered = (Obj **) realloc(
+            vm->remembered, sizeof(Obj *) * vm->rememberedCapacity);
+        if (vm->remembered == nullptr)
+            exit(1);
+    }
+    object->isRemembered = true;
+    vm->remembered[vm->rememberedCount++] = object;
+}
+
+// Once the young objects are gone nothing else can point at one, so all but
+// the objects that are always remembered are forgotten, as are those a full
+// collection didn't reach.
+static void forgetRemembered(VM *vm, bool full) {
+    int count = 0;
+    for (int i = 0; i < vm->rememberedCount; i++) {
+        Obj *object = vm->remembered[i];
+        if (alwaysRemembered(object) && (!full || isMarked(object))) {
+            vm->remembered[count++] = object;
         } else {
-            Obj *unreached = object;
-            object = object->next;
-            if (previous != nullptr) {
-                previous->next = object;
-            } else {
-                vm.objects = object;
+            object->isRemembered = false;
+        }
+    }
+    vm->rememberedCount = count;
+}
+
+// Promotes the marked young objects, in place, and frees the others. The
+// remark leaves the promoted ones marked for the sweep that follows it.
+static void sweepYoung(VM *vm, bool keepMarks) {
+    for (int i = 0; i < vm->youngPageCount; i++) {
+        Page *page = vm->youngPages[i];
+        // Back to front, like sweepPage(), so the cells freed here are
+        // handed out again in address order.
+        for (size_t word = PAGE_WORDS; word-- > 0;) {
+            uint64_t young = page->young[word];
+            page->young[word] = 0;
+            while (young != 0) {
+                int top = 63 - __builtin_clzll(young);
+                size_t bit = word * 64 + (size_t) top;
+                young &= ~((uint64_t) 1 << top);
+                Obj *object = (Obj *) ((char *) page + bit * POOL_GRANULE);
+                if (testBit(page->marks, bit)) {
+                    if (!keepMarks)
+                        clearBit(page->marks, bit);
+                    object->isOld = true;
+                    if (alwaysRemembered(object))
+                        rememberObject(vm, object);
+                } else {
+                    if (object->type == OBJ_STRING)
+                        tableDelete(&vm->strings, (ObjString *) object);
+                    freeObject(vm, object);
+                }
             }
+        }
+        page->hasYoung = false;
+    }
+    vm->youngPageCount = 0;
+    vm->youngBytes = 0;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static void endPause(VM *vm, double start) {
+    double pause = now() - start;
+    if (pause > vm->longestPause)
+        vm->longestPause = pause;
+}
 
-            freeObject(unreached);
+// Runs on a thread of its own while the program carries on. The roots are
+// already gray; the remark picks up whatever the program changes meanwhile.
+static void *markConcurrently(void *arg) {
+    VM *vm = arg;
+    while (vm->grayCount > 0) {
+        Obj *object = vm->grayStack[--vm->grayCount];
+        // The compiler and inline caches change these without barriers, and
+        // the remark traces them all again anyway.
+        if (!alwaysRemembered(object))
+            blackenObject(vm, object);
+    }
+    __atomic_store_n(&vm->markerDone, true, __ATOMIC_RELEASE);
+    return nullptr;
+}
+
+static void stopMarker(VM *vm) {
+    if (!vm->markerRunning)
+        return;
+    pthread_join(vm->marker, nullptr);
+    vm->markerRunning = false;
+    for (int i = 0; i < vm->retiredCount; i++) {
+        free(vm->retired[i]);
+    }
+    vm->retiredCount = 0;
+}
+
+// Ends the marking in one pause. The roots, the objects that are always
+// remembered and the young ones all change without barriers, so they are
+// traced again; the young survivors are then promoted, still marked, and the
+// pages left for collectStep() or the allocator to sweep.
+static void finishMarking(VM *vm) {
+    stopMarker(vm);
+    vm->gcPhase = GC_SWEEPING;
+    markRoots(vm);
+    for (int i = 0; i < vm->rememberedCount; i++) {
+        blackenObject(vm, vm->remembered[i]);
+    }
+    traceReferences(vm);
+    tableRemoveWhite(&vm->strings);
+    forgetRemembered(vm, true);
+    sweepYoung(vm, true);
+    // Every page is now swept afresh, so the cells on the free lists will be
+    // found again there.
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        vm->unswept[i] = vm->pages[i];
+        vm->pages[i] = nullptr;
+        vm->freeCells[i] = nullptr;
+    }
+}
+
+// Blackens up to `work` gray objects and returns whether any are left.
+static bool markSome(VM *vm, int work) {
+    while (vm->grayCount > 0 && work-- > 0) {
+        blackenObject(vm, vm->grayStack[--vm->grayCount]);
+    }
+    return vm->grayCount > 0;
+}
+
+// Sweeps up to `work` pages and returns whether any are left.
+static bool sweepSome(VM *vm, int work) {
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        while (vm->unswept[i] != nullptr) {
+            if (work-- == 0)
+                return true;
+            sweepNextPage(vm, i);
         }
     }
+    return false;
+}
+
+static void finishCollection(VM *vm) {
+    if (vm->gcPhase == GC_MARKING)
+        finishMarking(vm);
+    sweepSome(vm, INT_MAX);
+    vm->gcPhase = GC_IDLE;
+    vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
 }
 
-void collectGarbage() {
+void beginCollection(VM *vm) {
+    if (vm->gcPause == 0 && !vm->gcConcurrent) {
+        collectGarbage(vm);
+        return;
+    }
+    double start = now();
+    vm->gcPhase = GC_MARKING;
+    vm->stepBytes = 0;
+    vm->majorCollections++;
+    markRoots(vm);
+    // Without a thread the marking goes on a step at a time instead. A
+    // struct Value can't be stored atomically, see storeValue().
+#ifdef NAN_BOXING
+    if (vm->gcConcurrent) {
+        vm->markerDone = false;
+        vm->markerRunning =
+            pthread_create(&vm->marker, nullptr, markConcurrently, vm) == 0;
+    }
+#endif
+    endPause(vm, start);
+}
+
+void collectStep(VM *vm) {
+    vm->stepBytes = 0;
+    if (vm->markerRunning &&
+        !__atomic_load_n(&vm->markerDone, __ATOMIC_ACQUIRE))
+        return;
+    double start = now();
+    do {
+        if (vm->gcPhase == GC_MARKING) {
+            if (!markSome(vm, GC_STEP_WORK))
+                finishMarking(vm);
+        } else if (!sweepSome(vm, 1)) {
+            finishCollection(vm);
+        }
+#ifdef DEBUG_STRESS_GC
+        // The smallest steps interleave the most with the program.
+        break;
+#endif
+    } while (vm->gcPhase != GC_IDLE &&
+             (vm->gcPause == 0 || now() - start < vm->gcPause / 1e6));
+    endPause(vm, start);
+}
+
+void collectGarbage(VM *vm) {
 #ifdef DEBUG_LOG_GC
     printf("-- gc begin\n");
-    size_t before = vm.bytesAllocated;
+    size_t before = vm->bytesAllocated;
 #endif
 
-    markRoots();
-    traceReferences();
-    tableRemoveWhite(&vm.strings);
-    sweep();
-
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    double start = now();
+    if (vm->gcPhase != GC_IDLE)
+        finishCollection(vm);
+    vm->gcPhase = GC_MARKING;
+    vm->majorCollections++;
+    finishCollection(vm);
+    endPause(vm, start);
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
     printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-           before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+           before - vm->bytesAllocated, before, vm->bytesAllocated, vm->nextGC);
 #endif
 }
 
-void freeObjects() {
-    Obj *object = vm.objects;
-    while (object != nullptr) {
-        Obj *next = object->next;
-        freeObject(object);
-        object = next;
+void collectYoung(VM *vm) {
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin\n");
+    size_t before = vm->bytesAllocated;
+#endif
+
+    double start = now();
+    if (vm->gcPhase == GC_MARKING) {
+        // The remark collects the young objects as well.
+        finishMarking(vm);
+        endPause(vm, start);
+        return;
+    }
+    vm->collectingYoung = true;
+    markRoots(vm);
+    for (int i = 0; i < vm->rememberedCount; i++) {
+        blackenObject(vm, vm->remembered[i]);
+    }
+    traceReferences(vm);
+    vm->collectingYoung = false;
+    forgetRemembered(vm, false);
+    sweepYoung(vm, false);
+    vm->minorCollections++;
+    endPause(vm, start);
+
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu)\n",
+           before - vm->bytesAllocated, before, vm->bytesAllocated);
+#endif
+}
+
+static void freePages(VM *vm, Page *page) {
+    while (page != nullptr) {
+        Page *next = page->next;
+        for (size_t i = 0; i < cellCount(page->sizeClass); i++) {
+            Obj *object = pageCell(page, i);
+            if (testBit(page->allocated, cellBit(object)))
+                freeObject(vm, object);
+        }
+        // The mapping may come back as anything else, with no poison on it.
+        ASAN_UNPOISON_MEMORY_REGION(page, POOL_PAGE_SIZE);
+        munmap(page, POOL_PAGE_SIZE);
+        page = next;
+    }
+}
+
+void freeObjects(VM *vm) {
+    stopMarker(vm);
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        freePages(vm, vm->pages[i]);
+        freePages(vm, vm->unswept[i]);
+    }
+    free(vm->youngPages);
+    free(vm->grayStack);
+    free(vm->remembered);
+    free(vm->retired);
+}
+
+Obj **heapObjects(VM *vm, uint32_t *count) {
+    *count = 0;
+    size_t capacity = 0;
+    Obj **objects = nullptr;
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        for (int list = 0; list < 2; list++) {
+            Page *page = list == 0 ? vm->pages[i] : vm->unswept[i];
+            for (; page != nullptr; page = page->next) {
+                for (size_t j = 0; j < cellCount(i); j++) {
+                    Obj *object = pageCell(page, j);
+                    if (!testBit(page->allocated, cellBit(object)))
+                        continue;
+                    if (*count == capacity) {
+                        capacity = GROW_CAPACITY(capacity);
+                        objects = (Obj **) realloc(objects,
+                                                   sizeof(Obj *) * capacity);
+                        if (objects == nullptr)
+                            exit(1);
+                    }
+                    objects[(*count)++] = object;
+                }
+            }
+        }
     }
-    free(vm.grayStack);
+    return objects;
 }
 
 void initFileStream(FileStream *fs) {
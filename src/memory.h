@@ -1,22 +1,78 @@
 #ifndef MEMORY_H
 #define MEMORY_H
 #include "common.h"
+#include "object.h"
 #include "value.h"
+#include "vm.h"
 
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity) * 2)
-#define GROW_ARRAY(type, pointer, oldCount, newCount)                          \
-    (type *) reallocate((pointer), sizeof(type) * (oldCount),                  \
+#define GROW_ARRAY(vm, type, pointer, oldCount, newCount)                      \
+    (type *) reallocate((vm), (pointer), sizeof(type) * (oldCount),            \
                         sizeof(type) * (newCount))
-#define FREE_ARRAY(type, pointer, oldCount)                                    \
-    reallocate(pointer, sizeof(type) * oldCount, 0)
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
-#define ALLOCATE(type, count) (type*) reallocate(nullptr, 0, sizeof(type) * (count))
-
-void *reallocate(void *pointer, size_t oldSize, size_t newSize);
-void markObject(Obj* object);
-void markValue(Value value);
-void collectGarbage();
-void freeObjects();
+#define FREE_ARRAY(vm, type, pointer, oldCount)                                \
+    reallocate((vm), pointer, sizeof(type) * oldCount, 0)
+#define FREE(vm, type, pointer) reallocate((vm), pointer, sizeof(type), 0)
+#define FREE_OBJ(vm, type, pointer) freeCell((vm), pointer, sizeof(type))
+#define ALLOCATE(vm, type, count)                                              \
+    (type *) reallocate((vm), nullptr, 0, sizeof(type) * (count))
+
+// The default for vm.gcPause, in microseconds.
+#define GC_PAUSE_DEFAULT 1000
+
+void *reallocate(VM *vm, void *pointer, size_t oldSize, size_t newSize);
+// Objects are allocated from size-class pools and must be freed with the
+// size they were given. A new one is young until a collection promotes it.
+void *allocateCell(VM *vm, size_t size);
+void freeCell(VM *vm, void *pointer, size_t size);
+// Returns every object in the heap in a new array the caller frees. After
+// collectGarbage() that is every live object.
+Obj **heapObjects(VM *vm, uint32_t *count);
+void markObject(VM *vm, Obj* object);
+void markValue(VM *vm, Value value);
+// Collects the whole heap before returning, finishing any collection that
+// was under way first.
+void collectGarbage(VM *vm);
+// Marks the roots for a full collection that collectStep() then carries on
+// with a little at a time as the program allocates. With vm.gcConcurrent
+// another thread does the marking, and collectStep() only finishes it.
+void beginCollection(VM *vm);
+void collectStep(VM *vm);
+// Frees the young objects nothing reaches and promotes the rest.
+void collectYoung(VM *vm);
+void rememberObject(VM *vm, Obj *object);
+void freeObjects(VM *vm);
+
+static inline Page *pageOf(Obj *object) {
+    return (Page *) ((uintptr_t) object & ~(uintptr_t) (POOL_PAGE_SIZE - 1));
+}
+
+// The index of the bit for `object` in its page's bitmaps.
+static inline size_t cellBit(Obj *object) {
+    return ((uintptr_t) object & (POOL_PAGE_SIZE - 1)) / POOL_GRANULE;
+}
+
+static inline bool isMarked(Obj *object) {
+    size_t bit = cellBit(object);
+    return (pageOf(object)->marks[bit / 64] >> (bit % 64)) & 1;
+}
+
+// Follows a store of `value` into `object` once the object exists. A minor
+// collection needs to see the young objects only old ones point at, and
+// a full one that is marking traces the old objects that changed again at
+// the remark; the remembered set holds both.
+static inline void writeBarrier(VM *vm, Obj *object, Value value) {
+    if (!object->isOld || !IS_OBJ(value) || object->isRemembered)
+        return;
+    if (!AS_OBJ(value)->isOld || vm->gcPhase == GC_MARKING)
+        rememberObject(vm, object);
+}
+
+// Follows values moving around inside `object`, as when a list shifts its
+// elements, which the marker thread could otherwise miss mid-move.
+static inline void moveBarrier(VM *vm, Obj *object) {
+    if (object->isOld && !object->isRemembered && vm->gcPhase == GC_MARKING)
+        rememberObject(vm, object);
+}
 
 typedef struct {
     char *buf;
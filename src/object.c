@@ -14,16 +14,14 @@ const char *const ObjType_String[] = {
 #undef X
 };
 
-#define ALLOCATE_OBJ(type, objectType)                                         \
-    (type *) allocateObject(sizeof(type), objectType)
+#define ALLOCATE_OBJ(vm, type, objectType)                                     \
+    (type *) allocateObject((vm), sizeof(type), objectType)
 
-static Obj *allocateObject(size_t size, ObjType type) {
-    Obj *object = (Obj *) reallocate(nullptr, 0, size);
+static Obj *allocateObject(VM *vm, size_t size, ObjType type) {
+    Obj *object = (Obj *) allocateCell(vm, size);
     object->type = type;
-    object->isMarked = false;
-
-    object->next = vm.objects;
-    vm.objects = object;
+    object->isOld = false;
+    object->isRemembered = false;
 
 #ifdef DEBUG_LOG_GC
     fprintf(fout, "%p allocate %zu for %s\n", (void *) object, size,
@@ -33,40 +31,46 @@ static Obj *allocateObject(size_t size, ObjType type) {
     return object;
 }
 
-ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method) {
-    ObjBoundMethod *bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
+ObjBoundMethod *newBoundMethod(VM *vm, Value receiver, ObjClosure *method) {
+    ObjBoundMethod *bound = ALLOCATE_OBJ(vm, ObjBoundMethod, OBJ_BOUND_METHOD);
     bound->receiver = receiver;
     bound->method = method;
     return bound;
 }
 
-ObjClass *newClass(ObjString *name) {
-    ObjClass *class = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
+ObjClass *newClass(VM *vm, ObjString *name) {
+    ObjClass *class = ALLOCATE_OBJ(vm, ObjClass, OBJ_CLASS);
     class->name = name;
+    class->rootShape = nullptr;
+    class->slotHint = 0;
     initTable(&class->methods);
+    push(vm, OBJ_VAL(class));
+    class->rootShape = newShape(vm);
+    pop(vm);
     return class;
 }
 
-ObjClosure *newClosure(ObjFunction *function) {
-    ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue *, function->upvalueCount);
+ObjClosure *newClosure(VM *vm, ObjFunction *function) {
+    ObjUpvalue **upvalues = ALLOCATE(vm, ObjUpvalue *, function->upvalueCount);
     for (int i = 0; i < function->upvalueCount; i++) {
         upvalues[i] = nullptr;
     }
-    ObjClosure *closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+    ObjClosure *closure = ALLOCATE_OBJ(vm, ObjClosure, OBJ_CLOSURE);
     closure->function = function;
     closure->upvalues = upvalues;
     closure->upvalueCount = function->upvalueCount;
     return closure;
 }
 
-static ObjString *allocateString(char *chars, int length, uint32_t hash) {
-    ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+static ObjString *allocateString(VM *vm, char *chars, int length,
+                                 uint32_t hash) {
+    ObjString *string = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
     string->length = length;
     string->chars = chars;
     string->hash = hash;
-    push(OBJ_VAL(string));
-    tableSet(&vm.strings, string, NIL_VAL);
-    pop();
+    push(vm, OBJ_VAL(string));
+    tableSet(vm, &vm->strings, string, NIL_VAL);
+    pop(vm);
 
     return string;
 }
@@ -81,19 +85,19 @@ static uint32_t hashString(const char *key, int length) {
     return hash;
 }
 
-ObjString *copyString(const char *chars, int length) {
+ObjString *copyString(VM *vm, const char *chars, int length) {
     uint32_t hash = hashString(chars, length);
-    ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString *interned = tableFindString(&vm->strings, chars, length, hash);
     if (interned != nullptr)
         return interned;
-    char *heapChars = ALLOCATE(char, length + 1);
+    char *heapChars = ALLOCATE(vm, char, length + 1);
     memcpy(heapChars, chars, length);
     heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+    return allocateString(vm, heapChars, length, hash);
 }
 
-ObjUpvalue *newUpvalue(Value *slot) {
-    ObjUpvalue *upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+ObjUpvalue *newUpvalue(VM *vm, Value *slot) {
+    ObjUpvalue *upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, OBJ_UPVALUE);
     upvalue->closed = NIL_VAL;
     upvalue->location = slot;
     upvalue->next = nullptr;
@@ -153,50 +157,163 @@ void printObject(FILE *fout, Value value) {
             break;
         }
         case OBJ_NATIVE: fprintf(fout, "<native fn>"); break;
+        case OBJ_SHAPE: fprintf(fout, "shape"); break;
         case OBJ_STRING: fprintf(fout, "%s", AS_CSTRING(value)); break;
     }
 }
 
-ObjMap *newMap() {
-    ObjMap *map = ALLOCATE_OBJ(ObjMap, OBJ_MAP);
+ObjMap *newMap(VM *vm) {
+    ObjMap *map = ALLOCATE_OBJ(vm, ObjMap, OBJ_MAP);
     initTable(&map->table);
     return map;
 }
 
-ObjList *newList() {
-    ObjList *list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
+ObjList *newList(VM *vm) {
+    ObjList *list = ALLOCATE_OBJ(vm, ObjList, OBJ_LIST);
     initValueArray(&list->elements);
     return list;
 }
 
-ObjFunction *newFunction() {
-    ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+ObjFunction *newFunction(VM *vm) {
+    ObjFunction *function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
+    function->maxSlots = 0;
     function->name = nullptr;
+    function->hotness = 0;
+    function->jitCode = nullptr;
+    function->loops = nullptr;
+    function->lazy = nullptr;
     initChunk(&function->chunk);
     return function;
 }
 
-ObjInstance *newInstance(ObjClass *class) {
-    ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+void freeLazyFunction(VM *vm, ObjFunction *function) {
+    LazyFunction *lazy = function->lazy;
+    if (lazy == nullptr) return;
+    FREE_ARRAY(vm, ObjString *, lazy->upvalueNames, function->upvalueCount);
+    FREE(vm, LazyFunction, lazy);
+    function->lazy = nullptr;
+}
+
+ObjInstance *newInstance(VM *vm, ObjClass *class) {
+    int capacity = class->slotHint;
+    ObjInstance *instance = (ObjInstance *) allocateObject(vm, 
+        sizeof(ObjInstance) + sizeof(Value) * capacity, OBJ_INSTANCE);
     instance->class = class;
-    initTable(&instance->fields);
+    instance->shape = class->rootShape;
+    instance->fields = instance->inlineFields;
+    instance->fieldCapacity = capacity;
+    instance->inlineCapacity = capacity;
     return instance;
 }
 
-ObjNative *newNative(NativeFn function) {
-    ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+ObjShape *newShape(VM *vm) {
+    ObjShape *shape = ALLOCATE_OBJ(vm, ObjShape, OBJ_SHAPE);
+    shape->slotCount = 0;
+    shape->isDictionary = false;
+    initTable(&shape->slots);
+    initTable(&shape->transitions);
+    return shape;
+}
+
+// Returns the shape that has every slot of `shape` plus `name` as the next
+// slot. Shared shapes are reused through their transition table; dictionary
+// shapes belong to a single instance and are extended in place.
+static ObjShape *addSlot(VM *vm, ObjShape *shape, ObjString *name) {
+    if (shape->isDictionary) {
+        tableSet(vm, &shape->slots, name, NUMBER_VAL(shape->slotCount));
+        // The marker thread may be reading this shape, so the count goes up
+        // only once the caller has stored the new field.
+        __atomic_store_n(&shape->slotCount, shape->slotCount + 1,
+                         __ATOMIC_RELEASE);
+        return shape;
+    }
+
+    Value next;
+    if (tableGet(&shape->transitions, name, &next)) {
+        return AS_SHAPE(next);
+    }
+
+    ObjShape *child = newShape(vm);
+    push(vm, OBJ_VAL(child));
+    tableAddAll(vm, &shape->slots, &child->slots);
+    tableSet(vm, &child->slots, name, NUMBER_VAL(shape->slotCount));
+    child->slotCount = shape->slotCount + 1;
+    if (child->slotCount > SHAPE_MAX_SLOTS) {
+        child->isDictionary = true;
+    } else {
+        tableSet(vm, &shape->transitions, name, OBJ_VAL(child));
+    }
+    pop(vm);
+    return child;
+}
+
+int shapeSlot(ObjShape *shape, ObjString *name) {
+    Value slot;
+    if (!tableGet(&shape->slots, name, &slot)) {
+        return -1;
+    }
+    return (int) AS_NUMBER(slot);
+}
+
+bool getField(ObjInstance *instance, ObjString *name, Value *value) {
+    int slot = shapeSlot(instance->shape, name);
+    if (slot < 0) {
+        return false;
+    }
+    *value = instance->fields[slot];
+    return true;
+}
+
+// The caller must keep `value` reachable, since adding a field can allocate.
+void setField(VM *vm, ObjInstance *instance, ObjString *name, Value value) {
+    Value slot;
+    if (tableGet(&instance->shape->slots, name, &slot)) {
+        storeValue(&instance->fields[(int) AS_NUMBER(slot)], value);
+        writeBarrier(vm, (Obj *) instance, value);
+        return;
+    }
+
+    int index = instance->shape->slotCount;
+    if (index == instance->fieldCapacity) {
+        int capacity = GROW_CAPACITY(instance->fieldCapacity);
+        Value *fields = ALLOCATE(vm, Value, capacity);
+        memcpy(fields, instance->fields, sizeof(Value) * index);
+        if (instance->fields != instance->inlineFields) {
+            FREE_ARRAY(vm, Value, instance->fields, instance->fieldCapacity);
+        }
+        __atomic_store_n(&instance->fields, fields, __ATOMIC_RELEASE);
+        instance->fieldCapacity = capacity;
+    }
+
+    // The marker thread reads the shape and its slot count, then the fields
+    // they cover, so the field is stored before either changes.
+    storeValue(&instance->fields[index], value);
+    ObjShape *shape = addSlot(vm, instance->shape, name);
+    __atomic_store_n(&instance->shape, shape, __ATOMIC_RELEASE);
+    writeBarrier(vm, (Obj *) instance, value);
+    writeBarrier(vm, (Obj *) instance, OBJ_VAL(shape));
+
+    ObjClass *class = instance->class;
+    if (shape->slotCount > class->slotHint &&
+        shape->slotCount <= SHAPE_MAX_SLOTS) {
+        class->slotHint = shape->slotCount;
+    }
+}
+
+ObjNative *newNative(VM *vm, NativeFn function) {
+    ObjNative *native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
     native->function = function;
     return native;
 }
 
-ObjString *takeString(char *chars, int length) {
+ObjString *takeString(VM *vm, char *chars, int length) {
     uint32_t hash = hashString(chars, length);
-    ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString *interned = tableFindString(&vm->strings, chars, length, hash);
     if (interned != nullptr) {
-        FREE_ARRAY(char, chars, length + 1);
+        FREE_ARRAY(vm, char, chars, length + 1);
         return interned;
     }
-    return allocateString(chars, length, hash);
+    return allocateString(vm, chars, length, hash);
 }
@@ -16,6 +16,7 @@
 #define IS_LIST(value) isObjType((value), OBJ_LIST)
 #define IS_MAP(value) isObjType((value), OBJ_MAP)
 #define IS_NATIVE(value) isObjType((value), OBJ_NATIVE)
+#define IS_SHAPE(value) isObjType((value), OBJ_SHAPE)
 #define IS_STRING(value) isObjType((value), OBJ_STRING)
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod *) AS_OBJ(value))
@@ -26,6 +27,7 @@
 #define AS_INSTANCE(value) ((ObjInstance *) AS_OBJ(value))
 #define AS_MAP(value) ((ObjMap *) AS_OBJ(value))
 #define AS_NATIVE(value) (((ObjNative *) AS_OBJ(value))->function)
+#define AS_SHAPE(value) ((ObjShape *) AS_OBJ(value))
 #define AS_STRING(value) ((ObjString *) AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *) AS_OBJ(value))->chars)
 
@@ -39,6 +41,7 @@
     X(OBJ_LIST)                                                                \
     X(OBJ_MAP)                                                                 \
     X(OBJ_NATIVE)                                                              \
+    X(OBJ_SHAPE)                                                               \
     X(OBJ_STRING)
 
 typedef enum {
@@ -47,21 +50,49 @@ typedef enum {
 #undef X
 } ObjType;
 
+// Mark bits live in the page the object is in; see isMarked().
 struct Obj {
     ObjType type;
-    bool isMarked;
-    struct Obj *next;
+    bool isOld;        // has survived a collection
+    bool isRemembered; // is in vm->remembered
 };
 
+typedef struct JitCode JitCode;
+typedef struct TraceLoop TraceLoop;
+
+// A function whose body the compiler skipped, kept as source until its first
+// call compiles it.
+typedef struct {
+    ObjString *source; // the whole script it came from
+    int offset;        // of its parameter list in source
+    int line;
+    uint8_t type;      // the compiler's FunctionType
+    bool inClass;
+    bool hasSuperclass;
+    // What each upvalue is called where the function was defined.
+    ObjString **upvalueNames;
+} LazyFunction;
+
 typedef struct {
     Obj obj;
     int arity;
     int upvalueCount;
+    // Stack slots a frame of this function can use, including the callee and
+    // arguments; call() makes sure they exist before the frame runs.
+    int maxSlots;
     Chunk chunk;
     ObjString *name;
+    // Calls plus loop back edges, counted until the function is hot enough
+    // to compile. jitCode stays null when the JIT is off or not built.
+    int hotness;
+    JitCode *jitCode;
+    // Loops the tracing JIT has seen in this function, keyed by header.
+    TraceLoop *loops;
+    // Set until the body is compiled, with the chunk still empty.
+    LazyFunction *lazy;
 } ObjFunction;
 
-typedef Value (*NativeFn)(int argCount, const Value *args);
+typedef Value (*NativeFn)(VM *vm, int argCount, const Value *args);
 
 typedef struct {
     Obj obj;
@@ -89,16 +120,37 @@ typedef struct {
     int upvalueCount;
 } ObjClosure;
 
+// Instances whose shape would grow past this many fields stop sharing shapes
+// and get a private, mutable dictionary shape instead.
+#define SHAPE_MAX_SLOTS 32
+
+// A shape maps field names to slot indices. Instances that gained the same
+// fields in the same order share one shape, found by following transitions
+// from their class's root shape.
+typedef struct ObjShape {
+    Obj obj;
+    Table slots;       // field name -> slot index
+    Table transitions; // field name -> shape with that field appended
+    int slotCount;
+    bool isDictionary;
+} ObjShape;
+
 typedef struct {
     Obj obj;
     ObjString *name;
     Table methods;
+    ObjShape *rootShape;
+    int slotHint; // field count new instances reserve inline storage for
 } ObjClass;
 
 typedef struct {
     Obj obj;
     ObjClass *class;
-    Table fields;
+    ObjShape *shape;
+    Value *fields; // points at inlineFields until it outgrows them
+    int fieldCapacity;
+    int inlineCapacity;
+    Value inlineFields[];
 } ObjInstance;
 
 typedef struct {
@@ -117,17 +169,22 @@ typedef struct {
     Table table;
 } ObjMap;
 
-ObjList *newList();
-ObjMap *newMap();
-ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method);
-ObjInstance *newInstance(ObjClass *class);
-ObjClass *newClass(ObjString *name);
-ObjClosure *newClosure(ObjFunction *function);
-ObjFunction *newFunction();
-ObjNative *newNative(NativeFn function);
-ObjString *copyString(const char *chars, int length);
-ObjUpvalue *newUpvalue(Value *slot);
-ObjString *takeString(char *chars, int length);
+ObjList *newList(VM *vm);
+ObjMap *newMap(VM *vm);
+ObjBoundMethod *newBoundMethod(VM *vm, Value receiver, ObjClosure *method);
+ObjInstance *newInstance(VM *vm, ObjClass *class);
+ObjClass *newClass(VM *vm, ObjString *name);
+ObjClosure *newClosure(VM *vm, ObjFunction *function);
+ObjFunction *newFunction(VM *vm);
+void freeLazyFunction(VM *vm, ObjFunction *function);
+ObjNative *newNative(VM *vm, NativeFn function);
+ObjShape *newShape(VM *vm);
+int shapeSlot(ObjShape *shape, ObjString *name);
+bool getField(ObjInstance *instance, ObjString *name, Value *value);
+void setField(VM *vm, ObjInstance *instance, ObjString *name, Value value);
+ObjString *copyString(VM *vm, const char *chars, int length);
+ObjUpvalue *newUpvalue(VM *vm, Value *slot);
+ObjString *takeString(VM *vm, char *chars, int length);
 void printObject(FILE *fout, Value value);
 
 static inline bool isObjType(Value value, ObjType type) {
@@ -0,0 +1,372 @@
+// Peephole optimization of finished chunks. The code is decoded into a list
+// of instructions whose jumps name the instruction they land on, rewritten
+// until nothing changes, and encoded back with the jumps relocated. Every
+// rewrite leaves the code no longer than it was, so a jump that fit before
+// still fits.
+#include "peephole.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    uint8_t op;
+    int offset; // in the original code
+    int length;
+    int line;   // of its last byte, which is what runtime errors report
+    int target; // instruction a jump lands on, or -1
+    bool removed;
+    bool targeted;
+} Instruction;
+
+typedef struct {
+    Instruction *instructions;
+    int count;
+} Program;
+
+static bool isForwardJump(uint8_t op) {
+    switch (op) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_NOT_LESS: return true;
+        default: return false;
+    }
+}
+
+// Pushes a value without running any code that could fail.
+static bool isPurePush(uint8_t op) {
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE: return true;
+        default: return false;
+    }
+}
+
+static bool isReturn(uint8_t op) {
+    return op == OP_RETURN || op == OP_RETURN_NIL;
+}
+
+static void decode(const Chunk *chunk, Program *program) {
+    int *indices = malloc(sizeof(int) * (size_t) chunk->count);
+    program->instructions =
+        malloc(sizeof(Instruction) * (size_t) (chunk->count + 1));
+    if (indices == nullptr || program->instructions == nullptr) exit(1);
+
+    int count = 0;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        Instruction *instruction = &program->instructions[count];
+        instruction->op = chunk->code[offset];
+        instruction->offset = offset;
+        instruction->length = instructionLength(chunk, offset);
+        instruction->line = chunk->lines[offset + instruction->length - 1];
+        instruction->target = jumpTarget(chunk, offset);
+        instruction->removed = false;
+        indices[offset] = count++;
+    }
+    for (int i = 0; i < count; i++) {
+        Instruction *instruction = &program->instructions[i];
+        if (instruction->target >= 0) {
+            instruction->target = indices[instruction->target];
+        }
+    }
+    // Stands for the end of the code when no instruction is left after one.
+    program->instructions[count] =
+        (Instruction){OP_RETURN_NIL, chunk->count, 1, 0, -1, false, false};
+    program->count = count;
+    free(indices);
+}
+
+// The first instruction still there at or after `index`, or the count.
+static int live(const Program *program, int index) {
+    while (index < program->count && program->instructions[index].removed) {
+        index++;
+    }
+    return index;
+}
+
+static void markTargets(Program *program) {
+    for (int i = 0; i < program->count; i++) {
+        program->instructions[i].targeted = false;
+    }
+    for (int i = 0; i < program->count; i++) {
+        Instruction *instruction = &program->instructions[i];
+        if (!instruction->removed && instruction->target >= 0) {
+            program->instructions[live(program, instruction->target)]
+                .targeted = true;
+        }
+    }
+}
+
+// A jump to a removed instruction lands on the next one still there.
+static void removeInstruction(Program *program, int index) {
+    Instruction *instruction = &program->instructions[index];
+    instruction->removed = true;
+    if (instruction->targeted) {
+        program->instructions[live(program, index)].targeted = true;
+    }
+}
+
+static void becomeJump(Instruction *instruction, uint8_t op) {
+    instruction->op = op;
+    instruction->length = 3;
+}
+
+static bool isComparison(uint8_t op) {
+    return op == OP_EQUAL || op == OP_GREATER || op == OP_LESS;
+}
+
+// The jump that consumes a comparison's operands, taken when the comparison
+// comes out `whenTrue`.
+static uint8_t comparisonJump(uint8_t comparison, bool whenTrue) {
+    switch (comparison) {
+        case OP_EQUAL:
+            return whenTrue ? OP_JUMP_IF_EQUAL : OP_JUMP_IF_NOT_EQUAL;
+        case OP_GREATER:
+            return whenTrue ? OP_JUMP_IF_GREATER : OP_JUMP_IF_NOT_GREATER;
+        default: return whenTrue ? OP_JUMP_IF_LESS : OP_JUMP_IF_NOT_LESS;
+    }
+}
+
+// Rewrites pairs of adjacent instructions, provided nothing jumps between
+// them. A jump to the first of a pair that becomes one instruction lands on
+// that instruction, which does what the pair did.
+static bool combinePairs(Program *program) {
+    bool changed = false;
+    markTargets(program);
+    for (int i = live(program, 0); i < program->count;) {
+        Instruction *first = &program->instructions[i];
+        int j = live(program, i + 1);
+        if (j == program->count) break;
+        Instruction *second = &program->instructions[j];
+        if (second->targeted) {
+            i = j;
+            continue;
+        }
+
+        bool popped = second->op == OP_POP_JUMP_IF_FALSE ||
+                      second->op == OP_POP_JUMP_IF_TRUE;
+        bool whenTrue = second->op == OP_POP_JUMP_IF_TRUE;
+        if (isPurePush(first->op) && second->op == OP_POP) {
+            removeInstruction(program, i);
+            removeInstruction(program, j);
+            i = live(program, j);
+            changed = true;
+            continue;
+        }
+        if (first->op == OP_NOT && popped) {
+            second->op = whenTrue ? OP_POP_JUMP_IF_FALSE : OP_POP_JUMP_IF_TRUE;
+            removeInstruction(program, i);
+            i = j;
+            changed = true;
+            continue;
+        }
+        if (isComparison(first->op) && popped) {
+            // The fused jump fails where the comparison did.
+            becomeJump(second, comparisonJump(first->op, whenTrue));
+            second->line = first->line;
+            removeInstruction(program, i);
+            i = j;
+            changed = true;
+            continue;
+        }
+        if ((first->op == OP_TRUE || first->op == OP_FALSE ||
+             first->op == OP_NIL || first->op == OP_CONSTANT) &&
+            popped) {
+            // A literal condition: the constant table only holds numbers,
+            // strings and functions, which are all truthy.
+            bool truthy = first->op == OP_TRUE || first->op == OP_CONSTANT;
+            if (truthy == whenTrue) {
+                becomeJump(second, OP_JUMP);
+            } else {
+                removeInstruction(program, j);
+            }
+            removeInstruction(program, i);
+            i = live(program, j);
+            changed = true;
+            continue;
+        }
+        i = j;
+    }
+    return changed;
+}
+
+// Sends each forward jump to where the chain of jumps it starts ends up.
+// An unconditional one to a return or a loop's back edge becomes a copy of
+// it, and one to the very next instruction goes away.
+static bool threadJumps(Program *program) {
+    bool changed = false;
+    for (int i = 0; i < program->count; i++) {
+        Instruction *jump = &program->instructions[i];
+        if (jump->removed) continue;
+        if (jump->op == OP_LOOP) {
+            // A back edge to a jump past it, as a rotated for loop has
+            // before its body, goes there directly.
+            Instruction *landing =
+                &program->instructions[live(program, jump->target)];
+            if (landing->op == OP_JUMP &&
+                live(program, landing->target) > i) {
+                jump->op = OP_JUMP;
+                jump->target = live(program, landing->target);
+                changed = true;
+            }
+        }
+        if (!isForwardJump(jump->op)) continue;
+
+        int target = live(program, jump->target);
+        for (int steps = 0; steps < program->count; steps++) {
+            Instruction *next = &program->instructions[target];
+            int after = next->target >= 0 ? live(program, next->target) : -1;
+            // Back edges may be followed as long as they still lead forward
+            // from the jump, as the one at the end of an empty loop body
+            // does. A jump that keeps its falsey condition takes the next one
+            // too.
+            if (next->op != OP_JUMP && (next->op != OP_LOOP || after <= i) &&
+                (jump->op != OP_JUMP_IF_FALSE ||
+                 next->op != OP_JUMP_IF_FALSE)) {
+                break;
+            }
+            target = after;
+        }
+        if (target != jump->target) {
+            jump->target = target;
+            changed = true;
+        }
+
+        Instruction *landing = &program->instructions[target];
+        if (target == live(program, i + 1) &&
+            (jump->op == OP_JUMP || jump->op == OP_JUMP_IF_FALSE)) {
+            removeInstruction(program, i);
+            changed = true;
+        } else if (target == live(program, i + 1) &&
+                   (jump->op == OP_POP_JUMP_IF_FALSE ||
+                    jump->op == OP_POP_JUMP_IF_TRUE)) {
+            jump->op = OP_POP;
+            jump->length = 1;
+            jump->target = -1;
+            changed = true;
+        } else if (jump->op == OP_JUMP && isReturn(landing->op)) {
+            jump->op = landing->op;
+            jump->length = 1;
+            jump->target = -1;
+            changed = true;
+        } else if (jump->op == OP_JUMP && landing->op == OP_LOOP &&
+                   live(program, landing->target) <= i) {
+            jump->op = OP_LOOP;
+            jump->target = live(program, landing->target);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+// Removes everything no path from the first instruction reaches, like the
+// implicit return after an explicit one.
+static bool removeUnreachable(Program *program) {
+    bool *reached = calloc((size_t) program->count + 1, sizeof(bool));
+    int *worklist = malloc(sizeof(int) * (size_t) (program->count + 1));
+    if (reached == nullptr || worklist == nullptr) exit(1);
+
+    int pending = 0;
+    int start = live(program, 0);
+    reached[start] = true;
+    worklist[pending++] = start;
+    while (pending > 0) {
+        int i = worklist[--pending];
+        if (i == program->count) continue;
+        Instruction *instruction = &program->instructions[i];
+        int successors[2];
+        int successorCount = 0;
+        if (instruction->target >= 0) {
+            successors[successorCount++] = live(program, instruction->target);
+        }
+        if (instruction->op != OP_JUMP && instruction->op != OP_LOOP &&
+            !isReturn(instruction->op)) {
+            successors[successorCount++] = live(program, i + 1);
+        }
+        for (int s = 0; s < successorCount; s++) {
+            if (reached[successors[s]]) continue;
+            reached[successors[s]] = true;
+            worklist[pending++] = successors[s];
+        }
+    }
+
+    bool changed = false;
+    for (int i = 0; i < program->count; i++) {
+        if (!program->instructions[i].removed && !reached[i]) {
+            program->instructions[i].removed = true;
+            changed = true;
+        }
+    }
+    free(reached);
+    free(worklist);
+    return changed;
+}
+
+static void encode(Chunk *chunk, const Program *program) {
+    int *offsets = malloc(sizeof(int) * (size_t) (program->count + 1));
+    uint8_t *code = malloc((size_t) chunk->count);
+    int *lines = malloc(sizeof(int) * (size_t) chunk->count);
+    if (offsets == nullptr || code == nullptr || lines == nullptr) exit(1);
+
+    int count = 0;
+    for (int i = 0; i < program->count; i++) {
+        offsets[i] = count;
+        if (!program->instructions[i].removed) {
+            count += program->instructions[i].length;
+        }
+    }
+    offsets[program->count] = count;
+
+    for (int i = 0; i < program->count; i++) {
+        const Instruction *instruction = &program->instructions[i];
+        if (instruction->removed) continue;
+        int offset = offsets[i];
+        code[offset] = instruction->op;
+        if (instruction->target >= 0) {
+            int target = offsets[live(program, instruction->target)];
+            int jump = instruction->op == OP_LOOP ? offset + 3 - target
+                                                  : target - offset - 3;
+            code[offset + 1] = (uint8_t) ((jump >> 8) & 0xFF);
+            code[offset + 2] = (uint8_t) (jump & 0xFF);
+        } else {
+            memcpy(&code[offset + 1], &chunk->code[instruction->offset + 1],
+                   (size_t) instruction->length - 1);
+        }
+        for (int b = 0; b < instruction->length; b++) {
+            lines[offset + b] = instruction->line;
+        }
+    }
+
+    memcpy(chunk->code, code, (size_t) count);
+    memcpy(chunk->lines, lines, sizeof(int) * (size_t) count);
+    chunk->count = count;
+    free(offsets);
+    free(code);
+    free(lines);
+}
+
+void optimizeChunk(Chunk *chunk) {
+    if (chunk->count == 0) return;
+    Program program;
+    decode(chunk, &program);
+    bool changed = true;
+    while (changed) {
+        changed = combinePairs(&program);
+        changed = threadJumps(&program) || changed;
+        changed = removeUnreachable(&program) || changed;
+    }
+    encode(chunk, &program);
+    free(program.instructions);
+}
@@ -0,0 +1,12 @@
+#ifndef PEEPHOLE_H
+#define PEEPHOLE_H
+#include "chunk.h"
+
+// Rewrites a finished chunk in place into shorter code that does the same:
+// unreachable code goes, jumps to jumps go straight to the end of the chain,
+// literals pushed only to be popped are dropped, and a negation or
+// comparison followed by a conditional jump becomes one jump. Line numbers
+// move with their instructions.
+void optimizeChunk(Chunk *chunk);
+
+#endif /* PEEPHOLE_H */
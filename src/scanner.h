@@ -60,9 +60,15 @@ typedef struct {
     int line;
 } Token;
 
-void initScanner(const char *source);
+typedef struct {
+    const char *start;
+    const char *current;
+    int line;
+} Scanner;
+
+void initScanner(Scanner *scanner, const char *source);
 int count_decimals(double number);
-Token scanToken();
+Token scanToken(Scanner *scanner);
 bool lex(const char *source);
 
 #endif /* SCANNER_H */
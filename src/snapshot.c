@@ -0,0 +1,924 @@
+// Heap snapshots. The file holds one record per live object, in no
+// particular order, with every reference between objects written as an index
+// into the object table. Restoring checks the whole file, allocates every
+// object, copies its contents out of the mapping and turns the indices back
+// into pointers; nothing is compiled or run.
+#define _DEFAULT_SOURCE
+#include "snapshot.h"
+#include "bytecode.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define NONE UINT32_MAX
+#define OBJ_TYPE_COUNT (OBJ_STRING + 1)
+
+static const char magic[4] = {'L', 'O', 'X', 'H'};
+
+typedef struct {
+    uint32_t count; // entries in use, tombstones included
+    uint32_t capacity;
+    uint32_t entries;
+} TableRecord;
+
+typedef struct {
+    uint64_t key; // 1 + the key's object index, or 0 for an unused entry
+    uint64_t value;
+} EntryRecord;
+
+typedef struct {
+    uint32_t count;
+    uint32_t values;
+} ArrayRecord;
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t format;
+    uint32_t nativeCount;
+    uint32_t objectCount;
+    // Offset of the table of each object's record offset.
+    uint32_t objects;
+    uint32_t initString;
+    uint32_t listClass;
+    uint32_t mapClass;
+    TableRecord strings;
+    TableRecord globalSlots;
+    ArrayRecord globalValues;
+    ArrayRecord globalNames;
+} Header;
+
+// Each record starts with the object's type. Object references are indices,
+// or NONE for a null pointer, and values holding an object have its index
+// where the pointer would be.
+
+typedef struct {
+    uint32_t type;
+    uint32_t length;
+    uint32_t hash;
+    uint32_t chars;
+} StringRecord;
+
+typedef struct {
+    uint32_t type;
+    int32_t arity;
+    int32_t upvalueCount;
+    uint32_t name;
+    uint32_t code;
+    uint32_t count;
+    uint32_t lines;
+    uint32_t cacheCount;
+    ArrayRecord constants;
+    // A function still waiting for its first call has no code and keeps
+    // its LazyFunction here instead; source is NONE for any other.
+    uint32_t source;
+    int32_t offset;
+    int32_t line;
+    uint8_t lazyType;
+    uint8_t inClass;
+    uint8_t hasSuperclass;
+    uint32_t upvalueNames; // string indices, upvalueCount of them
+} FunctionRecord;
+
+typedef struct {
+    uint32_t type;
+    uint32_t native;
+} NativeRecord;
+
+typedef struct {
+    uint32_t type;
+    uint32_t function;
+    uint32_t upvalueCount;
+    uint32_t upvalues;
+} ClosureRecord;
+
+// Only closed upvalues can be saved.
+typedef struct {
+    uint32_t type;
+    uint32_t unused;
+    uint64_t closed;
+} UpvalueRecord;
+
+typedef struct {
+    uint32_t type;
+    uint32_t name;
+    uint32_t rootShape;
+    int32_t slotHint;
+    TableRecord methods;
+} ClassRecord;
+
+typedef struct {
+    uint32_t type;
+    int32_t slotCount;
+    uint32_t isDictionary;
+    TableRecord slots;
+    TableRecord transitions;
+} ShapeRecord;
+
+typedef struct {
+    uint32_t type;
+    uint32_t class;
+    uint32_t shape;
+    uint32_t fieldCapacity;
+    ArrayRecord fields;
+} InstanceRecord;
+
+typedef struct {
+    uint32_t type;
+    uint32_t method;
+    uint64_t receiver;
+} BoundMethodRecord;
+
+typedef struct {
+    uint32_t type;
+    ArrayRecord elements;
+} ListRecord;
+
+typedef struct {
+    uint32_t type;
+    TableRecord table;
+} MapRecord;
+
+static const size_t recordSizes[] = {
+    [OBJ_BOUND_METHOD] = sizeof(BoundMethodRecord),
+    [OBJ_CLASS] = sizeof(ClassRecord),
+    [OBJ_CLOSURE] = sizeof(ClosureRecord),
+    [OBJ_UPVALUE] = sizeof(UpvalueRecord),
+    [OBJ_FUNCTION] = sizeof(FunctionRecord),
+    [OBJ_INSTANCE] = sizeof(InstanceRecord),
+    [OBJ_LIST] = sizeof(ListRecord),
+    [OBJ_MAP] = sizeof(MapRecord),
+    [OBJ_NATIVE] = sizeof(NativeRecord),
+    [OBJ_SHAPE] = sizeof(ShapeRecord),
+    [OBJ_STRING] = sizeof(StringRecord),
+};
+
+static uint32_t countNatives() {
+    uint32_t count = 0;
+    while (nativeAt((int) count) != nullptr) count++;
+    return count;
+}
+
+// Writing.
+
+typedef struct {
+    ByteBuffer buffer;
+    // Every live object, sorted by address so an object's index can be
+    // found by bisection.
+    Obj **objects;
+    uint32_t count;
+} Writer;
+
+static int compareObjects(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t) *(Obj *const *) a;
+    uintptr_t y = (uintptr_t) *(Obj *const *) b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t objectIndex(Writer *writer, Obj *object) {
+    if (object == nullptr) return NONE;
+    Obj **found = bsearch(&object, writer->objects, writer->count,
+                          sizeof(Obj *), compareObjects);
+    assert(found != nullptr);
+    return (uint32_t) (found - writer->objects);
+}
+
+static uint64_t encodeValue(Writer *writer, Value value) {
+    if (!IS_OBJ(value)) return value;
+    return OBJ_VAL((uintptr_t) objectIndex(writer, AS_OBJ(value)));
+}
+
+static ArrayRecord writeValues(Writer *writer, const Value *values,
+                               int count) {
+    ArrayRecord record = {(uint32_t) count, 0};
+    record.values = reserveBytes(&writer->buffer,
+                                 sizeof(uint64_t) * (size_t) count,
+                                 sizeof(uint64_t));
+    uint64_t *encoded = (uint64_t *) (writer->buffer.bytes + record.values);
+    for (int i = 0; i < count; i++) {
+        encoded[i] = encodeValue(writer, values[i]);
+    }
+    return record;
+}
+
+static TableRecord writeTable(Writer *writer, const Table *table) {
+    TableRecord record = {(uint32_t) table->count, (uint32_t) table->capacity,
+                          0};
+    record.entries = reserveBytes(&writer->buffer,
+                                  sizeof(EntryRecord) *
+                                      (size_t) table->capacity,
+                                  sizeof(uint64_t));
+    EntryRecord *entries =
+        (EntryRecord *) (writer->buffer.bytes + record.entries);
+    for (int i = 0; i < table->capacity; i++) {
+        Entry *entry = &table->entries[i];
+        entries[i].key = entry->key == nullptr
+                             ? 0
+                             : 1 + objectIndex(writer, (Obj *) entry->key);
+        entries[i].value = encodeValue(writer, entry->value);
+    }
+    return record;
+}
+
+// Appends the record for `object` and returns its offset. Nothing is kept
+// that only makes sense in this process: inline caches start out empty and
+// machine code is compiled again once the restored code gets hot.
+static uint32_t writeObject(Writer *writer, Obj *object) {
+    ByteBuffer *buffer = &writer->buffer;
+    switch (object->type) {
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod *bound = (ObjBoundMethod *) object;
+            BoundMethodRecord record = {
+                OBJ_BOUND_METHOD, objectIndex(writer, (Obj *) bound->method),
+                encodeValue(writer, bound->receiver)};
+            return appendBytes(buffer, &record, sizeof(record), 8);
+        }
+        case OBJ_CLASS: {
+            ObjClass *class = (ObjClass *) object;
+            ClassRecord record = {OBJ_CLASS,
+                                  objectIndex(writer, (Obj *) class->name),
+                                  objectIndex(writer, (Obj *) class->rootShape),
+                                  class->slotHint, {0}};
+            record.methods = writeTable(writer, &class->methods);
+            return appendBytes(buffer, &record, sizeof(record), 8);
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure *closure = (ObjClosure *) object;
+            ClosureRecord record = {
+                OBJ_CLOSURE, objectIndex(writer, (Obj *) closure->function),
+                (uint32_t) closure->upvalueCount, 0};
+            record.upvalues = reserveBytes(buffer,
+                                           sizeof(uint32_t) *
+                                               (size_t) closure->upvalueCount,
+                                           sizeof(uint32_t));
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                uint32_t index =
+                    objectIndex(writer, (Obj *) closure->upvalues[i]);
+                memcpy(buffer->bytes + record.upvalues + sizeof(uint32_t) * i,
+                       &index, sizeof(index));
+            }
+            return appendBytes(buffer, &record, sizeof(record), 8);
+        }
+        case OBJ_UPVALUE: {
+            ObjUpvalue *upvalue = (ObjUpvalue *) object;
+            UpvalueRecord record = {OBJ_UPVALUE, 0,
+                                    encodeValue(writer, upvalue->closed)};
+            return appendBytes(buffer, &record, sizeof(record), 8);
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction *function = (ObjFunction *) object;
+            Chunk *chunk = &function->chunk;
+            FunctionRecord record = {
+                OBJ_FUNCTION,
+                function->arity,
+                function->upvalueCount,
+                objectIndex(writer, (Obj *) function->name),
+                appendBytes(buffer, chunk->code, (size_t) chunk->count, 1),
+                (uint32_t) chunk->count,
+                0,
+                (uint32_t) chunk->cacheCount,
+                {0},
+                NONE,
+                0, 0, 0, 0, 0, 0};
+            record.lines = appendBytes(buffer, chunk->lines,
+                                       sizeof(int) * (size_t) chunk->count,
+                                       sizeof(int));
+            record.constants = writeValues(writer, chunk->constants.values,
+                                           chunk->constants.count);
+            LazyFunction *lazy = function->lazy;
+            if (lazy != nullptr) {
+                record.source = objectIndex(writer, (Obj *) lazy->source);
+                record.offset = lazy->offset;
+                record.line = lazy->line;
+                record.lazyType = lazy->type;
+                record.inClass = lazy->inClass;
+                record.hasSuperclass = lazy->hasSuperclass;
+                record.upvalueNames = reserveBytes(
+                    buffer, sizeof(uint32_t) * (size_t) function->upvalueCount,
+                    sizeof(uint32_t));
+                for (int i = 0; i < function->upvalueCount; i++) {
+                    uint32_t index =
+                        objectIndex(writer, (Obj *) lazy->upvalueNames[i]);
+                    memcpy(buffer->bytes + record.upvalueNames +
+                               sizeof(uint32_t) * i,
+                           &index, sizeof(index));
+                }
+            }
+            return appendBytes(buffer, &record, sizeof(record), 8);
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance *instance = (ObjInstance *) object;
+            InstanceRecord record = {
+                OBJ_INSTANCE, objectIndex(writer, (Obj *) instance->class),
+                objectIndex(writer, (Obj *) instance->shape),
+                (uint32_t) instance->fieldCapacity, {0}};
+            record.fields = writeValues(writer, instance->fields,
+                                        instance->shape->slotCount);
+            return appendBytes(buffer, &record, sizeof(record), 8);
+        }
+        case OBJ_LIST: {
+            ObjList *list = (ObjList *) object;
+            ListRecord record = {OBJ_LIST, {0}};
+            record.elements = writeValues(writer, list->elements.values,
+                                          list->elements.count);
+            return appendBytes(buffer, &record, sizeof(record), 8);
+        }
+        case OBJ_MAP: {
+            MapRecord record = {OBJ_MAP, {0}};
+            record.table = writeTable(writer, &((ObjMap *) object)->table);
+            return appendBytes(buffer, &record, sizeof(record), 8);
+        }
+        case OBJ_NATIVE: {
+            NativeRecord record = {
+                OBJ_NATIVE,
+                (uint32_t) nativeIndex(((ObjNative *) object)->function)};
+            return appendBytes(buffer, &record, sizeof(record), 8);
+        }
+        case OBJ_SHAPE: {
+            ObjShape *shape = (ObjShape *) object;
+            ShapeRecord record = {OBJ_SHAPE, shape->slotCount,
+                                  shape->isDictionary, {0}, {0}};
+            record.slots = writeTable(writer, &shape->slots);
+            record.transitions = writeTable(writer, &shape->transitions);
+            return appendBytes(buffer, &record, sizeof(record), 8);
+        }
+        case OBJ_STRING: {
+            ObjString *string = (ObjString *) object;
+            StringRecord record = {
+                OBJ_STRING, (uint32_t) string->length, string->hash,
+                appendBytes(buffer, string->chars, (size_t) string->length,
+                            1)};
+            return appendBytes(buffer, &record, sizeof(record), 8);
+        }
+    }
+    return 0;
+}
+
+bool writeSnapshot(VM *vm, const char *path) {
+    if (vm->frameCount != 0 || vm->openUpvalues != nullptr) return false;
+    collectGarbage(vm);
+
+    Writer writer = {0};
+    writer.objects = heapObjects(vm, &writer.count);
+    for (uint32_t i = 0; i < writer.count; i++) {
+        // Natives from outside the built-in set can't be named in the file.
+        Obj *object = writer.objects[i];
+        if (object->type == OBJ_NATIVE &&
+            nativeIndex(((ObjNative *) object)->function) < 0) {
+            free(writer.objects);
+            return false;
+        }
+    }
+    qsort(writer.objects, writer.count, sizeof(Obj *), compareObjects);
+
+    Header header = {0};
+    memcpy(header.magic, magic, sizeof(magic));
+    header.version = SNAPSHOT_VERSION;
+    header.format = bytecodeFormat();
+    header.nativeCount = countNatives();
+    header.objectCount = writer.count;
+    reserveBytes(&writer.buffer, sizeof(Header), 8);
+    header.objects = reserveBytes(&writer.buffer,
+                                  sizeof(uint32_t) * writer.count,
+                                  sizeof(uint32_t));
+    for (uint32_t i = 0; i < writer.count; i++) {
+        uint32_t offset = writeObject(&writer, writer.objects[i]);
+        memcpy(writer.buffer.bytes + header.objects + sizeof(uint32_t) * i,
+               &offset, sizeof(offset));
+    }
+
+    header.initString = objectIndex(&writer, (Obj *) vm->initString);
+    header.listClass = objectIndex(&writer, (Obj *) vm->listClass);
+    header.mapClass = objectIndex(&writer, (Obj *) vm->mapClass);
+    header.strings = writeTable(&writer, &vm->strings);
+    header.globalSlots = writeTable(&writer, &vm->globalSlots);
+    header.globalValues = writeValues(&writer, vm->globalValues.values,
+                                      vm->globalValues.count);
+    header.globalNames = writeValues(&writer, vm->globalNames.values,
+                                     vm->globalNames.count);
+    memcpy(writer.buffer.bytes, &header, sizeof(header));
+
+    bool ok = writeBytes(&writer.buffer, path);
+    free(writer.objects);
+    free(writer.buffer.bytes);
+    return ok;
+}
+
+// Loading.
+
+typedef struct {
+    VM *vm;
+    uint8_t *base;
+    size_t size;
+    const Header *header;
+    const uint32_t *offsets;
+    // The type of each object, once its record has been found in bounds.
+    uint8_t *types;
+    Obj **objects;
+} Restorer;
+
+// What a value read from the file may be, beyond a valid reference.
+typedef enum {
+    ANY_VALUE,
+    METHOD_VALUE, // a closure or native
+    SLOT_VALUE,   // an integer below the limit given
+    SHAPE_VALUE,
+} ValueKind;
+
+static const void *at(const Restorer *r, uint32_t offset) {
+    return r->base + offset;
+}
+
+static bool inFile(const Restorer *r, uint32_t offset, size_t count,
+                   size_t size, size_t align) {
+    return offset % align == 0 && offset <= r->size &&
+           count <= (r->size - offset) / size;
+}
+
+static bool isObject(const Restorer *r, uint32_t index, ObjType type) {
+    return index < r->header->objectCount && r->types[index] == type;
+}
+
+static bool checkValue(const Restorer *r, uint64_t value, ValueKind kind,
+                       int limit) {
+    uint64_t index = IS_OBJ(value) ? (uintptr_t) AS_OBJ(value) : 0;
+    if (IS_OBJ(value) && index >= r->header->objectCount) return false;
+    switch (kind) {
+        case ANY_VALUE: return true;
+        case METHOD_VALUE:
+            return IS_OBJ(value) && (r->types[index] == OBJ_CLOSURE ||
+                                     r->types[index] == OBJ_NATIVE);
+        case SLOT_VALUE:
+            return IS_NUMBER(value) && AS_NUMBER(value) >= 0 &&
+                   AS_NUMBER(value) < limit &&
+                   AS_NUMBER(value) == (int) AS_NUMBER(value);
+        case SHAPE_VALUE: return IS_OBJ(value) && r->types[index] == OBJ_SHAPE;
+    }
+    return false;
+}
+
+static bool checkValues(const Restorer *r, ArrayRecord array, ValueKind kind,
+                        int limit) {
+    if (!inFile(r, array.values, array.count, sizeof(uint64_t),
+                sizeof(uint64_t)) ||
+        array.count > INT32_MAX) {
+        return false;
+    }
+    const uint64_t *values = at(r, array.values);
+    for (uint32_t i = 0; i < array.count; i++) {
+        if (!checkValue(r, values[i], kind, limit)) return false;
+    }
+    return true;
+}
+
+// A table must look like one tableSet() could have built: a power of two
+// capacity that always leaves an empty entry to stop a probe, string keys,
+// and a count that matches.
+static bool checkTable(const Restorer *r, TableRecord table, ValueKind kind,
+                       int limit) {
+    if (table.capacity == 0) return table.count == 0;
+    if ((table.capacity & (table.capacity - 1)) != 0 ||
+        table.capacity > INT32_MAX / 2 ||
+        table.count > table.capacity / 4 * 3 ||
+        !inFile(r, table.entries, table.capacity, sizeof(EntryRecord),
+                sizeof(uint64_t))) {
+        return false;
+    }
+    const EntryRecord *entries = at(r, table.entries);
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < table.capacity; i++) {
+        if (entries[i].key == 0) {
+            // Empty, or a tombstone.
+            if (entries[i].value != NIL_VAL) used++;
+            continue;
+        }
+        used++;
+        if (!isObject(r, (uint32_t) (entries[i].key - 1), OBJ_STRING) ||
+            entries[i].key > UINT32_MAX ||
+            !checkValue(r, entries[i].value, kind, limit)) {
+            return false;
+        }
+    }
+    return used == table.count;
+}
+
+static bool checkObject(const Restorer *r, uint32_t index) {
+    const void *record = at(r, r->offsets[index]);
+    switch ((ObjType) r->types[index]) {
+        case OBJ_BOUND_METHOD: {
+            const BoundMethodRecord *bound = record;
+            return isObject(r, bound->method, OBJ_CLOSURE) &&
+                   checkValue(r, bound->receiver, ANY_VALUE, 0);
+        }
+        case OBJ_CLASS: {
+            const ClassRecord *class = record;
+            return isObject(r, class->name, OBJ_STRING) &&
+                   isObject(r, class->rootShape, OBJ_SHAPE) &&
+                   class->slotHint >= 0 && class->slotHint <= SHAPE_MAX_SLOTS &&
+                   checkTable(r, class->methods, METHOD_VALUE, 0);
+        }
+        case OBJ_CLOSURE: {
+            const ClosureRecord *closure = record;
+            if (!isObject(r, closure->function, OBJ_FUNCTION)) return false;
+            const FunctionRecord *function =
+                at(r, r->offsets[closure->function]);
+            if (closure->upvalueCount != (uint32_t) function->upvalueCount ||
+                !inFile(r, closure->upvalues, closure->upvalueCount,
+                        sizeof(uint32_t), sizeof(uint32_t))) {
+                return false;
+            }
+            const uint32_t *upvalues = at(r, closure->upvalues);
+            for (uint32_t i = 0; i < closure->upvalueCount; i++) {
+                if (!isObject(r, upvalues[i], OBJ_UPVALUE)) return false;
+            }
+            return true;
+        }
+        case OBJ_UPVALUE:
+            return checkValue(r, ((const UpvalueRecord *) record)->closed,
+                              ANY_VALUE, 0);
+        case OBJ_FUNCTION: {
+            // The code itself is checked once the constants exist.
+            const FunctionRecord *function = record;
+            if (function->source != NONE) {
+                if (!isObject(r, function->source, OBJ_STRING) ||
+                    function->count != 0 || function->offset < 0 ||
+                    function->offset > (int32_t) ((const StringRecord *) at(
+                                           r, r->offsets[function->source]))
+                                           ->length ||
+                    function->upvalueCount < 0 ||
+                    !inFile(r, function->upvalueNames,
+                            (size_t) function->upvalueCount,
+                            sizeof(uint32_t), sizeof(uint32_t))) {
+                    return false;
+                }
+                const uint32_t *names = at(r, function->upvalueNames);
+                for (int32_t i = 0; i < function->upvalueCount; i++) {
+                    if (!isObject(r, names[i], OBJ_STRING)) return false;
+                }
+            }
+            return function->arity >= 0 && function->arity <= UINT8_MAX &&
+                   function->upvalueCount >= 0 &&
+                   function->upvalueCount <= UINT8_COUNT &&
+                   (function->name == NONE ||
+                    isObject(r, function->name, OBJ_STRING)) &&
+                   function->count <= INT32_MAX &&
+                   inFile(r, function->code, function->count, 1, 1) &&
+                   inFile(r, function->lines, function->count, sizeof(int),
+                          sizeof(int)) &&
+                   function->cacheCount <= UINT16_MAX + 1u &&
+                   checkValues(r, function->constants, ANY_VALUE, 0);
+        }
+        case OBJ_INSTANCE: {
+            const InstanceRecord *instance = record;
+            if (!isObject(r, instance->class, OBJ_CLASS) ||
+                !isObject(r, instance->shape, OBJ_SHAPE)) {
+                return false;
+            }
+            const ShapeRecord *shape = at(r, r->offsets[instance->shape]);
+            return instance->fields.count == (uint32_t) shape->slotCount &&
+                   instance->fieldCapacity >= instance->fields.count &&
+                   instance->fieldCapacity <= INT32_MAX / sizeof(Value) &&
+                   checkValues(r, instance->fields, ANY_VALUE, 0);
+        }
+        case OBJ_LIST:
+            return checkValues(r, ((const ListRecord *) record)->elements,
+                               ANY_VALUE, 0);
+        case OBJ_MAP:
+            return checkTable(r, ((const MapRecord *) record)->table,
+                              ANY_VALUE, 0);
+        case OBJ_NATIVE:
+            return ((const NativeRecord *) record)->native <
+                   r->header->nativeCount;
+        case OBJ_SHAPE: {
+            const ShapeRecord *shape = record;
+            return shape->slotCount >= 0 &&
+                   (shape->isDictionary ||
+                    shape->slotCount <= SHAPE_MAX_SLOTS) &&
+                   checkTable(r, shape->slots, SLOT_VALUE, shape->slotCount) &&
+                   checkTable(r, shape->transitions, SHAPE_VALUE, 0);
+        }
+        case OBJ_STRING: {
+            const StringRecord *string = record;
+            return string->length <= INT32_MAX - 1 &&
+                   inFile(r, string->chars, string->length, 1, 1);
+        }
+    }
+    return false;
+}
+
+// Checks everything restoring relies on, so that once it starts it cannot
+// fail halfway.
+static bool checkSnapshot(Restorer *r) {
+    const Header *header = r->header;
+    if (memcmp(header->magic, magic, sizeof(magic)) != 0 ||
+        header->version != SNAPSHOT_VERSION ||
+        header->format != bytecodeFormat() ||
+        header->nativeCount != countNatives() ||
+        !inFile(r, header->objects, header->objectCount, sizeof(uint32_t),
+                sizeof(uint32_t))) {
+        return false;
+    }
+    r->offsets = at(r, header->objects);
+    r->types = malloc(header->objectCount + 1);
+    if (r->types == nullptr) exit(1);
+    for (uint32_t i = 0; i < header->objectCount; i++) {
+        uint32_t offset = r->offsets[i];
+        if (!inFile(r, offset, 1, sizeof(uint32_t), 8)) return false;
+        uint32_t type = *(const uint32_t *) at(r, offset);
+        if (type >= OBJ_TYPE_COUNT ||
+            !inFile(r, offset, 1, recordSizes[type], 8)) {
+            return false;
+        }
+        r->types[i] = (uint8_t) type;
+    }
+    for (uint32_t i = 0; i < header->objectCount; i++) {
+        if (!checkObject(r, i)) return false;
+    }
+
+    if (!checkValues(r, header->globalNames, ANY_VALUE, 0)) return false;
+    const uint64_t *names = at(r, header->globalNames.values);
+    for (uint32_t i = 0; i < header->globalNames.count; i++) {
+        if (!IS_OBJ(names[i]) ||
+            r->types[(uintptr_t) AS_OBJ(names[i])] != OBJ_STRING) {
+            return false;
+        }
+    }
+
+    int globalCount = (int) header->globalNames.count;
+    return isObject(r, header->initString, OBJ_STRING) &&
+           isObject(r, header->listClass, OBJ_CLASS) &&
+           isObject(r, header->mapClass, OBJ_CLASS) &&
+           checkTable(r, header->strings, ANY_VALUE, 0) &&
+           checkTable(r, header->globalSlots, SLOT_VALUE, globalCount) &&
+           header->globalValues.count == header->globalNames.count &&
+           checkValues(r, header->globalValues, ANY_VALUE, 0) &&
+           header->globalNames.count <= UINT16_MAX + 1u;
+}
+
+static Obj *object(const Restorer *r, uint32_t index) {
+    return index == NONE ? nullptr : r->objects[index];
+}
+
+static Value restoreValue(const Restorer *r, uint64_t value) {
+    if (!IS_OBJ(value)) return value;
+    return OBJ_VAL(r->objects[(uintptr_t) AS_OBJ(value)]);
+}
+
+static void restoreValues(Restorer *r, ValueArray *array,
+                          ArrayRecord record) {
+    initValueArray(array);
+    if (record.count == 0) return;
+    array->values = ALLOCATE(r->vm, Value, record.count);
+    array->capacity = array->count = (int) record.count;
+    const uint64_t *values = at(r, record.values);
+    for (uint32_t i = 0; i < record.count; i++) {
+        array->values[i] = restoreValue(r, values[i]);
+    }
+}
+
+static void restoreTable(Restorer *r, Table *table, TableRecord record) {
+    initTable(table);
+    if (record.capacity == 0) return;
+    table->entries = ALLOCATE(r->vm, Entry, record.capacity);
+    table->capacity = (int) record.capacity;
+    table->count = (int) record.count;
+    const EntryRecord *entries = at(r, record.entries);
+    for (uint32_t i = 0; i < record.capacity; i++) {
+        table->entries[i].key =
+            entries[i].key == 0
+                ? nullptr
+                : (ObjString *) r->objects[entries[i].key - 1];
+        table->entries[i].value = restoreValue(r, entries[i].value);
+    }
+}
+
+static void restoreLazyFunction(Restorer *r, ObjFunction *function,
+                                const FunctionRecord *from) {
+    LazyFunction *lazy = ALLOCATE(r->vm, LazyFunction, 1);
+    lazy->source = (ObjString *) object(r, from->source);
+    lazy->offset = from->offset;
+    lazy->line = from->line;
+    lazy->type = from->lazyType;
+    lazy->inClass = from->inClass != 0;
+    lazy->hasSuperclass = from->hasSuperclass != 0;
+    lazy->upvalueNames =
+        ALLOCATE(r->vm, ObjString *, function->upvalueCount);
+    const uint32_t *names = at(r, from->upvalueNames);
+    for (int i = 0; i < function->upvalueCount; i++) {
+        lazy->upvalueNames[i] = (ObjString *) object(r, names[i]);
+    }
+    function->lazy = lazy;
+}
+
+static size_t objectSize(const Restorer *r, uint32_t index) {
+    switch ((ObjType) r->types[index]) {
+        case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+        case OBJ_CLASS: return sizeof(ObjClass);
+        case OBJ_CLOSURE: return sizeof(ObjClosure);
+        case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+        case OBJ_FUNCTION: return sizeof(ObjFunction);
+        case OBJ_INSTANCE: {
+            // Restored instances keep all their fields inline.
+            const InstanceRecord *record = at(r, r->offsets[index]);
+            return sizeof(ObjInstance) +
+                   sizeof(Value) * record->fieldCapacity;
+        }
+        case OBJ_LIST: return sizeof(ObjList);
+        case OBJ_MAP: return sizeof(ObjMap);
+        case OBJ_NATIVE: return sizeof(ObjNative);
+        case OBJ_SHAPE: return sizeof(ObjShape);
+        case OBJ_STRING: return sizeof(ObjString);
+    }
+    return 0;
+}
+
+// Fills in an allocated object from its record.
+static void restoreObject(Restorer *r, uint32_t index) {
+    VM *vm = r->vm;
+    Obj *obj = r->objects[index];
+    const void *record = at(r, r->offsets[index]);
+    switch (obj->type) {
+        case OBJ_BOUND_METHOD: {
+            const BoundMethodRecord *from = record;
+            ObjBoundMethod *bound = (ObjBoundMethod *) obj;
+            bound->receiver = restoreValue(r, from->receiver);
+            bound->method = (ObjClosure *) object(r, from->method);
+            break;
+        }
+        case OBJ_CLASS: {
+            const ClassRecord *from = record;
+            ObjClass *class = (ObjClass *) obj;
+            class->name = (ObjString *) object(r, from->name);
+            class->rootShape = (ObjShape *) object(r, from->rootShape);
+            class->slotHint = from->slotHint;
+            restoreTable(r, &class->methods, from->methods);
+            break;
+        }
+        case OBJ_CLOSURE: {
+            const ClosureRecord *from = record;
+            ObjClosure *closure = (ObjClosure *) obj;
+            closure->function = (ObjFunction *) object(r, from->function);
+            closure->upvalueCount = (int) from->upvalueCount;
+            closure->upvalues =
+                ALLOCATE(vm, ObjUpvalue *, closure->upvalueCount);
+            const uint32_t *upvalues = at(r, from->upvalues);
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                closure->upvalues[i] = (ObjUpvalue *) object(r, upvalues[i]);
+            }
+            break;
+        }
+        case OBJ_UPVALUE: {
+            ObjUpvalue *upvalue = (ObjUpvalue *) obj;
+            upvalue->closed =
+                restoreValue(r, ((const UpvalueRecord *) record)->closed);
+            upvalue->location = &upvalue->closed;
+            upvalue->next = nullptr;
+            break;
+        }
+        case OBJ_FUNCTION: {
+            const FunctionRecord *from = record;
+            ObjFunction *function = (ObjFunction *) obj;
+            function->arity = from->arity;
+            function->upvalueCount = from->upvalueCount;
+            function->maxSlots = 0;
+            function->name = (ObjString *) object(r, from->name);
+            function->hotness = 0;
+            function->jitCode = nullptr;
+            function->loops = nullptr;
+            function->lazy = nullptr;
+            initChunk(&function->chunk);
+            Chunk *chunk = &function->chunk;
+            if (from->source == NONE) {
+                // Borrowed from the mapping, like a loaded bytecode file's.
+                chunk->code = r->base + from->code;
+                chunk->lines = (int *) (r->base + from->lines);
+                chunk->count = (int) from->count;
+            } else {
+                restoreLazyFunction(r, function, from);
+            }
+            restoreValues(r, &chunk->constants, from->constants);
+            for (uint32_t i = 0; i < from->cacheCount; i++) {
+                addInlineCache(vm, chunk);
+            }
+            break;
+        }
+        case OBJ_INSTANCE: {
+            const InstanceRecord *from = record;
+            ObjInstance *instance = (ObjInstance *) obj;
+            instance->class = (ObjClass *) object(r, from->class);
+            instance->shape = (ObjShape *) object(r, from->shape);
+            instance->fields = instance->inlineFields;
+            instance->fieldCapacity = (int) from->fieldCapacity;
+            instance->inlineCapacity = (int) from->fieldCapacity;
+            const uint64_t *fields = at(r, from->fields.values);
+            for (uint32_t i = 0; i < from->fields.count; i++) {
+                instance->fields[i] = restoreValue(r, fields[i]);
+            }
+            break;
+        }
+        case OBJ_LIST:
+            restoreValues(r, &((ObjList *) obj)->elements,
+                          ((const ListRecord *) record)->elements);
+            break;
+        case OBJ_MAP:
+            restoreTable(r, &((ObjMap *) obj)->table,
+                         ((const MapRecord *) record)->table);
+            break;
+        case OBJ_NATIVE:
+            ((ObjNative *) obj)->function =
+                nativeAt((int) ((const NativeRecord *) record)->native);
+            break;
+        case OBJ_SHAPE: {
+            const ShapeRecord *from = record;
+            ObjShape *shape = (ObjShape *) obj;
+            shape->slotCount = from->slotCount;
+            shape->isDictionary = from->isDictionary != 0;
+            restoreTable(r, &shape->slots, from->slots);
+            restoreTable(r, &shape->transitions, from->transitions);
+            break;
+        }
+        case OBJ_STRING: {
+            const StringRecord *from = record;
+            ObjString *string = (ObjString *) obj;
+            string->length = (int) from->length;
+            string->hash = from->hash;
+            string->chars = ALLOCATE(vm, char, from->length + 1);
+            memcpy(string->chars, at(r, from->chars), from->length);
+            string->chars[from->length] = '\0';
+            break;
+        }
+    }
+}
+
+// The VM has no heap yet, and nothing restored is reachable from it until the
+// very end, so collections are held off until then.
+static bool restore(Restorer *r) {
+    VM *vm = r->vm;
+    const Header *header = r->header;
+    vm->gcHeld = true;
+    r->objects = malloc(sizeof(Obj *) * (header->objectCount + 1));
+    if (r->objects == nullptr) exit(1);
+    for (uint32_t i = 0; i < header->objectCount; i++) {
+        Obj *object = allocateCell(vm, objectSize(r, i));
+        object->type = (ObjType) r->types[i];
+        object->isOld = false;
+        object->isRemembered = false;
+        r->objects[i] = object;
+    }
+    for (uint32_t i = 0; i < header->objectCount; i++) {
+        restoreObject(r, i);
+    }
+
+    bool ok = true;
+    for (uint32_t i = 0; ok && i < header->objectCount; i++) {
+        ok = r->types[i] != OBJ_FUNCTION ||
+             ((ObjFunction *) r->objects[i])->lazy != nullptr ||
+             verifyBytecode((ObjFunction *) r->objects[i],
+                            (int) header->globalNames.count, nullptr);
+    }
+    if (ok) {
+        // Built aside first: a collection while vm->strings was only partly
+        // restored would drop the interned strings as unreachable.
+        Table strings, globalSlots;
+        ValueArray globalValues, globalNames;
+        restoreTable(r, &strings, header->strings);
+        restoreTable(r, &globalSlots, header->globalSlots);
+        restoreValues(r, &globalValues, header->globalValues);
+        restoreValues(r, &globalNames, header->globalNames);
+        vm->strings = strings;
+        vm->globalSlots = globalSlots;
+        vm->globalValues = globalValues;
+        vm->globalNames = globalNames;
+        vm->initString = (ObjString *) object(r, header->initString);
+        vm->listClass = (ObjClass *) object(r, header->listClass);
+        vm->mapClass = (ObjClass *) object(r, header->mapClass);
+    }
+    // Should any code be rejected, everything restored is simply garbage.
+    // Otherwise the first collection promotes it like anything new.
+    vm->gcHeld = false;
+    return ok;
+}
+
+bool loadSnapshot(VM *vm, const char *path) {
+    size_t size;
+    uint8_t *base = mapFile(path, sizeof(Header), &size);
+    if (base == nullptr) return false;
+
+    Restorer r = {vm, base, size, (const Header *) base, nullptr, nullptr,
+                  nullptr};
+    bool ok = checkSnapshot(&r) && restore(&r);
+    free(r.types);
+    free(r.objects);
+    if (ok) {
+        keepMapping(vm, base, size);
+    } else {
+        munmap(base, size);
+    }
+    return ok;
+}
@@ -0,0 +1,19 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+#include "common.h"
+#include "object.h"
+
+#define SNAPSHOT_VERSION 2
+
+// Saves the VM's whole heap: every live object, the interned strings, the
+// globals and the built-in classes. Only possible between scripts, with no
+// call in progress. Inline caches and compiled machine code are left out;
+// they fill in again as the restored code runs.
+bool writeSnapshot(VM *vm, const char *path);
+// Restores a heap saved by writeSnapshot() into a VM that has none yet, as
+// initVMFromSnapshot() does. The objects are copied out of the mapped file
+// and their references fixed up; functions run the bytecode in place. False,
+// with nothing reachable restored, if the file can't be used.
+bool loadSnapshot(VM *vm, const char *path);
+
+#endif /* SNAPSHOT_H */
@@ -0,0 +1,1648 @@
+// An optimizer over an SSA form of each finished function. The chunk is
+// lifted into a control-flow graph of basic blocks whose instructions keep
+// their bytecode form, and the values they pop and push are named as SSA
+// values: every stack position is a variable, locals included, and phis
+// join variables where paths meet. The passes rewrite the graph and the
+// bytecode is generated again from it.
+//
+// Loops whose condition is a single block are rotated first, so the
+// condition is tested again at the bottom of the body and the body gets a
+// block in front of it that runs once per loop. Then:
+//
+// - Copy propagation reads a value from the slot it was first stored in,
+//   or pushes it again when it is a literal.
+// - Loop-invariant code motion moves expressions at the start of the body
+//   that only use values the loop never changes into a block before the
+//   loop, leaving a load of a temporary.
+// - Common subexpression elimination keeps an expression, such as a load
+//   of this.field, in a temporary when every path to another one computes
+//   it first with nothing in between that could change it. A method loaded
+//   twice is then bound once, which only shows in the identity of the two.
+// - Dead-store elimination, run over the generated code, drops stores to
+//   slots nothing reads before they are written again or popped.
+//
+// Temporaries take slots right after the parameters, and the locals move up
+// to make room. Slots a closure captures can change in any call, so nothing
+// is assumed about them.
+#include "ssa.h"
+#include "chunk.h"
+#include "memory.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Instructions name temporaries by slots from here up until the code is
+// generated, as no real slot gets this high.
+#define TEMP_SLOT UINT8_COUNT
+// Longer loop conditions are not copied to the bottom of the loop.
+#define ROTATE_MAX 16
+// How many instructions from the start of a loop body are looked at for
+// invariant code.
+#define HOIST_MAX 64
+
+typedef struct {
+    uint8_t op;
+    int offset; // where its operands are copied from, or -1 for new code
+    int slot;   // of a GET_LOCAL, SET_LOCAL or SET_LOCAL_POP
+    int target; // block a jump goes to, or -1
+    int line;
+    // Set by buildSsa().
+    int inputs; // first of the values it pops, in Ir.operands
+    int output; // value it pushes, or -1
+} Ins;
+
+typedef struct {
+    Ins *code;
+    int count;
+    int capacity;
+    int fallthrough; // block run next when it does not jump away, or -1
+    // Set by analyze().
+    int preds; // first predecessor in Ir.preds
+    int predCount;
+    int depth; // stack height on entry, or -1 when nothing reaches it
+    int order; // position in reverse postorder
+    int loopDepth;
+    bool header; // a back edge lands on it
+    // Set by buildSsa(): the value of each variable on entry and exit.
+    int *entry;
+    int *exit;
+} Block;
+
+typedef enum { VALUE_ENTRY, VALUE_PHI, VALUE_RESULT } ValueKind;
+
+typedef struct {
+    ValueKind kind;
+    int variable; // the one it was created in
+    int block;
+    int ins;      // index in the block of the instruction computing it
+    int parent;   // the value a phi merging only that one stands for
+    int operands; // of a phi, one per predecessor, in Ir.operands
+} SsaValue;
+
+typedef struct {
+    const Chunk *chunk;
+    int entryDepth; // the callee and its arguments
+    bool captured[UINT8_COUNT];
+    Block *blocks;
+    int blockCount;
+    int blockCapacity;
+    int *layout; // blocks in the order their code is generated
+    int layoutCount;
+    int layoutCapacity;
+    int entry;
+    int temps;
+    // Set by analyze().
+    int *rpo;
+    int rpoCount;
+    int *preds;
+    int maxDepth;
+    // Set by buildSsa(). Stack positions are variables 0 to maxDepth - 1
+    // and temporaries follow them.
+    SsaValue *values;
+    int valueCount;
+    int valueCapacity;
+    int *operands;
+    int operandCount;
+    int operandCapacity;
+} Ir;
+
+typedef struct {
+    int pops;
+    int pushes;
+    int passthrough; // input the pushed value is, or -1 for a new one
+} StackUse;
+
+// Makes room for array[count].
+static void *reserve(void *array, int count, int *capacity, size_t size) {
+    if (count < *capacity) return array;
+    *capacity = GROW_CAPACITY(*capacity);
+    array = realloc(array, size * (size_t) *capacity);
+    if (array == nullptr) exit(1);
+    return array;
+}
+
+static void *allocate(size_t count, size_t size) {
+    void *array = calloc(count > 0 ? count : 1, size);
+    if (array == nullptr) exit(1);
+    return array;
+}
+
+static Ins newIns(uint8_t op, int slot, int line) {
+    return (Ins){op, -1, slot, -1, line, -1, -1};
+}
+
+static void append(Block *block, Ins ins) {
+    block->code =
+        reserve(block->code, block->count, &block->capacity, sizeof(Ins));
+    block->code[block->count++] = ins;
+}
+
+static int newBlock(Ir *ir) {
+    ir->blocks = reserve(ir->blocks, ir->blockCount, &ir->blockCapacity,
+                         sizeof(Block));
+    Block *block = &ir->blocks[ir->blockCount];
+    memset(block, 0, sizeof(Block));
+    block->fallthrough = -1;
+    block->depth = -1;
+    return ir->blockCount++;
+}
+
+static int layoutIndex(const Ir *ir, int block) {
+    for (int i = 0; i < ir->layoutCount; i++) {
+        if (ir->layout[i] == block) return i;
+    }
+    return -1;
+}
+
+// Puts `block` in the layout right before or after `other`.
+static void place(Ir *ir, int block, int other, bool after) {
+    ir->layout = reserve(ir->layout, ir->layoutCount, &ir->layoutCapacity,
+                         sizeof(int));
+    int at = layoutIndex(ir, other) + (after ? 1 : 0);
+    memmove(&ir->layout[at + 1], &ir->layout[at],
+            sizeof(int) * (size_t) (ir->layoutCount - at));
+    ir->layout[at] = block;
+    ir->layoutCount++;
+}
+
+static uint8_t operand(const Ir *ir, const Ins *ins, int index) {
+    return ir->chunk->code[ins->offset + index];
+}
+
+static ObjString *nameOf(const Ir *ir, const Ins *ins) {
+    return AS_STRING(ir->chunk->constants.values[operand(ir, ins, 1)]);
+}
+
+static bool isLiteral(uint8_t op) {
+    return op == OP_CONSTANT || op == OP_NIL || op == OP_TRUE ||
+           op == OP_FALSE;
+}
+
+// A conditional jump that pops its condition.
+static bool isBranch(uint8_t op) {
+    switch (op) {
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_NOT_LESS: return true;
+        default: return false;
+    }
+}
+
+static bool isJump(uint8_t op) {
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP ||
+           isBranch(op);
+}
+
+// Never goes on to the next instruction.
+static bool endsBlock(uint8_t op) {
+    return op == OP_JUMP || op == OP_LOOP || op == OP_RETURN ||
+           op == OP_RETURN_NIL;
+}
+
+static bool isCaptured(const Ir *ir, int slot) {
+    return slot < TEMP_SLOT && ir->captured[slot];
+}
+
+static StackUse stackUse(const Ir *ir, const Ins *ins) {
+    switch (ins->op) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_LIST_INIT:
+        case OP_MAP_INIT:
+        case OP_CLASS:
+        case OP_CLOSURE:
+        case OP_RETURN_NIL: return (StackUse){0, 1, -1};
+        case OP_SET_LOCAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_UPVALUE:
+        case OP_JUMP_IF_FALSE: return (StackUse){1, 1, 0};
+        case OP_GET_PROPERTY:
+        case OP_NOT:
+        case OP_NEGATE: return (StackUse){1, 1, -1};
+        case OP_SET_PROPERTY: return (StackUse){2, 1, 1};
+        case OP_SET_INDEX: return (StackUse){3, 1, 2};
+        case OP_LIST_DATA:
+        case OP_INHERIT:
+        case OP_METHOD: return (StackUse){2, 1, 0};
+        case OP_MAP_DATA: return (StackUse){3, 1, 0};
+        case OP_GET_SUPER:
+        case OP_GET_INDEX:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE: return (StackUse){2, 1, -1};
+        case OP_SET_PROPERTY_POP:
+        case OP_JUMP_IF_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_NOT_LESS: return (StackUse){2, 0, -1};
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            return (StackUse){operand(ir, ins, 1) + 1, 1, -1};
+        case OP_INVOKE: return (StackUse){operand(ir, ins, 2) + 1, 1, -1};
+        case OP_SUPER_INVOKE:
+            return (StackUse){operand(ir, ins, 2) + 2, 1, -1};
+        case OP_JUMP:
+        case OP_LOOP: return (StackUse){0, 0, -1};
+        default: return (StackUse){1, 0, -1};
+    }
+}
+
+static void initIr(Ir *ir, const Chunk *chunk, int entryDepth) {
+    memset(ir, 0, sizeof(Ir));
+    ir->chunk = chunk;
+    ir->entryDepth = entryDepth;
+}
+
+static void freeIr(Ir *ir) {
+    for (int b = 0; b < ir->blockCount; b++) {
+        free(ir->blocks[b].code);
+        free(ir->blocks[b].entry);
+        free(ir->blocks[b].exit);
+    }
+    free(ir->blocks);
+    free(ir->layout);
+    free(ir->rpo);
+    free(ir->preds);
+    free(ir->values);
+    free(ir->operands);
+}
+
+// Splits the chunk into basic blocks, laid out in the order they were.
+static bool lift(Ir *ir) {
+    const Chunk *chunk = ir->chunk;
+    if (chunk->count == 0) return false;
+    bool *leader = allocate((size_t) chunk->count + 1, sizeof(bool));
+    int *blockAt = allocate((size_t) chunk->count + 1, sizeof(int));
+    bool valid = true;
+
+    leader[0] = true;
+    for (int offset = 0; offset < chunk->count;) {
+        uint8_t op = chunk->code[offset];
+        if (op > OP_RETURN) {
+            valid = false;
+            break;
+        }
+        int next = offset + instructionLength(chunk, offset);
+        int target = jumpTarget(chunk, offset);
+        if (next > chunk->count || target >= chunk->count ||
+            (isJump(op) && target < 0)) {
+            valid = false;
+            break;
+        }
+        if (target >= 0) leader[target] = true;
+        if (target >= 0 || op == OP_RETURN || op == OP_RETURN_NIL) {
+            leader[next] = true;
+        }
+        if (op == OP_CLOSURE) {
+            for (int i = offset + 2; i < next; i += 2) {
+                if (chunk->code[i]) ir->captured[chunk->code[i + 1]] = true;
+            }
+        }
+        offset = next;
+    }
+
+    for (int offset = 0; valid && offset <= chunk->count; offset++) {
+        blockAt[offset] = -1;
+    }
+    int block = -1;
+    for (int offset = 0; valid && offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        if (leader[offset]) {
+            block = newBlock(ir);
+            blockAt[offset] = block;
+            ir->layout = reserve(ir->layout, ir->layoutCount,
+                                 &ir->layoutCapacity, sizeof(int));
+            ir->layout[ir->layoutCount++] = block;
+        }
+        int length = instructionLength(chunk, offset);
+        Ins ins = newIns(chunk->code[offset], -1,
+                         chunk->lines[offset + length - 1]);
+        ins.offset = offset;
+        ins.target = jumpTarget(chunk, offset);
+        if (ins.op == OP_GET_LOCAL || ins.op == OP_SET_LOCAL ||
+            ins.op == OP_SET_LOCAL_POP) {
+            ins.slot = chunk->code[offset + 1];
+        }
+        append(&ir->blocks[block], ins);
+    }
+
+    for (int b = 0; valid && b < ir->blockCount; b++) {
+        Block *current = &ir->blocks[b];
+        for (int i = 0; i < current->count; i++) {
+            Ins *ins = &current->code[i];
+            if (ins->target < 0) continue;
+            ins->target = blockAt[ins->target];
+            // A jump into the middle of an instruction.
+            if (ins->target < 0) valid = false;
+        }
+        if (!endsBlock(current->code[current->count - 1].op)) {
+            // Nothing may run off the end of the code.
+            if (b + 1 == ir->blockCount) valid = false;
+            current->fallthrough = b + 1;
+        }
+    }
+    free(leader);
+    free(blockAt);
+    return valid;
+}
+
+static int successors(const Ir *ir, int block, int out[2]) {
+    const Block *current = &ir->blocks[block];
+    int count = 0;
+    if (current->count > 0 && current->code[current->count - 1].target >= 0) {
+        out[count++] = current->code[current->count - 1].target;
+    }
+    if (current->fallthrough >= 0 &&
+        (count == 0 || out[0] != current->fallthrough)) {
+        out[count++] = current->fallthrough;
+    }
+    return count;
+}
+
+static int predOf(const Ir *ir, const Block *block, int index) {
+    return ir->preds[block->preds + index];
+}
+
+// Marks the blocks of the loop `header` starts, from every back edge to it.
+// Fails when a block reaches the loop without passing through the header.
+static bool naturalLoop(const Ir *ir, int header, bool *inLoop) {
+    memset(inLoop, 0, sizeof(bool) * (size_t) ir->blockCount);
+    int *work = allocate((size_t) ir->blockCount, sizeof(int));
+    int pending = 0;
+    const Block *start = &ir->blocks[header];
+    inLoop[header] = true;
+    for (int i = 0; i < start->predCount; i++) {
+        int pred = predOf(ir, start, i);
+        if (ir->blocks[pred].order >= start->order && !inLoop[pred]) {
+            inLoop[pred] = true;
+            work[pending++] = pred;
+        }
+    }
+    bool valid = true;
+    while (pending > 0) {
+        int block = work[--pending];
+        if (block == ir->entry) valid = false;
+        const Block *current = &ir->blocks[block];
+        for (int i = 0; i < current->predCount; i++) {
+            int pred = predOf(ir, current, i);
+            if (inLoop[pred]) continue;
+            inLoop[pred] = true;
+            work[pending++] = pred;
+        }
+    }
+    free(work);
+    return valid;
+}
+
+// Finds the reachable blocks, their predecessors, stack heights and loops.
+// Fails on code that does not keep one stack height per instruction, or
+// whose loops can be entered in the middle.
+static bool analyze(Ir *ir) {
+    int count = ir->blockCount;
+    for (int b = 0; b < count; b++) {
+        Block *block = &ir->blocks[b];
+        block->predCount = 0;
+        block->depth = -1;
+        block->order = -1;
+        block->loopDepth = 0;
+        block->header = false;
+    }
+
+    int *stack = allocate((size_t) count, sizeof(int));
+    int *next = allocate((size_t) count, sizeof(int));
+    bool *seen = allocate((size_t) count, sizeof(bool));
+    ir->rpo = realloc(ir->rpo, sizeof(int) * (size_t) count);
+    if (ir->rpo == nullptr) exit(1);
+    int top = 0;
+    int post = count;
+    stack[top++] = ir->entry;
+    seen[ir->entry] = true;
+    while (top > 0) {
+        int block = stack[top - 1];
+        int succ[2];
+        int succCount = successors(ir, block, succ);
+        if (next[block] < succCount) {
+            int s = succ[next[block]++];
+            if (!seen[s]) {
+                seen[s] = true;
+                stack[top++] = s;
+            }
+        } else {
+            ir->rpo[--post] = block;
+            top--;
+        }
+    }
+    // The reverse postorder was filled in from the back.
+    ir->rpoCount = count - post;
+    memmove(ir->rpo, &ir->rpo[post], sizeof(int) * (size_t) ir->rpoCount);
+    for (int r = 0; r < ir->rpoCount; r++) {
+        ir->blocks[ir->rpo[r]].order = r;
+    }
+
+    int edges = 0;
+    for (int r = 0; r < ir->rpoCount; r++) {
+        int succ[2];
+        int succCount = successors(ir, ir->rpo[r], succ);
+        for (int s = 0; s < succCount; s++) ir->blocks[succ[s]].predCount++;
+        edges += succCount;
+    }
+    ir->preds = realloc(ir->preds, sizeof(int) * (size_t) (edges + 1));
+    if (ir->preds == nullptr) exit(1);
+    int first = 0;
+    for (int b = 0; b < count; b++) {
+        ir->blocks[b].preds = first;
+        first += ir->blocks[b].predCount;
+        ir->blocks[b].predCount = 0;
+    }
+    for (int r = 0; r < ir->rpoCount; r++) {
+        int succ[2];
+        int succCount = successors(ir, ir->rpo[r], succ);
+        for (int s = 0; s < succCount; s++) {
+            Block *block = &ir->blocks[succ[s]];
+            ir->preds[block->preds + block->predCount++] = ir->rpo[r];
+        }
+    }
+
+    bool valid = true;
+    ir->maxDepth = ir->entryDepth;
+    ir->blocks[ir->entry].depth = ir->entryDepth;
+    for (int r = 0; valid && r < ir->rpoCount; r++) {
+        int b = ir->rpo[r];
+        Block *block = &ir->blocks[b];
+        int depth = block->depth;
+        for (int i = 0; valid && i < block->count; i++) {
+            const Ins *ins = &block->code[i];
+            StackUse use = stackUse(ir, ins);
+            bool local = ins->op == OP_GET_LOCAL || ins->op == OP_SET_LOCAL ||
+                         ins->op == OP_SET_LOCAL_POP;
+            if (use.pops > depth ||
+                (local && ins->slot < TEMP_SLOT && ins->slot >= depth)) {
+                valid = false;
+            }
+            depth += use.pushes - use.pops;
+            if (depth > ir->maxDepth) ir->maxDepth = depth;
+        }
+        int succ[2];
+        int succCount = successors(ir, b, succ);
+        for (int s = 0; valid && s < succCount; s++) {
+            Block *target = &ir->blocks[succ[s]];
+            if (target->depth < 0) target->depth = depth;
+            if (target->depth != depth) valid = false;
+        }
+    }
+
+    bool *inLoop = allocate((size_t) count, sizeof(bool));
+    for (int r = 0; valid && r < ir->rpoCount; r++) {
+        int h = ir->rpo[r];
+        Block *header = &ir->blocks[h];
+        for (int i = 0; i < header->predCount; i++) {
+            if (ir->blocks[predOf(ir, header, i)].order >= header->order) {
+                header->header = true;
+            }
+        }
+        if (!header->header) continue;
+        if (!naturalLoop(ir, h, inLoop)) valid = false;
+        for (int b = 0; b < count; b++) {
+            if (inLoop[b]) ir->blocks[b].loopDepth++;
+        }
+    }
+    free(inLoop);
+    free(stack);
+    free(next);
+    free(seen);
+    return valid;
+}
+
+static int variableOf(const Ir *ir, int slot) {
+    return slot >= TEMP_SLOT ? ir->maxDepth + slot - TEMP_SLOT : slot;
+}
+
+static int slotOf(const Ir *ir, int variable) {
+    return variable >= ir->maxDepth ? TEMP_SLOT + variable - ir->maxDepth
+                                    : variable;
+}
+
+static int newValue(Ir *ir, ValueKind kind, int variable, int block,
+                    int ins) {
+    ir->values = reserve(ir->values, ir->valueCount, &ir->valueCapacity,
+                         sizeof(SsaValue));
+    int value = ir->valueCount++;
+    ir->values[value] = (SsaValue){kind, variable, block, ins, value, -1};
+    return value;
+}
+
+static void addOperand(Ir *ir, int value) {
+    ir->operands = reserve(ir->operands, ir->operandCount,
+                           &ir->operandCapacity, sizeof(int));
+    ir->operands[ir->operandCount++] = value;
+}
+
+static int find(Ir *ir, int value) {
+    while (ir->values[value].parent != value) {
+        int parent = ir->values[value].parent;
+        ir->values[value].parent = ir->values[parent].parent;
+        value = parent;
+    }
+    return value;
+}
+
+// Names the values the instruction pops and pushes, and updates `state`,
+// the value of each variable.
+static bool defineValues(Ir *ir, int b, int i, int *state, int *depth) {
+    Ins *ins = &ir->blocks[b].code[i];
+    StackUse use = stackUse(ir, ins);
+    ins->inputs = ir->operandCount;
+    for (int k = 0; k < use.pops; k++) {
+        addOperand(ir, state[*depth - use.pops + k]);
+    }
+    int output = -1;
+    if (ins->op == OP_GET_LOCAL) {
+        output = isCaptured(ir, ins->slot)
+                     ? newValue(ir, VALUE_RESULT, *depth, b, i)
+                     : state[variableOf(ir, ins->slot)];
+        if (output < 0) return false;
+    } else if (use.pushes > 0) {
+        output = use.passthrough >= 0
+                     ? ir->operands[ins->inputs + use.passthrough]
+                     : newValue(ir, VALUE_RESULT, *depth - use.pops, b, i);
+    }
+    if (ins->op == OP_SET_LOCAL || ins->op == OP_SET_LOCAL_POP) {
+        int variable = variableOf(ir, ins->slot);
+        state[variable] =
+            isCaptured(ir, ins->slot)
+                ? newValue(ir, VALUE_RESULT, variable, b, i)
+                : ir->operands[ins->inputs + use.pops - 1];
+    }
+    *depth -= use.pops;
+    ins->output = output;
+    if (use.pushes > 0) state[(*depth)++] = output;
+    return true;
+}
+
+// Steps `state` over an instruction defineValues() has seen.
+static void replay(const Ir *ir, const Ins *ins, int *state, int *depth) {
+    StackUse use = stackUse(ir, ins);
+    if (ins->op == OP_SET_LOCAL || ins->op == OP_SET_LOCAL_POP) {
+        state[variableOf(ir, ins->slot)] =
+            ir->operands[ins->inputs + use.pops - 1];
+    }
+    *depth -= use.pops;
+    if (use.pushes > 0) state[(*depth)++] = ins->output;
+}
+
+// Puts the code in SSA form. Every join gets a phi for each variable, and
+// phis that only merge one value are then folded into it, so find() gives
+// the value a variable really holds.
+static bool buildSsa(Ir *ir) {
+    int variables = ir->maxDepth + ir->temps;
+    ir->valueCount = 0;
+    ir->operandCount = 0;
+    // The values variables hold on entry are numbered like the variables.
+    for (int v = 0; v < variables; v++) {
+        newValue(ir, VALUE_ENTRY, v, ir->entry, -1);
+    }
+
+    for (int r = 0; r < ir->rpoCount; r++) {
+        int b = ir->rpo[r];
+        Block *block = &ir->blocks[b];
+        size_t size = sizeof(int) * (size_t) (variables > 0 ? variables : 1);
+        block->entry = realloc(block->entry, size);
+        block->exit = realloc(block->exit, size);
+        if (block->entry == nullptr || block->exit == nullptr) exit(1);
+        bool join = block->predCount + (b == ir->entry ? 1 : 0) > 1;
+        for (int v = 0; v < variables; v++) {
+            if (v >= block->depth && v < ir->maxDepth) {
+                block->entry[v] = -1;
+            } else if (join) {
+                block->entry[v] = newValue(ir, VALUE_PHI, v, b, -1);
+            } else if (b == ir->entry) {
+                block->entry[v] = v;
+            } else {
+                block->entry[v] = ir->blocks[predOf(ir, block, 0)].exit[v];
+            }
+        }
+        memcpy(block->exit, block->entry, size);
+        int depth = block->depth;
+        for (int i = 0; i < block->count; i++) {
+            if (!defineValues(ir, b, i, ir->blocks[b].exit, &depth)) {
+                return false;
+            }
+        }
+    }
+
+    for (int value = 0; value < ir->valueCount; value++) {
+        if (ir->values[value].kind != VALUE_PHI) continue;
+        const Block *block = &ir->blocks[ir->values[value].block];
+        int variable = ir->values[value].variable;
+        ir->values[value].operands = ir->operandCount;
+        for (int p = 0; p < block->predCount; p++) {
+            int input = ir->blocks[predOf(ir, block, p)].exit[variable];
+            if (input < 0) return false;
+            addOperand(ir, input);
+        }
+        if (ir->values[value].block == ir->entry) addOperand(ir, variable);
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int value = 0; value < ir->valueCount; value++) {
+            SsaValue *phi = &ir->values[value];
+            if (phi->kind != VALUE_PHI || phi->parent != value) continue;
+            const Block *block = &ir->blocks[phi->block];
+            int count = block->predCount + (phi->block == ir->entry ? 1 : 0);
+            int same = -1;
+            bool trivial = true;
+            for (int k = 0; k < count; k++) {
+                int input = find(ir, ir->operands[phi->operands + k]);
+                if (input == value || input == same) continue;
+                if (same >= 0) {
+                    trivial = false;
+                    break;
+                }
+                same = input;
+            }
+            if (trivial && same >= 0) {
+                ir->values[value].parent = same;
+                changed = true;
+            }
+        }
+    }
+    return true;
+}
+
+static const Ins *definition(const Ir *ir, int value) {
+    const SsaValue *def = &ir->values[value];
+    if (def->kind != VALUE_RESULT) return nullptr;
+    return &ir->blocks[def->block].code[def->ins];
+}
+
+static void propagateCopies(Ir *ir) {
+    int *state = allocate((size_t) (ir->maxDepth + ir->temps), sizeof(int));
+    for (int r = 0; r < ir->rpoCount; r++) {
+        Block *block = &ir->blocks[ir->rpo[r]];
+        memcpy(state, block->entry,
+               sizeof(int) * (size_t) (ir->maxDepth + ir->temps));
+        int depth = block->depth;
+        for (int i = 0; i < block->count; i++) {
+            Ins *ins = &block->code[i];
+            if (ins->op == OP_GET_LOCAL && !isCaptured(ir, ins->slot)) {
+                int value = find(ir, ins->output);
+                const Ins *source = definition(ir, value);
+                int variable = ir->values[value].variable;
+                int home = slotOf(ir, variable);
+                if (source != nullptr && isLiteral(source->op)) {
+                    ins->op = source->op;
+                    ins->offset = source->offset;
+                    ins->slot = -1;
+                } else if (home != ins->slot && !isCaptured(ir, home) &&
+                           (home >= TEMP_SLOT || home < depth) &&
+                           state[variable] >= 0 &&
+                           find(ir, state[variable]) == value) {
+                    ins->slot = home;
+                }
+            }
+            replay(ir, ins, state, &depth);
+        }
+    }
+    free(state);
+}
+
+// Whether `ins` may change what `load`, a GET_GLOBAL, GET_UPVALUE,
+// GET_PROPERTY or GET_INDEX, reads.
+static bool clobbers(const Ir *ir, const Ins *ins, const Ins *load) {
+    switch (ins->op) {
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE: return true;
+        case OP_METHOD:
+        case OP_INHERIT: return load->op == OP_GET_PROPERTY;
+        case OP_SET_PROPERTY:
+        case OP_SET_PROPERTY_POP:
+            return load->op == OP_GET_PROPERTY &&
+                   nameOf(ir, ins) == nameOf(ir, load);
+        case OP_SET_INDEX:
+        case OP_LIST_DATA:
+        case OP_MAP_DATA: return load->op == OP_GET_INDEX;
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_POP:
+            return load->op == OP_GET_GLOBAL &&
+                   operand(ir, ins, 1) == operand(ir, load, 1) &&
+                   operand(ir, ins, 2) == operand(ir, load, 2);
+        case OP_SET_UPVALUE:
+            return load->op == OP_GET_UPVALUE &&
+                   operand(ir, ins, 1) == operand(ir, load, 1);
+        default: return false;
+    }
+}
+
+static bool loopClobbers(const Ir *ir, const bool *inLoop, const Ins *load) {
+    for (int b = 0; b < ir->blockCount; b++) {
+        if (!inLoop[b]) continue;
+        const Block *block = &ir->blocks[b];
+        for (int i = 0; i < block->count; i++) {
+            if (clobbers(ir, &block->code[i], load)) return true;
+        }
+    }
+    return false;
+}
+
+// Can neither fail nor be seen, so invariant code may move ahead of it.
+static bool isQuiet(uint8_t op) {
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_POP:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
+        case OP_GET_UPVALUE:
+        case OP_NOT:
+        case OP_EQUAL:
+        case OP_JUMP: return true;
+        default: return false;
+    }
+}
+
+static bool canRotate(uint8_t op) {
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_POP:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_GET_INDEX:
+        case OP_SET_INDEX:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_CALL:
+        case OP_INVOKE:
+        case OP_GET_SUPER:
+        case OP_SUPER_INVOKE: return true;
+        default: return false;
+    }
+}
+
+// A loop whose header tests the condition and leaves, falling into the
+// body, with every back edge a LOOP to the header.
+static bool isRotatable(const Ir *ir, int h, bool *inLoop) {
+    const Block *header = &ir->blocks[h];
+    if (header->count == 0 || header->count > ROTATE_MAX) return false;
+    const Ins *branch = &header->code[header->count - 1];
+    if (!isBranch(branch->op)) return false;
+    for (int i = 0; i < header->count - 1; i++) {
+        if (!canRotate(header->code[i].op)) return false;
+    }
+    if (!naturalLoop(ir, h, inLoop)) return false;
+    int body = header->fallthrough;
+    if (inLoop[branch->target] || body < 0 || !inLoop[body] ||
+        ir->blocks[body].predCount != 1) {
+        return false;
+    }
+    int exit = layoutIndex(ir, branch->target);
+    for (int i = 0; i < header->predCount; i++) {
+        int pred = predOf(ir, header, i);
+        if (!inLoop[pred]) continue;
+        const Block *latch = &ir->blocks[pred];
+        // The copied exit test jumps forward.
+        if (latch->count == 0 || latch->code[latch->count - 1].op != OP_LOOP ||
+            layoutIndex(ir, pred) > exit) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Turns `while (c) body` into `if (c) do body while (c)`: each back edge
+// tests the condition itself and loops to the start of the body.
+static void rotate(Ir *ir, int h, const bool *inLoop) {
+    int body = ir->blocks[h].fallthrough;
+    int predCount = ir->blocks[h].predCount;
+    int *latches = allocate((size_t) predCount, sizeof(int));
+    int latchCount = 0;
+    for (int i = 0; i < predCount; i++) {
+        int pred = predOf(ir, &ir->blocks[h], i);
+        if (inLoop[pred]) latches[latchCount++] = pred;
+    }
+    for (int l = 0; l < latchCount; l++) {
+        Block *latch = &ir->blocks[latches[l]];
+        int line = latch->code[--latch->count].line;
+        for (int i = 0; i < ir->blocks[h].count; i++) {
+            append(latch, ir->blocks[h].code[i]);
+        }
+        int back = newBlock(ir);
+        Ins loop = newIns(OP_LOOP, -1, line);
+        loop.target = body;
+        append(&ir->blocks[back], loop);
+        ir->blocks[latches[l]].fallthrough = back;
+        place(ir, back, latches[l], true);
+    }
+    free(latches);
+}
+
+static bool rotateLoops(Ir *ir) {
+    int limit = ir->blockCount;
+    bool *tried = allocate((size_t) limit, sizeof(bool));
+    bool *inLoop = nullptr;
+    bool valid = true;
+    for (;;) {
+        valid = analyze(ir);
+        if (!valid) break;
+        inLoop = realloc(inLoop, sizeof(bool) * (size_t) ir->blockCount);
+        if (inLoop == nullptr) exit(1);
+        int header = -1;
+        for (int h = 0; h < limit && header < 0; h++) {
+            if (tried[h] || !ir->blocks[h].header) continue;
+            tried[h] = true;
+            if (isRotatable(ir, h, inLoop)) header = h;
+        }
+        if (header < 0) break;
+        tried[ir->blocks[header].fallthrough] = true;
+        rotate(ir, header, inLoop);
+    }
+    free(tried);
+    free(inLoop);
+    return valid;
+}
+
+typedef struct {
+    int block;
+    int start;
+    int end;  // the root, which pushes the tree's value
+    int path; // position of the start on the path through the loop
+} Tree;
+
+// Whether the loop computes the same value with the instruction every time,
+// given that its operands are, and whether moving it saves any work.
+static bool isInvariant(Ir *ir, int header, const bool *inLoop,
+                        const Ins *ins, bool *worth) {
+    *worth = false;
+    switch (ins->op) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE: return true;
+        case OP_GET_LOCAL: {
+            // Must hold the value before the loop too.
+            if (isCaptured(ir, ins->slot)) return false;
+            const Block *start = &ir->blocks[header];
+            int value = find(ir, ins->output);
+            int variable = variableOf(ir, ins->slot);
+            const SsaValue *def = &ir->values[value];
+            return (ins->slot >= TEMP_SLOT || ins->slot < start->depth) &&
+                   find(ir, start->entry[variable]) == value &&
+                   (def->kind == VALUE_ENTRY || !inLoop[def->block]);
+        }
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE: return !loopClobbers(ir, inLoop, ins);
+        case OP_GET_PROPERTY:
+        case OP_GET_INDEX:
+            *worth = true;
+            return !loopClobbers(ir, inLoop, ins);
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NOT:
+        case OP_NEGATE: *worth = true; return true;
+        default: return false;
+    }
+}
+
+// Moves invariant expressions the first iteration of the loop computes
+// before anything that could fail or be seen into a new block in front of
+// the loop. Each one leaves its value in a new temporary.
+static bool hoistLoop(Ir *ir, int header, const bool *inLoop) {
+    const Block *start = &ir->blocks[header];
+    for (int i = 0; i < start->predCount; i++) {
+        int pred = predOf(ir, start, i);
+        // The block in front will fall into the header.
+        if (inLoop[pred] && ir->blocks[pred].fallthrough == header) {
+            return false;
+        }
+    }
+
+    // The path runs through blocks that only the one before leads to. An
+    // expression tree never spans two of them, as the stack in each block
+    // starts out unknown.
+    int *treeStart = allocate((size_t) ir->maxDepth, sizeof(int));
+    int *treeEnd = allocate((size_t) ir->maxDepth, sizeof(int));
+    bool *treeWorth = allocate((size_t) ir->maxDepth, sizeof(bool));
+    bool *quiet = allocate(HOIST_MAX, sizeof(bool));
+    bool *hoisted = allocate(HOIST_MAX, sizeof(bool));
+    Tree *trees = allocate(HOIST_MAX, sizeof(Tree));
+    int treeCount = 0;
+    int path = 0;
+    int block = header;
+    while (path < HOIST_MAX) {
+        const Block *current = &ir->blocks[block];
+        int base = path;
+        int depth = current->depth;
+        for (int p = 0; p < depth; p++) treeStart[p] = -1;
+        for (int i = 0; i < current->count && path < HOIST_MAX; i++) {
+            const Ins *ins = &current->code[i];
+            StackUse use = stackUse(ir, ins);
+            int first = depth - use.pops;
+            bool worth;
+            bool invariant = isInvariant(ir, header, inLoop, ins, &worth);
+            // The operands' trees must be right before it, in order.
+            for (int k = 0; invariant && k < use.pops; k++) {
+                int p = first + k;
+                int expected = k == 0 ? treeStart[p] : treeEnd[p - 1] + 1;
+                if (treeStart[p] < 0 || treeStart[p] != expected) {
+                    invariant = false;
+                }
+            }
+            if (invariant && use.pops > 0 && treeEnd[depth - 1] != path - 1) {
+                invariant = false;
+            }
+            for (int k = 0; k < use.pops; k++) {
+                int p = first + k;
+                if (invariant || treeStart[p] < 0 || !treeWorth[p]) continue;
+                bool movable = ir->maxDepth + ir->temps + treeCount <
+                               UINT8_COUNT;
+                for (int q = 0; movable && q < treeStart[p]; q++) {
+                    if (!quiet[q] && !hoisted[q]) movable = false;
+                }
+                if (!movable) continue;
+                for (int q = treeStart[p]; q <= treeEnd[p]; q++) {
+                    hoisted[q] = true;
+                }
+                trees[treeCount++] = (Tree){block, treeStart[p] - base,
+                                            treeEnd[p] - base, treeStart[p]};
+            }
+
+            quiet[path] = isQuiet(ins->op);
+            bool anyWorth = worth;
+            for (int k = 0; k < use.pops; k++) {
+                anyWorth = anyWorth || treeWorth[first + k];
+            }
+            depth = first;
+            if (use.pushes > 0) {
+                treeStart[depth] =
+                    invariant ? (use.pops > 0 ? treeStart[first] : path) : -1;
+                treeEnd[depth] = path;
+                treeWorth[depth] = invariant && anyWorth;
+                depth++;
+            }
+            path++;
+        }
+
+        if (current->count == 0) break;
+        const Ins *last = &current->code[current->count - 1];
+        int next = -1;
+        if (!isJump(last->op)) next = current->fallthrough;
+        if (last->op == OP_JUMP) next = last->target;
+        if (next < 0 || next == header || !inLoop[next] ||
+            ir->blocks[next].predCount != 1) {
+            break;
+        }
+        block = next;
+    }
+
+    if (treeCount > 0) {
+        // Trees are found as they are used, which is not always the order
+        // they run in.
+        for (int i = 1; i < treeCount; i++) {
+            Tree tree = trees[i];
+            int j = i;
+            for (; j > 0 && trees[j - 1].path > tree.path; j--) {
+                trees[j] = trees[j - 1];
+            }
+            trees[j] = tree;
+        }
+
+        int pre = newBlock(ir);
+        ir->blocks[pre].fallthrough = header;
+        place(ir, pre, header, false);
+        const Block *target = &ir->blocks[header];
+        for (int i = 0; i < target->predCount; i++) {
+            Block *pred = &ir->blocks[predOf(ir, target, i)];
+            if (inLoop[predOf(ir, target, i)]) continue;
+            if (pred->fallthrough == header) pred->fallthrough = pre;
+            if (pred->count > 0 &&
+                pred->code[pred->count - 1].target == header) {
+                pred->code[pred->count - 1].target = pre;
+            }
+        }
+        if (ir->entry == header) ir->entry = pre;
+
+        for (int t = 0; t < treeCount; t++) {
+            const Block *from = &ir->blocks[trees[t].block];
+            for (int i = trees[t].start; i <= trees[t].end; i++) {
+                append(&ir->blocks[pre], from->code[i]);
+            }
+            append(&ir->blocks[pre],
+                   newIns(OP_SET_LOCAL_POP, TEMP_SLOT + ir->temps + t,
+                          from->code[trees[t].end].line));
+        }
+        for (int t = treeCount - 1; t >= 0; t--) {
+            Block *from = &ir->blocks[trees[t].block];
+            int removed = trees[t].end - trees[t].start;
+            from->code[trees[t].start] =
+                newIns(OP_GET_LOCAL, TEMP_SLOT + ir->temps + t,
+                       from->code[trees[t].end].line);
+            memmove(&from->code[trees[t].start + 1],
+                    &from->code[trees[t].end + 1],
+                    sizeof(Ins) * (size_t) (from->count - trees[t].end - 1));
+            from->count -= removed;
+        }
+        ir->temps += treeCount;
+    }
+    free(treeStart);
+    free(treeEnd);
+    free(treeWorth);
+    free(quiet);
+    free(hoisted);
+    free(trees);
+    return treeCount > 0;
+}
+
+// Hoists out of one loop at a time, as each changes the graph.
+static bool hoistInvariants(Ir *ir) {
+    int limit = ir->blockCount;
+    bool *inLoop = nullptr;
+    bool stale = false;
+    bool valid = true;
+    for (int h = 0; valid && h < limit; h++) {
+        if (stale) {
+            valid = analyze(ir) && buildSsa(ir);
+            stale = false;
+            if (!valid) break;
+        }
+        if (!ir->blocks[h].header) continue;
+        inLoop = realloc(inLoop, sizeof(bool) * (size_t) ir->blockCount);
+        if (inLoop == nullptr) exit(1);
+        if (naturalLoop(ir, h, inLoop) && hoistLoop(ir, h, inLoop)) {
+            stale = true;
+        }
+    }
+    free(inLoop);
+    return valid;
+}
+
+typedef struct {
+    uint8_t op;
+    ObjString *name; // of a property load
+    int inputs[2];
+    const Ins *load; // an instance, for clobbers()
+    int temp;
+    int benefit;
+} Expression;
+
+static bool isPure(uint8_t op) {
+    switch (op) {
+        case OP_GET_PROPERTY:
+        case OP_GET_INDEX:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NOT:
+        case OP_NEGATE: return true;
+        default: return false;
+    }
+}
+
+static bool isLoad(uint8_t op) {
+    return op == OP_GET_PROPERTY || op == OP_GET_INDEX;
+}
+
+static int weight(const Block *block) {
+    int depth = block->loopDepth < 4 ? block->loopDepth : 4;
+    return 1 << (3 * depth);
+}
+
+typedef struct {
+    Expression *expressions;
+    int count;
+    int capacity;
+    int *table; // open addressing over expression indices, -1 when empty
+    int tableCapacity;
+} Expressions;
+
+static uint32_t hashExpression(const Expression *expression) {
+    uint32_t hash = 2166136261u;
+    uint32_t parts[] = {expression->op, (uint32_t) (uintptr_t) expression->name,
+                        (uint32_t) expression->inputs[0],
+                        (uint32_t) expression->inputs[1]};
+    for (int i = 0; i < 4; i++) {
+        hash ^= parts[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool sameExpression(const Expression *a, const Expression *b) {
+    return a->op == b->op && a->name == b->name &&
+           a->inputs[0] == b->inputs[0] && a->inputs[1] == b->inputs[1];
+}
+
+static void growTable(Expressions *set) {
+    free(set->table);
+    set->tableCapacity = set->tableCapacity < 16 ? 16 : set->tableCapacity * 2;
+    set->table = malloc(sizeof(int) * (size_t) set->tableCapacity);
+    if (set->table == nullptr) exit(1);
+    for (int i = 0; i < set->tableCapacity; i++) set->table[i] = -1;
+    for (int e = 0; e < set->count; e++) {
+        uint32_t i = hashExpression(&set->expressions[e]);
+        i &= (uint32_t) set->tableCapacity - 1;
+        while (set->table[i] >= 0) i = (i + 1) & (set->tableCapacity - 1);
+        set->table[i] = e;
+    }
+}
+
+static int intern(Expressions *set, Expression expression) {
+    if ((set->count + 1) * 2 > set->tableCapacity) growTable(set);
+    uint32_t mask = (uint32_t) set->tableCapacity - 1;
+    uint32_t i = hashExpression(&expression) & mask;
+    while (set->table[i] >= 0) {
+        if (sameExpression(&set->expressions[set->table[i]], &expression)) {
+            return set->table[i];
+        }
+        i = (i + 1) & mask;
+    }
+    set->expressions = reserve(set->expressions, set->count, &set->capacity,
+                               sizeof(Expression));
+    set->expressions[set->count] = expression;
+    set->table[i] = set->count;
+    return set->count++;
+}
+
+static void killLoads(const Ir *ir, const Expressions *set, const Ins *ins,
+                      uint64_t *available) {
+    for (int e = 0; e < set->count; e++) {
+        const Expression *expression = &set->expressions[e];
+        if (isLoad(expression->op) && clobbers(ir, ins, expression->load)) {
+            available[e / 64] &= ~(UINT64_C(1) << (e % 64));
+        }
+    }
+}
+
+// Walks the block from `available`, recording for each instruction that
+// computes an expression whether one is already available (2) or not (1).
+static void scanAvailable(const Ir *ir, const Expressions *set, int b,
+                          const int *classOf, uint64_t *available,
+                          uint8_t *role) {
+    const Block *block = &ir->blocks[b];
+    for (int i = 0; i < block->count; i++) {
+        int e = classOf[i];
+        if (e >= 0) {
+            uint64_t bit = UINT64_C(1) << (e % 64);
+            if (role != nullptr) role[i] = available[e / 64] & bit ? 2 : 1;
+            available[e / 64] |= bit;
+        }
+        switch (block->code[i].op) {
+            case OP_CALL:
+            case OP_TAIL_CALL:
+            case OP_INVOKE:
+            case OP_SUPER_INVOKE:
+            case OP_METHOD:
+            case OP_INHERIT:
+            case OP_SET_PROPERTY:
+            case OP_SET_PROPERTY_POP:
+            case OP_SET_INDEX:
+            case OP_LIST_DATA:
+            case OP_MAP_DATA:
+                killLoads(ir, set, &block->code[i], available);
+                break;
+            default: break;
+        }
+    }
+}
+
+// Keeps an expression computed on every path to another instance of it in
+// a temporary, when the loads saved outweigh the stores added.
+static void eliminateCommonSubexpressions(Ir *ir) {
+    Expressions set = {0};
+    int **classOf = allocate((size_t) ir->blockCount, sizeof(int *));
+    for (int r = 0; r < ir->rpoCount; r++) {
+        int b = ir->rpo[r];
+        const Block *block = &ir->blocks[b];
+        classOf[b] = allocate((size_t) block->count, sizeof(int));
+        for (int i = 0; i < block->count; i++) {
+            const Ins *ins = &block->code[i];
+            classOf[b][i] = -1;
+            if (!isPure(ins->op)) continue;
+            int pops = stackUse(ir, ins).pops;
+            Expression expression = {ins->op, nullptr, {-1, -1}, ins, -1, -1};
+            if (ins->op == OP_GET_PROPERTY) expression.name = nameOf(ir, ins);
+            for (int k = 0; k < pops; k++) {
+                expression.inputs[k] = find(ir, ir->operands[ins->inputs + k]);
+            }
+            classOf[b][i] = intern(&set, expression);
+        }
+    }
+
+    int words = (set.count + 63) / 64;
+    if (set.count > 0) {
+        uint64_t *out = allocate((size_t) ir->blockCount * (size_t) words,
+                                 sizeof(uint64_t));
+        uint64_t *available = allocate((size_t) words, sizeof(uint64_t));
+        for (int b = 0; b < ir->blockCount * words; b++) out[b] = UINT64_MAX;
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (int r = 0; r < ir->rpoCount; r++) {
+                int b = ir->rpo[r];
+                const Block *block = &ir->blocks[b];
+                for (int w = 0; w < words; w++) {
+                    available[w] = b == ir->entry ? 0 : UINT64_MAX;
+                }
+                for (int p = 0; p < block->predCount; p++) {
+                    const uint64_t *pred = &out[predOf(ir, block, p) * words];
+                    for (int w = 0; w < words; w++) available[w] &= pred[w];
+                }
+                scanAvailable(ir, &set, b, classOf[b], available, nullptr);
+                if (memcmp(available, &out[b * words],
+                           sizeof(uint64_t) * (size_t) words) != 0) {
+                    memcpy(&out[b * words], available,
+                           sizeof(uint64_t) * (size_t) words);
+                    changed = true;
+                }
+            }
+        }
+
+        uint8_t **roles = allocate((size_t) ir->blockCount, sizeof(uint8_t *));
+        for (int e = 0; e < set.count; e++) set.expressions[e].benefit = -1;
+        for (int r = 0; r < ir->rpoCount; r++) {
+            int b = ir->rpo[r];
+            const Block *block = &ir->blocks[b];
+            roles[b] = allocate((size_t) block->count, sizeof(uint8_t));
+            for (int w = 0; w < words; w++) {
+                available[w] = b == ir->entry ? 0 : UINT64_MAX;
+            }
+            for (int p = 0; p < block->predCount; p++) {
+                const uint64_t *pred = &out[predOf(ir, block, p) * words];
+                for (int w = 0; w < words; w++) available[w] &= pred[w];
+            }
+            scanAvailable(ir, &set, b, classOf[b], available, roles[b]);
+            for (int i = 0; i < block->count; i++) {
+                if (classOf[b][i] < 0) continue;
+                Expression *expression = &set.expressions[classOf[b][i]];
+                // A repeat saves pushing the operands and computing it again;
+                // the first instance pays for a store.
+                int save = stackUse(ir, &block->code[i]).pops +
+                           (isLoad(expression->op) ? 1 : 0);
+                expression->benefit += roles[b][i] == 2
+                                           ? weight(block) * save
+                                           : -weight(block);
+            }
+        }
+
+        for (int e = 0; e < set.count; e++) {
+            Expression *expression = &set.expressions[e];
+            if (expression->benefit > 0 &&
+                ir->maxDepth + ir->temps < UINT8_COUNT) {
+                expression->temp = TEMP_SLOT + ir->temps++;
+            }
+        }
+        for (int r = 0; r < ir->rpoCount; r++) {
+            int b = ir->rpo[r];
+            Block *block = &ir->blocks[b];
+            Ins *old = block->code;
+            int oldCount = block->count;
+            block->code = nullptr;
+            block->count = 0;
+            block->capacity = 0;
+            for (int i = 0; i < oldCount; i++) {
+                int e = classOf[b][i];
+                int temp = e >= 0 ? set.expressions[e].temp : -1;
+                if (temp < 0) {
+                    append(block, old[i]);
+                } else if (roles[b][i] == 1) {
+                    append(block, old[i]);
+                    append(block, newIns(OP_SET_LOCAL, temp, old[i].line));
+                } else {
+                    int pops = stackUse(ir, &old[i]).pops;
+                    for (int k = 0; k < pops; k++) {
+                        append(block, newIns(OP_POP, -1, old[i].line));
+                    }
+                    append(block, newIns(OP_GET_LOCAL, temp, old[i].line));
+                }
+            }
+            free(old);
+            free(roles[b]);
+        }
+        free(roles);
+        free(out);
+        free(available);
+    }
+    for (int r = 0; r < ir->rpoCount; r++) free(classOf[ir->rpo[r]]);
+    free(classOf);
+    free(set.expressions);
+    free(set.table);
+}
+
+typedef struct {
+    uint64_t bits[UINT8_COUNT / 64];
+} SlotSet;
+
+static bool hasSlot(const SlotSet *set, int slot) {
+    return (set->bits[slot / 64] >> (slot % 64)) & 1;
+}
+
+static void addSlot(SlotSet *set, int slot) {
+    set->bits[slot / 64] |= UINT64_C(1) << (slot % 64);
+}
+
+static void removeSlot(SlotSet *set, int slot) {
+    set->bits[slot / 64] &= ~(UINT64_C(1) << (slot % 64));
+}
+
+static SlotSet liveOut(const Ir *ir, int b, const SlotSet *liveIn) {
+    SlotSet live = {0};
+    int succ[2];
+    int succCount = successors(ir, b, succ);
+    for (int s = 0; s < succCount; s++) {
+        for (int w = 0; w < UINT8_COUNT / 64; w++) {
+            live.bits[w] |= liveIn[succ[s]].bits[w];
+        }
+    }
+    return live;
+}
+
+// Steps `live` back over the block, marking the stores in `dead`, if given,
+// that nothing reads.
+static void liveThrough(const Ir *ir, int b, SlotSet *live, bool *dead) {
+    const Block *block = &ir->blocks[b];
+    int *depths = allocate((size_t) block->count + 1, sizeof(int));
+    depths[0] = block->depth;
+    for (int i = 0; i < block->count; i++) {
+        StackUse use = stackUse(ir, &block->code[i]);
+        depths[i + 1] = depths[i] + use.pushes - use.pops;
+    }
+    for (int i = block->count - 1; i >= 0; i--) {
+        const Ins *ins = &block->code[i];
+        StackUse use = stackUse(ir, ins);
+        int first = depths[i] - use.pops;
+        if ((ins->op == OP_SET_LOCAL || ins->op == OP_SET_LOCAL_POP) &&
+            !isCaptured(ir, ins->slot)) {
+            if (dead != nullptr && !hasSlot(live, ins->slot)) dead[i] = true;
+            removeSlot(live, ins->slot);
+        }
+        for (int p = first; p < first + use.pushes; p++) removeSlot(live, p);
+        if (ins->op != OP_POP) {
+            for (int p = first; p < depths[i]; p++) addSlot(live, p);
+        }
+        if (ins->op == OP_GET_LOCAL) addSlot(live, ins->slot);
+    }
+    free(depths);
+}
+
+static void eliminateDeadStores(Ir *ir) {
+    SlotSet *liveIn = allocate((size_t) ir->blockCount, sizeof(SlotSet));
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int r = ir->rpoCount - 1; r >= 0; r--) {
+            int b = ir->rpo[r];
+            SlotSet live = liveOut(ir, b, liveIn);
+            liveThrough(ir, b, &live, nullptr);
+            if (memcmp(&live, &liveIn[b], sizeof(SlotSet)) != 0) {
+                liveIn[b] = live;
+                changed = true;
+            }
+        }
+    }
+    for (int r = 0; r < ir->rpoCount; r++) {
+        int b = ir->rpo[r];
+        Block *block = &ir->blocks[b];
+        bool *dead = allocate((size_t) block->count, sizeof(bool));
+        SlotSet live = liveOut(ir, b, liveIn);
+        liveThrough(ir, b, &live, dead);
+        int count = 0;
+        for (int i = 0; i < block->count; i++) {
+            Ins ins = block->code[i];
+            if (dead[i] && ins.op == OP_SET_LOCAL) continue;
+            if (dead[i]) ins = newIns(OP_POP, -1, ins.line);
+            block->code[count++] = ins;
+        }
+        block->count = count;
+        free(dead);
+    }
+    free(liveIn);
+}
+
+typedef struct {
+    uint8_t *code;
+    int *lines;
+    int count;
+    int capacity;
+} Output;
+
+static void emit(Output *out, uint8_t byte, int line) {
+    if (out->count == out->capacity) {
+        out->capacity = GROW_CAPACITY(out->capacity);
+        out->code = realloc(out->code, (size_t) out->capacity);
+        out->lines =
+            realloc(out->lines, sizeof(int) * (size_t) out->capacity);
+        if (out->code == nullptr || out->lines == nullptr) exit(1);
+    }
+    out->code[out->count] = byte;
+    out->lines[out->count++] = line;
+}
+
+// Where a slot ends up once the temporaries are placed after the
+// parameters.
+static int finalSlot(const Ir *ir, int slot) {
+    if (slot >= TEMP_SLOT) return ir->entryDepth + slot - TEMP_SLOT;
+    return slot < ir->entryDepth ? slot : slot + ir->temps;
+}
+
+typedef struct {
+    int at; // of the jump's operand
+    int block;
+} Fixup;
+
+// Generates the reachable blocks in layout order, and a jump wherever a
+// block does not fall into the next one.
+static bool generate(const Ir *ir, Output *out) {
+    if (ir->maxDepth + ir->temps > UINT8_COUNT) return false;
+    int *start = allocate((size_t) ir->blockCount, sizeof(int));
+    Fixup *fixups = nullptr;
+    int fixupCount = 0;
+    int fixupCapacity = 0;
+    for (int b = 0; b < ir->blockCount; b++) start[b] = -1;
+
+    const Block *entry = &ir->blocks[ir->entry];
+    int firstLine = entry->count > 0 ? entry->code[0].line : 1;
+    for (int t = 0; t < ir->temps; t++) emit(out, OP_NIL, firstLine);
+
+    bool valid = true;
+    for (int l = 0; l < ir->layoutCount; l++) {
+        int b = ir->layout[l];
+        const Block *block = &ir->blocks[b];
+        if (block->depth < 0) continue;
+        // The entry block comes first, as the code runs from the start.
+        if (start[ir->entry] < 0 && b != ir->entry) {
+            valid = false;
+            break;
+        }
+        start[b] = out->count;
+        int line = firstLine;
+        for (int i = 0; i < block->count; i++) {
+            const Ins *ins = &block->code[i];
+            line = ins->line;
+            emit(out, ins->op, line);
+            if (ins->op == OP_GET_LOCAL || ins->op == OP_SET_LOCAL ||
+                ins->op == OP_SET_LOCAL_POP) {
+                emit(out, (uint8_t) finalSlot(ir, ins->slot), line);
+            } else if (ins->target >= 0) {
+                fixups = reserve(fixups, fixupCount, &fixupCapacity,
+                                 sizeof(Fixup));
+                fixups[fixupCount++] = (Fixup){out->count, ins->target};
+                emit(out, 0xff, line);
+                emit(out, 0xff, line);
+            } else if (ins->offset >= 0) {
+                int length = instructionLength(ir->chunk, ins->offset);
+                for (int k = 1; k < length; k++) {
+                    uint8_t byte = operand(ir, ins, k);
+                    // The captured local of an upvalue.
+                    if (ins->op == OP_CLOSURE && k % 2 == 0 && byte) {
+                        int slot = finalSlot(ir, operand(ir, ins, ++k));
+                        emit(out, byte, line);
+                        emit(out, (uint8_t) slot, line);
+                        continue;
+                    }
+                    emit(out, byte, line);
+                }
+            }
+        }
+
+        int next = -1;
+        for (int n = l + 1; n < ir->layoutCount; n++) {
+            if (ir->blocks[ir->layout[n]].depth >= 0) {
+                next = ir->layout[n];
+                break;
+            }
+        }
+        if (block->fallthrough >= 0 && block->fallthrough != next) {
+            emit(out, start[block->fallthrough] >= 0 ? OP_LOOP : OP_JUMP, line);
+            fixups = reserve(fixups, fixupCount, &fixupCapacity, sizeof(Fixup));
+            fixups[fixupCount++] = (Fixup){out->count, block->fallthrough};
+            emit(out, 0xff, line);
+            emit(out, 0xff, line);
+        }
+    }
+
+    for (int f = 0; valid && f < fixupCount; f++) {
+        int at = fixups[f].at;
+        int target = start[fixups[f].block];
+        int jump = out->code[at - 1] == OP_LOOP ? at + 2 - target
+                                                : target - at - 2;
+        if (target < 0 || jump < 0 || jump > UINT16_MAX) {
+            valid = false;
+            break;
+        }
+        out->code[at] = (uint8_t) ((jump >> 8) & 0xff);
+        out->code[at + 1] = (uint8_t) (jump & 0xff);
+    }
+    free(fixups);
+    free(start);
+    return valid;
+}
+
+bool optimizeSsa(VM *vm, ObjFunction *function) {
+    Chunk *chunk = &function->chunk;
+    int entryDepth = function->arity + 1;
+    Output first = {0};
+    Output second = {0};
+    Ir ir;
+
+    initIr(&ir, chunk, entryDepth);
+    bool valid = lift(&ir) && rotateLoops(&ir) && analyze(&ir) &&
+                 buildSsa(&ir);
+    if (valid) {
+        propagateCopies(&ir);
+        valid = hoistInvariants(&ir) && analyze(&ir) && buildSsa(&ir);
+    }
+    if (valid) {
+        eliminateCommonSubexpressions(&ir);
+        valid = analyze(&ir) && generate(&ir, &first);
+    }
+    freeIr(&ir);
+
+    // Stores left dead by the passes above are found in the code they
+    // generated, where the temporaries are slots like any other.
+    Chunk generated = *chunk;
+    generated.code = first.code;
+    generated.lines = first.lines;
+    generated.count = first.count;
+    if (valid) {
+        initIr(&ir, &generated, entryDepth);
+        valid = lift(&ir) && analyze(&ir);
+        if (valid) {
+            eliminateDeadStores(&ir);
+            valid = analyze(&ir) && generate(&ir, &second);
+        }
+        freeIr(&ir);
+    }
+    generated.code = second.code;
+    generated.lines = second.lines;
+    generated.count = second.count;
+    valid = valid && maxStackDepth(&generated, entryDepth) >= 0;
+
+    bool changed =
+        valid && (second.count != chunk->count ||
+                  memcmp(second.code, chunk->code, (size_t) chunk->count) != 0);
+    if (changed) {
+        if (second.count > chunk->capacity) {
+            chunk->code = GROW_ARRAY(vm, uint8_t, chunk->code,
+                                     chunk->capacity, second.count);
+            chunk->lines = GROW_ARRAY(vm, int, chunk->lines, chunk->capacity,
+                                      second.count);
+            chunk->capacity = second.count;
+        }
+        memcpy(chunk->code, second.code, (size_t) second.count);
+        memcpy(chunk->lines, second.lines, sizeof(int) * (size_t) second.count);
+        chunk->count = second.count;
+    }
+    free(first.code);
+    free(first.lines);
+    free(second.code);
+    free(second.lines);
+    return changed;
+}
@@ -0,0 +1,13 @@
+#ifndef SSA_H
+#define SSA_H
+#include "object.h"
+
+// Rewrites a finished function's chunk through an SSA form of its code:
+// loops are rotated, copies propagated, loop-invariant expressions hoisted,
+// repeated expressions such as this.field loads computed once, and dead
+// stores to locals dropped. Temporaries take slots of their own, so the
+// function's locals may move. Returns whether the code changed; code the
+// optimizer cannot follow is left as it was.
+bool optimizeSsa(VM *vm, ObjFunction *function);
+
+#endif /* SSA_H */
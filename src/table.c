@@ -13,8 +13,8 @@ void initTable(Table *table) {
     table->entries = nullptr;
 }
 
-void freeTable(Table *table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+void freeTable(VM *vm, Table *table) {
+    FREE_ARRAY(vm, Entry, table->entries, table->capacity);
     initTable(table);
 }
 
@@ -50,8 +50,8 @@ bool tableGet(Table *table, ObjString *key, Value *value) {
     return true;
 }
 
-static void adjustCapacity(Table *table, int capacity) {
-    Entry *entries = ALLOCATE(Entry, capacity);
+static void adjustCapacity(VM *vm, Table *table, int capacity) {
+    Entry *entries = ALLOCATE(vm, Entry, capacity);
     for (int i = 0; i < capacity; i++) {
         entries[i].key = nullptr;
         entries[i].value = NIL_VAL;
@@ -67,23 +67,25 @@ static void adjustCapacity(Table *table, int capacity) {
         dest->value = entry->value;
         table->count++;
     }
-    FREE_ARRAY(Entry, table->entries, table->capacity);
-    table->entries = entries;
-    table->capacity = capacity;
+    FREE_ARRAY(vm, Entry, table->entries, table->capacity);
+    // The marker thread reads the capacity, then the entries.
+    __atomic_store_n(&table->entries, entries, __ATOMIC_RELEASE);
+    __atomic_store_n(&table->capacity, capacity, __ATOMIC_RELEASE);
 }
 
-bool tableSet(Table *table, ObjString *key, Value value) {
+bool tableSet(VM *vm, Table *table, ObjString *key, Value value) {
     if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
         int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
+        adjustCapacity(vm, table, capacity);
     }
     Entry *entry = findEntry(table->entries, table->capacity, key);
     bool isNewKey = entry->key == nullptr;
     if (isNewKey && IS_NIL(entry->value))
         table->count++;
 
-    entry->key = key;
-    entry->value = value;
+    // The marker thread may be reading the entry.
+    __atomic_store_n(&entry->key, key, __ATOMIC_RELEASE);
+    storeValue(&entry->value, value);
     return isNewKey;
 }
 
@@ -94,16 +96,16 @@ bool tableDelete(Table *table, ObjString *key) {
     Entry *entry = findEntry(table->entries, table->capacity, key);
     if (entry == nullptr)
         return false;
-    entry->key = nullptr;
-    entry->value = BOOL_VAL(true);
+    __atomic_store_n(&entry->key, nullptr, __ATOMIC_RELEASE);
+    storeValue(&entry->value, BOOL_VAL(true));
     return true;
 }
 
-void tableAddAll(Table *from, Table *to) {
+void tableAddAll(VM *vm, Table *from, Table *to) {
     for (int i = 0; i < from->capacity; i++) {
         Entry *entry = &from->entries[i];
         if (entry->key != nullptr) {
-            tableSet(to, entry->key, entry->value);
+            tableSet(vm, to, entry->key, entry->value);
         }
     }
 }
@@ -129,17 +131,19 @@ ObjString *tableFindString(Table *table, const char *chars, int length,
 void tableRemoveWhite(Table *table) {
     for (int i = 0; i < table->capacity; i++) {
         Entry *entry = &table->entries[i];
-        if (entry->key != nullptr && !entry->key->obj.isMarked) {
+        if (entry->key != nullptr && !isMarked(&entry->key->obj)) {
             tableDelete(table, entry->key);
         }
 
     }
 }
 
-void markTable(Table *table) {
-    for (int i = 0; i < table->capacity; i++) {
-        Entry *entry = &table->entries[i];
-        markObject((Obj *) entry->key);
-        markValue(entry->value);
+void markTable(VM *vm, Table *table) {
+    int capacity = __atomic_load_n(&table->capacity, __ATOMIC_ACQUIRE);
+    Entry *entries = __atomic_load_n(&table->entries, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < capacity; i++) {
+        Entry *entry = &entries[i];
+        markObject(vm, (Obj *) __atomic_load_n(&entry->key, __ATOMIC_ACQUIRE));
+        markValue(vm, loadValue(&entry->value));
     }
 }
@@ -0,0 +1,1216 @@
+// A tracing JIT for hot loops. Once a loop header is hot, the next
+// iteration is recorded: the recorder replays it on a shadow of the frame,
+// following the branches the real values take, and emits SSA IR with a type
+// or branch guard wherever a later iteration could go another way. Each
+// guard carries a snapshot of the interpreter state it exits to.
+//
+// Numeric variables the loop reads before writing are loaded and unboxed
+// once on entry, then live in XMM registers for the whole trace and are
+// only written back when it exits. Other variables are written through.
+#define _DEFAULT_SOURCE
+#include "trace.h"
+
+#ifdef LOX_JIT
+#include "jit.h"
+#include "x64.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Longer loops, and loops whose body needs more, stay interpreted.
+#define TRACE_MAX_INSTRUCTIONS 256
+#define TRACE_MAX_IR 1024
+#define TRACE_MAX_STACK 64
+#define TRACE_MAX_VARIABLES 64
+#define TRACE_MAX_STORES 64
+#define TRACE_MAX_HOMES 8
+// Recording gives up on a loop after aborting this many times.
+#define TRACE_MAX_ABORTS 3
+// A trace that averages fewer iterations per entry than this, once it has
+// been entered often enough to tell, costs more than it saves.
+#define TRACE_PROBATION 64
+#define TRACE_MIN_ITERATIONS 4
+
+struct TraceLoop {
+    TraceLoop *next;
+    int header; // bytecode offset the back edge jumps to
+    int hotness;
+    int aborts;
+    bool blacklisted;
+    int base; // stack depth at the header, relative to the frame's slots
+    uint8_t *code;
+    size_t size;
+    uint64_t entries;
+    uint64_t iterations;
+};
+
+// Stack slots are variables numbered by slot; globals follow after them.
+#define GLOBAL_VARIABLES 0x10000
+#define IS_GLOBAL(variable) ((variable) >= GLOBAL_VARIABLES)
+
+typedef enum {
+    IR_CONSTANT, // a boxed `value`
+    IR_NUMBER,   // an unboxed `value`
+    IR_LOAD,     // the boxed `variable`
+    IR_UNBOX,    // `a`, guarded to be a number
+    IR_ADD,
+    IR_SUBTRACT,
+    IR_MULTIPLY,
+    IR_DIVIDE,
+    IR_NEGATE,
+    IR_LESS, // boxed Booleans
+    IR_GREATER,
+    IR_EQUAL,
+    IR_NOT,
+    IR_GUARD_TRUTHY, // guards that `a` is truthy when `expected`
+    IR_GUARD_LESS,   // guards that `a < b` is `expected`
+    IR_GUARD_GREATER,
+    IR_GUARD_EQUAL,
+    IR_GUARD_LIST,  // guards that `a` is a list
+    IR_INDEX,       // `a[b]`, guarding the index
+    IR_STORE_INDEX, // `a[b] = c`, guarding the index
+    IR_STORE,       // `variable = a`
+} IrOp;
+
+typedef struct {
+    uint8_t op;
+    bool number; // the result is an unboxed double
+    bool expected;
+    int a, b, c;
+    int variable;
+    int snapshot;
+    Value value;
+} IrIns;
+
+// What a side exit writes back before run() resumes at `ip`: the values on
+// the stack above the header's depth, and the variables written so far.
+typedef struct {
+    int variable;
+    int ref;
+} SnapshotEntry;
+
+typedef struct {
+    uint8_t *ip;
+    int depth;
+    int start;
+    int count;
+} Snapshot;
+
+typedef struct {
+    int variable;
+    int load;     // the IR_LOAD on first reading it, -1 when written first
+    int current;  // its value at this point of the iteration
+    bool numeric; // every value it held was a number
+    bool written;
+    int home; // XMM register holding it across iterations, or -1
+} Variable;
+
+// A value on the shadow stack: what it is now and the IR that computes it.
+typedef struct {
+    Value value;
+    int ref;
+} Shadow;
+
+typedef struct {
+    TraceLoop *loop;
+    VM *vm;
+    CallFrame *frame;
+    Chunk *chunk;
+    int base;
+    bool failed;
+
+    IrIns ir[TRACE_MAX_IR];
+    int irCount;
+    Snapshot *snapshots;
+    int snapshotCount;
+    int snapshotCapacity;
+    SnapshotEntry *entries;
+    int entryCount;
+    int entryCapacity;
+    int preSnapshot; // the current instruction's own snapshot, once taken
+
+    Variable variables[TRACE_MAX_VARIABLES];
+    Shadow shadowVariables[TRACE_MAX_VARIABLES];
+    int variableCount;
+    Shadow stack[TRACE_MAX_STACK];
+    int depth;
+    // List stores the shadow iteration made, in place of making them.
+    struct {
+        ObjList *list;
+        int index;
+        Value value;
+    } stores[TRACE_MAX_STORES];
+    int storeCount;
+} Recorder;
+
+static bool isFalsey(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static bool isListIndex(ObjList *list, Value index) {
+    if (!IS_NUMBER(index)) return false;
+    double number = AS_NUMBER(index);
+    return number >= 0 && number < (double) list->elements.count &&
+           (double) (int) number == number;
+}
+
+static bool isConstant(Recorder *r, int ref) {
+    return r->ir[ref].op == IR_CONSTANT || r->ir[ref].op == IR_NUMBER;
+}
+
+static int emit(Recorder *r, IrOp op, bool number, int a, int b) {
+    if (r->irCount == TRACE_MAX_IR) {
+        r->failed = true;
+        return 0;
+    }
+    IrIns *ins = &r->ir[r->irCount];
+    memset(ins, 0, sizeof(*ins));
+    ins->op = (uint8_t) op;
+    ins->number = number;
+    ins->a = a;
+    ins->b = b;
+    ins->c = -1;
+    ins->variable = -1;
+    ins->snapshot = -1;
+    return r->irCount++;
+}
+
+static int constant(Recorder *r, Value value) {
+    bool number = IS_NUMBER(value);
+    int ref = emit(r, number ? IR_NUMBER : IR_CONSTANT, number, -1, -1);
+    r->ir[ref].value = value;
+    return ref;
+}
+
+// Emits an instruction without side effects, reusing an identical one from
+// earlier in the trace. Being linear, every earlier one dominates it.
+static int pure(Recorder *r, IrOp op, bool number, int a, int b) {
+    for (int i = r->irCount - 1; i >= 0; i--) {
+        IrIns *ins = &r->ir[i];
+        if (ins->op == op && ins->a == a && ins->b == b) return i;
+    }
+    return emit(r, op, number, a, b);
+}
+
+static int snapshot(Recorder *r, uint8_t *ip) {
+    if (r->snapshotCount == r->snapshotCapacity) {
+        r->snapshotCapacity = r->snapshotCapacity < 16
+                                  ? 16
+                                  : r->snapshotCapacity * 2;
+        r->snapshots = realloc(r->snapshots,
+                               sizeof(Snapshot) * (size_t) r->snapshotCapacity);
+    }
+    int needed = r->entryCount + r->depth + r->variableCount;
+    if (needed > r->entryCapacity) {
+        while (r->entryCapacity < needed) {
+            r->entryCapacity = r->entryCapacity < 64 ? 64
+                                                     : r->entryCapacity * 2;
+        }
+        r->entries = realloc(r->entries, sizeof(SnapshotEntry) *
+                                             (size_t) r->entryCapacity);
+    }
+    Snapshot *snapshot = &r->snapshots[r->snapshotCount];
+    snapshot->ip = ip;
+    snapshot->depth = r->depth;
+    snapshot->start = r->entryCount;
+    for (int i = 0; i < r->depth; i++) {
+        r->entries[r->entryCount++] =
+            (SnapshotEntry){r->base + i, r->stack[i].ref};
+    }
+    for (int i = 0; i < r->variableCount; i++) {
+        Variable *variable = &r->variables[i];
+        if (!variable->written) continue;
+        r->entries[r->entryCount++] =
+            (SnapshotEntry){variable->variable, variable->current};
+    }
+    snapshot->count = r->entryCount - snapshot->start;
+    return r->snapshotCount++;
+}
+
+// Guards exiting to the instruction being recorded, before it has changed
+// anything, so run() executes it again and raises any error itself.
+static int preSnapshot(Recorder *r, int offset) {
+    if (r->preSnapshot < 0) {
+        r->preSnapshot = snapshot(r, r->chunk->code + offset);
+    }
+    return r->preSnapshot;
+}
+
+static int guard(Recorder *r, IrOp op, int a, int b, bool expected,
+                 int snapshot) {
+    int ref = emit(r, op, false, a, b);
+    r->ir[ref].expected = expected;
+    r->ir[ref].snapshot = snapshot;
+    return ref;
+}
+
+static void pushShadow(Recorder *r, Value value, int ref) {
+    if (r->depth == TRACE_MAX_STACK) {
+        r->failed = true;
+        return;
+    }
+    r->stack[r->depth++] = (Shadow){value, ref};
+}
+
+// Checks the instruction has its operands above the header's depth.
+static bool need(Recorder *r, int count) {
+    if (r->depth < count) r->failed = true;
+    return !r->failed;
+}
+
+static Shadow popShadow(Recorder *r) {
+    if (!need(r, 1)) return (Shadow){NIL_VAL, 0};
+    return r->stack[--r->depth];
+}
+
+static Value *location(Recorder *r, int variable) {
+    if (IS_GLOBAL(variable)) {
+        return &r->vm->globalValues.values[variable - GLOBAL_VARIABLES];
+    }
+    return &r->frame->slots[variable];
+}
+
+static Variable *findVariable(Recorder *r, int variable, int *index) {
+    for (int i = 0; i < r->variableCount; i++) {
+        if (r->variables[i].variable == variable) {
+            *index = i;
+            return &r->variables[i];
+        }
+    }
+    if (r->variableCount == TRACE_MAX_VARIABLES) {
+        r->failed = true;
+        return nullptr;
+    }
+    *index = r->variableCount;
+    Variable *added = &r->variables[r->variableCount++];
+    *added = (Variable){variable, -1, -1, true, false, -1};
+    return added;
+}
+
+static void readVariable(Recorder *r, int variable, int offset) {
+    int index;
+    Variable *found = findVariable(r, variable, &index);
+    if (found == nullptr) return;
+    if (found->current >= 0) {
+        pushShadow(r, r->shadowVariables[index].value, found->current);
+        return;
+    }
+    Value value = *location(r, variable);
+    if (IS_UNDEFINED(value)) {
+        r->failed = true;
+        return;
+    }
+    int ref = emit(r, IR_LOAD, false, -1, -1);
+    r->ir[ref].variable = variable;
+    found->load = ref;
+    if (IS_NUMBER(value)) {
+        int snapshot = preSnapshot(r, offset);
+        ref = emit(r, IR_UNBOX, true, ref, -1);
+        r->ir[ref].snapshot = snapshot;
+    } else {
+        found->numeric = false;
+    }
+    found->current = ref;
+    r->shadowVariables[index] = (Shadow){value, ref};
+    pushShadow(r, value, ref);
+}
+
+static void writeVariable(Recorder *r, int variable, Shadow shadow) {
+    int index;
+    Variable *found = findVariable(r, variable, &index);
+    if (found == nullptr) return;
+    if (IS_UNDEFINED(*location(r, variable))) {
+        r->failed = true;
+        return;
+    }
+    if (!IS_NUMBER(shadow.value)) found->numeric = false;
+    found->current = shadow.ref;
+    found->written = true;
+    r->shadowVariables[index] = shadow;
+    int ref = emit(r, IR_STORE, false, shadow.ref, -1);
+    r->ir[ref].variable = variable;
+}
+
+static Value listElement(Recorder *r, ObjList *list, int index) {
+    for (int i = r->storeCount - 1; i >= 0; i--) {
+        if (r->stores[i].list == list && r->stores[i].index == index) {
+            return r->stores[i].value;
+        }
+    }
+    return list->elements.values[index];
+}
+
+static void recordGetIndex(Recorder *r, int offset) {
+    if (!need(r, 2)) return;
+    Shadow list = r->stack[r->depth - 2];
+    Shadow index = r->stack[r->depth - 1];
+    if (!IS_LIST(list.value) || !isListIndex(AS_LIST(list.value), index.value)) {
+        r->failed = true;
+        return;
+    }
+    int snapshot = preSnapshot(r, offset);
+    guard(r, IR_GUARD_LIST, list.ref, -1, true, snapshot);
+    Value value = listElement(r, AS_LIST(list.value),
+                              (int) AS_NUMBER(index.value));
+    int ref = emit(r, IR_INDEX, false, list.ref, index.ref);
+    r->ir[ref].snapshot = snapshot;
+    if (IS_NUMBER(value)) {
+        ref = emit(r, IR_UNBOX, true, ref, -1);
+        r->ir[ref].snapshot = snapshot;
+    }
+    r->depth -= 2;
+    pushShadow(r, value, ref);
+}
+
+// Whether the value `ref` computes is never an object, which a trace can
+// store without the write barrier.
+static bool neverObject(Recorder *r, int ref) {
+    IrIns *ins = &r->ir[ref];
+    switch (ins->op) {
+        case IR_CONSTANT: return !IS_OBJ(ins->value);
+        case IR_LESS:
+        case IR_GREATER:
+        case IR_EQUAL:
+        case IR_NOT: return true;
+        default: return ins->number;
+    }
+}
+
+static void recordSetIndex(Recorder *r, int offset) {
+    if (!need(r, 3)) return;
+    Shadow list = r->stack[r->depth - 3];
+    Shadow index = r->stack[r->depth - 2];
+    Shadow value = r->stack[r->depth - 1];
+    if (!IS_LIST(list.value) || !isListIndex(AS_LIST(list.value), index.value) ||
+        !neverObject(r, value.ref) || r->storeCount == TRACE_MAX_STORES) {
+        r->failed = true;
+        return;
+    }
+    int snapshot = preSnapshot(r, offset);
+    guard(r, IR_GUARD_LIST, list.ref, -1, true, snapshot);
+    int ref = emit(r, IR_STORE_INDEX, false, list.ref, index.ref);
+    r->ir[ref].c = value.ref;
+    r->ir[ref].snapshot = snapshot;
+    r->stores[r->storeCount].list = AS_LIST(list.value);
+    r->stores[r->storeCount].index = (int) AS_NUMBER(index.value);
+    r->stores[r->storeCount].value = value.value;
+    r->storeCount++;
+    r->depth -= 3;
+    pushShadow(r, value.value, value.ref);
+}
+
+static void recordArithmetic(Recorder *r, IrOp op) {
+    Shadow b = popShadow(r);
+    Shadow a = popShadow(r);
+    if (!IS_NUMBER(a.value) || !IS_NUMBER(b.value)) {
+        r->failed = true;
+        return;
+    }
+    double x = AS_NUMBER(a.value), y = AS_NUMBER(b.value);
+    double result;
+    switch (op) {
+        case IR_ADD: result = x + y; break;
+        case IR_SUBTRACT: result = x - y; break;
+        case IR_MULTIPLY: result = x * y; break;
+        default: result = x / y; break;
+    }
+    Value value = NUMBER_VAL(result);
+    if (isConstant(r, a.ref) && isConstant(r, b.ref)) {
+        pushShadow(r, value, constant(r, value));
+    } else {
+        pushShadow(r, value, pure(r, op, true, a.ref, b.ref));
+    }
+}
+
+static void recordComparison(Recorder *r, IrOp op) {
+    Shadow b = popShadow(r);
+    Shadow a = popShadow(r);
+    Value value;
+    if (op == IR_EQUAL) {
+        value = BOOL_VAL(valuesEqual(a.value, b.value));
+    } else if (!IS_NUMBER(a.value) || !IS_NUMBER(b.value)) {
+        r->failed = true;
+        return;
+    } else if (op == IR_LESS) {
+        value = BOOL_VAL(AS_NUMBER(a.value) < AS_NUMBER(b.value));
+    } else {
+        value = BOOL_VAL(AS_NUMBER(a.value) > AS_NUMBER(b.value));
+    }
+    if (isConstant(r, a.ref) && isConstant(r, b.ref)) {
+        pushShadow(r, value, constant(r, value));
+    } else {
+        pushShadow(r, value, pure(r, op, false, a.ref, b.ref));
+    }
+}
+
+// A conditional jump becomes a guard that the next iteration goes the same
+// way, exiting to the other way otherwise. The stack is as the jump left it.
+static void recordBranch(Recorder *r, IrOp op, Shadow a, Shadow b,
+                         bool expected, int otherWay) {
+    if (isConstant(r, a.ref) && (b.ref < 0 || isConstant(r, b.ref))) return;
+    if (op == IR_GUARD_TRUTHY && r->ir[a.ref].number) return;
+    guard(r, op, a.ref, b.ref, expected,
+          snapshot(r, r->chunk->code + otherWay));
+}
+
+static int readShort(const uint8_t *code, int offset) {
+    return (code[offset] << 8) | code[offset + 1];
+}
+
+// Replays one iteration from the loop header back to it. Returns false if
+// it does something the trace compiler doesn't handle, like a call.
+static bool record(Recorder *r) {
+    Chunk *chunk = r->chunk;
+    uint8_t *code = chunk->code;
+    Value *constants = chunk->constants.values;
+    int header = r->loop->header;
+    uint8_t *visited = calloc((size_t) chunk->count, 1);
+    if (visited == nullptr) return false;
+
+    int offset = header;
+    int steps = 0;
+    do {
+        // Coming back anywhere but the header means an inner loop.
+        if (visited[offset] || ++steps > TRACE_MAX_INSTRUCTIONS) {
+            r->failed = true;
+            break;
+        }
+        visited[offset] = true;
+        r->preSnapshot = -1;
+        int next = offset + instructionLength(chunk, offset);
+        uint8_t op = code[offset];
+        switch (op) {
+            case OP_CONSTANT: {
+                Value value = constants[code[offset + 1]];
+                pushShadow(r, value, constant(r, value));
+                break;
+            }
+            case OP_NIL: pushShadow(r, NIL_VAL, constant(r, NIL_VAL)); break;
+            case OP_TRUE: pushShadow(r, TRUE_VAL, constant(r, TRUE_VAL)); break;
+            case OP_FALSE: pushShadow(r, FALSE_VAL, constant(r, FALSE_VAL)); break;
+            case OP_POP: popShadow(r); break;
+            case OP_GET_LOCAL: {
+                int slot = code[offset + 1];
+                if (slot < r->base) {
+                    readVariable(r, slot, offset);
+                } else if (slot - r->base < r->depth) {
+                    Shadow local = r->stack[slot - r->base];
+                    pushShadow(r, local.value, local.ref);
+                } else {
+                    r->failed = true;
+                }
+                break;
+            }
+            case OP_SET_LOCAL:
+            case OP_SET_LOCAL_POP: {
+                int slot = code[offset + 1];
+                if (!need(r, 1)) break;
+                Shadow value = r->stack[r->depth - 1];
+                if (slot < r->base) {
+                    writeVariable(r, slot, value);
+                } else if (slot - r->base < r->depth) {
+                    r->stack[slot - r->base] = value;
+                } else {
+                    r->failed = true;
+                }
+                if (op == OP_SET_LOCAL_POP) r->depth--;
+                break;
+            }
+            case OP_GET_GLOBAL:
+                readVariable(r, GLOBAL_VARIABLES + readShort(code, offset + 1),
+                             offset);
+                break;
+            case OP_SET_GLOBAL:
+            case OP_SET_GLOBAL_POP:
+                if (!need(r, 1)) break;
+                writeVariable(r, GLOBAL_VARIABLES + readShort(code, offset + 1),
+                              r->stack[r->depth - 1]);
+                if (op == OP_SET_GLOBAL_POP) r->depth--;
+                break;
+            case OP_GET_INDEX:
+            case OP_GET_INDEX_LIST: recordGetIndex(r, offset); break;
+            case OP_SET_INDEX:
+            case OP_SET_INDEX_LIST: recordSetIndex(r, offset); break;
+            case OP_EQUAL: recordComparison(r, IR_EQUAL); break;
+            case OP_GREATER: recordComparison(r, IR_GREATER); break;
+            case OP_LESS: recordComparison(r, IR_LESS); break;
+            case OP_ADD:
+            case OP_ADD_NUM: recordArithmetic(r, IR_ADD); break;
+            case OP_SUBTRACT: recordArithmetic(r, IR_SUBTRACT); break;
+            case OP_MULTIPLY: recordArithmetic(r, IR_MULTIPLY); break;
+            case OP_DIVIDE: recordArithmetic(r, IR_DIVIDE); break;
+            case OP_NOT: {
+                Shadow a = popShadow(r);
+                Value value = BOOL_VAL(isFalsey(a.value));
+                if (isConstant(r, a.ref) || r->ir[a.ref].number) {
+                    pushShadow(r, value, constant(r, value));
+                } else {
+                    pushShadow(r, value, pure(r, IR_NOT, false, a.ref, -1));
+                }
+                break;
+            }
+            case OP_NEGATE: {
+                Shadow a = popShadow(r);
+                if (!IS_NUMBER(a.value)) {
+                    r->failed = true;
+                    break;
+                }
+                Value value = NUMBER_VAL(-AS_NUMBER(a.value));
+                if (isConstant(r, a.ref)) {
+                    pushShadow(r, value, constant(r, value));
+                } else {
+                    pushShadow(r, value, pure(r, IR_NEGATE, true, a.ref, -1));
+                }
+                break;
+            }
+            case OP_JUMP:
+            case OP_LOOP: next = jumpTarget(chunk, offset); break;
+            case OP_JUMP_IF_FALSE:
+            case OP_POP_JUMP_IF_FALSE:
+            case OP_POP_JUMP_IF_TRUE: {
+                if (!need(r, 1)) break;
+                Shadow a = op != OP_JUMP_IF_FALSE ? popShadow(r)
+                                                  : r->stack[r->depth - 1];
+                bool falsey = isFalsey(a.value);
+                bool taken = falsey != (op == OP_POP_JUMP_IF_TRUE);
+                int target = jumpTarget(chunk, offset);
+                recordBranch(r, IR_GUARD_TRUTHY, a, (Shadow){NIL_VAL, -1},
+                             !falsey, taken ? next : target);
+                if (taken) next = target;
+                break;
+            }
+            case OP_JUMP_IF_EQUAL:
+            case OP_JUMP_IF_NOT_EQUAL: {
+                Shadow b = popShadow(r);
+                Shadow a = popShadow(r);
+                bool equal = valuesEqual(a.value, b.value);
+                bool taken = equal == (op == OP_JUMP_IF_EQUAL);
+                int target = jumpTarget(chunk, offset);
+                recordBranch(r, IR_GUARD_EQUAL, a, b, equal,
+                             taken ? next : target);
+                if (taken) next = target;
+                break;
+            }
+            case OP_JUMP_IF_GREATER:
+            case OP_JUMP_IF_NOT_GREATER:
+            case OP_JUMP_IF_LESS:
+            case OP_JUMP_IF_NOT_LESS: {
+                Shadow b = popShadow(r);
+                Shadow a = popShadow(r);
+                if (!IS_NUMBER(a.value) || !IS_NUMBER(b.value)) {
+                    r->failed = true;
+                    break;
+                }
+                bool greater = op == OP_JUMP_IF_GREATER ||
+                               op == OP_JUMP_IF_NOT_GREATER;
+                bool result = greater ? AS_NUMBER(a.value) > AS_NUMBER(b.value)
+                                      : AS_NUMBER(a.value) < AS_NUMBER(b.value);
+                bool negated = op == OP_JUMP_IF_NOT_GREATER ||
+                               op == OP_JUMP_IF_NOT_LESS;
+                bool taken = result != negated;
+                int target = jumpTarget(chunk, offset);
+                recordBranch(r, greater ? IR_GUARD_GREATER : IR_GUARD_LESS, a,
+                             b, result, taken ? next : target);
+                if (taken) next = target;
+                break;
+            }
+            default: r->failed = true; break;
+        }
+        if (r->failed) break;
+        offset = next;
+    } while (offset != header);
+
+    free(visited);
+    return !r->failed && r->depth == 0;
+}
+
+// Keeps the numeric variables the loop reads before writing in registers,
+// as many as there are homes for.
+static void chooseHomes(Recorder *r) {
+    int homes = 0;
+    for (int i = 0; i < r->variableCount && homes < TRACE_MAX_HOMES; i++) {
+        Variable *variable = &r->variables[i];
+        if (variable->load < 0 || !variable->numeric) continue;
+        if (variable->written && !r->ir[variable->current].number) continue;
+        variable->home = 14 - homes++;
+    }
+}
+
+static Variable *homeOf(Recorder *r, int variable) {
+    for (int i = 0; i < r->variableCount; i++) {
+        if (r->variables[i].variable == variable) {
+            return r->variables[i].home >= 0 ? &r->variables[i] : nullptr;
+        }
+    }
+    return nullptr;
+}
+
+#define XMM_SCRATCH 15
+#define NO_REGISTER -1
+
+static const int gprPool[] = {RAX, RCX, RDX, RBX, RSI, RDI, R8, R9};
+#define GPR_POOL_SIZE ((int) (sizeof(gprPool) / sizeof(gprPool[0])))
+
+typedef struct {
+    Recorder *r;
+    Assembler as;
+    int8_t *reg;
+    int *lastUse;
+    bool *released;
+    bool *hoisted; // the loads and unboxes of homed variables
+    uint16_t freeXmm;
+    uint16_t freeGpr; // indexes into gprPool
+} Codegen;
+
+static bool needsRegister(const IrIns *ins) {
+    switch (ins->op) {
+        case IR_LOAD:
+        case IR_UNBOX:
+        case IR_ADD:
+        case IR_SUBTRACT:
+        case IR_MULTIPLY:
+        case IR_DIVIDE:
+        case IR_NEGATE:
+        case IR_LESS:
+        case IR_GREATER:
+        case IR_EQUAL:
+        case IR_NOT:
+        case IR_INDEX: return true;
+        default: return false;
+    }
+}
+
+static void use(Codegen *g, int ref, int at) {
+    if (ref >= 0 && g->lastUse[ref] < at) g->lastUse[ref] = at;
+}
+
+// Whether a snapshot entry is written back on exit: stack values always,
+// variables only if they are homed, since the rest are written through.
+static bool isWrittenBack(Recorder *r, const SnapshotEntry *entry) {
+    return (!IS_GLOBAL(entry->variable) && entry->variable >= r->base) ||
+           homeOf(r, entry->variable) != nullptr;
+}
+
+static void computeLiveness(Codegen *g) {
+    Recorder *r = g->r;
+    for (int i = 0; i < r->irCount; i++) g->lastUse[i] = i;
+    for (int i = 0; i < r->irCount; i++) {
+        IrIns *ins = &r->ir[i];
+        if (g->hoisted[i]) continue;
+        if (ins->op != IR_CONSTANT && ins->op != IR_NUMBER &&
+            ins->op != IR_LOAD) {
+            use(g, ins->a, i);
+            use(g, ins->b, i);
+            use(g, ins->c, i);
+        }
+        if (ins->snapshot < 0) continue;
+        Snapshot *snapshot = &r->snapshots[ins->snapshot];
+        for (int j = 0; j < snapshot->count; j++) {
+            SnapshotEntry *entry = &r->entries[snapshot->start + j];
+            if (isWrittenBack(r, entry)) use(g, entry->ref, i);
+        }
+    }
+    for (int i = 0; i < r->variableCount; i++) {
+        Variable *variable = &r->variables[i];
+        if (variable->home >= 0 && variable->written) {
+            use(g, variable->current, r->irCount);
+        }
+    }
+}
+
+static bool allocate(Codegen *g, int ref) {
+    if (g->r->ir[ref].number) {
+        for (int x = 0; x < XMM_SCRATCH; x++) {
+            if (g->freeXmm & (1u << x)) {
+                g->freeXmm &= (uint16_t) ~(1u << x);
+                g->reg[ref] = (int8_t) x;
+                return true;
+            }
+        }
+    } else {
+        for (int i = 0; i < GPR_POOL_SIZE; i++) {
+            if (g->freeGpr & (1u << i)) {
+                g->freeGpr &= (uint16_t) ~(1u << i);
+                g->reg[ref] = (int8_t) gprPool[i];
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static void release(Codegen *g, int ref, int at) {
+    if (ref < 0 || g->lastUse[ref] != at || g->released[ref] ||
+        g->reg[ref] == NO_REGISTER || g->hoisted[ref]) {
+        return;
+    }
+    g->released[ref] = true;
+    if (g->r->ir[ref].number) {
+        g->freeXmm |= (uint16_t) (1u << g->reg[ref]);
+    } else {
+        for (int i = 0; i < GPR_POOL_SIZE; i++) {
+            if (gprPool[i] == g->reg[ref]) g->freeGpr |= (uint16_t) (1u << i);
+        }
+    }
+}
+
+static void releaseDying(Codegen *g, int at) {
+    IrIns *ins = &g->r->ir[at];
+    if (ins->op != IR_CONSTANT && ins->op != IR_NUMBER && ins->op != IR_LOAD) {
+        release(g, ins->a, at);
+        release(g, ins->b, at);
+        release(g, ins->c, at);
+    }
+    if (ins->snapshot < 0) return;
+    Snapshot *snapshot = &g->r->snapshots[ins->snapshot];
+    for (int j = 0; j < snapshot->count; j++) {
+        release(g, g->r->entries[snapshot->start + j].ref, at);
+    }
+}
+
+static void exitIf(Codegen *g, Condition cc, int snapshot) {
+    addPatch(&g->as, 0, jumpIf(&g->as, cc), snapshot);
+}
+
+// Boxes `ref` into the general register `dst`.
+static void boxInto(Codegen *g, int dst, int ref) {
+    IrIns *ins = &g->r->ir[ref];
+    if (ins->op == IR_CONSTANT || ins->op == IR_NUMBER) {
+        moveImmediate(&g->as, dst, ins->value);
+    } else if (ins->number) {
+        moveFromXmm(&g->as, dst, g->reg[ref]);
+    } else if (g->reg[ref] != dst) {
+        opRegister(&g->as, 0x89, dst, g->reg[ref]);
+    }
+}
+
+// The general register holding boxed `ref`, boxing it into `scratch` if it
+// isn't in one already.
+static int boxed(Codegen *g, int ref, int scratch) {
+    IrIns *ins = &g->r->ir[ref];
+    if (ins->op != IR_CONSTANT && !ins->number) return g->reg[ref];
+    boxInto(g, scratch, ref);
+    return scratch;
+}
+
+// The XMM register holding unboxed `ref`, loading constants into scratch.
+static int unboxed(Codegen *g, int ref) {
+    IrIns *ins = &g->r->ir[ref];
+    if (ins->op != IR_NUMBER) return g->reg[ref];
+    moveImmediate(&g->as, R11, ins->value);
+    moveToXmm(&g->as, XMM_SCRATCH, R11);
+    return XMM_SCRATCH;
+}
+
+static void addressVariable(Codegen *g, int variable, int *base,
+                            int32_t *disp) {
+    if (IS_GLOBAL(variable)) {
+        load(&g->as, R10, R_VM, offsetof(VM, globalValues.values));
+        *base = R10;
+        *disp = 8 * (variable - GLOBAL_VARIABLES);
+    } else {
+        *base = R_SLOTS;
+        *disp = 8 * variable;
+    }
+}
+
+static void loadVariable(Codegen *g, int dst, int variable) {
+    int base;
+    int32_t disp;
+    addressVariable(g, variable, &base, &disp);
+    load(&g->as, dst, base, disp);
+}
+
+static void storeVariable(Codegen *g, int variable, int src) {
+    int base;
+    int32_t disp;
+    addressVariable(g, variable, &base, &disp);
+    store(&g->as, base, disp, src);
+}
+
+static void guardNumber(Codegen *g, int reg, int snapshot) {
+    Assembler *as = &g->as;
+    opRegister(as, 0x89, R11, reg);
+    opRegister(as, 0x21, R11, R_QNAN);
+    opRegister(as, 0x39, R11, R_QNAN);
+    exitIf(g, CC_E, snapshot);
+}
+
+// Flags for `cmp value - NIL_VAL, 1`: below or equal means falsey.
+static void compareFalsey(Codegen *g, int reg) {
+    opRegister(&g->as, 0x89, R11, reg);
+    opRegister(&g->as, 0x29, R11, R_NIL);
+    alu(&g->as, ALU_CMP, R11, 1);
+}
+
+// Leaves the list's elements pointer in R10 and the index in R11, exiting
+// unless the index is an integer within bounds.
+static void checkListIndex(Codegen *g, IrIns *ins) {
+    Assembler *as = &g->as;
+    moveImmediate(as, R10, ~(SIGN_BIT | QNAN));
+    opRegister(as, 0x21, R10, g->reg[ins->a]);
+    IrIns *index = &g->r->ir[ins->b];
+    if (index->op == IR_NUMBER) {
+        moveImmediate(as, R11, (uint64_t) (int) AS_NUMBER(index->value));
+    } else {
+        int x = g->reg[ins->b];
+        truncateToInteger(as, R11, x);
+        integerToDouble(as, XMM_SCRATCH, R11);
+        sseRegister(as, 0x66, 0x2E, XMM_SCRATCH, x); // ucomisd
+        exitIf(g, CC_NE, ins->snapshot);
+        exitIf(g, CC_P, ins->snapshot);
+    }
+    alu(as, ALU_CMP, R11, INT32_MAX);
+    exitIf(g, CC_A, ins->snapshot);
+    opMemory32(as, 0x3B, R11, R10, offsetof(ObjList, elements.count));
+    exitIf(g, CC_AE, ins->snapshot);
+    load(as, R10, R10, offsetof(ObjList, elements.values));
+}
+
+static void arithmetic(Codegen *g, IrIns *ins, int dst) {
+    Assembler *as = &g->as;
+    uint8_t op = ins->op == IR_ADD        ? 0x58
+                 : ins->op == IR_SUBTRACT ? 0x5C
+                 : ins->op == IR_MULTIPLY ? 0x59
+                                          : 0x5E;
+    int b = unboxed(g, ins->b);
+    int a = unboxed(g, ins->a);
+    if (dst == b && dst != a) {
+        // Work in the scratch register rather than overwrite b first.
+        if (a != XMM_SCRATCH) sseRegister(as, 0xF2, 0x10, XMM_SCRATCH, a);
+        sseRegister(as, 0xF2, op, XMM_SCRATCH, b);
+        sseRegister(as, 0xF2, 0x10, dst, XMM_SCRATCH);
+        return;
+    }
+    if (dst != a) sseRegister(as, 0xF2, 0x10, dst, a);
+    sseRegister(as, 0xF2, op, dst, b);
+}
+
+static void compileIns(Codegen *g, int i) {
+    Assembler *as = &g->as;
+    IrIns *ins = &g->r->ir[i];
+    int dst = g->reg[i];
+    switch (ins->op) {
+        case IR_CONSTANT:
+        case IR_NUMBER: break;
+        case IR_LOAD: loadVariable(g, dst, ins->variable); break;
+        case IR_UNBOX:
+            guardNumber(g, g->reg[ins->a], ins->snapshot);
+            moveToXmm(as, dst, g->reg[ins->a]);
+            break;
+        case IR_ADD:
+        case IR_SUBTRACT:
+        case IR_MULTIPLY:
+        case IR_DIVIDE: arithmetic(g, ins, dst); break;
+        case IR_NEGATE: {
+            int a = g->reg[ins->a];
+            moveImmediate(as, R11, SIGN_BIT);
+            moveToXmm(as, XMM_SCRATCH, R11);
+            if (dst != a) sseRegister(as, 0xF2, 0x10, dst, a);
+            sseRegister(as, 0x66, 0x57, dst, XMM_SCRATCH); // xorpd
+            break;
+        }
+        case IR_LESS:
+        case IR_GREATER:
+        case IR_GUARD_LESS:
+        case IR_GUARD_GREATER: {
+            int b = unboxed(g, ins->b);
+            int a = unboxed(g, ins->a);
+            // a > b and b < a are both "above" once ordered that way.
+            bool less = ins->op == IR_LESS || ins->op == IR_GUARD_LESS;
+            sseRegister(as, 0x66, 0x2E, less ? b : a, less ? a : b);
+            if (ins->op == IR_LESS || ins->op == IR_GREATER) {
+                boolFromCondition(as, CC_A, dst);
+            } else {
+                exitIf(g, ins->expected ? CC_BE : CC_A, ins->snapshot);
+            }
+            break;
+        }
+        case IR_EQUAL:
+        case IR_GUARD_EQUAL: {
+            int a = boxed(g, ins->a, R10);
+            int b = boxed(g, ins->b, R11);
+            opRegister(as, 0x39, a, b);
+            if (ins->op == IR_EQUAL) {
+                boolFromCondition(as, CC_E, dst);
+            } else {
+                exitIf(g, ins->expected ? CC_NE : CC_E, ins->snapshot);
+            }
+            break;
+        }
+        case IR_NOT:
+            compareFalsey(g, boxed(g, ins->a, R10));
+            boolFromCondition(as, CC_BE, dst);
+            break;
+        case IR_GUARD_TRUTHY:
+            compareFalsey(g, boxed(g, ins->a, R10));
+            exitIf(g, ins->expected ? CC_BE : CC_A, ins->snapshot);
+            break;
+        case IR_GUARD_LIST: {
+            int a = g->reg[ins->a];
+            moveImmediate(as, R11, SIGN_BIT | QNAN);
+            opRegister(as, 0x89, R10, a);
+            opRegister(as, 0x21, R10, R11);
+            opRegister(as, 0x39, R10, R11);
+            exitIf(g, CC_NE, ins->snapshot);
+            moveImmediate(as, R10, ~(SIGN_BIT | QNAN));
+            opRegister(as, 0x21, R10, a);
+            aluMemory(as, ALU_CMP, 1, R10, offsetof(Obj, type), OBJ_LIST);
+            exitIf(g, CC_NE, ins->snapshot);
+            break;
+        }
+        case IR_INDEX:
+            checkListIndex(g, ins);
+            loadIndexed(as, dst, R10, R11);
+            break;
+        case IR_STORE_INDEX:
+            checkListIndex(g, ins);
+            shift(as, 4, R11, 3);            // shl r11, 3
+            opRegister(as, 0x01, R10, R11); // add r10, r11
+            store(as, R10, 0, boxed(g, ins->c, R11));
+            break;
+        case IR_STORE:
+            if (homeOf(g->r, ins->variable) != nullptr) break;
+            storeVariable(g, ins->variable, boxed(g, ins->a, R11));
+            break;
+    }
+}
+
+// Moves each homed variable's new value into its home for the next
+// iteration. The moves happen at once, so cycles go through the scratch.
+static void moveToHomes(Codegen *g) {
+    Recorder *r = g->r;
+    int dsts[TRACE_MAX_HOMES], srcs[TRACE_MAX_HOMES];
+    int constants[TRACE_MAX_HOMES];
+    int count = 0, constantCount = 0;
+    for (int i = 0; i < r->variableCount; i++) {
+        Variable *variable = &r->variables[i];
+        if (variable->home < 0 || !variable->written) continue;
+        int current = variable->current;
+        if (r->ir[current].op == IR_NUMBER) {
+            constants[constantCount++] = i;
+        } else if (g->reg[current] != variable->home) {
+            dsts[count] = variable->home;
+            srcs[count] = g->reg[current];
+            count++;
+        }
+    }
+    while (count > 0) {
+        int ready = -1;
+        for (int i = 0; i < count && ready < 0; i++) {
+            bool blocked = false;
+            for (int j = 0; j < count; j++) {
+                if (j != i && srcs[j] == dsts[i]) blocked = true;
+            }
+            if (!blocked) ready = i;
+        }
+        if (ready < 0) {
+            // Every destination is still needed: park one in the scratch.
+            int parked = dsts[0];
+            sseRegister(&g->as, 0xF2, 0x10, XMM_SCRATCH, parked);
+            for (int j = 0; j < count; j++) {
+                if (srcs[j] == parked) srcs[j] = XMM_SCRATCH;
+            }
+            continue;
+        }
+        sseRegister(&g->as, 0xF2, 0x10, dsts[ready], srcs[ready]);
+        dsts[ready] = dsts[count - 1];
+        srcs[ready] = srcs[count - 1];
+        count--;
+    }
+    for (int i = 0; i < constantCount; i++) {
+        Variable *variable = &r->variables[constants[i]];
+        moveImmediate(&g->as, R11, r->ir[variable->current].value);
+        moveToXmm(&g->as, variable->home, R11);
+    }
+}
+
+static void writeBack(Codegen *g, int variable, int ref) {
+    boxInto(g, R11, ref);
+    storeVariable(g, variable, R11);
+}
+
+// Restores what run() expects at the snapshot's instruction and returns.
+static void compileExit(Codegen *g, int index) {
+    Recorder *r = g->r;
+    Assembler *as = &g->as;
+    Snapshot *snapshot = &r->snapshots[index];
+    bool *done = calloc((size_t) r->variableCount + 1, sizeof(bool));
+    for (int j = 0; j < snapshot->count; j++) {
+        SnapshotEntry *entry = &r->entries[snapshot->start + j];
+        if (!isWrittenBack(r, entry)) continue;
+        writeBack(g, entry->variable, entry->ref);
+        for (int k = 0; k < r->variableCount; k++) {
+            if (r->variables[k].variable == entry->variable) done[k] = true;
+        }
+    }
+    // The entry snapshot exits before any home is loaded.
+    for (int k = 0; index > 0 && k < r->variableCount; k++) {
+        Variable *variable = &r->variables[k];
+        if (variable->home < 0 || !variable->written || done[k]) continue;
+        moveFromXmm(as, R11, variable->home);
+        storeVariable(g, variable->variable, R11);
+    }
+    free(done);
+    lea(as, R11, R_SLOTS, 8 * (r->base + snapshot->depth));
+    store(as, R_VM, offsetof(VM, stackTop), R11);
+    moveImmediate(as, R11, (uint64_t) (uintptr_t) snapshot->ip);
+    store(as, R_FRAME, offsetof(CallFrame, ip), R11);
+    moveImmediate(as, RAX, JIT_EXIT);
+    epilogue(as);
+}
+
+static bool compile(Recorder *r) {
+    Codegen g = {0};
+    g.r = r;
+    g.reg = malloc((size_t) r->irCount);
+    g.lastUse = malloc(sizeof(int) * (size_t) r->irCount);
+    g.released = calloc((size_t) r->irCount, sizeof(bool));
+    g.hoisted = calloc((size_t) r->irCount, sizeof(bool));
+    bool ok = g.reg != nullptr && g.lastUse != nullptr &&
+              g.released != nullptr && g.hoisted != nullptr;
+    if (!ok) goto done;
+    memset(g.reg, NO_REGISTER, (size_t) r->irCount);
+
+    g.freeXmm = (uint16_t) ((1u << XMM_SCRATCH) - 1);
+    g.freeGpr = (uint16_t) ((1u << GPR_POOL_SIZE) - 1);
+    for (int i = 0; i < r->variableCount; i++) {
+        Variable *variable = &r->variables[i];
+        if (variable->home < 0) continue;
+        g.hoisted[variable->load] = true;
+        g.hoisted[variable->load + 1] = true;
+        g.reg[variable->load + 1] = (int8_t) variable->home;
+        g.freeXmm &= (uint16_t) ~(1u << variable->home);
+    }
+    computeLiveness(&g);
+
+    // Homed variables are loaded once, exiting straight back to the header
+    // if one of them isn't a number today.
+    for (int i = 0; i < r->variableCount; i++) {
+        Variable *variable = &r->variables[i];
+        if (variable->home < 0) continue;
+        loadVariable(&g, R11, variable->variable);
+        opRegister(&g.as, 0x89, RAX, R11);
+        guardNumber(&g, RAX, 0);
+        moveToXmm(&g.as, variable->home, RAX);
+    }
+
+    int loopStart = g.as.count;
+    for (int i = 0; i < r->irCount && ok; i++) {
+        if (g.hoisted[i]) continue;
+        IrIns *ins = &r->ir[i];
+        bool guarded = ins->snapshot >= 0;
+        if (!guarded) releaseDying(&g, i);
+        if (needsRegister(ins) && !allocate(&g, i)) ok = false;
+        if (!ok) break;
+        compileIns(&g, i);
+        if (guarded) releaseDying(&g, i);
+        // A result nothing uses is dead straight away.
+        if (needsRegister(ins)) release(&g, i, i);
+    }
+    if (!ok) goto done;
+    moveToHomes(&g);
+    moveImmediate(&g.as, R11, (uint64_t) (uintptr_t) &r->loop->iterations);
+    aluMemory(&g.as, ALU_ADD, 8, R11, 0, 1);
+    patchJump(&g.as, jump(&g.as), loopStart);
+
+    int *exits = malloc(sizeof(int) * (size_t) r->snapshotCount);
+    ok = exits != nullptr;
+    for (int i = 0; ok && i < r->snapshotCount; i++) {
+        exits[i] = g.as.count;
+        compileExit(&g, i);
+    }
+    for (int i = 0; ok && i < g.as.patchCount; i++) {
+        Patch *patch = &g.as.patches[i];
+        patchJump(&g.as, patch->position, exits[patch->offset]);
+    }
+    free(exits);
+    if (ok) {
+        r->loop->code = mapCode(&g.as, &r->loop->size);
+        ok = r->loop->code != nullptr;
+    }
+
+done:
+    free(g.as.code);
+    free(g.as.patches);
+    free(g.reg);
+    free(g.lastUse);
+    free(g.released);
+    free(g.hoisted);
+    return ok;
+}
+
+static bool compileTrace(VM *vm, CallFrame *frame, TraceLoop *loop) {
+    Recorder *r = calloc(1, sizeof(Recorder));
+    if (r == nullptr) return false;
+    r->loop = loop;
+    r->vm = vm;
+    r->frame = frame;
+    r->chunk = &frame->function->chunk;
+    r->base = (int) (vm->stackTop - frame->slots);
+    loop->base = r->base;
+    // Snapshot 0 leaves at the header before anything has happened.
+    snapshot(r, r->chunk->code + loop->header);
+    bool ok = !r->failed && record(r);
+    if (ok) {
+        chooseHomes(r);
+        ok = compile(r);
+    }
+    free(r->snapshots);
+    free(r->entries);
+    free(r);
+    return ok;
+}
+
+static TraceLoop *findLoop(ObjFunction *function, int header) {
+    for (TraceLoop *loop = function->loops; loop != nullptr; loop = loop->next) {
+        if (loop->header == header) return loop;
+    }
+    TraceLoop *loop = calloc(1, sizeof(TraceLoop));
+    if (loop == nullptr) return nullptr;
+    loop->header = header;
+    loop->next = function->loops;
+    function->loops = loop;
+    return loop;
+}
+
+static void dropTrace(TraceLoop *loop) {
+    unmapCode(loop->code, loop->size);
+    loop->code = nullptr;
+}
+
+bool traceLoop(VM *vm, CallFrame *frame) {
+    ObjFunction *function = frame->function;
+    int header = (int) (frame->ip - function->chunk.code);
+    TraceLoop *loop = findLoop(function, header);
+    if (loop == nullptr || loop->blacklisted) return false;
+    if (loop->code == nullptr) {
+        if (++loop->hotness < TRACE_HOT_THRESHOLD) return false;
+        loop->hotness = 0;
+        if (!compileTrace(vm, frame, loop)) {
+            if (++loop->aborts == TRACE_MAX_ABORTS) loop->blacklisted = true;
+            return false;
+        }
+    }
+    if (vm->stackTop - frame->slots != loop->base) return false;
+
+    loop->entries++;
+    jitEnterAt(vm, frame, loop->code);
+    if (loop->entries >= TRACE_PROBATION &&
+        loop->iterations < loop->entries * TRACE_MIN_ITERATIONS) {
+        dropTrace(loop);
+        loop->blacklisted = true;
+    }
+    return true;
+}
+
+void traceFree(TraceLoop *loops) {
+    while (loops != nullptr) {
+        TraceLoop *next = loops->next;
+        if (loops->code != nullptr) dropTrace(loops);
+        free(loops);
+        loops = next;
+    }
+}
+#endif
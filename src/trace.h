@@ -0,0 +1,19 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include "common.h"
+
+#ifdef LOX_JIT
+#include "object.h"
+#include "vm.h"
+
+// A loop is recorded once its back edge has been taken this often.
+#define TRACE_HOT_THRESHOLD 64
+
+// Called by run() for every taken back edge while tracing is on, with
+// frame->ip at the loop header and vm.stackTop current. Returns true when a
+// trace ran, which leaves both at the instruction it exited to.
+bool traceLoop(VM *vm, CallFrame *frame);
+void traceFree(TraceLoop *loops);
+#endif
+
+#endif /* TRACE_H */
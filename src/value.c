@@ -12,37 +12,44 @@ void initValueArray(ValueArray *array) {
     array->count = 0;
 }
 
-static void ensureNewSpace(ValueArray *array) {
+static void ensureNewSpace(VM *vm, ValueArray *array) {
     if (array->capacity < array->count + 1) {
         int oldCapacity = array->capacity;
         array->capacity = GROW_CAPACITY(oldCapacity);
-        array->values =
-            GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
+        Value *values =
+            GROW_ARRAY(vm, Value, array->values, oldCapacity, array->capacity);
+        // The marker thread reads the count, then the values.
+        __atomic_store_n(&array->values, values, __ATOMIC_RELEASE);
     }
 }
 
-void writeValueArray(ValueArray *array, Value value) {
-    ensureNewSpace(array);
+void writeValueArray(VM *vm, ValueArray *array, Value value) {
+    ensureNewSpace(vm, array);
 
     array->values[array->count] = value;
-    array->count++;
+    __atomic_store_n(&array->count, array->count + 1, __ATOMIC_RELEASE);
 }
 
-void insertValueArray(ValueArray *array, int pos, Value value) {
+// The elements shift one at a time, as the marker thread may be reading
+// them; moveBarrier() has the list traced again for what it missed.
+void insertValueArray(VM *vm, ValueArray *array, int pos, Value value) {
     assert(pos >= 0 && pos < array->count);
-    ensureNewSpace(array);
-    memmove(array->values + pos + 1, array->values + pos,
-            (array->count - pos) * sizeof(Value));
-    array->values[pos] = value;
-    array->count++;
+    ensureNewSpace(vm, array);
+    array->values[array->count] = array->values[array->count - 1];
+    for (int i = array->count - 1; i > pos; i--) {
+        storeValue(&array->values[i], array->values[i - 1]);
+    }
+    storeValue(&array->values[pos], value);
+    __atomic_store_n(&array->count, array->count + 1, __ATOMIC_RELEASE);
 }
 
 Value removeValueArray(ValueArray *array, int pos) {
     assert(pos >= 0 && pos < array->count);
     Value value = array->values[pos];
-    memmove(array->values + pos, array->values + pos + 1,
-            (array->count - pos - 1) * sizeof(Value));
-    array->count--;
+    for (int i = pos; i < array->count - 1; i++) {
+        storeValue(&array->values[i], array->values[i + 1]);
+    }
+    __atomic_store_n(&array->count, array->count - 1, __ATOMIC_RELEASE);
     return value;
 }
 
@@ -82,12 +89,13 @@ void printValue(FILE *fout, Value value) {
             break;
         }
         case VAL_OBJ: printObject(value); break;
+        case VAL_UNDEFINED: break;
     }
 #endif
 }
 
-void freeValueArray(ValueArray *array) {
-    FREE_ARRAY(Value, array->values, array->capacity);
+void freeValueArray(VM *vm, ValueArray *array) {
+    FREE_ARRAY(vm, Value, array->values, array->capacity);
     initValueArray(array);
 }
 
@@ -6,6 +6,7 @@
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
+typedef struct VM VM;
 
 #ifdef NAN_BOXING
 #define QNAN     ((uint64_t)0x7ffc000000000000)
@@ -14,6 +15,7 @@ typedef struct ObjString ObjString;
 #define TAG_NIL   1 // 01
 #define TAG_FALSE 2 // 10
 #define TAG_TRUE  3 // 11
+#define TAG_UNDEFINED 4 // 100
 
 typedef uint64_t Value;
 
@@ -22,11 +24,15 @@ typedef uint64_t Value;
 
 #define BOOL_VAL(b)  ((b) ? TRUE_VAL : FALSE_VAL)
 #define NIL_VAL   ((Value)(uint64_t)(QNAN | TAG_NIL))
+// Marks a global slot that has been reserved by the compiler but not yet
+// defined. It never appears on the value stack.
+#define UNDEFINED_VAL ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 #define NUMBER_VAL(num) numToValue(num)
 #define OBJ_VAL(obj) (Value)(SIGN_BIT | QNAN | (uint64_t) (uintptr_t) (obj))
 
 #define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
 #define IS_NIL(value)  ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
 #define IS_NUMBER(value) (((value) & QNAN) != QNAN)
 #define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 
@@ -53,6 +59,7 @@ typedef enum {
     VAL_NIL,
     VAL_NUMBER,
     VAL_OBJ,
+    VAL_UNDEFINED,
 } ValueType;
 
 typedef struct {
@@ -68,6 +75,7 @@ typedef struct {
 #define IS_NIL(value)     ((value).type == VAL_NIL)
 #define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 
 #define AS_BOOL(value)    ((value).as.boolean)
 #define AS_NUMBER(value)  ((value).as.number)
@@ -77,9 +85,33 @@ typedef struct {
 #define NIL_VAL           ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(value)    ((Value){VAL_OBJ, {.obj = (Obj*)value}})
+#define UNDEFINED_VAL     ((Value){VAL_UNDEFINED, {.number = 0}})
 
 #endif
 
+// A slot in an old object may be read by the marker thread while the
+// script writes it; see markConcurrently(). Stores release whatever object
+// the value points at to the marker, which loads with acquire. Only a
+// NaN-boxed value fits in one atomic word, so only then does the marker
+// run on a thread.
+#ifdef NAN_BOXING
+static inline void storeValue(Value *slot, Value value) {
+    __atomic_store_n(slot, value, __ATOMIC_RELEASE);
+}
+
+static inline Value loadValue(const Value *slot) {
+    return __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+}
+#else
+static inline void storeValue(Value *slot, Value value) {
+    *slot = value;
+}
+
+static inline Value loadValue(const Value *slot) {
+    return *slot;
+}
+#endif
+
 typedef struct {
     int capacity;
     int count;
@@ -87,10 +119,10 @@ typedef struct {
 } ValueArray;
 
 void initValueArray(ValueArray *array);
-void writeValueArray(ValueArray *array, Value value);
+void writeValueArray(VM *vm, ValueArray *array, Value value);
 Value removeValueArray(ValueArray *array, int pos);
-void insertValueArray(ValueArray *array, int pos, Value value);
-void freeValueArray(ValueArray *array);
+void insertValueArray(VM *vm, ValueArray *array, int pos, Value value);
+void freeValueArray(VM *vm, ValueArray *array);
 void printValueC(FILE *fout, Value value);
 void printValue(FILE *fout, Value value);
 bool valuesEqual(Value a, Value b);
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <inttypes.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -6,80 +7,98 @@
 #include <string.h>
 #include <time.h>
 
+#include "bytecode.h"
 #include "chunk.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
+#include "snapshot.h"
 #include "table.h"
+#include "trace.h"
 #include "value.h"
 #include "vm.h"
 
-VM vm;
 
-static void nativeError(const char *format, ...);
-static void defineNativeMethod(ObjClass *class, const char *name, NativeFn fn);
-static void runtimeError(const char *format, ...);
+// Values C code may push above a frame's maxSlots, mostly to keep fresh
+// objects reachable while it allocates.
+#define STACK_SLACK 8
 
-static Value printLoxValue(int argCount, const Value *args) {
+static Value nativeError(VM *vm, const char *format, ...);
+static void defineNativeMethod(VM *vm, ObjClass *class, const char *name,
+                               NativeFn fn);
+static void runtimeError(VM *vm, const char *format, ...);
+
+static Value printLoxValue(VM *vm, int argCount, const Value *args) {
     for (int i = 0; i < argCount; i++) {
-        printValue(vm.fout, args[i]);
+        printValue(vm->fout, args[i]);
     }
-    fprintf(vm.fout, "\n");
+    fprintf(vm->fout, "\n");
     return BOOL_VAL(true);
 }
 
-static Value printErrNative(int argCount, const Value *args) {
+static Value printErrNative(VM *vm, int argCount, const Value *args) {
     if (argCount != 1) {
-        nativeError("Expected 1 argument but got %d", argCount);
+        return nativeError(vm, "Expected 1 argument but got %d", argCount);
     }
     if (!IS_STRING(args[0])) {
-        nativeError("Expected string argument.");
+        return nativeError(vm, "Expected string argument.");
     }
-    fprintf(stderr, "%s\n", AS_CSTRING(args[0]));
+    fprintf(vm->ferr, "%s\n", AS_CSTRING(args[0]));
     return BOOL_VAL(true);
 }
 
-static Value clockNative(int argCount, const Value *args) {
-    (void) argCount, (void) args;
+static Value clockNative(VM *vm, int argCount, const Value *args) {
+    (void) vm, (void) argCount, (void) args;
     return NUMBER_VAL((double) clock() / CLOCKS_PER_SEC);
 }
 
-static Value timeNative(int argCount, const Value *args) {
-    (void) argCount, (void) args;
+static Value timeNative(VM *vm, int argCount, const Value *args) {
+    (void) vm, (void) argCount, (void) args;
     return NUMBER_VAL((double) time(nullptr));
 }
-static void resetStack() {
-    vm.stackTop = vm.stack;
-    vm.frameCount = 0;
-    vm.openUpvalues = nullptr;
+static void resetStack(VM *vm) {
+    vm->stackTop = vm->stack;
+    vm->frameCount = 0;
+    vm->openUpvalues = nullptr;
 }
 
-static bool checkIndexBounds(const char *type, int bounds, Value indexValue) {
+static bool checkIndexBounds(VM *vm, const char *type, int bounds,
+                             Value indexValue) {
     if (!IS_NUMBER(indexValue)) {
-        runtimeError("%s must be a number.", type);
+        runtimeError(vm, "%s must be a number.", type);
         return false;
     }
     double indexNum = AS_NUMBER(indexValue);
     if (indexNum < 0 || indexNum >= (double) bounds) {
-        runtimeError("%s (%g) out of bounds (%d)", type, indexNum, bounds);
+        runtimeError(vm, "%s (%g) out of bounds (%d)", type, indexNum, bounds);
         return false;
     }
     if ((double) (int) indexNum != indexNum) {
-        runtimeError("%s (%g) must be a whole number.", type, indexNum);
+        runtimeError(vm, "%s (%g) must be a whole number.", type, indexNum);
         return false;
     }
     return true;
 }
 
-static bool checkListIndex(Value listValue, Value indexValue) {
+// The guard for the quickened list accesses; anything else goes through
+// checkListIndex for the error message.
+static inline bool isListIndex(ObjList *list, Value indexValue) {
+    if (!IS_NUMBER(indexValue)) return false;
+    double indexNum = AS_NUMBER(indexValue);
+    return indexNum >= 0 && indexNum < (double) list->elements.count &&
+           (double) (int) indexNum == indexNum;
+}
+
+static bool checkListIndex(VM *vm, Value listValue, Value indexValue) {
     ObjList *list = AS_LIST(listValue);
-    return checkIndexBounds("List index", list->elements.count, indexValue);
+    return checkIndexBounds(vm, "List index", list->elements.count, indexValue);
 }
 
-static Value mapCount(int argCount, const Value *args) {
+static Value mapCount(VM *vm, int argCount, const Value *args) {
     if (argCount != 0) {
-        nativeError("Expected 0 arguments, got %d", argCount);
+        return nativeError(vm, "Expected 0 arguments, got %d", argCount);
     }
     ObjMap *map = AS_MAP(args[-1]);
     int count = 0;
@@ -89,12 +108,12 @@ static Value mapCount(int argCount, const Value *args) {
     return NUMBER_VAL((double) count);
 }
 
-static Value mapHas(int argCount, const Value *args) {
+static Value mapHas(VM *vm, int argCount, const Value *args) {
     if (argCount != 1) {
-        nativeError("Expected 1 argument, got %d", argCount);
+        return nativeError(vm, "Expected 1 argument, got %d", argCount);
     }
     if (!IS_STRING(args[0])) {
-        nativeError("Maps can only be indexed by string.");
+        return nativeError(vm, "Maps can only be indexed by string.");
     }
 
     ObjMap *map = AS_MAP(args[-1]);
@@ -103,12 +122,12 @@ static Value mapHas(int argCount, const Value *args) {
     return BOOL_VAL(tableGet(&map->table, key, &value));
 }
 
-static Value mapRemove(int argCount, const Value *args) {
+static Value mapRemove(VM *vm, int argCount, const Value *args) {
     if (argCount != 1) {
-        nativeError("Expected 1 arguments, got %d", argCount);
+        return nativeError(vm, "Expected 1 arguments, got %d", argCount);
     }
     if (!IS_STRING(args[0])) {
-        nativeError("Maps can only be indexed by string.");
+        return nativeError(vm, "Maps can only be indexed by string.");
     }
 
     ObjMap *map = AS_MAP(args[-1]);
@@ -117,195 +136,335 @@ static Value mapRemove(int argCount, const Value *args) {
     return BOOL_VAL(tableDelete(&map->table, key));
 }
 
-static void initMapClass() {
+static void initMapClass(VM *vm) {
     const char mapStr[] = "(Map)";
-    ObjString *mapClassName = copyString(mapStr, sizeof(mapStr) - 1);
-    push(OBJ_VAL(mapClassName));
-    vm.mapClass = newClass(mapClassName);
-    pop();
-
-    defineNativeMethod(vm.mapClass, "count", mapCount);
-    defineNativeMethod(vm.mapClass, "has", mapHas);
-    defineNativeMethod(vm.mapClass, "remove", mapRemove);
+    ObjString *mapClassName = copyString(vm, mapStr, sizeof(mapStr) - 1);
+    push(vm, OBJ_VAL(mapClassName));
+    vm->mapClass = newClass(vm, mapClassName);
+    pop(vm);
+
+    defineNativeMethod(vm, vm->mapClass, "count", mapCount);
+    defineNativeMethod(vm, vm->mapClass, "has", mapHas);
+    defineNativeMethod(vm, vm->mapClass, "remove", mapRemove);
 }
 
-static Value listPop(int argCount, const Value *args) {
+static Value listPop(VM *vm, int argCount, const Value *args) {
     if (argCount != 0) {
-        nativeError("Expected 0 arguments, got %d", argCount);
+        return nativeError(vm, "Expected 0 arguments, got %d", argCount);
     }
     ObjList *list = AS_LIST(args[-1]);
     if (list->elements.count == 0) {
-        runtimeError("Can't pop form empty list.");
-        return BOOL_VAL(false);
+        return nativeError(vm, "Can't pop form empty list.");
     }
     return removeValueArray(&list->elements, list->elements.count - 1);
 }
 
-static Value listPush(int argCount, const Value *args) {
+static Value listPush(VM *vm, int argCount, const Value *args) {
     if (argCount != 1) {
-        nativeError("Expected 1 arguments, got %d", argCount);
+        return nativeError(vm, "Expected 1 arguments, got %d", argCount);
     }
     ObjList *list = AS_LIST(args[-1]);
-    writeValueArray(&list->elements, args[0]);
+    writeValueArray(vm, &list->elements, args[0]);
+    writeBarrier(vm, (Obj *) list, args[0]);
     return NIL_VAL;
 }
 
-static Value listInsert(int argCount, const Value *args) {
+static Value listInsert(VM *vm, int argCount, const Value *args) {
     if (argCount != 2) {
-        nativeError("expected 2 arguments, got %d", argCount);
+        return nativeError(vm, "expected 2 arguments, got %d", argCount);
     }
-    if (!checkListIndex(args[-1], args[0])) {
-        nativeError("Invalid list.");
+    if (!checkListIndex(vm, args[-1], args[0])) {
+        return UNDEFINED_VAL; // already reported
     }
 
     ObjList *list = AS_LIST(args[-1]);
     int pos = (int) AS_NUMBER(args[0]);
-    insertValueArray(&list->elements, pos, args[1]);
+    insertValueArray(vm, &list->elements, pos, args[1]);
+    writeBarrier(vm, (Obj *) list, args[1]);
+    moveBarrier(vm, (Obj *) list);
 
     return NIL_VAL;
 }
 
-static Value listSize(int argCount, const Value *args) {
+static Value listSize(VM *vm, int argCount, const Value *args) {
     if (argCount != 0) {
-        nativeError("Expected 0 arguments, got %d", argCount);
+        return nativeError(vm, "Expected 0 arguments, got %d", argCount);
     }
     ObjList *list = AS_LIST(args[-1]);
     return NUMBER_VAL((double) list->elements.count);
 }
 
-static Value listRemove(int argCount, const Value *args) {
+static Value listRemove(VM *vm, int argCount, const Value *args) {
     if (argCount != 1) {
-        nativeError("Expected 1 arguments, got %d", argCount);
+        return nativeError(vm, "Expected 1 arguments, got %d", argCount);
     }
-    if (!checkListIndex(args[-1], args[0])) {
-        nativeError("Invalid list.");
+    if (!checkListIndex(vm, args[-1], args[0])) {
+        return UNDEFINED_VAL; // already reported
     }
     ObjList *list = AS_LIST(args[-1]);
     int pos = (int) AS_NUMBER(args[0]);
+    moveBarrier(vm, (Obj *) list);
     return removeValueArray(&list->elements, pos);
 }
 
-static void initListClass() {
+static void initListClass(VM *vm) {
     const char listStr[] = "(List)";
-    ObjString *listClassName = copyString(listStr, sizeof(listStr) - 1);
-    push(OBJ_VAL(listClassName));
-    vm.listClass = newClass(listClassName);
-    pop();
-
-    defineNativeMethod(vm.listClass, "insert", listInsert);
-    defineNativeMethod(vm.listClass, "push", listPush);
-    defineNativeMethod(vm.listClass, "pop", listPop);
-    defineNativeMethod(vm.listClass, "size", listSize);
-    defineNativeMethod(vm.listClass, "remove", listRemove);
+    ObjString *listClassName = copyString(vm, listStr, sizeof(listStr) - 1);
+    push(vm, OBJ_VAL(listClassName));
+    vm->listClass = newClass(vm, listClassName);
+    pop(vm);
+
+    defineNativeMethod(vm, vm->listClass, "insert", listInsert);
+    defineNativeMethod(vm, vm->listClass, "push", listPush);
+    defineNativeMethod(vm, vm->listClass, "pop", listPop);
+    defineNativeMethod(vm, vm->listClass, "size", listSize);
+    defineNativeMethod(vm, vm->listClass, "remove", listRemove);
 }
 
-static void nativeError(const char *format, ...) {
-    va_list args;
-    va_start(args, format);
-    vfprintf(vm.ferr, format, args);
-    va_end(args);
-    fputs("\n", vm.ferr);
+static void reportError(VM *vm, const char *format, va_list args) {
+    vfprintf(vm->ferr, format, args);
+    fputs("\n", vm->ferr);
 
-    for (int i = vm.frameCount - 1; i >= 0; i--) {
-        CallFrame *frame = &vm.frames[i];
+    for (int i = vm->frameCount - 1; i >= 0; i--) {
+        CallFrame *frame = &vm->frames[i];
         ObjFunction *function = frame->closure->function;
         size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(vm.ferr, "[line %d] in ", function->chunk.lines[instruction]);
+        fprintf(vm->ferr, "[line %d] in ", function->chunk.lines[instruction]);
         if (function->name == nullptr) {
-            fprintf(vm.ferr, "script\n");
+            fprintf(vm->ferr, "script\n");
         } else {
-            fprintf(vm.ferr, "%s()\n", function->name->chars);
+            fprintf(vm->ferr, "%s()\n", function->name->chars);
         }
     }
 
-    freeVM();
-    exit(70);
+    resetStack(vm);
 }
 
-static void runtimeError(const char *format, ...) {
+static void runtimeError(VM *vm, const char *format, ...) {
     va_list args;
     va_start(args, format);
-    vfprintf(vm.ferr, format, args);
+    reportError(vm, format, args);
     va_end(args);
-    fputs("\n", vm.ferr);
+}
 
-    for (int i = vm.frameCount - 1; i >= 0; i--) {
-        CallFrame *frame = &vm.frames[i];
-        ObjFunction *function = frame->closure->function;
-        size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(vm.ferr, "[line %d] in ", function->chunk.lines[instruction]);
-        if (function->name == nullptr) {
-            fprintf(vm.ferr, "script\n");
-        } else {
-            fprintf(vm.ferr, "%s()\n", function->name->chars);
-        }
+// Natives fail with `return nativeError(...)`: the error is reported and the
+// stack unwound like any runtime error, and the UNDEFINED_VAL it returns, which
+// is never a real value, tells callValue() to give up.
+static Value nativeError(VM *vm, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    reportError(vm, format, args);
+    va_end(args);
+    return UNDEFINED_VAL;
+}
+
+static void defineNative(VM *vm, const char *name, NativeFn function) {
+    push(vm, OBJ_VAL(copyString(vm, name, (int) strlen(name))));
+    push(vm, OBJ_VAL(newNative(vm, function)));
+    int slot = globalSlot(vm, AS_STRING(vm->stack[0]));
+    vm->globalValues.values[slot] = vm->stack[1];
+    pop(vm);
+    pop(vm);
+}
+
+static void defineNativeMethod(VM *vm, ObjClass *class, const char *name,
+                               NativeFn fn) {
+    ObjString *str = copyString(vm, name, (int) strlen(name));
+    push(vm, OBJ_VAL(str));
+    ObjNative *native = newNative(vm, fn);
+    push(vm, OBJ_VAL(native));
+    tableSet(vm, &class->methods, str, OBJ_VAL(native));
+    pop(vm);
+    pop(vm);
+}
+
+// Every native, in a fixed order: heap snapshots refer to them by index, so
+// new ones go at the end.
+static const NativeFn natives[] = {
+    printLoxValue, printErrNative, clockNative, timeNative,
+    mapCount,      mapHas,         mapRemove,   listInsert,
+    listPush,      listPop,        listSize,    listRemove,
+};
+
+int nativeIndex(NativeFn function) {
+    for (int i = 0; i < (int) (sizeof(natives) / sizeof(natives[0])); i++) {
+        if (natives[i] == function) return i;
     }
+    return -1;
+}
 
-    resetStack();
+NativeFn nativeAt(int index) {
+    if (index < 0 || index >= (int) (sizeof(natives) / sizeof(natives[0]))) {
+        return nullptr;
+    }
+    return natives[index];
 }
 
-static void defineNative(const char *name, NativeFn function) {
-    push(OBJ_VAL(copyString(name, (int) strlen(name))));
-    push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-    pop();
-    pop();
+// Everything but the heap.
+static void initState(VM *vm, FILE *fout, FILE *ferr) {
+    vm->frames = malloc(sizeof(CallFrame) * FRAMES_INITIAL);
+    vm->frameCapacity = FRAMES_INITIAL;
+    vm->maxFrames = FRAMES_MAX;
+    vm->stack = malloc(sizeof(Value) * STACK_INITIAL);
+    vm->stackLimit = vm->stack + STACK_INITIAL;
+    if (vm->frames == nullptr || vm->stack == nullptr) exit(1);
+    resetStack(vm);
+    vm->fout = fout;
+    vm->ferr = ferr;
+    vm->youngBytes = 0;
+    vm->remembered = nullptr;
+    vm->rememberedCount = 0;
+    vm->rememberedCapacity = 0;
+    vm->collectingYoung = false;
+    vm->gcPhase = GC_IDLE;
+    vm->gcPause = GC_PAUSE_DEFAULT;
+    vm->stepBytes = 0;
+    vm->gcHeld = false;
+    vm->minorCollections = 0;
+    vm->majorCollections = 0;
+    vm->longestPause = 0;
+    vm->gcConcurrent = false;
+    vm->markerRunning = false;
+    vm->markerDone = false;
+    vm->retired = nullptr;
+    vm->retiredCount = 0;
+    vm->retiredCapacity = 0;
+    vm->parser = nullptr;
+    vm->cacheDir = nullptr;
+    vm->images = nullptr;
+    vm->bytesAllocated = 0;
+    vm->nextGC = 1024 * 1024;
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        vm->pages[i] = nullptr;
+        vm->unswept[i] = nullptr;
+        vm->freeCells[i] = nullptr;
+    }
+    vm->youngPages = nullptr;
+    vm->youngPageCount = 0;
+    vm->youngPageCapacity = 0;
+    vm->grayCount = 0;
+    vm->grayCapacity = 0;
+    vm->grayStack = nullptr;
+    vm->listClass = nullptr;
+    vm->mapClass = nullptr;
+    vm->cacheEpoch = 0;
+    vm->cacheHits = 0;
+    vm->cacheMisses = 0;
+    vm->jitEnabled = false;
+    vm->tracingEnabled = false;
+    vm->lazyCompile = false;
+    vm->peepholeEnabled = true;
+    vm->ssaEnabled = true;
+    vm->inlineEnabled = true;
+
+    initTable(&vm->globalSlots);
+    initValueArray(&vm->globalValues);
+    initValueArray(&vm->globalNames);
+    initTable(&vm->strings);
+    vm->initString = nullptr;
 }
 
-static void defineNativeMethod(ObjClass *class, const char *name, NativeFn fn) {
-    ObjString *str = copyString(name, (int) strlen(name));
-    push(OBJ_VAL(str));
-    ObjNative *native = newNative(fn);
-    push(OBJ_VAL(native));
-    tableSet(&class->methods, str, OBJ_VAL(native));
-    pop();
-    pop();
+// The objects every VM starts with.
+static void initRuntime(VM *vm) {
+    vm->initString = copyString(vm, "init", 4);
+    initListClass(vm);
+    initMapClass(vm);
+    defineNative(vm, "clock", timeNative);
+    defineNative(vm, "wallClock", clockNative);
+    defineNative(vm, "error", printErrNative);
+    defineNative(vm, "printf", printLoxValue);
 }
 
-void initVM(FILE *fout, FILE *ferr) {
-    resetStack();
-    vm.fout = fout;
-    vm.ferr = ferr;
-    vm.objects = nullptr;
-    vm.bytesAllocated = 0;
-    vm.nextGC = 1024 * 1024;
-    vm.grayCount = 0;
-    vm.grayCapacity = 0;
-    vm.grayStack = nullptr;
-    vm.listClass = nullptr;
-    vm.mapClass = nullptr;
+void initVM(VM *vm, FILE *fout, FILE *ferr) {
+    initState(vm, fout, ferr);
+    initRuntime(vm);
+}
 
-    initTable(&vm.globals);
-    initTable(&vm.strings);
-    vm.initString = nullptr;
-    vm.initString = copyString("init", 4);
-    initListClass();
-    initMapClass();
-    defineNative("clock", timeNative);
-    defineNative("wallClock", clockNative);
-    defineNative("error", printErrNative);
-    defineNative("printf", printLoxValue);
+bool initVMFromSnapshot(VM *vm, FILE *fout, FILE *ferr, const char *path) {
+    initState(vm, fout, ferr);
+    if (loadSnapshot(vm, path)) return true;
+    initRuntime(vm);
+    return false;
 }
-void freeVM() {
-    freeTable(&vm.strings);
-    freeTable(&vm.globals);
-    vm.initString = nullptr;
-    freeObjects();
+
+void freeVM(VM *vm) {
+    freeTable(vm, &vm->strings);
+    freeTable(vm, &vm->globalSlots);
+    freeValueArray(vm, &vm->globalValues);
+    freeValueArray(vm, &vm->globalNames);
+    vm->initString = nullptr;
+    freeObjects(vm);
+    freeBytecodeImages(vm);
+    free(vm->frames);
+    free(vm->stack);
+    vm->frames = nullptr;
+    vm->stack = vm->stackTop = vm->stackLimit = nullptr;
 }
 
-void push(Value value) {
-    *vm.stackTop = value;
-    vm.stackTop++;
+void printStats(VM *vm, FILE *ferr) {
+    size_t lookups = vm->cacheHits + vm->cacheMisses;
+    fprintf(ferr, "inline caches: %zu hits, %zu misses (%.1f%% hit rate)\n",
+            vm->cacheHits, vm->cacheMisses,
+            lookups == 0 ? 0.0
+                         : 100.0 * (double) vm->cacheHits / (double) lookups);
+    fprintf(ferr,
+            "gc: %zu minor, %zu major collections, longest pause %.3f ms\n",
+            vm->minorCollections, vm->majorCollections,
+            vm->longestPause * 1000);
 }
 
-Value pop() {
-    vm.stackTop--;
-    return *vm.stackTop;
+// Returns the slot of the global variable `name`, reserving an undefined
+// one the first time the name is seen.
+int globalSlot(VM *vm, ObjString *name) {
+    Value slot;
+    if (tableGet(&vm->globalSlots, name, &slot)) {
+        return (int) AS_NUMBER(slot);
+    }
+    push(vm, OBJ_VAL(name));
+    writeValueArray(vm, &vm->globalValues, UNDEFINED_VAL);
+    writeValueArray(vm, &vm->globalNames, OBJ_VAL(name));
+    tableSet(vm, &vm->globalSlots, name, NUMBER_VAL(vm->globalNames.count - 1));
+    pop(vm);
+    return vm->globalNames.count - 1;
 }
 
-static Value peek(int distance) { return vm.stackTop[-1 - distance]; }
+// Moves the value stack to a block with room for `needed` more values above
+// vm->stackTop, rebasing the frames' slots and the open upvalues. Anything
+// else pointing into the old block, like run()'s cached stackTop, has to be
+// reloaded afterwards.
+static void growStack(VM *vm, size_t needed) {
+    size_t count = (size_t) (vm->stackTop - vm->stack);
+    size_t capacity = (size_t) (vm->stackLimit - vm->stack);
+    while (capacity < count + needed) capacity *= 2;
+
+    Value *stack = realloc(vm->stack, sizeof(Value) * capacity);
+    if (stack == nullptr) exit(1);
+    for (int i = 0; i < vm->frameCount; i++) {
+        vm->frames[i].slots = stack + (vm->frames[i].slots - vm->stack);
+    }
+    for (ObjUpvalue *upvalue = vm->openUpvalues; upvalue != nullptr;
+         upvalue = upvalue->next) {
+        upvalue->location = stack + (upvalue->location - vm->stack);
+    }
+    vm->stack = stack;
+    vm->stackTop = stack + count;
+    vm->stackLimit = stack + capacity;
+}
 
-static bool call(Obj *callable, int argCount) {
+void push(VM *vm, Value value) {
+    if (vm->stackTop == vm->stackLimit) growStack(vm, 1);
+    *vm->stackTop = value;
+    vm->stackTop++;
+}
+
+Value pop(VM *vm) {
+    vm->stackTop--;
+    return *vm->stackTop;
+}
+
+static Value peek(VM *vm, int distance) { return vm->stackTop[-1 - distance]; }
+
+static bool call(VM *vm, Obj *callable, int argCount) {
     ObjClosure *closure;
     ObjFunction *function;
 
@@ -318,104 +477,222 @@ static bool call(Obj *callable, int argCount) {
         function = (ObjFunction *) callable;
     }
     if (argCount != function->arity) {
-        runtimeError("Expected %d arguments but got %d.", function->arity,
+        runtimeError(vm, "Expected %d arguments but got %d.", function->arity,
                      argCount);
         return false;
     }
-    if (vm.frameCount == FRAMES_MAX) {
-        runtimeError("Stack overflow.");
+    if (function->lazy != nullptr && !compileLazyFunction(vm, function)) {
+        runtimeError(vm, "Could not compile %s().", function->name->chars);
         return false;
     }
-    CallFrame *frame = &vm.frames[vm.frameCount++];
+    if (vm->frameCount >= vm->maxFrames) {
+        runtimeError(vm, "Stack overflow.");
+        return false;
+    }
+    if (vm->frameCount == vm->frameCapacity) {
+        int capacity = vm->frameCapacity * 2;
+        if (capacity > vm->maxFrames) capacity = vm->maxFrames;
+        CallFrame *frames =
+            realloc(vm->frames, sizeof(CallFrame) * (size_t) capacity);
+        if (frames == nullptr) exit(1);
+        vm->frames = frames;
+        vm->frameCapacity = capacity;
+    }
+    // The frame's own slots, plus a little for the values natives and the
+    // allocator push while it runs.
+    int needed = function->maxSlots - argCount - 1 + STACK_SLACK;
+    if (vm->stackLimit - vm->stackTop < needed) growStack(vm, (size_t) needed);
+#ifdef LOX_JIT
+    if (vm->jitEnabled && function->jitCode == nullptr &&
+        function->hotness < JIT_HOT_THRESHOLD &&
+        ++function->hotness == JIT_HOT_THRESHOLD) {
+        jitCompile(function);
+    }
+#endif
+    CallFrame *frame = &vm->frames[vm->frameCount++];
     frame->closure = closure;
     frame->function = function;
     frame->ip = function->chunk.code;
-    frame->slots = vm.stackTop - argCount - 1;
+    frame->slots = vm->stackTop - argCount - 1;
     return true;
 }
 
-static bool callValue(Value callee, int argCount) {
+static bool callValue(VM *vm, Value callee, int argCount) {
     if (IS_OBJ(callee)) {
         switch (OBJ_TYPE(callee)) {
             case OBJ_BOUND_METHOD: {
                 ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
-                vm.stackTop[-argCount - 1] = bound->receiver;
-                return callValue(OBJ_VAL(bound->method), argCount);
+                vm->stackTop[-argCount - 1] = bound->receiver;
+                return callValue(vm, OBJ_VAL(bound->method), argCount);
             }
             case OBJ_CLASS: {
                 ObjClass *class = AS_CLASS(callee);
-                vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(class));
+                vm->stackTop[-argCount - 1] = OBJ_VAL(newInstance(vm, class));
                 Value initializer;
-                if (tableGet(&class->methods, vm.initString, &initializer)) {
-                    return callValue(initializer, argCount);
+                if (tableGet(&class->methods, vm->initString, &initializer)) {
+                    return callValue(vm, initializer, argCount);
                 } else if (argCount != 0) {
-                    runtimeError("Expected 0 arguments but got %d.", argCount);
+                    runtimeError(vm, "Expected 0 arguments but got %d.",
+                                 argCount);
                     return false;
                 }
                 return true;
             }
-            case OBJ_CLOSURE: return call(AS_OBJ(callee), argCount);
+            case OBJ_CLOSURE: return call(vm, AS_OBJ(callee), argCount);
             case OBJ_NATIVE: {
                 NativeFn native = AS_NATIVE(callee);
-                Value result = native(argCount, vm.stackTop - argCount);
-                vm.stackTop -= argCount + 1;
-                push(result);
+                Value result = native(vm, argCount, vm->stackTop - argCount);
+                if (IS_UNDEFINED(result)) return false;
+                vm->stackTop -= argCount + 1;
+                push(vm, result);
                 return true;
             }
             default: break;
         }
     }
-    runtimeError("Can only call functions and classes.");
+    runtimeError(vm, "Can only call functions and classes.");
     return false;
 }
 
-static bool invokeFromClass(ObjClass *class, ObjString *name, int argCount) {
+static inline CacheEntry *findCacheEntry(VM *vm, InlineCache *cache, Obj *key) {
+    if (cache->epoch != vm->cacheEpoch) {
+        cache->epoch = vm->cacheEpoch;
+        cache->count = 0;
+    }
+    int count = cache->count < IC_POLYMORPHIC_MAX ? cache->count : IC_POLYMORPHIC_MAX;
+    for (int i = 0; i < count; i++) {
+        if (cache->entries[i].key == key) {
+            vm->cacheHits++;
+            return &cache->entries[i];
+        }
+    }
+    vm->cacheMisses++;
+    return nullptr;
+}
+
+// Once a site has seen more receivers than it can hold it stops learning and
+// keeps the entries it has; everything else takes the slow path.
+static void fillCache(InlineCache *cache, Obj *key, int slot, Value value) {
+    if (cache->count == IC_MEGAMORPHIC) return;
+    if (cache->count == IC_POLYMORPHIC_MAX) {
+        cache->count = IC_MEGAMORPHIC;
+        return;
+    }
+    CacheEntry *entry = &cache->entries[cache->count++];
+    entry->key = key;
+    entry->slot = slot;
+    entry->value = value;
+}
+
+static bool invokeFromClass(VM *vm, ObjClass *class, ObjString *name,
+                            int argCount,
+                            InlineCache *cache) {
+    CacheEntry *entry = findCacheEntry(vm, cache, (Obj *) class);
+    if (entry != nullptr) {
+        return callValue(vm, entry->value, argCount);
+    }
     Value method;
     if (!tableGet(&class->methods, name, &method)) {
-        runtimeError("Undefined property '%s'.", name->chars);
+        runtimeError(vm, "Undefined property '%s'.", name->chars);
         return false;
     }
-    return callValue(method, argCount);
+    fillCache(cache, (Obj *) class, -1, method);
+    return callValue(vm, method, argCount);
 }
 
-static bool invoke(ObjString *name, int argCount) {
-    Value receiver = peek(argCount);
+static bool invoke(VM *vm, ObjString *name, int argCount, InlineCache *cache) {
+    Value receiver = peek(vm, argCount);
     ObjClass *class;
 
     if (IS_LIST(receiver)) {
-        class = vm.listClass;
+        class = vm->listClass;
     } else if (IS_MAP(receiver)) {
-        class = vm.mapClass;
+        class = vm->mapClass;
     } else if (IS_INSTANCE(receiver)) {
+        // Instances are keyed by shape rather than class so a hit can also
+        // tell whether a field shadows the method, and where it lives.
         ObjInstance *instance = AS_INSTANCE(receiver);
-        Value value;
-        if (tableGet(&instance->fields, name, &value)) {
-            vm.stackTop[-argCount - 1] = value;
-            return callValue(value, argCount);
+        ObjShape *shape = instance->shape;
+        CacheEntry *entry = findCacheEntry(vm, cache, (Obj *) shape);
+        int slot;
+        if (entry != nullptr) {
+            if (entry->slot < 0) return callValue(vm, entry->value, argCount);
+            slot = entry->slot;
+        } else {
+            slot = shapeSlot(shape, name);
+            if (slot < 0) {
+                Value method;
+                if (!tableGet(&instance->class->methods, name, &method)) {
+                    runtimeError(vm, "Undefined property '%s'.", name->chars);
+                    return false;
+                }
+                // Dictionary shapes change in place, so a later field could
+                // start shadowing the method without the key changing.
+                if (!shape->isDictionary) fillCache(cache, (Obj *) shape, -1, method);
+                return callValue(vm, method, argCount);
+            }
+            if (!shape->isDictionary) fillCache(cache, (Obj *) shape, slot, NIL_VAL);
         }
-        class = instance->class;
+        Value value = instance->fields[slot];
+        vm->stackTop[-argCount - 1] = value;
+        return callValue(vm, value, argCount);
     } else {
-        runtimeError("Only lists, maps, and instances have methods.");
+        runtimeError(vm, "Only lists, maps, and instances have methods.");
         return false;
     }
-    return invokeFromClass(class, name, argCount);
+    return invokeFromClass(vm, class, name, argCount, cache);
+}
+
+// Whether the call an OP_CALL_INLINE stands for would run `function`.
+static inline bool callsInlined(Value callee, ObjFunction *function) {
+    return IS_CLOSURE(callee) && AS_CLOSURE(callee)->function == function;
 }
 
-static bool bindMethod(ObjClass *class, ObjString *name) {
+// Whether the method call an OP_INVOKE_INLINE stands for would run
+// `function`, and every field its body reads is already there so none of
+// the copy's property loads can fail. The answer is cached by shape in
+// `guard`; dictionary shapes are checked every time.
+static bool invokesInlined(VM *vm, Value receiver, ObjString *name,
+                           ObjFunction *function, InlineCache *guard) {
+    if (!IS_INSTANCE(receiver)) return false;
+    ObjInstance *instance = AS_INSTANCE(receiver);
+    ObjShape *shape = instance->shape;
+    CacheEntry *entry = findCacheEntry(vm, guard, (Obj *) shape);
+    if (entry != nullptr) return entry->slot > 0;
+
+    Value method;
+    bool inlined = shapeSlot(shape, name) < 0 &&
+                   tableGet(&instance->class->methods, name, &method) &&
+                   callsInlined(method, function);
+    Chunk *chunk = &function->chunk;
+    for (int offset = 0; inlined && offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        if (chunk->code[offset] == OP_GET_PROPERTY) {
+            Value field = chunk->constants.values[chunk->code[offset + 1]];
+            inlined = shapeSlot(shape, AS_STRING(field)) >= 0;
+        }
+    }
+    if (!shape->isDictionary) {
+        fillCache(guard, (Obj *) shape, inlined ? 1 : 0, NIL_VAL);
+    }
+    return inlined;
+}
+
+static bool bindMethod(VM *vm, ObjClass *class, ObjString *name) {
     Value method;
     if (!tableGet(&class->methods, name, &method)) {
-        runtimeError("Undefined property '%s'.", name->chars);
+        runtimeError(vm, "Undefined property '%s'.", name->chars);
         return false;
     }
-    ObjBoundMethod *bound = newBoundMethod(peek(0), AS_CLOSURE(method));
-    pop();
-    push(OBJ_VAL(bound));
+    ObjBoundMethod *bound = newBoundMethod(vm, peek(vm, 0), AS_CLOSURE(method));
+    pop(vm);
+    push(vm, OBJ_VAL(bound));
     return true;
 }
 
-static ObjUpvalue *captureUpvalue(Value *local) {
+static ObjUpvalue *captureUpvalue(VM *vm, Value *local) {
     ObjUpvalue *prevUpvalue = nullptr;
-    ObjUpvalue *upvalue = vm.openUpvalues;
+    ObjUpvalue *upvalue = vm->openUpvalues;
     while (upvalue != nullptr && upvalue->location > local) {
         prevUpvalue = upvalue;
         upvalue = upvalue->next;
@@ -426,441 +703,998 @@ static ObjUpvalue *captureUpvalue(Value *local) {
         return upvalue;
     }
 
-    ObjUpvalue *createdUpvalue = newUpvalue(local);
+    ObjUpvalue *createdUpvalue = newUpvalue(vm, local);
     createdUpvalue->next = upvalue;
     if (prevUpvalue == nullptr) {
-        vm.openUpvalues = createdUpvalue;
+        vm->openUpvalues = createdUpvalue;
     } else {
         prevUpvalue->next = createdUpvalue;
     }
     return createdUpvalue;
 }
 
-static void closeUpvalues(const Value *last) {
-    while (vm.openUpvalues != nullptr && vm.openUpvalues->location >= last) {
-        ObjUpvalue *upvalue = vm.openUpvalues;
-        upvalue->closed = *upvalue->location;
+static void closeUpvalues(VM *vm, const Value *last) {
+    while (vm->openUpvalues != nullptr && vm->openUpvalues->location >= last) {
+        ObjUpvalue *upvalue = vm->openUpvalues;
+        storeValue(&upvalue->closed, *upvalue->location);
         upvalue->location = &upvalue->closed;
-        vm.openUpvalues = upvalue->next;
+        writeBarrier(vm, (Obj *) upvalue, upvalue->closed);
+        vm->openUpvalues = upvalue->next;
+    }
+}
+
+// Calls `callee` in place of the current frame, for `return f(...)`: its
+// upvalues are closed and the callee and arguments slid down over its slots.
+// Natives and classes are called normally and return to the OP_RETURN that
+// follows, as does a call with the wrong arity so the error names the caller.
+static bool tailCall(VM *vm, Value callee, int argCount) {
+    if (IS_BOUND_METHOD(callee)) {
+        ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
+        vm->stackTop[-argCount - 1] = bound->receiver;
+        callee = OBJ_VAL(bound->method);
+    }
+    // Anything that could fail goes through an ordinary call, so that the
+    // error is reported from the caller's frame. A lazy body compiles on its
+    // first call, after which tail calls to it reuse the frame.
+    if (!IS_CLOSURE(callee) ||
+        AS_CLOSURE(callee)->function->arity != argCount ||
+        AS_CLOSURE(callee)->function->lazy != nullptr) {
+        return callValue(vm, callee, argCount);
     }
+    CallFrame *frame = &vm->frames[vm->frameCount - 1];
+    Value *args = vm->stackTop - argCount - 1;
+    closeUpvalues(vm, frame->slots);
+    memmove(frame->slots, args, sizeof(Value) * (size_t) (argCount + 1));
+    vm->stackTop = frame->slots + argCount + 1;
+    vm->frameCount--;
+    return call(vm, AS_OBJ(callee), argCount);
 }
 
-static void defineMethod(ObjString *name) {
-    Value method = peek(0);
-    ObjClass *class = AS_CLASS(peek(1));
-    tableSet(&class->methods, name, method);
-    pop();
+static void defineMethod(VM *vm, ObjString *name) {
+    Value method = peek(vm, 0);
+    ObjClass *class = AS_CLASS(peek(vm, 1));
+    tableSet(vm, &class->methods, name, method);
+    pop(vm);
 }
 
 static bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate() {
-    ObjString *b = AS_STRING(peek(0));
-    ObjString *a = AS_STRING(peek(1));
+static void concatenate(VM *vm) {
+    ObjString *b = AS_STRING(peek(vm, 0));
+    ObjString *a = AS_STRING(peek(vm, 1));
 
     int length = a->length + b->length;
-    char *chars = ALLOCATE(char, length + 1);
+    char *chars = ALLOCATE(vm, char, length + 1);
     memcpy(chars, a->chars, a->length);
     memcpy(chars + a->length, b->chars, b->length);
     chars[length] = '\0';
 
-    ObjString *result = takeString(chars, length);
+    ObjString *result = takeString(vm, chars, length);
+
+    pop(vm);
+    pop(vm);
+    push(vm, OBJ_VAL(result));
+}
+
+// The property and index instructions, shared by run() and compiled code.
+// `ip` points past the instruction and `stackTop` is the caller's cached
+// stack top; both are written back before anything that can allocate or
+// report an error. Each leaves its result in the lowest operand's slot and
+// the caller drops the rest.
+#define SYNC() (frame->ip = ip, vm->stackTop = stackTop)
+#define FAIL(...)                                                              \
+    do {                                                                       \
+        SYNC();                                                                \
+        runtimeError(vm, __VA_ARGS__);                                         \
+        return false;                                                          \
+    } while (0)
+
+static inline bool getProperty(VM *vm, CallFrame *frame, uint8_t *ip,
+                               Value *stackTop,
+                               ObjString *name, InlineCache *cache) {
+    if (!IS_INSTANCE(stackTop[-1])) {
+        FAIL("Only instances have properties.");
+    }
+
+    ObjInstance *instance = AS_INSTANCE(stackTop[-1]);
+    ObjShape *shape = instance->shape;
+
+    Value method;
+    CacheEntry *entry = findCacheEntry(vm, cache, (Obj *) shape);
+    if (entry != nullptr) {
+        if (entry->slot >= 0) {
+            stackTop[-1] = instance->fields[entry->slot];
+            return true;
+        }
+        method = entry->value;
+    } else {
+        int slot = shapeSlot(shape, name);
+        if (slot >= 0) {
+            if (!shape->isDictionary) fillCache(cache, (Obj *) shape, slot, NIL_VAL);
+            stackTop[-1] = instance->fields[slot];
+            return true;
+        }
+        if (!tableGet(&instance->class->methods, name, &method)) {
+            FAIL("Undefined property '%s'.", name->chars);
+        }
+        if (!shape->isDictionary) fillCache(cache, (Obj *) shape, -1, method);
+    }
+    SYNC();
+    ObjBoundMethod *bound = newBoundMethod(vm, stackTop[-1],
+                                           AS_CLOSURE(method));
+    stackTop[-1] = OBJ_VAL(bound);
+    return true;
+}
+
+// Stores stackTop[-1] into the instance below it; unlike the others it
+// leaves both operands for the caller, which knows whether to keep the value.
+static inline bool setProperty(VM *vm, CallFrame *frame, uint8_t *ip,
+                               Value *stackTop,
+                               ObjString *name, InlineCache *cache) {
+    if (!IS_INSTANCE(stackTop[-2])) {
+        FAIL("Only instances have properties.");
+    }
+
+    ObjInstance *instance = AS_INSTANCE(stackTop[-2]);
+    ObjShape *shape = instance->shape;
+
+    // A hit remembers both the slot and the shape after the store, so
+    // adding a field along a known transition skips the shape tables.
+    CacheEntry *entry = findCacheEntry(vm, cache, (Obj *) shape);
+    if (entry != nullptr && entry->slot < instance->fieldCapacity) {
+        storeValue(&instance->fields[entry->slot], stackTop[-1]);
+        __atomic_store_n(&instance->shape, AS_SHAPE(entry->value),
+                         __ATOMIC_RELEASE);
+        writeBarrier(vm, (Obj *) instance, stackTop[-1]);
+        writeBarrier(vm, (Obj *) instance, entry->value);
+    } else {
+        SYNC();
+        setField(vm, instance, name, stackTop[-1]);
+        ObjShape *newShape = instance->shape;
+        if (entry == nullptr && !shape->isDictionary && !newShape->isDictionary) {
+            fillCache(cache, (Obj *) shape, shapeSlot(newShape, name),
+                      OBJ_VAL(newShape));
+        }
+    }
+    return true;
+}
+
+static inline bool getIndex(VM *vm, CallFrame *frame, uint8_t *ip,
+                            Value *stackTop) {
+    if (IS_LIST(stackTop[-2])) {
+        ip[-1] = OP_GET_INDEX_LIST;
+        SYNC();
+        if (!checkListIndex(vm, stackTop[-2], stackTop[-1])) {
+            return false;
+        }
+        ObjList *list = AS_LIST(stackTop[-2]);
+        stackTop[-2] = list->elements.values[(int) AS_NUMBER(stackTop[-1])];
+        return true;
+    } else if (IS_MAP(stackTop[-2])) {
+        if (!IS_STRING(stackTop[-1])) {
+            FAIL("Maps can only be indexed be string.");
+        }
+        ObjString *key = AS_STRING(stackTop[-1]);
+        ObjMap *map = AS_MAP(stackTop[-2]);
+        Value value;
+        if (tableGet(&map->table, key, &value)) {
+            stackTop[-2] = value;
+            return true;
+        }
+        FAIL("Undefined key '%s'.", key->chars);
+    }
+    FAIL("Can only index lists or maps.");
+}
+
+static inline bool setIndex(VM *vm, CallFrame *frame, uint8_t *ip,
+                            Value *stackTop) {
+    if (IS_LIST(stackTop[-3])) {
+        ip[-1] = OP_SET_INDEX_LIST;
+        SYNC();
+        if (!checkListIndex(vm, stackTop[-3], stackTop[-2])) {
+            return false;
+        }
+        ObjList *list = AS_LIST(stackTop[-3]);
+        storeValue(&list->elements.values[(int) AS_NUMBER(stackTop[-2])],
+                   stackTop[-1]);
+        writeBarrier(vm, (Obj *) list, stackTop[-1]);
+        stackTop[-3] = stackTop[-1];
+        return true;
+    } else if (IS_MAP(stackTop[-3])) {
+        if (!IS_STRING(stackTop[-2])) {
+            FAIL("Maps can only be indexed be string.");
+        }
+        ObjString *key = AS_STRING(stackTop[-2]);
+        ObjMap *map = AS_MAP(stackTop[-3]);
+        SYNC();
+        tableSet(vm, &map->table, key, stackTop[-1]);
+        writeBarrier(vm, (Obj *) map, OBJ_VAL(key));
+        writeBarrier(vm, (Obj *) map, stackTop[-1]);
+        stackTop[-3] = stackTop[-1];
+        return true;
+    }
+    FAIL("Can only set index of lists or maps.");
+}
+
+#ifdef LOX_JIT
+bool jitGetProperty(VM *vm, CallFrame *frame, uint8_t *ip, Value *stackTop,
+                    ObjString *name, InlineCache *cache) {
+    return getProperty(vm, frame, ip, stackTop, name, cache);
+}
+
+bool jitSetProperty(VM *vm, CallFrame *frame, uint8_t *ip, Value *stackTop,
+                    ObjString *name, InlineCache *cache) {
+    return setProperty(vm, frame, ip, stackTop, name, cache);
+}
+
+bool jitGetIndex(VM *vm, CallFrame *frame, uint8_t *ip, Value *stackTop) {
+    return getIndex(vm, frame, ip, stackTop);
+}
+
+bool jitSetIndex(VM *vm, CallFrame *frame, uint8_t *ip, Value *stackTop) {
+    return setIndex(vm, frame, ip, stackTop);
+}
+
+// Compiled code adds numbers itself and only gets here for anything else.
+bool jitAdd(VM *vm, CallFrame *frame, uint8_t *ip, Value *stackTop) {
+    if (!IS_STRING(stackTop[-1]) || !IS_STRING(stackTop[-2])) {
+        FAIL("Operands must be two numbers or two strings.");
+    }
+    SYNC();
+    concatenate(vm);
+    return true;
+}
+
+void jitPrint(VM *vm, Value value) {
+    printValue(vm->fout, value);
+    fprintf(vm->fout, "\n");
+}
+
+void jitCloseUpvalues(VM *vm, Value *last) { closeUpvalues(vm, last); }
+
+void jitSetUpvalue(VM *vm, ObjUpvalue *upvalue, Value value) {
+    storeValue(upvalue->location, value);
+    writeBarrier(vm, (Obj *) upvalue, value);
+}
+
+// Calls return null when the callee was native and compiled code can carry
+// on in the same frame.
+void *jitCall(VM *vm, int argCount) {
+    int frameCount = vm->frameCount;
+    if (!callValue(vm, peek(vm, argCount), argCount)) return jitErrorExit();
+    return vm->frameCount == frameCount ? nullptr : jitContinuation(vm);
+}
+
+// A tail call keeps the frame count, but the frame now runs another function
+// from its start.
+void *jitTailCall(VM *vm, int argCount) {
+    int frameCount = vm->frameCount;
+    uint8_t *ip = vm->frames[frameCount - 1].ip;
+    if (!tailCall(vm, peek(vm, argCount), argCount)) return jitErrorExit();
+    if (vm->frameCount == frameCount && vm->frames[frameCount - 1].ip == ip) {
+        return nullptr;
+    }
+    return jitContinuation(vm);
+}
+
+void *jitInvoke(VM *vm, ObjString *name, int argCount, InlineCache *cache) {
+    int frameCount = vm->frameCount;
+    if (!invoke(vm, name, argCount, cache)) return jitErrorExit();
+    return vm->frameCount == frameCount ? nullptr : jitContinuation(vm);
+}
+
+bool jitCallsInlined(Value callee, ObjFunction *function) {
+    return callsInlined(callee, function);
+}
+
+bool jitInvokesInlined(VM *vm, Value receiver, ObjString *name,
+                       ObjFunction *function, InlineCache *guard) {
+    return invokesInlined(vm, receiver, name, function, guard);
+}
+
+void *jitSuperInvoke(VM *vm, ObjString *name, int argCount,
+                     InlineCache *cache) {
+    int frameCount = vm->frameCount;
+    ObjClass *superclass = AS_CLASS(pop(vm));
+    if (!invokeFromClass(vm, superclass, name, argCount,
+                         cache)) return jitErrorExit();
+    return vm->frameCount == frameCount ? nullptr : jitContinuation(vm);
+}
+
+void *jitReturn(VM *vm, Value *slots) {
+    Value result = pop(vm);
+    closeUpvalues(vm, slots);
+    vm->frameCount--;
+    vm->stackTop = slots;
+    push(vm, result);
+    return jitContinuation(vm);
+}
+#endif
 
-    pop();
-    pop();
-    push(OBJ_VAL(result));
+#undef SYNC
+#undef FAIL
+
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceExecution(VM *vm, CallFrame *frame) {
+    fprintf(vm->ferr, "          ");
+    for (Value *slot = vm->stack; slot < vm->stackTop; slot++) {
+        fprintf(vm->ferr, "[ ");
+        printValue(vm->ferr, *slot);
+        fprintf(vm->ferr, " ]");
+    }
+    fprintf(vm->ferr, "\n");
+    Chunk *chunk = &frame->function->chunk;
+    disassembleInstruction(vm, vm->ferr, chunk,
+                           (int) (frame->ip - chunk->code));
 }
+#endif
 
-static InterpretResult run() {
-    CallFrame *frame = &vm.frames[vm.frameCount - 1];
-#define READ_BYTE() (*frame->ip++)
-#define READ_CONSTANT()                                                        \
-    (frame->closure->function->chunk.constants.values[READ_BYTE()])
+static InterpretResult run(VM *vm) {
+    // The hot interpreter state lives in locals so the compiler can keep it
+    // in registers. It is written back to the CallFrame and vm->stackTop
+    // before anything that can observe it: calls, returns, allocations (which
+    // may collect garbage) and runtime errors.
+    CallFrame *frame;
+    uint8_t *ip;
+    Value *slots;
+    Value *constants;
+    InlineCache *caches;
+    Value *stackTop;
+
+#define STORE_FRAME() (frame->ip = ip, vm->stackTop = stackTop)
+#define LOAD_FRAME()                                                           \
+    do {                                                                       \
+        frame = &vm->frames[vm->frameCount - 1];                               \
+        ip = frame->ip;                                                        \
+        slots = frame->slots;                                                  \
+        constants = frame->function->chunk.constants.values;                   \
+        caches = frame->function->chunk.caches;                                \
+        stackTop = vm->stackTop;                                               \
+    } while (0)
+#define PUSH(value) (*stackTop++ = (value))
+#define POP() (*--stackTop)
+#define DROP() (stackTop--)
+#define PEEK(distance) (stackTop[-1 - (distance)])
+#define READ_BYTE() (*ip++)
+#define READ_CONSTANT() (constants[READ_BYTE()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
-#define READ_SHORT()                                                           \
-    (frame->ip += 2, (uint16_t) ((frame->ip[-2] << 8) | frame->ip[-1]))
+#define READ_SHORT() (ip += 2, (uint16_t) ((ip[-2] << 8) | ip[-1]))
+#define READ_CACHE() (&caches[READ_SHORT()])
+#define GLOBAL_NAME(slot) (AS_STRING(vm->globalNames.values[slot])->chars)
+#define RUNTIME_ERROR(...)                                                     \
+    do {                                                                       \
+        STORE_FRAME();                                                         \
+        runtimeError(vm, __VA_ARGS__);                                         \
+        return INTERPRET_RUNTIME_ERROR;                                        \
+    } while (0)
 #define BINARY_OP(valueType, op)                                               \
     do {                                                                       \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                      \
-            runtimeError("Operands must be numbers.");                         \
-            return INTERPRET_RUNTIME_ERROR;                                    \
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {                      \
+            RUNTIME_ERROR("Operands must be numbers.");                        \
         }                                                                      \
-        double b = AS_NUMBER(pop());                                           \
-        double a = AS_NUMBER(pop());                                           \
-        push(valueType(a op b));                                               \
+        double b = AS_NUMBER(POP());                                           \
+        double a = AS_NUMBER(POP());                                           \
+        PUSH(valueType(a op b));                                               \
+    } while (0)
+
+// The fused forms of OP_GREATER/OP_LESS followed by a conditional jump.
+// `condition` says when the jump is taken in terms of `a` and `b`. It negates
+// the comparison rather than flipping it so NaN behaves as it did unfused.
+#define COMPARE_JUMP(condition)                                                \
+    do {                                                                       \
+        uint16_t offset = READ_SHORT();                                        \
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {                      \
+            RUNTIME_ERROR("Operands must be numbers.");                        \
+        }                                                                      \
+        double b = AS_NUMBER(POP());                                           \
+        double a = AS_NUMBER(POP());                                           \
+        if (condition)                                                         \
+            ip += offset;                                                      \
+    } while (0)
+
+// Only for instructions without operands, where ip[-1] is the opcode.
+#define QUICKEN(op) (ip[-1] = (op))
+// Restores the generic instruction and executes it in place of the
+// quickened one whose guard just failed.
+#define DEQUICKEN(op)                                                          \
+    do {                                                                       \
+        ip[-1] = (op);                                                         \
+        ip--;                                                                  \
+        DISPATCH();                                                            \
     } while (0)
 
-    for (;;) {
+#ifdef LOX_JIT
+// Hands the current frame to its compiled code, if it has any, and follows
+// calls and returns for as long as they land in compiled code too.
+#define JIT_ENTER()                                                            \
+    while (frame->function->jitCode != nullptr) {                              \
+        STORE_FRAME();                                                         \
+        JitStatus status = jitEnter(vm, frame);                                \
+        if (status == JIT_ERROR) return INTERPRET_RUNTIME_ERROR;               \
+        if (vm->frameCount == 0) {                                             \
+            vm->stackTop--;                                                    \
+            return INTERPRET_OK;                                               \
+        }                                                                      \
+        LOAD_FRAME();                                                          \
+        if (status == JIT_EXIT) break;                                         \
+    }
+// Loops count towards hotness as well as calls, so a long-running script
+// body gets compiled and entered at its loop header. A loop with a trace runs
+// that first; it exits to wherever the trace left the loop's usual path.
+#define JIT_LOOP()                                                             \
+    do {                                                                       \
+        if (vm->tracingEnabled) {                                              \
+            STORE_FRAME();                                                     \
+            if (traceLoop(vm, frame)) LOAD_FRAME();                            \
+        }                                                                      \
+        ObjFunction *function = frame->function;                               \
+        if (vm->jitEnabled && function->hotness < JIT_HOT_THRESHOLD &&         \
+            ++function->hotness == JIT_HOT_THRESHOLD) {                        \
+            jitCompile(function);                                              \
+        }                                                                      \
+        JIT_ENTER();                                                           \
+    } while (0)
+#else
+#define JIT_ENTER() ((void) 0)
+#define JIT_LOOP() ((void) 0)
+#endif
+
 #ifdef DEBUG_TRACE_EXECUTION
-        fprintf(ferr, "         ");
-        for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
-            fprintf(ferr, "[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        fprintf(ferr, "\n");
-        disassembleInstruction(
-            &frame->closure->function->chunk,
-            (int) (frame->ip - frame->closure->function->chunk.code));
+#define TRACE_EXECUTION() (STORE_FRAME(), traceExecution(vm, frame))
+#else
+#define TRACE_EXECUTION() ((void) 0)
 #endif
-        OpCode instruction;
-        switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
-            }
-            case OP_NIL: push(NIL_VAL); break;
-            case OP_TRUE: push(BOOL_VAL(true)); break;
-            case OP_FALSE: push(BOOL_VAL(false)); break;
-            case OP_POP: pop(); break;
-            case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
-            }
-            case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
-                break;
-            }
-            case OP_GET_GLOBAL: {
-                ObjString *name = READ_STRING();
-                Value value;
-                if (!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(value);
-                break;
-            }
-            case OP_DEFINE_GLOBAL: {
-                ObjString *name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
-                pop();
-                break;
-            }
-            case OP_SET_GLOBAL: {
-                ObjString *name = READ_STRING();
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name);
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }
-            case OP_GET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
-                break;
-            }
-            case OP_SET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
-            }
-            case OP_GET_PROPERTY: {
-                if (!IS_INSTANCE(peek(0))) {
-                    runtimeError("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
 
-                ObjInstance *instance = AS_INSTANCE(peek(0));
-                ObjString *name = READ_STRING();
+#ifdef COMPUTED_GOTO
+    static void *dispatchTable[] = {
+#define X(e) &&label_##e,
+        OPCODE_ENUM
+#undef X
+    };
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(op) label_##op
+#define DISPATCH()                                                             \
+    do {                                                                       \
+        TRACE_EXECUTION();                                                     \
+        goto *dispatchTable[READ_BYTE()];                                      \
+    } while (0)
+#else
+#define INTERPRET_LOOP                                                         \
+    loop:                                                                      \
+    TRACE_EXECUTION();                                                         \
+    switch (READ_BYTE())
+#define CASE(op) case op
+#define DISPATCH() goto loop
+#endif
 
-                Value value;
-                if (tableGet(&instance->fields, name, &value)) {
-                    pop(); // instance
-                    push(value);
-                    break;
-                }
-                if (!bindMethod(instance->class, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+    LOAD_FRAME();
+    JIT_ENTER();
+    INTERPRET_LOOP {
+        CASE(OP_CONSTANT): {
+            Value constant = READ_CONSTANT();
+            PUSH(constant);
+            DISPATCH();
+        }
+        CASE(OP_NIL): PUSH(NIL_VAL); DISPATCH();
+        CASE(OP_TRUE): PUSH(BOOL_VAL(true)); DISPATCH();
+        CASE(OP_FALSE): PUSH(BOOL_VAL(false)); DISPATCH();
+        CASE(OP_POP): DROP(); DISPATCH();
+        CASE(OP_GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            PUSH(slots[slot]);
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            slots[slot] = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL_POP): {
+            uint8_t slot = READ_BYTE();
+            slots[slot] = POP();
+            DISPATCH();
+        }
+        CASE(OP_GET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            Value value = vm->globalValues.values[slot];
+            if (IS_UNDEFINED(value)) {
+                RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
             }
-            case OP_SET_PROPERTY: {
-                if (!IS_INSTANCE(peek(1))) {
-                    runtimeError("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+            PUSH(value);
+            DISPATCH();
+        }
+        CASE(OP_DEFINE_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            vm->globalValues.values[slot] = POP();
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            Value *global = &vm->globalValues.values[slot];
+            if (IS_UNDEFINED(*global)) {
+                RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
+            }
+            *global = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL_POP): {
+            uint16_t slot = READ_SHORT();
+            Value *global = &vm->globalValues.values[slot];
+            if (IS_UNDEFINED(*global)) {
+                RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
+            }
+            *global = POP();
+            DISPATCH();
+        }
+        CASE(OP_GET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            PUSH(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
+        CASE(OP_SET_UPVALUE): {
+            ObjUpvalue *upvalue = frame->closure->upvalues[READ_BYTE()];
+            storeValue(upvalue->location, PEEK(0));
+            writeBarrier(vm, (Obj *) upvalue, PEEK(0));
+            DISPATCH();
+        }
+        CASE(OP_GET_PROPERTY): {
+            ObjString *name = READ_STRING();
+            InlineCache *cache = READ_CACHE();
+            if (!getProperty(vm, frame, ip, stackTop, name, cache)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            DISPATCH();
+        }
+        CASE(OP_SET_PROPERTY):
+        CASE(OP_SET_PROPERTY_POP): {
+            ObjString *name = READ_STRING();
+            InlineCache *cache = READ_CACHE();
+            if (!setProperty(vm, frame, ip, stackTop, name, cache)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            if (ip[-4] == OP_SET_PROPERTY_POP) {
+                stackTop -= 2;
+            } else {
+                PEEK(1) = PEEK(0);
+                DROP();
+            }
+            DISPATCH();
+        }
+        CASE(OP_GET_INDEX): {
+            if (!getIndex(vm, frame, ip, stackTop)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            DROP();
+            DISPATCH();
+        }
+        CASE(OP_SET_INDEX): {
+            if (!setIndex(vm, frame, ip, stackTop)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            stackTop -= 2;
+            DISPATCH();
+        }
+        CASE(OP_LIST_INIT): {
+            STORE_FRAME();
+            ObjList *list = newList(vm);
+            PUSH(OBJ_VAL(list));
+            DISPATCH();
+        }
+        CASE(OP_LIST_DATA): {
+            if (!IS_LIST(PEEK(1))) {
+                RUNTIME_ERROR("List data can only be added to a list.");
+            }
+            ObjList *list = AS_LIST(PEEK(1));
+            STORE_FRAME();
+            writeValueArray(vm, &list->elements, PEEK(0));
+            writeBarrier(vm, (Obj *) list, PEEK(0));
+            DROP();
+            DISPATCH();
+        }
+        CASE(OP_MAP_INIT): {
+            STORE_FRAME();
+            ObjMap *map = newMap(vm);
+            PUSH(OBJ_VAL(map));
+            DISPATCH();
+        }
+        CASE(OP_MAP_DATA): {
+            if (!IS_MAP(PEEK(2))) {
+                RUNTIME_ERROR("Map data can only be added to a map.");
+            }
+            if (!IS_STRING(PEEK(1))) {
+                RUNTIME_ERROR("Map key must be a string.");
+            }
+            ObjMap *map = AS_MAP(PEEK(2));
+            ObjString *key = AS_STRING(PEEK(1));
+            STORE_FRAME();
+            tableSet(vm, &map->table, key, PEEK(0));
+            writeBarrier(vm, (Obj *) map, OBJ_VAL(key));
+            writeBarrier(vm, (Obj *) map, PEEK(0));
+            DROP(); // Value
+            DROP(); // Key
+            DISPATCH();
+        }
+        CASE(OP_GET_SUPER): {
+            ObjString *name = READ_STRING();
+            ObjClass *superclass = AS_CLASS(POP());
 
-                ObjInstance *instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
-                Value value = pop();
-                pop();
-                push(value);
-                break;
-            }
-            case OP_GET_INDEX: {
-                if (IS_LIST(peek(1))) {
-                    if (!checkListIndex(peek(1), peek(0))) {
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
-                    int index = (int) AS_NUMBER(pop());
-                    ObjList *list = AS_LIST(pop());
-                    push(list->elements.values[index]);
-                    break;
-                } else if (IS_MAP(peek(1))) {
-                    if (!IS_STRING(peek(0))) {
-                        runtimeError("Maps can only be indexed be string.");
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
-                    ObjString *key = AS_STRING(peek(0));
-                    ObjMap *map = AS_MAP(peek(1));
-                    Value value;
-                    if (tableGet(&map->table, key, &value)) {
-                        pop(); // key
-                        pop(); // map
-                        push(value);
-                        break;
-                    }
-                    runtimeError("Undefined key '%s'.", key->chars);
-                } else {
-                    runtimeError("Can only index lists or maps.");
-                }
+            STORE_FRAME();
+            if (!bindMethod(vm, superclass, name)) {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SET_INDEX: {
-                if (IS_LIST(peek(2))) {
-                    if (!checkListIndex(peek(2), peek(1))) {
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
-                    Value value = pop();
-                    int index = (int) AS_NUMBER(pop());
-                    ObjList *list = AS_LIST(pop());
-                    list->elements.values[index] = value;
-                    push(value);
-                    break;
-                } else if (IS_MAP(peek(2))) {
-                    if (!IS_STRING(peek(1))) {
-                        runtimeError("Maps can only be indexed be string.");
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
-                    ObjString *key = AS_STRING(peek(1));
-                    ObjMap *map = AS_MAP(peek(2));
-                    tableSet(&map->table, key, peek(0));
-                    Value value = pop();
-                    pop(); // key
-                    pop(); // map
-                    push(value);
-                    break;
-                } else {
-                    runtimeError("Can only set index of lists or maps.");
-                }
+            stackTop = vm->stackTop;
+            DISPATCH();
+        }
+        CASE(OP_EQUAL): {
+            Value a = POP();
+            Value b = POP();
+            PUSH(BOOL_VAL(valuesEqual(a, b)));
+            DISPATCH();
+        }
+        CASE(OP_GREATER): BINARY_OP(BOOL_VAL, >); DISPATCH();
+        CASE(OP_LESS): BINARY_OP(BOOL_VAL, <); DISPATCH();
+        CASE(OP_ADD): {
+            if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+                QUICKEN(OP_ADD_STR);
+                STORE_FRAME();
+                concatenate(vm);
+                stackTop = vm->stackTop;
+            } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+                QUICKEN(OP_ADD_NUM);
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(POP());
+                PUSH(NUMBER_VAL(a + b));
+            } else {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
+            }
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -); DISPATCH();
+        CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *); DISPATCH();
+        CASE(OP_DIVIDE): BINARY_OP(NUMBER_VAL, /); DISPATCH();
+        CASE(OP_NOT): PEEK(0) = BOOL_VAL(isFalsey(PEEK(0))); DISPATCH();
+        CASE(OP_NEGATE): {
+            if (!IS_NUMBER(PEEK(0))) {
+                RUNTIME_ERROR("Operand must be a number.");
+            }
+            PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+            DISPATCH();
+        }
+        CASE(OP_PRINT): {
+            printValue(vm->fout, POP());
+            fprintf(vm->fout, "\n");
+            DISPATCH();
+        }
+        CASE(OP_JUMP): {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(PEEK(0)))
+                ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_LOOP): {
+            uint16_t offset = READ_SHORT();
+            ip -= offset;
+            JIT_LOOP();
+            DISPATCH();
+        }
+        CASE(OP_POP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(POP()))
+                ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_POP_JUMP_IF_TRUE): {
+            uint16_t offset = READ_SHORT();
+            if (!isFalsey(POP()))
+                ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_EQUAL): {
+            uint16_t offset = READ_SHORT();
+            Value b = POP();
+            Value a = POP();
+            if (valuesEqual(a, b))
+                ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_NOT_EQUAL): {
+            uint16_t offset = READ_SHORT();
+            Value b = POP();
+            Value a = POP();
+            if (!valuesEqual(a, b))
+                ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_GREATER): COMPARE_JUMP(a > b); DISPATCH();
+        CASE(OP_JUMP_IF_NOT_GREATER): COMPARE_JUMP(!(a > b)); DISPATCH();
+        CASE(OP_JUMP_IF_LESS): COMPARE_JUMP(a < b); DISPATCH();
+        CASE(OP_JUMP_IF_NOT_LESS): COMPARE_JUMP(!(a < b)); DISPATCH();
+        CASE(OP_CALL): {
+            int argCount = READ_BYTE();
+            STORE_FRAME();
+            if (!callValue(vm, PEEK(argCount), argCount)) {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_LIST_INIT: {
-                push(OBJ_VAL(newList()));
-                break;
+            LOAD_FRAME();
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_TAIL_CALL): {
+            int argCount = READ_BYTE();
+            STORE_FRAME();
+            if (!tailCall(vm, PEEK(argCount), argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_LIST_DATA: {
-                if (!IS_LIST(peek(1))) {
-                    runtimeError("List data can only be added to a list.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                ObjList *list = AS_LIST(peek(1));
-                writeValueArray(&list->elements, peek(0));
-                pop();
-                break;
-            }
-            case OP_MAP_INIT: {
-                push(OBJ_VAL(newMap()));
-                break;
-            }
-            case OP_MAP_DATA: {
-                if (!IS_MAP(peek(2))) {
-                    runtimeError("Map data can only be added to a map.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                if (!IS_STRING(peek(1))) {
-                    runtimeError("Map key must be a string.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                ObjMap *map = AS_MAP(peek(2));
-                ObjString *key = AS_STRING(peek(1));
-                tableSet(&map->table, key, peek(0));
-                pop(); // Value
-                pop(); // Key
-                break;
-            }
-            case OP_GET_SUPER: {
-                ObjString *name = READ_STRING();
-                ObjClass *superclass = AS_CLASS(pop());
-
-                if (!bindMethod(superclass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }
-            case OP_EQUAL: {
-                Value a = pop();
-                Value b = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
-            }
-            case OP_GREATER: BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS: BINARY_OP(BOOL_VAL, <); break;
-            case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
+            LOAD_FRAME();
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_INVOKE): {
+            ObjString *method = READ_STRING();
+            int argCount = READ_BYTE();
+            InlineCache *cache = READ_CACHE();
+            STORE_FRAME();
+            if (!invoke(vm, method, argCount, cache)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_SUPER_INVOKE): {
+            ObjString *method = READ_STRING();
+            int argCount = READ_BYTE();
+            InlineCache *cache = READ_CACHE();
+            ObjClass *superclass = AS_CLASS(POP());
+            STORE_FRAME();
+            if (!invokeFromClass(vm, superclass, method, argCount, cache)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            JIT_ENTER();
+            DISPATCH();
+        }
+        // A passed guard carries on into the inlined body, which leaves the
+        // result where the callee was. Otherwise the call returns to the
+        // end of the body.
+        CASE(OP_CALL_INLINE): {
+            int argCount = READ_BYTE();
+            ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+            uint16_t offset = READ_SHORT();
+            if (callsInlined(PEEK(argCount), function)) DISPATCH();
+            ip += offset;
+            STORE_FRAME();
+            if (!callValue(vm, PEEK(argCount), argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_INVOKE_INLINE): {
+            ObjString *method = READ_STRING();
+            int argCount = READ_BYTE();
+            InlineCache *cache = READ_CACHE();
+            InlineCache *guard = READ_CACHE();
+            ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+            uint16_t offset = READ_SHORT();
+            if (invokesInlined(vm, PEEK(argCount), method, function, guard)) {
+                DISPATCH();
+            }
+            ip += offset;
+            STORE_FRAME();
+            if (!invoke(vm, method, argCount, cache)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_CLOSURE): {
+            ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+            STORE_FRAME();
+            ObjClosure *closure = newClosure(vm, function);
+            PUSH(OBJ_VAL(closure));
+            vm->stackTop = stackTop;
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                uint8_t isLocal = READ_BYTE();
+                uint8_t index = READ_BYTE();
+                if (isLocal) {
+                    closure->upvalues[i] = captureUpvalue(vm, slots + index);
                 } else {
-                    runtimeError(
-                        "Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE: BINARY_OP(NUMBER_VAL, /); break;
-            case OP_NOT: push(BOOL_VAL(isFalsey(pop()))); break;
-            case OP_NEGATE: {
-                if (!IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
-            }
-            case OP_PRINT: {
-                printValue(vm.fout, pop());
-                fprintf(vm.fout, "\n");
-                break;
-            }
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-                break;
-            }
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
-                if (isFalsey(peek(0)))
-                    frame->ip += offset;
-                break;
-            }
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-                break;
-            }
-            case OP_CALL: {
-                int argCount = READ_BYTE();
-                if (!callValue(peek(argCount), argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
-            }
-            case OP_INVOKE: {
-                ObjString *method = READ_STRING();
-                int argCount = READ_BYTE();
-                if (!invoke(method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
-            }
-            case OP_SUPER_INVOKE: {
-                ObjString *method = READ_STRING();
-                int argCount = READ_BYTE();
-                ObjClass *superclass = AS_CLASS(pop());
-                if (!invokeFromClass(superclass, method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
+                    closure->upvalues[i] = frame->closure->upvalues[index];
                 }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
-            }
-            case OP_CLOSURE: {
-                ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure *closure = newClosure(function);
-                push(OBJ_VAL(closure));
-                for (int i = 0; i < closure->upvalueCount; i++) {
-                    uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
-                    if (isLocal) {
-                        closure->upvalues[i] =
-                            captureUpvalue(frame->slots + index);
-                    } else {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
-                    }
-                }
-                break;
-            }
-            case OP_CLOSE_UPVALUE: {
-                closeUpvalues(vm.stackTop - 1);
-                pop();
-                break;
-            }
-            case OP_CLASS: {
-                push(OBJ_VAL(newClass(READ_STRING())));
-                break;
-            }
-            case OP_INHERIT: {
-                Value superclass = peek(1);
-                if (!IS_CLASS(superclass)) {
-                    runtimeError("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                ObjClass *subclass = AS_CLASS(peek(0));
-                tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-                pop();
-                break;
-            }
-            case OP_METHOD: {
-                defineMethod(READ_STRING());
-                break;
-            }
-            case OP_RETURN: {
-                Value result = pop();
-                closeUpvalues(frame->slots);
-                vm.frameCount--;
-                if (vm.frameCount == 0) {
-                    pop();
-                    return INTERPRET_OK;
-                }
-                vm.stackTop = frame->slots;
-                push(result);
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                writeBarrier(vm, (Obj *) closure,
+                             OBJ_VAL(closure->upvalues[i]));
+            }
+            DISPATCH();
+        }
+        CASE(OP_CLOSE_UPVALUE): {
+            closeUpvalues(vm, stackTop - 1);
+            DROP();
+            DISPATCH();
+        }
+        CASE(OP_CLASS): {
+            ObjString *name = READ_STRING();
+            STORE_FRAME();
+            ObjClass *class = newClass(vm, name);
+            PUSH(OBJ_VAL(class));
+            DISPATCH();
+        }
+        CASE(OP_INHERIT): {
+            Value superclass = PEEK(1);
+            if (!IS_CLASS(superclass)) {
+                RUNTIME_ERROR("Superclass must be a class.");
+            }
+            ObjClass *subclass = AS_CLASS(PEEK(0));
+            STORE_FRAME();
+            tableAddAll(vm, &AS_CLASS(superclass)->methods, &subclass->methods);
+            vm->cacheEpoch++;
+            DROP();
+            DISPATCH();
+        }
+        CASE(OP_METHOD): {
+            ObjString *name = READ_STRING();
+            STORE_FRAME();
+            defineMethod(vm, name);
+            vm->cacheEpoch++;
+            stackTop = vm->stackTop;
+            DISPATCH();
+        }
+        CASE(OP_RETURN_NIL):
+            PUSH(NIL_VAL);
+            // fall through
+        CASE(OP_RETURN): {
+            Value result = POP();
+            closeUpvalues(vm, slots);
+            vm->frameCount--;
+            if (vm->frameCount == 0) {
+                vm->stackTop = stackTop - 1;
+                return INTERPRET_OK;
+            }
+            vm->stackTop = slots;
+            LOAD_FRAME();
+            PUSH(result);
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_ADD_NUM): {
+            if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+                DEQUICKEN(OP_ADD);
             }
+            double b = AS_NUMBER(POP());
+            PEEK(0) = NUMBER_VAL(AS_NUMBER(PEEK(0)) + b);
+            DISPATCH();
+        }
+        CASE(OP_ADD_STR): {
+            if (!IS_STRING(PEEK(0)) || !IS_STRING(PEEK(1))) {
+                DEQUICKEN(OP_ADD);
+            }
+            STORE_FRAME();
+            concatenate(vm);
+            stackTop = vm->stackTop;
+            DISPATCH();
+        }
+        CASE(OP_GET_INDEX_LIST): {
+            if (!IS_LIST(PEEK(1))) {
+                DEQUICKEN(OP_GET_INDEX);
+            }
+            ObjList *list = AS_LIST(PEEK(1));
+            if (!isListIndex(list, PEEK(0))) {
+                STORE_FRAME();
+                checkListIndex(vm, PEEK(1), PEEK(0));
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            int index = (int) AS_NUMBER(POP());
+            PEEK(0) = list->elements.values[index];
+            DISPATCH();
+        }
+        CASE(OP_SET_INDEX_LIST): {
+            if (!IS_LIST(PEEK(2))) {
+                DEQUICKEN(OP_SET_INDEX);
+            }
+            ObjList *list = AS_LIST(PEEK(2));
+            if (!isListIndex(list, PEEK(1))) {
+                STORE_FRAME();
+                checkListIndex(vm, PEEK(2), PEEK(1));
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            Value value = POP();
+            int index = (int) AS_NUMBER(POP());
+            storeValue(&list->elements.values[index], value);
+            writeBarrier(vm, (Obj *) list, value);
+            PEEK(0) = value;
+            DISPATCH();
         }
     }
+    // Only reachable when the switch sees a byte that isn't an opcode.
+    RUNTIME_ERROR("Unknown opcode.");
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef PUSH
+#undef POP
+#undef DROP
+#undef PEEK
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_STRING
 #undef READ_SHORT
+#undef READ_CACHE
+#undef GLOBAL_NAME
+#undef RUNTIME_ERROR
+#undef QUICKEN
+#undef COMPARE_JUMP
+#undef DEQUICKEN
 #undef BINARY_OP
+#undef TRACE_EXECUTION
+#undef JIT_ENTER
+#undef JIT_LOOP
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
 }
 
-InterpretResult evaluate(const char *source) {
-    ObjFunction *function = compile_expression(source);
+InterpretResult evaluate(VM *vm, const char *source) {
+    ObjFunction *function = compile_expression(vm, source);
     if (function == nullptr)
         return INTERPRET_COMPILE_ERROR;
-    push(OBJ_VAL(function));
-    ObjClosure *closure = newClosure(function);
-    pop();
-    push(OBJ_VAL(closure));
-    call((Obj *) closure, 0);
+    push(vm, OBJ_VAL(function));
+    ObjClosure *closure = newClosure(vm, function);
+    pop(vm);
+    push(vm, OBJ_VAL(closure));
+    if (!call(vm, (Obj *) closure, 0)) return INTERPRET_RUNTIME_ERROR;
+
+    return run(vm);
+}
 
-    return run();
+// The file in vm.cacheDir that holds the bytecode with `key`.
+static char *cachePath(VM *vm, uint64_t key) {
+    size_t length = strlen(vm->cacheDir) + 24;
+    char *path = malloc(length);
+    if (path == nullptr) exit(1);
+    snprintf(path, length, "%s/%016" PRIx64 ".loxc", vm->cacheDir, key);
+    return path;
 }
 
-InterpretResult interpret(const char *source) {
-    ObjFunction *function = compile(source);
+InterpretResult interpret(VM *vm, const char *source) {
+    ObjFunction *function = nullptr;
+    uint64_t key = 0;
+    char *path = nullptr;
+    if (vm->cacheDir != nullptr) {
+        // Compiled with other optimizations, the code has another key, so
+        // it is neither loaded nor overwritten.
+        key = cacheKey(vm, source);
+        path = cachePath(vm, key);
+        function = loadBytecode(vm, path, key);
+    }
+    if (function == nullptr) {
+        function = compile(vm, source);
+        // Failing to write the cache only costs the next run a compile.
+        if (function != nullptr && path != nullptr) {
+            push(vm, OBJ_VAL(function));
+            writeBytecode(vm, function, key, path);
+            pop(vm);
+        }
+    }
+    free(path);
     if (function == nullptr)
         return INTERPRET_COMPILE_ERROR;
-    push(OBJ_VAL(function));
-    ObjClosure *closure = newClosure(function);
-    pop();
-    push(OBJ_VAL(closure));
-    call((Obj *) closure, 0);
+    return interpretFunction(vm, function);
+}
+
+InterpretResult interpretFunction(VM *vm, ObjFunction *function) {
+    push(vm, OBJ_VAL(function));
+    ObjClosure *closure = newClosure(vm, function);
+    pop(vm);
+    push(vm, OBJ_VAL(closure));
+    if (!call(vm, (Obj *) closure, 0)) return INTERPRET_RUNTIME_ERROR;
 
-    return run();
+    return run(vm);
 }
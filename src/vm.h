@@ -4,9 +4,44 @@
 #include "object.h"
 #include "table.h"
 #include "value.h"
+#include <pthread.h>
 #include <stdint.h>
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// Both stacks start this small and grow on demand, so an idle VM costs a
+// few kilobytes. FRAMES_MAX is only the default for vm.maxFrames.
+#define FRAMES_INITIAL 16
+#define STACK_INITIAL 256
+#define FRAMES_MAX 100000
+
+// Where the full collection in progress is; see collectStep().
+typedef enum {
+    GC_IDLE,
+    GC_MARKING,
+    GC_SWEEPING,
+} GcPhase;
+
+// Objects are carved out of pages, with a size class every POOL_GRANULE
+// bytes up to the largest object there can be; see allocateCell().
+#define POOL_GRANULE 16
+#define POOL_MAX_SIZE 320
+#define POOL_CLASSES (POOL_MAX_SIZE / POOL_GRANULE)
+#define POOL_PAGE_SIZE (64 * 1024)
+#define PAGE_WORDS (POOL_PAGE_SIZE / POOL_GRANULE / 64)
+
+// A page is aligned to its size, so the one an object is in is its address
+// with the low bits cleared. Each bitmap has a bit per granule, standing for
+// the cell that starts there.
+typedef struct Page {
+    struct Page *next;
+    int sizeClass;
+    bool hasYoung; // is in vm->youngPages
+    uint64_t allocated[PAGE_WORDS];
+    uint64_t marks[PAGE_WORDS];
+    uint64_t young[PAGE_WORDS];
+} Page;
+
+typedef struct FreeCell {
+    struct FreeCell *next;
+} FreeCell;
 
 typedef struct {
     ObjClosure *closure;
@@ -15,29 +50,101 @@ typedef struct {
     Value *slots;
 } CallFrame;
 
-typedef struct {
+// One interpreter. Nothing is shared between VMs, so each can run on its own
+// thread; a VM itself must only be used by one thread at a time.
+struct VM {
     FILE *fout;
     FILE *ferr;
-    CallFrame frames[FRAMES_MAX];
+    CallFrame *frames;
     int frameCount;
-    Value stack[STACK_MAX];
+    int frameCapacity;
+    // Calls nested deeper than this fail with "Stack overflow."
+    int maxFrames;
+    // The value stack is one block that moves when it grows; growStack()
+    // rebases every pointer into it.
+    Value *stack;
     Value *stackTop;
+    Value *stackLimit;
     Chunk *chunk;
     uint8_t *ip;
     Table strings;
     ObjString *initString;
-    Table globals;
+    // Globals live in a dense array indexed by slots the compiler assigns;
+    // globalSlots maps each name to its slot and globalNames maps back.
+    Table globalSlots;
+    ValueArray globalValues;
+    ValueArray globalNames;
     ObjUpvalue *openUpvalues;
 
     ObjClass *listClass;
     ObjClass *mapClass;
+    // Bumped whenever a method table changes, which empties every inline
+    // cache lazily on its next lookup.
+    uint32_t cacheEpoch;
+    size_t cacheHits;
+    size_t cacheMisses;
+    // Compile hot functions to native code; only honoured when the JIT is
+    // built in.
+    bool jitEnabled;
+    // Record and compile traces of hot loops that are being interpreted.
+    bool tracingEnabled;
+    // Compile function bodies on their first call instead of with the rest
+    // of the script; see compileLazyFunction().
+    bool lazyCompile;
+    // Run optimizeChunk() over each function the compiler finishes.
+    bool peepholeEnabled;
+    // Run optimizeSsa() over each function the compiler finishes.
+    bool ssaEnabled;
+    // Run inlineCalls() over each script once it has compiled.
+    bool inlineEnabled;
     size_t bytesAllocated;
     size_t nextGC;
-    Obj *objects;
+    // The pages of each size class, those a full collection has yet to sweep
+    // held apart until it does or the allocator runs out of free cells.
+    Page *pages[POOL_CLASSES];
+    Page *unswept[POOL_CLASSES];
+    FreeCell *freeCells[POOL_CLASSES];
+    Page **youngPages;
+    int youngPageCount;
+    int youngPageCapacity;
+    // Objects that have survived a collection are old and the rest young.
+    // A minor collection only traces young ones, from the roots and from
+    // the old objects that may point at them, which are remembered.
+    size_t youngBytes; // allocated since the last collection
+    Obj **remembered;
+    int rememberedCount;
+    int rememberedCapacity;
+    bool collectingYoung;
+    // A full collection marks and sweeps a little at a time, taking at most
+    // gcPause microseconds each time it runs; 0 does it all at once.
+    GcPhase gcPhase;
+    int gcPause;
+    size_t stepBytes;  // allocated since the collection last ran
+    bool gcHeld;       // no collections while a snapshot is restored
+    size_t minorCollections;
+    size_t majorCollections;
+    double longestPause; // in seconds
+    // With gcConcurrent the marking runs on a thread of its own. Blocks that
+    // thread might be reading are retired rather than freed until it stops.
+    bool gcConcurrent;
+    bool markerRunning;
+    bool markerDone; // set by the marker thread when the gray stack is empty
+    pthread_t marker;
+    void **retired;
+    int retiredCount;
+    int retiredCapacity;
     int grayCount;
     int grayCapacity;
     Obj **grayStack;
-} VM;
+    // The compile in progress, whose unfinished functions are GC roots.
+    struct Parser *parser;
+    // When set, interpret() keeps the bytecode of every script it compiles
+    // in this directory and loads it from there the next time it sees the
+    // same source.
+    const char *cacheDir;
+    // Bytecode files mapped by loadBytecode(), unmapped by freeVM().
+    struct BytecodeImage *images;
+};
 
 typedef enum {
     INTERPRET_OK,
@@ -45,13 +152,23 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR,
 } InterpretResult;
 
-extern VM vm;
-
-void initVM(FILE *fout, FILE *ferr);
-void freeVM();
-InterpretResult interpret(const char *source);
-InterpretResult evaluate(const char *source);
-void push(Value value);
-Value pop();
+void initVM(VM *vm, FILE *fout, FILE *ferr);
+// Like initVM(), but starting from the heap writeSnapshot() saved instead of
+// building the usual one. If the snapshot can't be used, the VM is set up as
+// initVM() would and this returns false.
+bool initVMFromSnapshot(VM *vm, FILE *fout, FILE *ferr, const char *path);
+void freeVM(VM *vm);
+InterpretResult interpret(VM *vm, const char *source);
+// Runs a top-level function that was compiled or loaded earlier.
+InterpretResult interpretFunction(VM *vm, ObjFunction *function);
+InterpretResult evaluate(VM *vm, const char *source);
+void printStats(VM *vm, FILE *ferr);
+int globalSlot(VM *vm, ObjString *name);
+// The built-in natives are numbered so heap snapshots can name them.
+// nativeIndex() is -1 and nativeAt() nullptr for anything else.
+int nativeIndex(NativeFn function);
+NativeFn nativeAt(int index);
+void push(VM *vm, Value value);
+Value pop(VM *vm);
 
 #endif /* VM_H */
@@ -0,0 +1,325 @@
+#ifndef X64_H
+#define X64_H
+// A minimal x86-64 assembler shared by the JIT compilers. Only the forms
+// they use are here, each named after what it does rather than its mnemonic.
+#include "common.h"
+
+#ifdef LOX_JIT
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+} Register;
+
+// Pinned while compiled code runs. They are all callee-saved, so the slow
+// paths it calls leave them alone.
+#define R_STACK_TOP RBX
+#define R_SLOTS R12
+#define R_FRAME R13
+#define R_QNAN R14
+#define R_NIL R15
+#define R_VM RBP
+
+typedef enum {
+    CC_B = 0x2,
+    CC_AE = 0x3,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A = 0x7,
+    CC_S = 0x8,
+    CC_P = 0xA,
+} Condition;
+
+typedef enum {
+    ALU_ADD = 0,
+    ALU_OR = 1,
+    ALU_AND = 4,
+    ALU_SUB = 5,
+    ALU_CMP = 7,
+} AluOp;
+
+typedef struct {
+    int kind; // defined by each compiler
+    int position;
+    int offset;
+} Patch;
+
+typedef struct {
+    uint8_t *code;
+    int count;
+    int capacity;
+    Patch *patches;
+    int patchCount;
+    int patchCapacity;
+} Assembler;
+
+static inline void emitByte(Assembler *as, uint8_t byte) {
+    if (as->count == as->capacity) {
+        as->capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+        as->code = realloc(as->code, (size_t) as->capacity);
+        if (as->code == nullptr) exit(1);
+    }
+    as->code[as->count++] = byte;
+}
+
+static inline void emit32(Assembler *as, uint32_t value) {
+    for (int i = 0; i < 4; i++) emitByte(as, (uint8_t) (value >> (8 * i)));
+}
+
+static inline void emit64(Assembler *as, uint64_t value) {
+    for (int i = 0; i < 8; i++) emitByte(as, (uint8_t) (value >> (8 * i)));
+}
+
+static inline void addPatch(Assembler *as, int kind, int position, int offset) {
+    if (as->patchCount == as->patchCapacity) {
+        as->patchCapacity = as->patchCapacity < 64 ? 64 : as->patchCapacity * 2;
+        as->patches = realloc(as->patches,
+                              sizeof(Patch) * (size_t) as->patchCapacity);
+        if (as->patches == nullptr) exit(1);
+    }
+    as->patches[as->patchCount++] = (Patch) {kind, position, offset};
+}
+
+static inline void rex(Assembler *as, bool wide, int reg, int index, int base) {
+    uint8_t prefix = (uint8_t) (0x40 | (wide ? 8 : 0) | ((reg & 8) >> 1) |
+                                ((index & 8) >> 2) | ((base & 8) >> 3));
+    if (prefix != 0x40) emitByte(as, prefix);
+}
+
+// [base + disp], always with an explicit displacement so RBP and R13 need
+// no special casing.
+static inline void modrmMemory(Assembler *as, int reg, int base, int32_t disp) {
+    bool small = disp >= -128 && disp <= 127;
+    emitByte(as, (uint8_t) ((small ? 0x40 : 0x80) | ((reg & 7) << 3) |
+                            (base & 7)));
+    if ((base & 7) == RSP) emitByte(as, 0x24);
+    if (small) {
+        emitByte(as, (uint8_t) (int8_t) disp);
+    } else {
+        emit32(as, (uint32_t) disp);
+    }
+}
+
+static inline void modrmRegister(Assembler *as, int reg, int rm) {
+    emitByte(as, (uint8_t) (0xC0 | ((reg & 7) << 3) | (rm & 7)));
+}
+
+// op reg, [base + disp] for 64-bit loads (8B), lea (8D) and cmp (3B).
+static inline void opMemory(Assembler *as, uint8_t op, int reg, int base,
+                            int32_t disp) {
+    rex(as, true, reg, 0, base);
+    emitByte(as, op);
+    modrmMemory(as, reg, base, disp);
+}
+
+static inline void load(Assembler *as, int dst, int base, int32_t disp) {
+    opMemory(as, 0x8B, dst, base, disp);
+}
+
+static inline void store(Assembler *as, int base, int32_t disp, int src) {
+    opMemory(as, 0x89, src, base, disp);
+}
+
+// Adjusts a register without touching the flags.
+static inline void lea(Assembler *as, int dst, int base, int32_t disp) {
+    opMemory(as, 0x8D, dst, base, disp);
+}
+
+// op rm, reg between registers: mov (89), add (01), and (21), sub (29),
+// xor (31), cmp (39), test (85).
+static inline void opRegister(Assembler *as, uint8_t op, int rm, int reg) {
+    rex(as, true, reg, 0, rm);
+    emitByte(as, op);
+    modrmRegister(as, reg, rm);
+}
+
+static inline void alu(Assembler *as, AluOp op, int reg, int32_t imm) {
+    rex(as, true, 0, 0, reg);
+    if (imm >= -128 && imm <= 127) {
+        emitByte(as, 0x83);
+        modrmRegister(as, op, reg);
+        emitByte(as, (uint8_t) (int8_t) imm);
+    } else {
+        emitByte(as, 0x81);
+        modrmRegister(as, op, reg);
+        emit32(as, (uint32_t) imm);
+    }
+}
+
+// The same with a 32-bit operand, for int and uint32_t fields.
+static inline void opMemory32(Assembler *as, uint8_t op, int reg, int base,
+                              int32_t disp) {
+    rex(as, false, reg, 0, base);
+    emitByte(as, op);
+    modrmMemory(as, reg, base, disp);
+}
+
+// reg = [base + index * 8]
+static inline void loadIndexed(Assembler *as, int dst, int base, int index) {
+    rex(as, true, dst, index, base);
+    emitByte(as, 0x8B);
+    emitByte(as, (uint8_t) (0x44 | ((dst & 7) << 3)));
+    emitByte(as, (uint8_t) (0xC0 | ((index & 7) << 3) | (base & 7)));
+    emitByte(as, 0);
+}
+
+// 83 /ext with a memory operand: add/cmp of an imm8 to [base + disp]. `size`
+// is 1, 4 or 8 bytes.
+static inline void aluMemory(Assembler *as, AluOp op, int size, int base,
+                             int32_t disp, int8_t imm) {
+    rex(as, size == 8, 0, 0, base);
+    emitByte(as, size == 1 ? 0x80 : 0x83);
+    modrmMemory(as, op, base, disp);
+    emitByte(as, (uint8_t) imm);
+}
+
+// C1 /4 (shl) and /5 (shr) by a constant.
+static inline void shift(Assembler *as, int ext, int reg, uint8_t amount) {
+    rex(as, true, 0, 0, reg);
+    emitByte(as, 0xC1);
+    modrmRegister(as, ext, reg);
+    emitByte(as, amount);
+}
+
+static inline void moveImmediate(Assembler *as, int reg, uint64_t imm) {
+    if (imm <= UINT32_MAX) {
+        rex(as, false, 0, 0, reg);
+        emitByte(as, (uint8_t) (0xB8 | (reg & 7)));
+        emit32(as, (uint32_t) imm);
+    } else {
+        rex(as, true, 0, 0, reg);
+        emitByte(as, (uint8_t) (0xB8 | (reg & 7)));
+        emit64(as, imm);
+    }
+}
+
+// movsd/addsd/... xmm, [base + disp]; `prefix` picks the scalar double forms.
+static inline void sse(Assembler *as, uint8_t prefix, uint8_t op, int xmm,
+                       int base, int32_t disp) {
+    emitByte(as, prefix);
+    rex(as, false, xmm, 0, base);
+    emitByte(as, 0x0F);
+    emitByte(as, op);
+    modrmMemory(as, xmm, base, disp);
+}
+
+static inline void emitPush(Assembler *as, int reg) {
+    if (reg >= R8) emitByte(as, 0x41);
+    emitByte(as, (uint8_t) (0x50 | (reg & 7)));
+}
+
+static inline void emitPop(Assembler *as, int reg) {
+    if (reg >= R8) emitByte(as, 0x41);
+    emitByte(as, (uint8_t) (0x58 | (reg & 7)));
+}
+
+static inline void callAbsolute(Assembler *as, const void *function) {
+    moveImmediate(as, RAX, (uint64_t) (uintptr_t) function);
+    emitByte(as, 0xFF);
+    emitByte(as, 0xD0);
+}
+
+// Both leave a rel32 to be patched and return its position.
+static inline int jump(Assembler *as) {
+    emitByte(as, 0xE9);
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+static inline int jumpIf(Assembler *as, Condition cc) {
+    emitByte(as, 0x0F);
+    emitByte(as, (uint8_t) (0x80 | cc));
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+static inline void patchJump(Assembler *as, int position, int target) {
+    uint32_t rel = (uint32_t) (target - (position + 4));
+    memcpy(&as->code[position], &rel, sizeof(rel));
+}
+
+// Turns the condition into TRUE_VAL or FALSE_VAL in `dst`. They sit right
+// after NIL_VAL, which is pinned in R_NIL.
+static inline void boolFromCondition(Assembler *as, Condition cc, int dst) {
+    emitByte(as, (uint8_t) (0x40 | ((dst & 8) >> 3)));
+    emitByte(as, 0x0F);
+    emitByte(as, (uint8_t) (0x90 | cc));
+    modrmRegister(as, 0, dst); // setcc dst8
+    emitByte(as, (uint8_t) (0x40 | ((dst & 8) >> 1) | ((dst & 8) >> 3)));
+    emitByte(as, 0x0F);
+    emitByte(as, 0xB6);
+    modrmRegister(as, dst, dst); // movzx dst32, dst8
+    rex(as, true, dst, dst, R_NIL);
+    emitByte(as, 0x8D);
+    emitByte(as, (uint8_t) (0x44 | ((dst & 7) << 3)));
+    emitByte(as, (uint8_t) (((dst & 7) << 3) | (R_NIL & 7)));
+    emitByte(as, 1); // lea dst, [r15 + dst + 1]
+}
+
+static inline void epilogue(Assembler *as) {
+    alu(as, ALU_ADD, RSP, 8);
+    emitPop(as, RBP);
+    emitPop(as, R15);
+    emitPop(as, R14);
+    emitPop(as, R13);
+    emitPop(as, R12);
+    emitPop(as, RBX);
+    emitByte(as, 0xC3);
+}
+
+// Scalar double operations between registers: movsd (10), addsd (58),
+// subsd (5C), mulsd (59), divsd (5E) with prefix F2, ucomisd (2E) with 66.
+static inline void sseRegister(Assembler *as, uint8_t prefix, uint8_t op,
+                               int dst, int src) {
+    emitByte(as, prefix);
+    rex(as, false, dst, 0, src);
+    emitByte(as, 0x0F);
+    emitByte(as, op);
+    modrmRegister(as, dst, src);
+}
+
+// movq between a general register and an XMM register, either way.
+static inline void moveToXmm(Assembler *as, int xmm, int reg) {
+    emitByte(as, 0x66);
+    rex(as, true, xmm, 0, reg);
+    emitByte(as, 0x0F);
+    emitByte(as, 0x6E);
+    modrmRegister(as, xmm, reg);
+}
+
+static inline void moveFromXmm(Assembler *as, int reg, int xmm) {
+    emitByte(as, 0x66);
+    rex(as, true, xmm, 0, reg);
+    emitByte(as, 0x0F);
+    emitByte(as, 0x7E);
+    modrmRegister(as, xmm, reg);
+}
+
+// cvttsd2si reg, xmm and cvtsi2sd xmm, reg, both 64-bit.
+static inline void truncateToInteger(Assembler *as, int reg, int xmm) {
+    emitByte(as, 0xF2);
+    rex(as, true, reg, 0, xmm);
+    emitByte(as, 0x0F);
+    emitByte(as, 0x2C);
+    modrmRegister(as, reg, xmm);
+}
+
+static inline void integerToDouble(Assembler *as, int xmm, int reg) {
+    emitByte(as, 0xF2);
+    rex(as, true, xmm, 0, reg);
+    emitByte(as, 0x0F);
+    emitByte(as, 0x2A);
+    modrmRegister(as, xmm, reg);
+}
+
+// Maps the assembled code executable; null if the system refuses.
+uint8_t *mapCode(const Assembler *as, size_t *size);
+void unmapCode(uint8_t *code, size_t size);
+#endif
+
+#endif /* X64_H */
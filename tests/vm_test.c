@@ -1,8 +1,16 @@
+#define _DEFAULT_SOURCE
+#include "../src/batch.h"
+#include "../src/bytecode.h"
 #include "../src/common.h"
+#include "../src/compiler.h"
 #include "../src/memory.h"
+#include "../src/snapshot.h"
 #include "../src/vm.h"
 #include "utest.h"
+#include <inttypes.h>
 #include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 typedef struct {
     InterpretResult ires;
@@ -10,33 +18,44 @@ typedef struct {
     const char *expected;
 } VMCase;
 
-struct VM {
+struct Interpreter {
     VMCase *cases;
+    bool jit;
+    bool tracing;
+    int maxFrames; // 0 keeps the VM's default
+    bool lazy;
 };
 
-#define VM_TEST(name, data, count)                                             \
-    UTEST_I(VM, name, count) {                                                 \
+// Runs the cases with the fixture's settings given as designated
+// initializers, e.g. `.jit = true`; anything left out is off.
+#define VM_TEST_WITH(name, data, count, ...)                                   \
+    UTEST_I(Interpreter, name, count) {                                        \
         static_assert(sizeof(data) / sizeof(data[0]) == count, #name);         \
-        utest_fixture->cases = data;                                           \
+        *utest_fixture = (struct Interpreter){.cases = data, __VA_ARGS__};     \
         ASSERT_TRUE(1);                                                        \
     }
 
-UTEST_I_SETUP(VM) {
+#define VM_TEST(name, data, count) VM_TEST_WITH(name, data, count)
+
+UTEST_I_SETUP(Interpreter) {
     (void) utest_index;
     (void) utest_fixture;
     ASSERT_TRUE(1);
 }
 
-UTEST_I_TEARDOWN(VM) {
+UTEST_I_TEARDOWN(Interpreter) {
     VMCase *testCase = &utest_fixture->cases[utest_index];
-    VM vm;
-    (void) vm;
     FileStream fout, ferr;
     initFileStream(&fout);
     initFileStream(&ferr);
 
-    initVM(fout.fp, ferr.fp);
-    InterpretResult result = interpret(testCase->code);
+    VM vm;
+    initVM(&vm, fout.fp, ferr.fp);
+    vm.jitEnabled = utest_fixture->jit;
+    vm.tracingEnabled = utest_fixture->tracing;
+    vm.lazyCompile = utest_fixture->lazy;
+    if (utest_fixture->maxFrames != 0) vm.maxFrames = utest_fixture->maxFrames;
+    InterpretResult result = interpret(&vm, testCase->code);
     fflush(fout.fp);
     fflush(ferr.fp);
 
@@ -49,7 +68,7 @@ UTEST_I_TEARDOWN(VM) {
     }
     freeFileStream(&fout);
     freeFileStream(&ferr);
-    freeVM();
+    freeVM(&vm);
 }
 
 VMCase assignment[] = {
@@ -666,6 +685,497 @@ VMCase constructor[] = {
 };
 VM_TEST(Constructor, constructor, 11)
 
+VMCase fields[] = {
+    {INTERPRET_OK,
+     "class Point {}\n"
+     "var a = Point();\n"
+     "a.x = 1;\n"
+     "a.y = 2;\n"
+     "var b = Point();\n"
+     "b.y = 3;\n"
+     "b.x = 4;\n"
+     "print a.x; // expect: 1\n"
+     "print a.y; // expect: 2\n"
+     "print b.x; // expect: 4\n"
+     "print b.y; // expect: 3\n",
+     "1\n2\n4\n3\n"},
+    {INTERPRET_OK,
+     "class Foo {}\n"
+     "var foo = Foo();\n"
+     "foo.bar = \"before\";\n"
+     "print foo.bar = \"after\"; // expect: after\n"
+     "print foo.bar; // expect: after\n",
+     "after\nafter\n"},
+    {INTERPRET_OK,
+     "class Many {\n"
+     "  fill() {\n"
+     "    this.f0 = 0; this.f1 = 1; this.f2 = 2; this.f3 = 3;\n"
+     "    this.f4 = 4; this.f5 = 5; this.f6 = 6; this.f7 = 7;\n"
+     "    this.f8 = 8; this.f9 = 9; this.f10 = 10; this.f11 = 11;\n"
+     "    this.f12 = 12; this.f13 = 13; this.f14 = 14; this.f15 = 15;\n"
+     "    this.f16 = 16; this.f17 = 17; this.f18 = 18; this.f19 = 19;\n"
+     "    this.f20 = 20; this.f21 = 21; this.f22 = 22; this.f23 = 23;\n"
+     "    this.f24 = 24; this.f25 = 25; this.f26 = 26; this.f27 = 27;\n"
+     "    this.f28 = 28; this.f29 = 29; this.f30 = 30; this.f31 = 31;\n"
+     "    this.f32 = 32; this.f33 = 33; this.f34 = 34; this.f35 = 35;\n"
+     "    this.f36 = 36; this.f37 = 37; this.f38 = 38; this.f39 = 39;\n"
+     "  }\n"
+     "}\n"
+     "var m = Many();\n"
+     "m.fill();\n"
+     "print m.f0 + m.f31 + m.f32 + m.f39; // expect: 102\n"
+     "m.f35 = -1;\n"
+     "print m.f35; // expect: -1\n"
+     "var n = Many();\n"
+     "n.fill();\n"
+     "print n.f39; // expect: 39\n",
+     "102\n-1\n39\n"},
+    {INTERPRET_OK,
+     "class Foo {\n"
+     "  method() { return \"method\"; }\n"
+     "}\n"
+     "fun shadow() { return \"field\"; }\n"
+     "var foo = Foo();\n"
+     "print foo.method(); // expect: method\n"
+     "foo.method = shadow;\n"
+     "print foo.method(); // expect: field\n"
+     "print Foo().method(); // expect: method\n",
+     "method\nfield\nmethod\n"},
+    {INTERPRET_RUNTIME_ERROR,
+     "class Foo {}\n"
+     "var foo = Foo();\n"
+     "foo.a = 1;\n"
+     "print foo.b; // expect runtime error: Undefined property 'b'.\n",
+     "Undefined property 'b'.\n[line 4] in script\n"},
+};
+VM_TEST(Field, fields, 5)
+
+VMCase globals[] = {
+    {INTERPRET_OK,
+     "fun show() { print later; }\n"
+     "var later = \"defined\";\n"
+     "show(); // expect: defined\n"
+     "var later = \"redefined\";\n"
+     "show(); // expect: redefined\n",
+     "defined\nredefined\n"},
+    {INTERPRET_OK,
+     "var count = 0;\n"
+     "fun bump() { count = count + 1; }\n"
+     "for (var i = 0; i < 5; i = i + 1) bump();\n"
+     "print count; // expect: 5\n"
+     "var clock = \"shadowed native\";\n"
+     "print clock; // expect: shadowed native\n",
+     "5\nshadowed native\n"},
+    {INTERPRET_RUNTIME_ERROR,
+     "fun f() { return missing; }\n"
+     "f(); // expect runtime error: Undefined variable 'missing'.\n",
+     "Undefined variable 'missing'.\n[line 1] in f()\n[line 2] in script\n"},
+    {INTERPRET_RUNTIME_ERROR,
+     "fun set() { notYet = 1; }\n"
+     "set(); // expect runtime error: Undefined variable 'notYet'.\n",
+     "Undefined variable 'notYet'.\n[line 1] in set()\n[line 2] in script\n"},
+};
+VM_TEST(Global, globals, 4)
+
+VMCase inlineCaches[] = {
+    {INTERPRET_OK,
+     "class A { name() { return \"A\"; } }\n"
+     "class B { name() { return \"B\"; } }\n"
+     "class C { name() { return \"C\"; } }\n"
+     "class D { name() { return \"D\"; } }\n"
+     "class E { name() { return \"E\"; } }\n"
+     "class F { name() { return \"F\"; } }\n"
+     "var all = [A(), B(), C(), D(), E(), F(), A(), F()];\n"
+     "var s = \"\";\n"
+     "for (var i = 0; i < 8; i = i + 1) {\n"
+     "  s = s + all[i].name();\n"
+     "}\n"
+     "print s; // expect: ABCDEFAF\n",
+     "ABCDEFAF\n"},
+    {INTERPRET_OK,
+     "class P { init(v) { this.v = v; } get() { return this.v; } }\n"
+     "class Q { init(v) { this.w = 0; this.v = v; } }\n"
+     "fun read(o) { return o.v; }\n"
+     "var total = 0;\n"
+     "for (var i = 0; i < 10; i = i + 1) {\n"
+     "  total = total + read(P(i)) + read(Q(1));\n"
+     "}\n"
+     "print total; // expect: 55\n"
+     "var get = P(7).get;\n"
+     "print get(); // expect: 7\n",
+     "55\n7\n"},
+    {INTERPRET_OK,
+     "class Foo { m() { return \"method\"; } }\n"
+     "fun field() { return \"field\"; }\n"
+     "fun call(o) { return o.m(); }\n"
+     "var a = Foo();\n"
+     "var b = Foo();\n"
+     "b.m = field;\n"
+     "print call(a) + call(b) + call(a) + call(b);\n",
+     "methodfieldmethodfield\n"},
+    {INTERPRET_OK,
+     "class Base { say() { return \"base\"; } }\n"
+     "class Mid < Base { say() { return \"mid\" + super.say(); } }\n"
+     "class Leaf < Mid { say() { return \"leaf\" + super.say(); } }\n"
+     "print Leaf().say(); // expect: leafmidbase\n"
+     "print Mid().say(); // expect: midbase\n"
+     "print Leaf().say(); // expect: leafmidbase\n",
+     "leafmidbase\nmidbase\nleafmidbase\n"},
+    {INTERPRET_OK,
+     "fun size(o) { return o.size(); }\n"
+     "class Sized { size() { return 10; } }\n"
+     "var l = [1, 2, 3];\n"
+     "print size(l) + size(Sized()) + size(l); // expect: 16\n",
+     "16\n"},
+    {INTERPRET_RUNTIME_ERROR,
+     "class A { m() { return 1; } }\n"
+     "class B {}\n"
+     "fun call(o) { return o.m(); }\n"
+     "call(A());\n"
+     "call(B()); // expect runtime error: Undefined property 'm'.\n",
+     "Undefined property 'm'.\n[line 3] in call()\n[line 5] in script\n"},
+};
+VM_TEST(InlineCache, inlineCaches, 6)
+
+VMCase quickening[] = {
+    {INTERPRET_OK,
+     "fun add(a, b) { return a + b; }\n"
+     "print add(1, 2); // expect: 3\n"
+     "print add(\"a\", \"b\"); // expect: ab\n"
+     "print add(3, 4); // expect: 7\n"
+     "print add(\"c\", \"d\"); // expect: cd\n",
+     "3\nab\n7\ncd\n"},
+    {INTERPRET_OK,
+     "fun at(c, k) { return c[k]; }\n"
+     "fun put(c, k, v) { return c[k] = v; }\n"
+     "var l = [1, 2];\n"
+     "var m = {a: 3};\n"
+     "put(l, 0, 5);\n"
+     "put(m, \"b\", 6);\n"
+     "put(l, 1, 7);\n"
+     "print at(l, 0) + at(m, \"a\") + at(l, 1) + at(m, \"b\"); // expect: 21\n",
+     "21\n"},
+    {INTERPRET_RUNTIME_ERROR,
+     "fun add(a, b) { return a + b; }\n"
+     "add(1, 2);\n"
+     "add(1, \"a\"); // expect runtime error: Operands must be two numbers or two strings.\n",
+     "Operands must be two numbers or two strings.\n[line 1] in add()\n"
+     "[line 3] in script\n"},
+    {INTERPRET_RUNTIME_ERROR,
+     "var l = [1, 2];\n"
+     "var sum = 0;\n"
+     "for (var i = 0; i < 3; i = i + 1) {\n"
+     "  sum = sum + l[i]; // expect runtime error: List index (2) out of bounds (2)\n"
+     "}\n",
+     "List index (2) out of bounds (2)\n[line 4] in script\n"},
+};
+VM_TEST(Quickening, quickening, 4)
+
+VMCase superinstructions[] = {
+    {INTERPRET_OK,
+     "fun check(a, b) {\n"
+     "  var s = \"\";\n"
+     "  if (a < b) s = s + \"<\"; else s = s + \".\";\n"
+     "  if (a <= b) s = s + \"l\"; else s = s + \".\";\n"
+     "  if (a > b) s = s + \">\"; else s = s + \".\";\n"
+     "  if (a >= b) s = s + \"g\"; else s = s + \".\";\n"
+     "  if (a == b) s = s + \"=\"; else s = s + \".\";\n"
+     "  if (a != b) s = s + \"!\"; else s = s + \".\";\n"
+     "  return s;\n"
+     "}\n"
+     "print check(1, 2); // expect: <l...!\n"
+     "print check(2, 2); // expect: .l.g=.\n"
+     "print check(3, 2); // expect: ..>g.!\n"
+     "var nan = 0 / 0;\n"
+     "print check(nan, 1); // expect: .l.g.!\n",
+     "<l...!\n.l.g=.\n..>g.!\n.l.g.!\n"},
+    {INTERPRET_OK,
+     "var a = 1;\n"
+     "var b = 2;\n"
+     "if (a < b and b < a) print \"and\"; else print \"not and\";\n"
+     "if (b < a or a < b) print \"or\";\n"
+     "if (!(a < b)) print \"bad\"; else print \"not\";\n"
+     "if (a) print \"truthy\";\n"
+     "if (nil) print \"bad\";\n"
+     "var i = 0;\n"
+     "while (i != 3) i = i + 1;\n"
+     "print i;\n"
+     "for (var j = 10; j >= 8; j = j - 1) print j;\n",
+     "not and\nor\nnot\ntruthy\n3\n10\n9\n8\n"},
+    {INTERPRET_OK,
+     "class Box {}\n"
+     "var box = Box();\n"
+     "var g = 0;\n"
+     "{\n"
+     "  var l = 0;\n"
+     "  l = 1;\n"
+     "  g = l + 1;\n"
+     "  box.v = g + 1;\n"
+     "  print l = 5; // expect: 5\n"
+     "  print l + g + box.v; // expect: 10\n"
+     "}\n"
+     "fun none() {}\n"
+     "print none(); // expect: nil\n",
+     "5\n10\nnil\n"},
+    {INTERPRET_RUNTIME_ERROR,
+     "var a = 1;\n"
+     "if (a <\n"
+     "    \"b\") print a; // expect runtime error: Operands must be numbers.\n",
+     "Operands must be numbers.\n[line 3] in script\n"},
+};
+VM_TEST(Superinstruction, superinstructions, 4)
+
+// Literal operands are folded at compile time; anything the VM would reject
+// is left for it to report, on the same line.
+VMCase folding[] = {
+    {INTERPRET_OK,
+     "print 2 * 60 * 60; print \"a\" + \"b\" + \"c\"; print -(1 + 2) * 3;\n"
+     "print !nil == true; print 2 <= 1; print \"a\" != \"a\"; print -0;\n"
+     "print 0 / 0 >= 1; print 0 / 0 < 1; print 1 / 0;\n"
+     "var x = 3; print -x * 1 / 1 - 0; print x * 1 + 0;\n",
+     "7200\nabc\n-9\ntrue\nfalse\nfalse\n-0\ntrue\nfalse\ninf\n-3\n3\n"},
+    {INTERPRET_RUNTIME_ERROR,
+     "print \"a\" + \"b\";\n"
+     "print 1 +\n"
+     "  \"b\";\n",
+     "Operands must be two numbers or two strings.\n[line 3] in script\n"},
+    {INTERPRET_RUNTIME_ERROR,
+     "print !\"a\";\n"
+     "print -\"a\";\n",
+     "Operand must be a number.\n[line 2] in script\n"},
+    {INTERPRET_RUNTIME_ERROR,
+     "print (nil - 1) * 1;\n",
+     "Operands must be numbers.\n[line 1] in script\n"},
+};
+VM_TEST(Folding, folding, 4)
+
+// Far deeper than the stacks start out, which only works if they grow and
+// everything pointing into them is moved along.
+VMCase deepStacks[] = {
+    {INTERPRET_OK,
+     "fun depth(n) { if (n == 0) return 0; return 1 + depth(n - 1); }\n"
+     "print depth(20000);",
+     "20000\n"},
+    {INTERPRET_OK,
+     "var getters = [];\n"
+     "fun nest(n) {\n"
+     "  var a = n; var b = n * 2;\n"
+     "  fun get() { return a + b; }\n"
+     "  if (n > 0) { var inner = nest(n - 1); getters.push(get); return inner + 1; }\n"
+     "  return get();\n"
+     "}\n"
+     "print nest(3000); print getters[0](); print getters[2999]();",
+     "3000\n3\n9000\n"},
+    {INTERPRET_OK,
+     "class Node {\n"
+     "  init(depth) {\n"
+     "    if (depth > 0) { this.left = Node(depth - 1); this.right = Node(depth - 1); }\n"
+     "    else { this.left = nil; this.right = nil; }\n"
+     "  }\n"
+     "  count() {\n"
+     "    if (this.left == nil) return 1;\n"
+     "    return 1 + this.left.count() + this.right.count();\n"
+     "  }\n"
+     "}\n"
+     "fun chain(n) { if (n == 0) return Node(10).count(); return chain(n - 1); }\n"
+     "fun wide(a, b, c, d, e, f, g, h) {\n"
+     "  return [a, b, c, d, e, f, g, h, [a, b, [c, d, [e, f, [g, h]]]]];\n"
+     "}\n"
+     "fun deep(n) {\n"
+     "  if (n == 0) return wide(1, 2, 3, 4, 5, 6, 7, 8);\n"
+     "  return deep(n - 1);\n"
+     "}\n"
+     "print chain(1000); print deep(500)[8][2][2][2][1];",
+     "2047\n8\n"},
+};
+VM_TEST(DeepStack, deepStacks, 3)
+
+VMCase maxFrames[] = {
+    {INTERPRET_RUNTIME_ERROR,
+     "fun f(n) { return 1 + f(n + 1); }\n"
+     "f(0);",
+     "Stack overflow.\n[line 1] in f()\n[line 1] in f()\n[line 1] in f()\n"
+     "[line 2] in script\n"},
+    {INTERPRET_OK,
+     "fun f(n) { if (n == 0) return 0; return f(n - 1); }\n"
+     "fun g(n) { return 1 + f(n); }\n"
+     "print f(100000); print g(1);",
+     "0\n1\n"},
+};
+// The VM's maxFrames lowered to 4.
+VM_TEST_WITH(MaxFrames, maxFrames, 2, .maxFrames = 4)
+
+// Deeper than FRAMES_MAX, which only works if tail calls reuse frames.
+VMCase tailCalls[] = {
+    {INTERPRET_OK,
+     "fun sum(n, acc) { if (n == 0) return acc; return sum(n - 1, acc + n); }\n"
+     "print sum(100000, 0);\n"
+     "fun even(n) { if (n == 0) return true; return odd(n - 1); }\n"
+     "fun odd(n) { if (n == 0) return false; return even(n - 1); }\n"
+     "print even(10001);",
+     "5.00005e+09\nfalse\n"},
+    {INTERPRET_OK,
+     "var fs = [];\n"
+     "fun keep(n) {\n"
+     "  if (n == 0) return fs;\n"
+     "  fun get() { return n; }\n"
+     "  fs.push(get);\n"
+     "  return keep(n - 1);\n"
+     "}\n"
+     "keep(3);\n"
+     "print fs[0]() + fs[1]() * 10 + fs[2]() * 100;",
+     "123\n"},
+    {INTERPRET_OK,
+     "class Counter {\n"
+     "  init(n) { this.n = n; }\n"
+     "  down() { if (this.n == 0) return \"done\"; this.n = this.n - 1;\n"
+     "    var next = this.down; return next(); }\n"
+     "}\n"
+     "class P { init(x) { this.x = x; } }\n"
+     "fun make(x) { return P(x); }\n"
+     "fun id(x) { return x; }\n"
+     "fun twice(x) { return id(id(x)); }\n"
+     "print Counter(5000).down(); print make(3).x; print twice(4);",
+     "done\n3\n4\n"},
+    {INTERPRET_RUNTIME_ERROR,
+     "fun f(a) { return a; }\n"
+     "fun g() {\n"
+     "  return f();\n"
+     "}\n"
+     "g();",
+     "Expected 1 arguments but got 0.\n[line 3] in g()\n[line 5] in script\n"},
+};
+VM_TEST(TailCall, tailCalls, 4)
+
+// Every loop runs past the JIT's hotness threshold so the rest of it, and
+// the functions it calls, execute as native code.
+VMCase jit[] = {
+    {INTERPRET_OK,
+     "var sum = 0;\n"
+     "for (var i = 0; i < 3000; i = i + 1) { sum = sum + i * 2 - i / 2; }\n"
+     "print sum; print -sum; print !sum; print sum == sum; print nil != false;",
+     "6.74775e+06\n-6.74775e+06\nfalse\ntrue\ntrue\n"},
+    {INTERPRET_OK,
+     "fun fib(n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); }\n"
+     "print fib(20);",
+     "6765\n"},
+    {INTERPRET_OK,
+     "class P { init(x) { this.x = x; } get() { return this.x; } }\n"
+     "class Q < P { get() { return super.get() + 1; } }\n"
+     "var p = P(1); var q = Q(1); var t = 0;\n"
+     "for (var i = 0; i < 2000; i = i + 1) {\n"
+     "  t = t + p.get() + q.get() + p.x; p.x = p.x + 1;\n"
+     "}\n"
+     "print t; print p.x;",
+     "4.006e+06\n2001\n"},
+    {INTERPRET_OK,
+     "var s = \"\"; var l = [0, 0]; var m = {k : 0};\n"
+     "for (var i = 0; i < 2000; i = i + 1) {\n"
+     "  if (i >= 1997) s = s + \"ab\";\n"
+     "  l[1] = l[1] + 1; m[\"k\"] = m[\"k\"] + l[0] + 2;\n"
+     "}\n"
+     "print s; print l[1]; print m[\"k\"];",
+     "ababab\n2000\n4000\n"},
+    {INTERPRET_OK,
+     "fun counter() { var n = 0; fun inc() { n = n + 1; return n; } return inc; }\n"
+     "var total = 0;\n"
+     "for (var i = 0; i < 1500; i = i + 1) { var c = counter(); c(); total = total + c(); }\n"
+     "print total;",
+     "3000\n"},
+    {INTERPRET_RUNTIME_ERROR,
+     "fun f(x) { return x + 1; }\n"
+     "var a = 0;\n"
+     "for (var i = 0; i < 3000; i = i + 1) {\n"
+     "  a = f(a);\n"
+     "  if (i == 2500) a = \"x\";\n"
+     "}",
+     "Operands must be two numbers or two strings.\n[line 1] in f()\n[line 4] in "
+     "script\n"},
+    {INTERPRET_RUNTIME_ERROR,
+     "var a = 0;\n"
+     "for (var i = 0; i < 3000; i = i + 1) {\n"
+     "  if (i == 2999) a = a < nil;\n"
+     "}",
+     "Operands must be numbers.\n[line 3] in script\n"},
+    {INTERPRET_OK,
+     "fun loop(n, acc) { if (n == 0) return acc; return loop(n - 1, acc + 1); }\n"
+     "class P { init(x) { this.x = x; } }\n"
+     "fun make(x) { return P(x); }\n"
+     "var t = 0;\n"
+     "for (var i = 0; i < 1500; i = i + 1) t = t + make(i).x;\n"
+     "print loop(50000, 0); print t;",
+     "50000\n1.12425e+06\n"},
+};
+
+// With --jit; builds without the JIT interpret the cases instead.
+VM_TEST_WITH(Jit, jit, 8, .jit = true)
+
+VMCase tracing[] = {
+    {INTERPRET_OK,
+     "var i = 0; var n = 0; var s = 0;\n"
+     "while (i < 1000) {\n"
+     "  i = i + 1; n = n * 2 + 1;\n"
+     "  if (n > 100000) n = 0;\n"
+     "  if (i == 700) s = \"x\";\n"
+     "  if (i > 997) s = s + \"y\";\n"
+     "}\n"
+     "print i; print n; print s;",
+     "1000\n16383\nxyyy\n"},
+    {INTERPRET_OK,
+     "var a = 1; var b = 2; var c = 3;\n"
+     "for (var k = 0; k < 500; k = k + 1) { var t = a; a = b; b = c; c = -t; }\n"
+     "print a; print b; print c;",
+     "3\n-1\n-2\n"},
+    {INTERPRET_OK,
+     "fun f(l) {\n"
+     "  var total = 0;\n"
+     "  for (var j = 0; j < 300; j = j + 1) l[j] = l[j] * 3;\n"
+     "  var i = 0;\n"
+     "  while (i < 300) { total = total + l[i] - i / 2; i = i + 1; }\n"
+     "  return total;\n"
+     "}\n"
+     "var l = [];\n"
+     "for (var i = 0; i < 300; i = i + 1) l.push(i);\n"
+     "print f(l); print l[299];",
+     "112125\n897\n"},
+    {INTERPRET_OK,
+     "var e = 0; var r = \"\"; var eq = 0;\n"
+     "while (e < 300) {\n"
+     "  var local = e * 2; e = e + 1;\n"
+     "  if (e == 250) local = \"s\";\n"
+     "  if (e > 297) r = r + \"-\";\n"
+     "  if (-0 * e == 0) eq = eq + 1;\n"
+     "  var nan = 0 / 0; if (nan == nan) eq = eq + 100;\n"
+     "  if (local == \"s\") r = r + local;\n"
+     "}\n"
+     "print r; print eq;",
+     "s---\n30000\n"},
+    {INTERPRET_OK,
+     "var flag = nil; var n = 0;\n"
+     "while (n < 300) {\n"
+     "  n = n + 1;\n"
+     "  if (!flag) flag = nil;\n"
+     "  if (n == 250) flag = true;\n"
+     "  if (flag) n = n + 1;\n"
+     "}\n"
+     "var total = 0;\n"
+     "for (var i = 0; i < 100; i = i + 1)\n"
+     "  for (var j = 0; j < 100; j = j + 1) total = total + i * j;\n"
+     "print n; print flag; print total;",
+     "301\ntrue\n2.45025e+07\n"},
+    {INTERPRET_RUNTIME_ERROR,
+     "var l = [1, 2, 3]; var y = 0; var a = 0;\n"
+     "while (y < 500) {\n"
+     "  y = y + 1;\n"
+     "  if (y == 450) l = 5;\n"
+     "  a = a + l[1];\n"
+     "}",
+     "Can only index lists or maps.\n[line 5] in script\n"},
+};
+
+// With --trace-jit, the same way.
+VM_TEST_WITH(Tracing, tracing, 6, .tracing = true)
+
 VMCase lists[] = {
     {INTERPRET_OK, "print [nil][0];", "nil\n"},
     {INTERPRET_OK, " var l = [1, 2]; print l[1];", "2\n"},
@@ -673,7 +1183,750 @@ VMCase lists[] = {
      "List index (2) out of bounds (2)\n[line 1] in script\n"},
     {INTERPRET_RUNTIME_ERROR, "var l = [1,2]; print l[-3];",
      "List index (-3) out of bounds (2)\n[line 1] in script\n"},
+    {INTERPRET_RUNTIME_ERROR, "var l = [];\nl.pop();\nprint \"unreached\";",
+     "Can't pop form empty list.\n[line 2] in script\n"},
+    {INTERPRET_RUNTIME_ERROR, "fun f(l) { l.push(); }\nf([]);",
+     "Expected 1 arguments, got 0\n[line 1] in f()\n[line 2] in script\n"},
 };
-VM_TEST(List, lists, 4)
+VM_TEST(List, lists, 6)
+
+VMCase lazy[] = {
+    // Bodies that are never called are never compiled.
+    {INTERPRET_OK,
+     "fun unused() { this is not ( lox }\n"
+     "fun used(a) { return a + 1; }\n"
+     "print used(1);",
+     "2\n"},
+    {INTERPRET_RUNTIME_ERROR,
+     "fun f() {\n  return 1 +;\n}\n"
+     "print \"before\";\nf();",
+     "[line 2] Error at ';': Expect expression\n"
+     "Could not compile f().\n[line 5] in script\n"},
+    // A tail call that fails still shows the caller.
+    {INTERPRET_RUNTIME_ERROR,
+     "fun f() {\n  return 1 +;\n}\n"
+     "fun g() {\n  return f();\n}\n"
+     "g();",
+     "[line 2] Error at ';': Expect expression\n"
+     "Could not compile f().\n[line 5] in g()\n[line 7] in script\n"},
+    // Upvalues are found while skipping, through functions nested in the
+    // skipped one and past names that only look like variables.
+    {INTERPRET_OK,
+     "fun outer() {\n"
+     "  var a = \"a\"; var b = \"b\";\n"
+     "  fun middle() { fun inner() { return a + b; } return inner; }\n"
+     "  fun keys() { var m = {a: 1}; return m[\"a\"]; }\n"
+     "  a = \"A\";\n"
+     "  return [middle(), keys];\n"
+     "}\n"
+     "var l = outer(); print l[0](); print l[1]();",
+     "Ab\n1\n"},
+    {INTERPRET_OK,
+     "class A { name() { return \"A\"; } }\n"
+     "class B < A {\n"
+     "  init(x) { this.x = x; }\n"
+     "  name() { fun get() { return super.name() + this.x; } return get; }\n"
+     "}\n"
+     "print B(\"b\").name()();",
+     "Ab\n"},
+    {INTERPRET_OK,
+     "fun fib(n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); }\n"
+     "fun count(n) { if (n == 0) return 0; return count(n - 1); }\n"
+     "print fib(15); print count(10000);",
+     "610\n0\n"},
+};
+// With function bodies compiled on their first call.
+VM_TEST_WITH(Lazy, lazy, 6, .lazy = true)
+
+// Two VMs share nothing: globals, strings and errors stay with the VM that
+// made them, however their calls are interleaved.
+UTEST(Interpreter, Independent) {
+    FileStream out[2], err[2];
+    VM vms[2];
+    for (int i = 0; i < 2; i++) {
+        initFileStream(&out[i]);
+        initFileStream(&err[i]);
+        initVM(&vms[i], out[i].fp, err[i].fp);
+    }
+
+    EXPECT_TRUE(interpret(&vms[0], "var a = \"first\";") == INTERPRET_OK);
+    EXPECT_TRUE(interpret(&vms[1], "var b = \"second\";") == INTERPRET_OK);
+    EXPECT_TRUE(interpret(&vms[0], "print a;") == INTERPRET_OK);
+    EXPECT_TRUE(interpret(&vms[1], "print a;") == INTERPRET_RUNTIME_ERROR);
+    EXPECT_TRUE(interpret(&vms[1], "print b + b;") == INTERPRET_OK);
+    freeVM(&vms[0]);
+    EXPECT_TRUE(interpret(&vms[1], "print b;") == INTERPRET_OK);
+    freeVM(&vms[1]);
+
+    for (int i = 0; i < 2; i++) {
+        fflush(out[i].fp);
+        fflush(err[i].fp);
+    }
+    EXPECT_STREQ("first\n", out[0].buf);
+    EXPECT_STREQ("", err[0].buf);
+    EXPECT_STREQ("secondsecond\nsecond\n", out[1].buf);
+    EXPECT_STREQ("Undefined variable 'a'.\n[line 1] in script\n", err[1].buf);
+    for (int i = 0; i < 2; i++) {
+        freeFileStream(&out[i]);
+        freeFileStream(&err[i]);
+    }
+}
+
+// Folded operands give back their constant slots, and an identity is only
+// dropped after an instruction that already checks for a number.
+UTEST(Interpreter, Folding) {
+    VM vm;
+    initVM(&vm, stdout, stderr);
+    ObjFunction *script = compile(&vm, "print 2 * 60 * 60 - 0;");
+    ASSERT_TRUE(script != nullptr);
+    uint8_t folded[] = {OP_CONSTANT, 0, OP_PRINT, OP_RETURN_NIL};
+    ASSERT_EQ(script->chunk.count, (int) sizeof(folded));
+    EXPECT_EQ(0, memcmp(folded, script->chunk.code, sizeof(folded)));
+    EXPECT_EQ(1, script->chunk.constants.count);
+    EXPECT_EQ(7200.0, AS_NUMBER(script->chunk.constants.values[0]));
+
+    script = compile(&vm, "fun f(x) { return -x * 1 / 1 + x * 1; }");
+    ASSERT_TRUE(script != nullptr);
+    ObjFunction *f = AS_FUNCTION(script->chunk.constants.values[0]);
+    uint8_t identities[] = {OP_GET_LOCAL, 1, OP_NEGATE, OP_GET_LOCAL, 1,
+                            OP_CONSTANT, 0, OP_MULTIPLY, OP_ADD, OP_RETURN};
+    ASSERT_EQ(f->chunk.count, (int) sizeof(identities));
+    EXPECT_EQ(0, memcmp(identities, f->chunk.code, sizeof(identities)));
+    freeVM(&vm);
+}
+
+// Runs `source` in a VM with an optimization off and then on, set by
+// `configure`, and expects the same result, output and errors from both.
+// The result is also stored in `result` unless that is null.
+static void expectSameWithAndWithout(int *utest_result, const char *source,
+                                     void (*configure)(VM *vm, bool enabled),
+                                     InterpretResult *result) {
+    FileStream out[2], err[2];
+    InterpretResult results[2];
+    for (int on = 0; on < 2; on++) {
+        initFileStream(&out[on]);
+        initFileStream(&err[on]);
+        VM vm;
+        initVM(&vm, out[on].fp, err[on].fp);
+        configure(&vm, on == 1);
+        results[on] = interpret(&vm, source);
+        freeVM(&vm);
+        fflush(out[on].fp);
+        fflush(err[on].fp);
+    }
+    EXPECT_EQ(results[0], results[1]);
+    EXPECT_STREQ(out[0].buf, out[1].buf);
+    EXPECT_STREQ(err[0].buf, err[1].buf);
+    for (int on = 0; on < 2; on++) {
+        freeFileStream(&out[on]);
+        freeFileStream(&err[on]);
+    }
+    if (result != nullptr)
+        *result = results[1];
+}
+
+static void usePeephole(VM *vm, bool enabled) {
+    vm->peepholeEnabled = enabled;
+}
+
+static void useSsa(VM *vm, bool enabled) {
+    vm->ssaEnabled = enabled;
+}
+
+static void useInline(VM *vm, bool enabled) {
+    vm->inlineEnabled = enabled;
+}
+
+// Scripts print and fail the same with the peephole pass on and off, and
+// the pass leaves the code below.
+UTEST(Interpreter, Peephole) {
+    static const char *sources[] = {
+        "fun f(a) { if (!a) return 1; return 2; }\n"
+        "fun g(a, b) { if (!(a < b)) return a; else return b; }\n"
+        "print f(nil); print f(0); print g(1, 2); print g(0 / 0, 1);\n"
+        "fun h(n) {\n"
+        "  var s = 0;\n"
+        "  while (n > 0) { if (n > 2) { s = s + n; } else { s = s - 1; } "
+        "n = n - 1; }\n"
+        "  return s;\n"
+        "}\n"
+        "fun first() { var i = 0; while (true) { i = i + 1; "
+        "if (i == 7) return i; } }\n"
+        "print h(5); print first();\n"
+        "print 1 and 2 and nil and 3; print nil or false or 3;\n"
+        "print (1 and nil) and 2; print !!nil; if (!!f) print \"f\";\n"
+        "1; nil; \"str\"; true; { var y = 2; y; }\n"
+        "for (var k = 0; k < 3; k = k + 1) {}\n"
+        "if (false) print \"no\"; else print \"yes\";\n",
+        "var a = 1;\n"
+        "if (!(a <\n"
+        "      \"b\")) print a;\n",
+    };
+    for (int i = 0; i < 2; i++) {
+        expectSameWithAndWithout(utest_result, sources[i], usePeephole,
+                                 nullptr);
+    }
+
+    VM vm;
+    initVM(&vm, stdout, stderr);
+    ObjFunction *script = compile(&vm, "1; nil; \"str\"; true;");
+    ASSERT_TRUE(script != nullptr);
+    EXPECT_EQ(1, script->chunk.count);
+    EXPECT_EQ(OP_RETURN_NIL, script->chunk.code[0]);
+
+    // The negation goes into the jump, and the jump over the rest after the
+    // first return and the implicit return at the end are never reached.
+    script = compile(&vm, "fun f(a) { if (!a) return 1; return 2; }");
+    ASSERT_TRUE(script != nullptr);
+    ObjFunction *f = AS_FUNCTION(script->chunk.constants.values[0]);
+    uint8_t inverted[] = {OP_GET_LOCAL, 1, OP_POP_JUMP_IF_TRUE, 0, 3,
+                          OP_CONSTANT,  0, OP_RETURN,           OP_CONSTANT,
+                          1,            OP_RETURN};
+    ASSERT_EQ(f->chunk.count, (int) sizeof(inverted));
+    EXPECT_EQ(0, memcmp(inverted, f->chunk.code, sizeof(inverted)));
+
+    script = compile(&vm, "fun g(a, b) { if (!(a < b)) return a; "
+                          "else return b; }");
+    ASSERT_TRUE(script != nullptr);
+    f = AS_FUNCTION(script->chunk.constants.values[0]);
+    uint8_t fused[] = {OP_GET_LOCAL, 1,         OP_GET_LOCAL, 2,
+                       OP_JUMP_IF_LESS, 0,      3,            OP_GET_LOCAL,
+                       1,            OP_RETURN, OP_GET_LOCAL, 2,
+                       OP_RETURN};
+    ASSERT_EQ(f->chunk.count, (int) sizeof(fused));
+    EXPECT_EQ(0, memcmp(fused, f->chunk.code, sizeof(fused)));
+    freeVM(&vm);
+}
+
+// Scripts print and fail the same with the SSA optimizer on and off, and
+// the loop below loads this.n once and this.k before the loop starts.
+UTEST(Interpreter, Ssa) {
+    static const char *sources[] = {
+        "class V {\n"
+        "  init(x, y) { this.x = x; this.y = y; }\n"
+        "  len2() { return this.x * this.x + this.y * this.y; }\n"
+        "  scale(k) { for (var i = 0; i < 3; i = i + 1) "
+        "this.x = this.x * k; return this.x; }\n"
+        "  m() { return \"m\"; }\n"
+        "  twice() { var a = this.m; var b = this.m; return a() + b(); }\n"
+        "}\n"
+        "var v = V(3, 4); print v.len2(); print v.scale(2); print v.twice();\n"
+        "fun calls(o) { var s = 0; var i = 0; while (i < 3) { s = s + o.x; "
+        "o.scale(2); s = s + o.x; o.x = 1; s = s + o.x; i = i + 1; } "
+        "return s; }\n"
+        "print calls(V(1, 1));\n"
+        "fun captured() {\n"
+        "  var fs = []; var x = 1;\n"
+        "  for (var i = 0; i < 3; i = i + 1) { var j = i * x; "
+        "fun g() { x = x + 1; return j; } fs.push(g); }\n"
+        "  var s = 0;\n"
+        "  for (var k = 0; k < 3; k = k + 1) { s = s + fs[k]() + x * 10; }\n"
+        "  return s;\n"
+        "}\n"
+        "print captured();\n"
+        "var l = [1, 2]; var g = 1;\n"
+        "fun stores() { var s = 0; var i = 0; while (i < 3) { "
+        "s = s + l[0] + g * 2; l[0] = l[0] + 1; g = g + 1; i = i + 1; } "
+        "return s; }\n"
+        "print stores();\n"
+        "fun nested(n) { var t = 0; for (var i = 0; i < n; i = i + 1) "
+        "for (var j = 0; j < n; j = j + 1) t = t + n * 2 + i; return t; }\n"
+        "print nested(4);\n"
+        "fun never(o) { var i = 0; while (i < 0) { print o.f; i = i + 1; } "
+        "return i; }\n"
+        "print never(nil);\n",
+        "fun f(o) { var i = 0; while (i < 3) { print i; var x = o.f * 2; "
+        "i = i + 1; } }\n"
+        "f(nil);\n",
+        "var i = 0; while (i < 2) { print i; i = i + missing; }\n",
+    };
+    for (int i = 0; i < 3; i++) {
+        expectSameWithAndWithout(utest_result, sources[i], useSsa, nullptr);
+    }
+
+    VM vm;
+    initVM(&vm, stdout, stderr);
+    ObjFunction *script =
+        compile(&vm, "class P { sum() { var s = 0; var i = 0; "
+                     "while (i < this.n) { s = s + this.k * 2 + this.n; "
+                     "i = i + 1; } return s; } }");
+    ASSERT_TRUE(script != nullptr);
+    ObjFunction *sum = nullptr;
+    for (int i = 0; i < script->chunk.constants.count; i++) {
+        Value constant = script->chunk.constants.values[i];
+        if (IS_FUNCTION(constant)) sum = AS_FUNCTION(constant);
+    }
+    ASSERT_TRUE(sum != nullptr);
+    Chunk *chunk = &sum->chunk;
+    int loads = 0;
+    int lastLoad = -1;
+    int loopStart = -1;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        if (chunk->code[offset] == OP_GET_PROPERTY) {
+            loads++;
+            lastLoad = offset;
+        }
+        if (chunk->code[offset] == OP_LOOP) {
+            loopStart = jumpTarget(chunk, offset);
+        }
+    }
+    EXPECT_EQ(2, loads);
+    ASSERT_TRUE(loopStart >= 0);
+    EXPECT_LT(lastLoad, loopStart);
+    freeVM(&vm);
+}
+
+// Inlined calls behave like real ones, including when the guard fails
+// because the method was shadowed or replaced, or the receiver is missing a
+// field the body reads.
+UTEST(Interpreter, Inline) {
+    static const char *sources[] = {
+        "class P {\n"
+        "  init(x) { this.x = x; }\n"
+        "  getX() { return this.x; }\n"
+        "  setX(v) { this.x = v; }\n"
+        "  self() { return this; }\n"
+        "  is(v) { return !(this.x == v); }\n"
+        "  second(a, b) { return b; }\n"
+        "}\n"
+        "class Q < P {}\n"
+        "fun id(a) { return a; }\n"
+        "fun seven() { return 7; }\n"
+        "var p = P(1); var q = Q(2); var s = 0;\n"
+        "for (var i = 0; i < 4; i = i + 1) {\n"
+        "  p.setX(p.getX() + i);\n"
+        "  s = s + p.getX() + q.getX() + id(i) + p.second(1, i);\n"
+        "  if (i == 1) q.getX = seven;\n"
+        "}\n"
+        "print s; print p.self() == p; print p.is(7); print id(\"a\");\n"
+        "class E { getX() { return this.x; } }\n"
+        "print P(3).getX(); print E().getX();\n",
+        "fun id(a) { return a; }\n"
+        "print id(1);\n"
+        "id = nil;\n"
+        "print id(2);\n",
+    };
+    for (int i = 0; i < 2; i++) {
+        InterpretResult result;
+        expectSameWithAndWithout(utest_result, sources[i], useInline,
+                                 &result);
+        EXPECT_TRUE(result == INTERPRET_RUNTIME_ERROR);
+    }
+
+    // The getter and the function are inlined; a body with arithmetic,
+    // which could fail, is still called, as is the class.
+    VM vm;
+    initVM(&vm, stdout, stderr);
+    ObjFunction *script =
+        compile(&vm, "class P { getX() { return this.x; } "
+                     "sum() { return this.x + 1; } }\n"
+                     "fun id(a) { return a; }\n"
+                     "var p = P(); p.x = 1; print p.getX() + p.sum() + id(2);");
+    ASSERT_TRUE(script != nullptr);
+    int counts[OP_INVOKE_INLINE + 1] = {0};
+    Chunk *chunk = &script->chunk;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        if (chunk->code[offset] <= OP_INVOKE_INLINE) {
+            counts[chunk->code[offset]]++;
+        }
+    }
+    EXPECT_EQ(1, counts[OP_INVOKE_INLINE]);
+    EXPECT_EQ(1, counts[OP_INVOKE]);
+    EXPECT_EQ(1, counts[OP_CALL_INLINE]);
+    EXPECT_EQ(1, counts[OP_CALL]);
+    EXPECT_EQ(maxStackDepth(chunk, 1), script->maxSlots);
+    freeVM(&vm);
+}
+
+// A script run a piece at a time, with collection work after each piece.
+typedef struct {
+    const char *source;
+    void (*then)(int *utest_result, VM *vm); // or nullptr
+} GcStep;
+
+// Runs the steps in one VM, set to a collection mode by `configure` unless
+// that is null, and expects `expected` to be all they print.
+static void expectGcSteps(int *utest_result, void (*configure)(VM *vm),
+                          const GcStep *steps, int count,
+                          const char *expected) {
+    FileStream out, err;
+    initFileStream(&out);
+    initFileStream(&err);
+    VM vm;
+    initVM(&vm, out.fp, err.fp);
+    if (configure != nullptr)
+        configure(&vm);
+    for (int i = 0; i < count; i++) {
+        EXPECT_TRUE(interpret(&vm, steps[i].source) == INTERPRET_OK);
+        if (steps[i].then != nullptr)
+            steps[i].then(utest_result, &vm);
+    }
+    freeVM(&vm);
+
+    fflush(out.fp);
+    fflush(err.fp);
+    EXPECT_STREQ(expected, out.buf);
+    EXPECT_STREQ("", err.buf);
+    freeFileStream(&out);
+    freeFileStream(&err);
+}
+
+static void collectYoungStep(int *utest_result, VM *vm) {
+    (void) utest_result;
+    collectYoung(vm);
+}
+
+static void emptyYoungStep(int *utest_result, VM *vm) {
+    collectYoung(vm);
+    EXPECT_EQ(0, vm->youngPageCount);
+}
+
+static void collectGarbageStep(int *utest_result, VM *vm) {
+    (void) utest_result;
+    collectGarbage(vm);
+}
+
+// Starts a full collection on an otherwise empty young generation and
+// leaves it marking.
+static void beginMarkingStep(int *utest_result, VM *vm) {
+    collectGarbage(vm);
+    beginCollection(vm);
+    if (!vm->gcConcurrent)
+        collectStep(vm);
+    EXPECT_TRUE(vm->gcPhase == GC_MARKING);
+}
+
+static void finishMarkingStep(int *utest_result, VM *vm) {
+    (void) utest_result;
+    while (vm->gcPhase == GC_MARKING) {
+        collectStep(vm);
+    }
+}
+
+static void finishSweepingStep(int *utest_result, VM *vm) {
+    while (vm->gcPhase != GC_IDLE) {
+        collectStep(vm);
+    }
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        EXPECT_TRUE(vm->unswept[i] == nullptr);
+    }
+    collectGarbage(vm);
+}
+
+static void useIncremental(VM *vm) {
+    vm->gcPause = 1;
+}
+
+static void useConcurrent(VM *vm) {
+    vm->gcConcurrent = true;
+}
+
+// Young strings stored into objects a minor collection has already promoted
+// survive the next one, whichever kind of store put them there.
+UTEST(Interpreter, Generational) {
+    GcStep steps[] = {
+        {"class Box {} var box = Box(); var list = [nil];"
+         "var map = {}; var items = [];"
+         "fun cell() { var kept; fun get() { return kept; }"
+         " fun set(v) { kept = v; } return [get, set]; }"
+         "var pair = cell();",
+         emptyYoungStep},
+        {"var s = \"a\"; box.field = s + \"1\";"
+         "list[0] = s + \"2\"; map[s + \"3\"] = s + \"4\";"
+         "items.push(s + \"5\"); pair[1](s + \"6\");",
+         collectYoungStep},
+        {"print box.field; print list[0]; print map[\"a3\"];"
+         "print items[0]; print pair[0]();"
+         "print box.field == \"a\" + \"1\";",
+         collectGarbageStep},
+        {"print map[\"a3\"] + pair[0]();", nullptr},
+    };
+    expectGcSteps(utest_result, nullptr, steps, 4,
+                  "a1\na2\na4\na5\na6\ntrue\na4a6\n");
+}
+
+// Old objects move between others while a full collection is marking a
+// few at a time, and the sweep runs alongside the script that follows.
+UTEST(Interpreter, Incremental) {
+    GcStep steps[] = {
+        {"class Box { init(n) { this.kept = [n]; } }"
+         "var boxes = [];"
+         "for (var i = 0; i < 200; i = i + 1)"
+         "  boxes.push(Box(i));",
+         beginMarkingStep},
+        {"for (var i = 0; i < 100; i = i + 1) {"
+         "  boxes[i].hidden = boxes[199 - i].kept;"
+         "  boxes[199 - i].kept = nil;"
+         "  boxes[199 - i].hidden = boxes[i].kept;"
+         "  boxes[i].kept = [\"young\"];"
+         "}",
+         finishMarkingStep},
+        {"var sum = 0;"
+         "for (var i = 0; i < 100; i = i + 1)"
+         "  sum = sum + boxes[i].hidden[0]"
+         "      + boxes[199 - i].hidden[0];"
+         "print sum;",
+         finishSweepingStep},
+        {"print boxes[5].kept[0] + \" again\";"
+         "print boxes[150].kept;",
+         nullptr},
+    };
+    expectGcSteps(utest_result, useIncremental, steps, 4,
+                  "19900\nyoung again\nnil\n");
+}
+
+// The same with the marking on a thread of its own, racing the script that
+// moves things around, including by shifting the lists they're in. Past
+// SHAPE_MAX_SLOTS the shape is the instance's own and grows in place while
+// the marker reads it.
+UTEST(Interpreter, Concurrent) {
+    char wideA[1024], wideB[1024];
+    int length = snprintf(wideA, sizeof(wideA), "var wide = Box(0);");
+    for (int i = 0; i < 40; i++) {
+        length += snprintf(wideA + length, sizeof(wideA) - length,
+                           "wide.a%d = [%d];", i, i);
+    }
+    length = 0;
+    for (int i = 0; i < 40; i++) {
+        length += snprintf(wideB + length, sizeof(wideB) - length,
+                           "wide.b%d = [%d];", i, i);
+    }
+    GcStep steps[] = {
+        {"class Box { init(n) { this.kept = [n]; } }"
+         "var boxes = [];"
+         "for (var i = 0; i < 2000; i = i + 1)"
+         "  boxes.push(Box(i));",
+         beginMarkingStep},
+        {"for (var i = 0; i < 1000; i = i + 1) {"
+         "  boxes[i].hidden = boxes[1999 - i].kept;"
+         "  boxes[1999 - i].kept = nil;"
+         "  boxes[1999 - i].hidden = boxes[i].kept;"
+         "  boxes[i].kept = [\"young\"];"
+         "}"
+         "boxes.insert(0, boxes.remove(1999));",
+         collectGarbageStep},
+        {"var sum = 0;"
+         "for (var i = 0; i < 2000; i = i + 1)"
+         "  sum = sum + boxes[i].hidden[0];"
+         "print sum == 1999000;"
+         "var j = 0;"
+         "for (var i = 0; i < 20000; i = i + 1) {"
+         "  boxes[j].next = Box(i); j = j + 1;"
+         "  if (j == 2000) j = 0;"
+         "}"
+         "print boxes[0].hidden[0];",
+         nullptr},
+        {wideA, beginMarkingStep},
+        {wideB, collectGarbageStep},
+        {"print wide.a39[0] + wide.b39[0];", nullptr},
+    };
+    expectGcSteps(utest_result, useConcurrent, steps, 6, "true\n0\n78\n");
+}
+
+// Freed cells go back to their size class, each of which has pages of its
+// own. Collections are held off, as the cells aren't real objects.
+UTEST(Interpreter, Pool) {
+    VM vm;
+    initVM(&vm, stdout, stderr);
+    collectGarbage(&vm);
+    vm.gcHeld = true;
+    size_t before = vm.bytesAllocated;
+    void *a = allocateCell(&vm, 40);
+    void *b = allocateCell(&vm, 64);
+    EXPECT_TRUE(pageOf(a) != pageOf(b));
+    EXPECT_EQ(0u, (uintptr_t) pageOf(a) % POOL_PAGE_SIZE);
+    freeCell(&vm, a, 40);
+    EXPECT_TRUE(allocateCell(&vm, 33) == a);
+    freeCell(&vm, a, 33);
+    freeCell(&vm, b, 64);
+    EXPECT_EQ(before, vm.bytesAllocated);
+    vm.gcHeld = false;
+    freeVM(&vm);
+}
+
+// More scripts than workers, so some get stolen; each keeps its own output
+// and status however the workers interleave.
+UTEST(Interpreter, Batch) {
+    static const char *sources[] = {
+        "print 1 + 2;",
+        "var l = []; l.pop();",
+        "print ;",
+        "fun f(n) { if (n < 2) return n; return f(n - 1) + f(n - 2); }"
+        "print f(15);",
+        "error(\"to ferr\"); print \"after\";",
+    };
+    Batch batch;
+    initBatch(&batch);
+    for (int i = 0; i < 40; i++) {
+        addBatchScript(&batch, "script", sources[i % 5]);
+    }
+    BatchOptions options = {3, false, false, false, true, true, true, 0,
+                            nullptr, nullptr};
+    EXPECT_EQ(3, runBatch(&batch, &options));
+
+    for (int i = 0; i < batch.count; i++) {
+        BatchScript *script = &batch.scripts[i];
+        switch (i % 5) {
+            case 0:
+                EXPECT_EQ(0, script->status);
+                EXPECT_STREQ("3\n", script->out.buf);
+                break;
+            case 1:
+                EXPECT_EQ(70, script->status);
+                EXPECT_STREQ("Can't pop form empty list.\n[line 1] in script\n",
+                             script->err.buf);
+                break;
+            case 2:
+                EXPECT_EQ(65, script->status);
+                EXPECT_STREQ("", script->out.buf);
+                break;
+            case 3:
+                EXPECT_EQ(0, script->status);
+                EXPECT_STREQ("610\n", script->out.buf);
+                break;
+            case 4:
+                EXPECT_EQ(0, script->status);
+                EXPECT_STREQ("after\n", script->out.buf);
+                EXPECT_STREQ("to ferr\n", script->err.buf);
+                break;
+        }
+        EXPECT_TRUE(script->seconds >= 0);
+    }
+    freeBatch(&batch);
+}
+
+// A script compiled to a file runs the same once loaded back from it.
+UTEST(Interpreter, Bytecode) {
+    const char *source =
+        "var greeting = \"hi\";"
+        "fun counter() { var n = 0; fun inc() { n = n + 1; return n; } "
+        "return inc; }"
+        "class A { init(x) { this.x = x; } get() { return this.x; } }"
+        "var c = counter(); c();"
+        "print greeting; print A(c()).get();";
+    uint64_t hash = hashSource(source);
+    FileStream out, err;
+    initFileStream(&out);
+    initFileStream(&err);
+
+    char path[] = "/tmp/lox_bytecode_XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_TRUE(fd >= 0);
+    close(fd);
+    VM vm;
+    initVM(&vm, out.fp, err.fp);
+    ObjFunction *script = compile(&vm, source);
+    ASSERT_TRUE(script != nullptr);
+    push(&vm, OBJ_VAL(script));
+    EXPECT_TRUE(writeBytecode(&vm, script, hash, path));
+    pop(&vm);
+    freeVM(&vm);
+    EXPECT_TRUE(isBytecodeFile(path));
+
+    // Globals defined first take the slots the file's own globals had.
+    initVM(&vm, out.fp, err.fp);
+    EXPECT_TRUE(interpret(&vm, "var x = 1; var y = 2;") == INTERPRET_OK);
+    EXPECT_TRUE(loadBytecode(&vm, path, hash + 1) == nullptr);
+    script = loadBytecode(&vm, path, hash);
+    ASSERT_TRUE(script != nullptr);
+    EXPECT_TRUE(interpretFunction(&vm, script) == INTERPRET_OK);
+    EXPECT_TRUE(interpret(&vm, "print greeting; print x + y;") ==
+                INTERPRET_OK);
+    freeVM(&vm);
+    unlink(path);
+
+    // The first run compiles and writes the cache, the second loads it and
+    // the third, without the peephole pass, compiles a cache of its own.
+    char dir[] = "/tmp/lox_cache_XXXXXX";
+    ASSERT_TRUE(mkdtemp(dir) != nullptr);
+    uint64_t keys[2];
+    for (int i = 0; i < 3; i++) {
+        initVM(&vm, out.fp, err.fp);
+        vm.cacheDir = dir;
+        vm.peepholeEnabled = i < 2;
+        keys[i / 2] = cacheKey(&vm, source);
+        EXPECT_TRUE(interpret(&vm, source) == INTERPRET_OK);
+        EXPECT_TRUE((vm.images != nullptr) == (i == 1));
+        freeVM(&vm);
+    }
+    EXPECT_NE(keys[0], keys[1]);
+    for (int i = 0; i < 2; i++) {
+        char cached[64];
+        snprintf(cached, sizeof(cached), "%s/%016" PRIx64 ".loxc", dir,
+                 keys[i]);
+        struct stat info;
+        EXPECT_EQ(0, stat(cached, &info));
+        unlink(cached);
+    }
+    rmdir(dir);
+
+    fflush(out.fp);
+    fflush(err.fp);
+    EXPECT_STREQ("hi\n2\nhi\n3\nhi\n2\nhi\n2\nhi\n2\n", out.buf);
+    EXPECT_STREQ("", err.buf);
+    freeFileStream(&out);
+    freeFileStream(&err);
+}
+
+// A fresh VM restored from an image of the prelude runs the script as if
+// the prelude had just run.
+UTEST(Interpreter, Snapshot) {
+    const char *prelude =
+        "class Point { init(x, y) { this.x = x; this.y = y; }"
+        " sum() { return this.x + this.y; } }"
+        "fun counter() { var n = 0; fun inc() { n = n + 1; return n; } "
+        "return inc; }"
+        "var next = counter(); next();"
+        "var origin = Point(1, 2);"
+        "var names = [\"a\", \"b\"];"
+        "var ages = {a: 1};"
+        "var greeting = \"hi\";";
+    const char *script =
+        "print greeting; print next(); print origin.sum();"
+        "names.push(\"c\"); print names.size(); print ages[\"a\"];"
+        "print ages.has(\"b\"); print Point(3, 4).sum();"
+        "print \"h\" + \"i\" == greeting;";
+    FileStream out, err;
+    initFileStream(&out);
+    initFileStream(&err);
+
+    char path[] = "/tmp/lox_snapshot_XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_TRUE(fd >= 0);
+    close(fd);
+    VM vm;
+    // The second image still holds the bodies the prelude never called as
+    // source, and its script runs twice to warm the restored code up.
+    for (int i = 0; i < 2; i++) {
+        initVM(&vm, out.fp, err.fp);
+        vm.lazyCompile = i == 1;
+        EXPECT_TRUE(interpret(&vm, prelude) == INTERPRET_OK);
+        EXPECT_TRUE(writeSnapshot(&vm, path));
+        freeVM(&vm);
+
+        ASSERT_TRUE(initVMFromSnapshot(&vm, out.fp, err.fp, path));
+        EXPECT_TRUE(interpret(&vm, script) == INTERPRET_OK);
+        if (i == 1) EXPECT_TRUE(interpret(&vm, script) == INTERPRET_OK);
+        freeVM(&vm);
+    }
+    unlink(path);
+
+    // Without a usable image the VM starts out as initVM() would leave it.
+    EXPECT_FALSE(initVMFromSnapshot(&vm, out.fp, err.fp, path));
+    EXPECT_TRUE(interpret(&vm, "print [1].size();") == INTERPRET_OK);
+    freeVM(&vm);
+
+    fflush(out.fp);
+    fflush(err.fp);
+    EXPECT_STREQ("hi\n2\n3\n3\n1\nfalse\n7\ntrue\n"
+                 "hi\n2\n3\n3\n1\nfalse\n7\ntrue\n"
+                 "hi\n3\n3\n4\n1\nfalse\n7\ntrue\n1\n",
+                 out.buf);
+    EXPECT_STREQ("", err.buf);
+    freeFileStream(&out);
+    freeFileStream(&err);
+}
 
 UTEST_MAIN()